@@ -12,12 +12,14 @@
 #include <spi_flash.h>
 
 #include "rboot-api.h"
+#include "rboot-private.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#if defined(BOOT_CONFIG_CHKSUM) || defined(BOOT_RTC_ENABLED)
+#if defined(BOOT_CONFIG_CHKSUM) || defined(BOOT_RTC_ENABLED) || defined(BOOT_PLAN_ENABLED) \
+	|| defined(BOOT_INSTALL_ENABLED) || defined(BOOT_PARTITIONS) || defined(BOOT_HISTORY_ADDR)
 // calculate checksum for block of data
 // from start up to (but excluding) end
 static uint8_t calc_chksum(uint8_t *start, uint8_t *end) {
@@ -30,6 +32,52 @@ static uint8_t calc_chksum(uint8_t *start, uint8_t *end) {
 }
 #endif
 
+// 32 bit FNV-1a, used for the rom block and boot plan digests
+static uint32_t ICACHE_FLASH_ATTR calc_digest(uint32_t digest, uint8_t *data, uint32_t len) {
+	while (len > 0) {
+		digest = (digest ^ *data) * DIGEST_PRIME;
+		data++;
+		len--;
+	}
+	return digest;
+}
+
+// digest a block of flash, len must be a multiple of 4
+static uint32_t ICACHE_FLASH_ATTR flash_digest(uint32_t addr, uint32_t len) {
+	uint32_t buffer[64];
+	uint32_t digest = DIGEST_INIT;
+	uint32_t readlen;
+	while (len > 0) {
+		readlen = (len < sizeof(buffer)) ? len : sizeof(buffer);
+		spi_flash_read(addr, buffer, readlen);
+		digest = calc_digest(digest, (uint8_t*)buffer, readlen);
+		addr += readlen;
+		len -= readlen;
+	}
+	return digest;
+}
+
+// get the flash size from the header rboot was flashed with, as rboot
+// does it is limited to the first 8Mbit when big flash is not enabled
+static uint32_t ICACHE_FLASH_ATTR get_flash_size(void) {
+	uint32_t header;
+	uint32_t flashsize;
+	spi_flash_read(0, &header, sizeof(header));
+	switch (((uint8_t*)&header)[3] >> 4) {
+		case 1: flashsize = 0x40000; break;
+		case 2: flashsize = 0x100000; break;
+		case 3: case 5: flashsize = 0x200000; break;
+		case 4: case 6: flashsize = 0x400000; break;
+		case 8: flashsize = 0x800000; break;
+		case 9: flashsize = 0x1000000; break;
+		default: flashsize = 0x80000; break;
+	}
+#ifndef BOOT_BIG_FLASH
+	if (flashsize > 0x100000) flashsize = 0x100000;
+#endif
+	return flashsize;
+}
+
 // get the rboot config
 rboot_config ICACHE_FLASH_ATTR rboot_get_config(void) {
 	rboot_config conf;
@@ -37,29 +85,95 @@ rboot_config ICACHE_FLASH_ATTR rboot_get_config(void) {
 	return conf;
 }
 
+// write the whole config sector, with a journal the copy there is
+// written first (its first word, holding the config magic, last) so
+// rboot can finish the write if power is lost part way through
+static bool ICACHE_FLASH_ATTR write_config_sector(uint8_t *buffer) {
+#ifdef BOOT_CONFIG_JOURNAL_ADDR
+	uint32_t zero = 0;
+
+	if (spi_flash_erase_sector(BOOT_CONFIG_JOURNAL_ADDR / SECTOR_SIZE) != SPI_FLASH_RESULT_OK
+		|| spi_flash_write(BOOT_CONFIG_JOURNAL_ADDR + sizeof(uint32_t),
+			(uint32_t*)((void*)(buffer + sizeof(uint32_t))), SECTOR_SIZE - sizeof(uint32_t)) != SPI_FLASH_RESULT_OK
+		|| spi_flash_write(BOOT_CONFIG_JOURNAL_ADDR, (uint32_t*)((void*)buffer), sizeof(uint32_t)) != SPI_FLASH_RESULT_OK) {
+		return false;
+	}
+#endif
+	if (spi_flash_erase_sector(BOOT_CONFIG_SECTOR) != SPI_FLASH_RESULT_OK
+		|| spi_flash_write(BOOT_CONFIG_SECTOR * SECTOR_SIZE, (uint32_t*)((void*)buffer), SECTOR_SIZE) != SPI_FLASH_RESULT_OK) {
+		return false;
+	}
+#ifdef BOOT_CONFIG_JOURNAL_ADDR
+	// done, the journal copy is no longer valid
+	spi_flash_write(BOOT_CONFIG_JOURNAL_ADDR, &zero, sizeof(zero));
+#endif
+	return true;
+}
+
+// start a config sector transaction
+bool ICACHE_FLASH_ATTR rboot_config_begin(rboot_config_txn *txn) {
+	txn->sector = (uint8_t*)pvPortMalloc(SECTOR_SIZE, 0, 0);
+	if (!txn->sector) {
+		//os_printf("No ram!\r\n");
+		return false;
+	}
+	txn->config = (rboot_config*)txn->sector;
+	spi_flash_read(BOOT_CONFIG_SECTOR * SECTOR_SIZE, (uint32_t*)((void*)txn->sector), SECTOR_SIZE);
+	return true;
+}
+
+// write out all the changes of a transaction at once, only if
+// anything actually changed, updates checksum automatically (if enabled)
+bool ICACHE_FLASH_ATTR rboot_config_commit(rboot_config_txn *txn) {
+	uint32_t current[64];
+	uint32_t pos;
+	bool ok = true;
+
+	if (!txn->sector) {
+		return false;
+	}
+#ifdef BOOT_CONFIG_CHKSUM
+	txn->config->chksum = calc_chksum((uint8_t*)txn->config, (uint8_t*)&txn->config->chksum);
+#endif
+
+	for (pos = 0; pos < SECTOR_SIZE; pos += sizeof(current)) {
+		spi_flash_read(BOOT_CONFIG_SECTOR * SECTOR_SIZE + pos, current, sizeof(current));
+		if (memcmp(current, txn->sector + pos, sizeof(current)) != 0) {
+			ok = write_config_sector(txn->sector);
+			break;
+		}
+	}
+
+	rboot_config_abort(txn);
+	return ok;
+}
+
+// drop a transaction, nothing has been written
+void ICACHE_FLASH_ATTR rboot_config_abort(rboot_config_txn *txn) {
+	if (txn->sector) {
+		vPortFree(txn->sector, 0, 0);
+	}
+	txn->sector = NULL;
+	txn->config = NULL;
+}
+
 // write the rboot config
 // preserves the contents of the rest of the sector,
 // so the rest of the sector can be used to store user data
 // updates checksum automatically (if enabled)
 bool ICACHE_FLASH_ATTR rboot_set_config(rboot_config *conf) {
-	uint8_t *buffer;
-	buffer = (uint8_t*)pvPortMalloc(SECTOR_SIZE, 0, 0);
-	if (!buffer) {
-		//os_printf("No ram!\r\n");
+	rboot_config_txn txn;
+
+	if (!rboot_config_begin(&txn)) {
 		return false;
 	}
 
 #ifdef BOOT_CONFIG_CHKSUM
 	conf->chksum = calc_chksum((uint8_t*)conf, (uint8_t*)&conf->chksum);
 #endif
-	
-	spi_flash_read(BOOT_CONFIG_SECTOR * SECTOR_SIZE, (uint32_t*)((void*)buffer), SECTOR_SIZE);
-	memcpy(buffer, conf, sizeof(rboot_config));
-	spi_flash_erase_sector(BOOT_CONFIG_SECTOR);
-	spi_flash_write(BOOT_CONFIG_SECTOR * SECTOR_SIZE, (uint32_t*)((void*)buffer), SECTOR_SIZE);
-	
-	vPortFree(buffer, 0, 0);
-	return true;
+
+	memcpy(txn.config, conf, sizeof(rboot_config));
+	return rboot_config_commit(&txn);
 }
 
 // get current boot rom
@@ -78,17 +192,337 @@ bool ICACHE_FLASH_ATTR rboot_set_current_rom(uint8_t rom) {
 	return rboot_set_config(&conf);
 }
 
-// create the write status struct, based on supplied start address
+// get the size of a rom slot, calculated the same way as rboot
+uint32_t ICACHE_FLASH_ATTR rboot_get_slot_size(uint8_t rom) {
+	rboot_config conf;
+	uint32_t start;
+	uint32_t end;
+	uint32_t flashsize;
+	uint8_t loop;
+
+	conf = rboot_get_config();
+	if (rom >= conf.count) return 0;
+
+	start = conf.roms[rom];
+	end = (start | 0xfffff) + 1;
+	flashsize = get_flash_size();
+	if (flashsize > start && flashsize < end) {
+		end = flashsize;
+	}
+	for (loop = 0; loop < conf.count && loop < MAX_ROMS; loop++) {
+		if (conf.roms[loop] > start && conf.roms[loop] < end) {
+			end = conf.roms[loop];
+		}
+	}
+	return end - start;
+}
+
+// read and validate the block table header for a rom, returns the
+// flash address of the table, or 0 if the rom doesn't have a valid one
+static uint32_t ICACHE_FLASH_ATTR get_block_table(uint8_t rom, rboot_block_table *table, uint32_t *romaddr) {
+	rboot_config conf;
+	uint32_t slotsize;
+	uint32_t tableaddr;
+
+	slotsize = rboot_get_slot_size(rom);
+	if (slotsize <= SECTOR_SIZE) return 0;
+	conf = rboot_get_config();
+	*romaddr = conf.roms[rom];
+	tableaddr = *romaddr + slotsize - SECTOR_SIZE;
+
+	spi_flash_read(tableaddr, (uint32_t*)table, sizeof(rboot_block_table));
+	if (table->magic != RBOOT_BLOCK_TABLE_MAGIC || table->length > slotsize - SECTOR_SIZE
+		|| ((table->length + RBOOT_BLOCK_SIZE - 1) / RBOOT_BLOCK_SIZE) * sizeof(uint32_t)
+			> SECTOR_SIZE - sizeof(rboot_block_table)) {
+		return 0;
+	}
+	// the digests themselves must be intact
+	if (table->table_digest != flash_digest(tableaddr + sizeof(rboot_block_table),
+			((table->length + RBOOT_BLOCK_SIZE - 1) / RBOOT_BLOCK_SIZE) * sizeof(uint32_t))) {
+		return 0;
+	}
+	return tableaddr;
+}
+
+// length of a block, the last one may be short
+static uint32_t ICACHE_FLASH_ATTR get_block_len(rboot_block_table *table, uint16_t block) {
+	uint32_t len = table->length - (block * RBOOT_BLOCK_SIZE);
+	return (len < RBOOT_BLOCK_SIZE) ? len : RBOOT_BLOCK_SIZE;
+}
+
+// get the expected digest for a block from the table
+static uint32_t ICACHE_FLASH_ATTR get_block_digest(uint32_t tableaddr, uint16_t block) {
+	uint32_t digest;
+	spi_flash_read(tableaddr + sizeof(rboot_block_table) + (block * sizeof(uint32_t)), &digest, sizeof(digest));
+	return digest;
+}
+
+// create the block digest table for a rom
+// and write it to the last sector of the slot
+bool ICACHE_FLASH_ATTR rboot_write_block_table(uint8_t rom, uint32_t length) {
+	rboot_config conf;
+	rboot_block_table *table;
+	uint32_t *digests;
+	uint32_t slotsize;
+	uint32_t romaddr;
+	uint16_t blocks;
+	uint16_t block;
+	bool ret = false;
+
+	// flash reads are in whole words
+	length = (length + 3) & ~3;
+	blocks = (length + RBOOT_BLOCK_SIZE - 1) / RBOOT_BLOCK_SIZE;
+
+	slotsize = rboot_get_slot_size(rom);
+	if (slotsize <= SECTOR_SIZE || length > slotsize - SECTOR_SIZE
+		|| blocks * sizeof(uint32_t) > SECTOR_SIZE - sizeof(rboot_block_table)) {
+		return false;
+	}
+	conf = rboot_get_config();
+	romaddr = conf.roms[rom];
+
+	table = (rboot_block_table*)pvPortMalloc(SECTOR_SIZE, 0, 0);
+	if (!table) {
+		//os_printf("No ram!\r\n");
+		return false;
+	}
+	memset(table, 0xff, SECTOR_SIZE);
+	digests = (uint32_t*)(table + 1);
+
+	table->magic = RBOOT_BLOCK_TABLE_MAGIC;
+	table->length = length;
+	table->table_digest = DIGEST_INIT;
+	for (block = 0; block < blocks; block++) {
+		digests[block] = flash_digest(romaddr + (block * RBOOT_BLOCK_SIZE), get_block_len(table, block));
+	}
+	table->table_digest = calc_digest(DIGEST_INIT, (uint8_t*)digests, blocks * sizeof(uint32_t));
+
+	if (spi_flash_erase_sector((romaddr + slotsize - SECTOR_SIZE) / SECTOR_SIZE) == SPI_FLASH_RESULT_OK
+		&& spi_flash_write(romaddr + slotsize - SECTOR_SIZE, (uint32_t*)table, SECTOR_SIZE) == SPI_FLASH_RESULT_OK) {
+		ret = true;
+	}
+
+	vPortFree(table, 0, 0);
+	return ret;
+}
+
+// check a range of blocks of a rom against its digest table
+int32_t ICACHE_FLASH_ATTR rboot_check_blocks(uint8_t rom, uint16_t first, uint16_t count, uint8_t *bad) {
+	rboot_block_table table;
+	uint32_t tableaddr;
+	uint32_t romaddr;
+	uint16_t blocks;
+	uint16_t block;
+	int32_t badcount = 0;
+
+	tableaddr = get_block_table(rom, &table, &romaddr);
+	if (tableaddr == 0) return -1;
+
+	blocks = (table.length + RBOOT_BLOCK_SIZE - 1) / RBOOT_BLOCK_SIZE;
+	for (block = first; block < blocks && block - first < count; block++) {
+		if (flash_digest(romaddr + (block * RBOOT_BLOCK_SIZE), get_block_len(&table, block))
+			!= get_block_digest(tableaddr, block)) {
+			badcount++;
+			if (bad) bad[block / 8] |= (1 << (block % 8));
+		}
+	}
+	return badcount;
+}
+
+// erase and rewrite a single block of a rom
+static bool ICACHE_FLASH_ATTR write_block(uint32_t romaddr, uint16_t block, uint8_t *data, uint32_t len) {
+	uint32_t addr = romaddr + (block * RBOOT_BLOCK_SIZE);
+	return (spi_flash_erase_sector(addr / SECTOR_SIZE) == SPI_FLASH_RESULT_OK
+		&& spi_flash_write(addr, (uint32_t*)((void*)data), len) == SPI_FLASH_RESULT_OK);
+}
+
+// repair bad blocks of a rom by copying matching blocks from another slot
+int32_t ICACHE_FLASH_ATTR rboot_repair_blocks(uint8_t rom, uint8_t src_rom) {
+	rboot_config conf;
+	rboot_block_table table;
+	uint8_t *buffer;
+	uint32_t tableaddr;
+	uint32_t romaddr;
+	uint32_t srcaddr;
+	uint32_t expected;
+	uint32_t len;
+	uint16_t blocks;
+	uint16_t block;
+	int32_t unrepaired = 0;
+
+	tableaddr = get_block_table(rom, &table, &romaddr);
+	if (tableaddr == 0) return -1;
+	conf = rboot_get_config();
+	if (src_rom >= conf.count || src_rom == rom) return -1;
+	srcaddr = conf.roms[src_rom];
+
+	buffer = (uint8_t*)pvPortMalloc(RBOOT_BLOCK_SIZE, 0, 0);
+	if (!buffer) {
+		//os_printf("No ram!\r\n");
+		return -1;
+	}
+
+	blocks = (table.length + RBOOT_BLOCK_SIZE - 1) / RBOOT_BLOCK_SIZE;
+	for (block = 0; block < blocks; block++) {
+		len = get_block_len(&table, block);
+		expected = get_block_digest(tableaddr, block);
+		if (flash_digest(romaddr + (block * RBOOT_BLOCK_SIZE), len) == expected) {
+			continue;
+		}
+		// only copy the source block if it is what we expect
+		spi_flash_read(srcaddr + (block * RBOOT_BLOCK_SIZE), (uint32_t*)((void*)buffer), len);
+		if (calc_digest(DIGEST_INIT, buffer, len) != expected
+			|| !write_block(romaddr, block, buffer, len)
+			|| flash_digest(romaddr + (block * RBOOT_BLOCK_SIZE), len) != expected) {
+			unrepaired++;
+		}
+	}
+
+	vPortFree(buffer, 0, 0);
+	return unrepaired;
+}
+
+// repair a single block of a rom with supplied (e.g. downloaded) data
+bool ICACHE_FLASH_ATTR rboot_repair_block(uint8_t rom, uint16_t block, uint8_t *data) {
+	rboot_block_table table;
+	uint32_t tableaddr;
+	uint32_t romaddr;
+	uint32_t len;
+
+	tableaddr = get_block_table(rom, &table, &romaddr);
+	if (tableaddr == 0 || block >= (table.length + RBOOT_BLOCK_SIZE - 1) / RBOOT_BLOCK_SIZE) {
+		return false;
+	}
+	len = get_block_len(&table, block);
+	if (calc_digest(DIGEST_INIT, data, len) != get_block_digest(tableaddr, block)) {
+		return false;
+	}
+	return write_block(romaddr, block, data, len);
+}
+
+#ifdef BOOT_RESET_RESUME
+// ask for (or cancel) a factory reset on the next boot, the request is
+// left where rboot keeps the progress of the reset in the config sector
+bool ICACHE_FLASH_ATTR rboot_set_factory_reset(bool enable) {
+	rboot_config_txn txn;
+	uint32_t *magic;
+
+	if (!rboot_config_begin(&txn)) {
+		return false;
+	}
+	magic = (uint32_t*)((void*)(txn.sector + RESTORE_OFFSET));
+	if (*magic == RESTORE_MAGIC) {
+		// already under way, it can't be cancelled
+		rboot_config_abort(&txn);
+		return enable;
+	}
+	*magic = enable ? RESET_REQUEST_MAGIC : 0xffffffff;
+	return rboot_config_commit(&txn);
+}
+#endif
+
+#ifdef BOOT_DIRTY_MAP_ADDR
+// mark the sectors of the reset region covered by a write as dirty,
+// by clearing their bits in the map, so factory reset will erase them
+bool ICACHE_FLASH_ATTR rboot_mark_dirty(uint32_t addr, uint32_t len) {
+	uint32_t sector;
+	uint32_t last;
+	uint32_t mapaddr;
+	uint32_t bits;
+	uint32_t mask;
+
+	if (len == 0 || addr >= BOOT_RESET_ADDR + BOOT_RESET_SIZE || addr + len <= BOOT_RESET_ADDR) {
+		return true;
+	}
+	if (addr < BOOT_RESET_ADDR) {
+		len -= BOOT_RESET_ADDR - addr;
+		addr = BOOT_RESET_ADDR;
+	}
+	if (addr + len > BOOT_RESET_ADDR + BOOT_RESET_SIZE) {
+		len = BOOT_RESET_ADDR + BOOT_RESET_SIZE - addr;
+	}
+
+	sector = (addr - BOOT_RESET_ADDR) / SECTOR_SIZE;
+	last = (addr + len - 1 - BOOT_RESET_ADDR) / SECTOR_SIZE;
+	while (sector <= last) {
+		// handle the bits in one map word at a time
+		mapaddr = BOOT_DIRTY_MAP_ADDR + sizeof(uint32_t) + (sector / 32) * sizeof(uint32_t);
+		mask = 0;
+		do {
+			mask |= 1 << (sector % 32);
+			sector++;
+		} while (sector <= last && (sector % 32) != 0);
+		// only program the map if a bit actually needs clearing
+		spi_flash_read(mapaddr, &bits, sizeof(bits));
+		if (bits & mask) {
+			bits = ~mask;
+			if (spi_flash_write(mapaddr, &bits, sizeof(bits)) != SPI_FLASH_RESULT_OK) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// write to flash, marking the sectors dirty first if in the reset region
+bool ICACHE_FLASH_ATTR rboot_flash_write(uint32_t addr, uint32_t *data, uint32_t len) {
+	if (!rboot_mark_dirty(addr, len)) {
+		return false;
+	}
+	return (spi_flash_write(addr, data, len) == SPI_FLASH_RESULT_OK);
+}
+#endif
+
+// header expected next while writing a rom slot
+#define ADMIT_NONE    0 // not a rom slot, or all headers checked
+#define ADMIT_IMAGE   1 // first 16 bytes of the slot
+#define ADMIT_ROM     2 // rom header after the irom of a new format image
+#define ADMIT_SECTION 3
+#define ADMIT_FAILED  4
+
+// create the write status struct, based on supplied start address, a
+// write to the start of a rom slot has its headers checked as they arrive
 rboot_write_status ICACHE_FLASH_ATTR rboot_write_init(uint32_t start_addr) {
 	rboot_write_status status = {0};
+	rboot_config conf;
+	uint8_t loop;
+
 	status.start_addr = start_addr;
 	status.start_sector = start_addr / SECTOR_SIZE;
 	status.last_sector_erased = status.start_sector - 1;
 	//status.max_sector_count = 200;
 	//os_printf("init addr: 0x%08x\r\n", start_addr);
+
+	conf = rboot_get_config();
+	for (loop = 0; loop < conf.count && loop < MAX_ROMS; loop++) {
+		if (conf.roms[loop] == start_addr) {
+			status.admit = ADMIT_IMAGE;
+			status.next_header = start_addr;
+			status.slot_end = start_addr + rboot_get_slot_size(loop);
+			break;
+		}
+	}
 	return status;
 }
 
+#ifdef BOOT_PLAN_ENABLED
+// clear the boot plan of the rom slot at addr, if it has one, it
+// describes the rom that was there before
+static bool ICACHE_FLASH_ATTR clear_slot_plan(uint32_t addr) {
+	rboot_config conf;
+	rboot_plan plan;
+	uint8_t rom;
+
+	conf = rboot_get_config();
+	for (rom = 0; rom < conf.count && rom < MAX_ROMS; rom++) {
+		if (conf.roms[rom] == addr && rboot_get_boot_plan(rom, &plan)) {
+			return rboot_set_boot_plan(rom, NULL);
+		}
+	}
+	return true;
+}
+#endif
+
 // ensure any remaning bytes get written (needed for files not a multiple of 4 bytes)
 bool ICACHE_FLASH_ATTR rboot_write_end(rboot_write_status *status) {
 	uint8_t i;
@@ -96,7 +530,153 @@ bool ICACHE_FLASH_ATTR rboot_write_end(rboot_write_status *status) {
 		for (i = status->extra_count; i < 4; i++) {
 			status->extra_bytes[i] = 0xff;
 		}
-		return rboot_write_flash(status, status->extra_bytes, 4);
+		if (!rboot_write_flash(status, status->extra_bytes, 4)) {
+			return false;
+		}
+	}
+#ifdef BOOT_PLAN_ENABLED
+	// anything erased in a rom slot means a new rom
+	if (status->slot_end != 0 && status->last_sector_erased >= (int32_t)status->start_sector
+		&& !clear_slot_plan(status->start_sector * SECTOR_SIZE)) {
+		return false;
+	}
+#endif
+	// a rom must have had all its headers
+	return (status->admit == ADMIT_NONE);
+}
+
+// check a section header at pos, it loads to ram or, for the first
+// section of a single link image, is the irom sitting where it is linked
+// to be mapped for this slot, and sets where the next header is
+static bool ICACHE_FLASH_ATTR check_section(rboot_write_status *status, uint32_t pos,
+	uint32_t addr, uint32_t len, bool first) {
+
+	if ((len & 3) != 0 || status->slot_end - pos < 8 || len > status->slot_end - pos - 8) {
+		return false;
+	}
+	if (!((addr >= IRAM_START && addr <= IRAM_END && len <= IRAM_END - addr)
+		|| (addr >= DRAM_START && addr <= DRAM_END && len <= DRAM_END - addr)
+		|| (first && addr == RBOOT_FLASH_MAP_ADDR + ((pos + 8) % 0x100000)))) {
+		return false;
+	}
+	status->next_header = pos + 8 + len;
+	status->admit = (--status->sections == 0) ? ADMIT_NONE : ADMIT_SECTION;
+	return true;
+}
+
+// check the header held for start_addr, the first 16 bytes of the image
+// are checked together (a new format header, or the header and first
+// section header of an old one) so nothing is erased for a bad one
+static bool ICACHE_FLASH_ATTR check_header(rboot_write_status *status) {
+	uint8_t *bytes = (uint8_t*)status->header;
+	uint32_t room = status->slot_end - status->start_addr;
+	uint32_t device;
+	uint32_t len;
+
+	if (status->admit == ADMIT_SECTION) {
+		return check_section(status, status->start_addr, status->header[0], status->header[1], false);
+	}
+	if (status->admit == ADMIT_IMAGE) {
+		// the same check the ota writer makes
+		spi_flash_read(0, &device, sizeof(device));
+		if (!check_rom_header(status->header, status->start_addr, room, ((uint8_t*)&device)[3])) {
+			return false;
+		}
+		if (bytes[0] == ROM_MAGIC_NEW1) {
+			// irom, then the rom header, all in the slot
+			len = status->header[3];
+			if (room < 16 + 8 || len > room - 16 - 8) {
+				return false;
+			}
+			status->next_header = status->start_addr + 16 + len;
+			status->admit = ADMIT_ROM;
+			return true;
+		}
+	}
+	if (bytes[0] != ROM_MAGIC || bytes[1] == 0 || room < 8) {
+		return false;
+	}
+	status->sections = bytes[1];
+	status->next_header = status->start_addr + 8;
+	if (status->admit == ADMIT_IMAGE) {
+		return check_section(status, status->start_addr + 8, status->header[2], status->header[3], true);
+	}
+	status->admit = ADMIT_SECTION;
+	return true;
+}
+
+// erase as far as needed and program a multiple of 4 bytes from an aligned buffer
+static bool ICACHE_FLASH_ATTR program_words(rboot_write_status *status, uint8_t *buffer, uint32_t len) {
+	int32_t lastsect;
+
+	if (len == 0) {
+		return true;
+	}
+	if (status->slot_end != 0 && len > status->slot_end - status->start_addr) {
+		return false;
+	}
+
+	// erase any additional sectors needed by this chunk
+	lastsect = ((status->start_addr + len) - 1) / SECTOR_SIZE;
+	while (lastsect > status->last_sector_erased) {
+		status->last_sector_erased++;
+		spi_flash_erase_sector(status->last_sector_erased);
+	}
+
+	// write current chunk
+	//os_printf("write addr: 0x%08x, len: 0x%04x\r\n", status->start_addr, len);
+#ifdef BOOT_DIRTY_MAP_ADDR
+	if (!rboot_flash_write(status->start_addr, (uint32_t *)((void*)buffer), len)) {
+#else
+	if (spi_flash_write(status->start_addr, (uint32_t *)((void*)buffer), len) != SPI_FLASH_RESULT_OK) {
+#endif
+		return false;
+	}
+	status->start_addr += len;
+	return true;
+}
+
+// write a multiple of 4 bytes from an aligned buffer, when writing a rom
+// slot each header is held back until it is complete and checked, so
+// nothing after a bad header is erased or written
+static bool ICACHE_FLASH_ATTR write_words(rboot_write_status *status, uint8_t *buffer, uint32_t len) {
+	uint32_t part;
+	uint8_t hlen;
+
+	while (len > 0) {
+		if (status->admit == ADMIT_NONE) {
+			return program_words(status, buffer, len);
+		}
+		if (status->admit == ADMIT_FAILED) {
+			return false;
+		}
+		if (status->start_addr < status->next_header) {
+			// data up to the next header
+			part = status->next_header - status->start_addr;
+			if (part > len) part = len;
+			if (!program_words(status, buffer, part)) {
+				return false;
+			}
+		} else {
+			// collect the header, then check it before writing it
+			hlen = (status->admit == ADMIT_IMAGE) ? 16 : 8;
+			part = hlen - status->held;
+			if (part > len) part = len;
+			memcpy((uint8_t*)status->header + status->held, buffer, part);
+			status->held += part;
+			if (status->held == hlen) {
+				status->held = 0;
+				if (!check_header(status)) {
+					status->admit = ADMIT_FAILED;
+					return false;
+				}
+				if (!program_words(status, (uint8_t*)status->header, hlen)) {
+					return false;
+				}
+			}
+		}
+		buffer += part;
+		len -= part;
 	}
 	return true;
 }
@@ -105,9 +685,8 @@ bool ICACHE_FLASH_ATTR rboot_write_end(rboot_write_status *status) {
 // call repeatedly with more data (max len per write is the flash sector size (4k))
 bool ICACHE_FLASH_ATTR rboot_write_flash(rboot_write_status *status, uint8_t *data, uint16_t len) {
 	
-	bool ret = false;
+	bool ret;
 	uint8_t *buffer;
-	int32_t lastsect;
 	
 	if (data == NULL || len == 0) {
 		return true;
@@ -136,26 +715,663 @@ bool ICACHE_FLASH_ATTR rboot_write_flash(rboot_write_status *status, uint8_t *da
 
 	// check data will fit
 	//if (status->start_addr + len < (status->start_sector + status->max_sector_count) * SECTOR_SIZE) {
+		ret = write_words(status, buffer, len);
+	//}
+
+	vPortFree(buffer, 0, 0);
+	return ret;
+}
+
+// the pipe's producer (a receive callback) and consumer (a task) share
+// one core, so it is enough to keep the compiler from moving the slot
+// accesses across the index updates, no fence instruction is needed
+#define PIPE_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+// set up a pipe of slots between a network receive callback and the writer
+bool ICACHE_FLASH_ATTR rboot_pipe_init(rboot_pipe *pipe, rboot_write_status *status,
+	uint8_t *slots, uint16_t slot_size, uint8_t count, uint32_t end_addr) {
+
+	// count must be a power of 2 for the free running indexes to wrap cleanly
+	if (slots == NULL || ((uint32_t)slots & 3) != 0 || (slot_size & 3) != 0 || slot_size < 8
+		|| count < 2 || count > RBOOT_PIPE_MAX_SLOTS || (count & (count - 1)) != 0) {
+		return false;
+	}
+
+	memset(pipe, 0, sizeof(rboot_pipe));
+	pipe->slots = slots;
+	pipe->slot_size = slot_size;
+	pipe->count = count;
+	pipe->high_mark = count - count / 4;
+	pipe->low_mark = count / 4;
+	pipe->align = status->extra_count;
+	pipe->end_addr = end_addr;
+	return true;
+}
 
-		// erase any additional sectors needed by this chunk
-		lastsect = ((status->start_addr + len) - 1) / SECTOR_SIZE;
-		while (lastsect > status->last_sector_erased) {
-			status->last_sector_erased++;
-			spi_flash_erase_sector(status->last_sector_erased);
+// reserve the next free slot to receive data in to, NULL if they're all in use
+// the data is placed so that, with the bytes the writer is carrying over from
+// the previous slot in front, it starts on a word boundary
+uint8_t* ICACHE_FLASH_ATTR rboot_pipe_reserve(rboot_pipe *pipe, uint16_t *space) {
+	if ((uint8_t)(pipe->head - pipe->tail) >= pipe->count) {
+		return NULL;
+	}
+	// the writer is done with the slot before the data goes in
+	PIPE_BARRIER();
+	*space = pipe->slot_size - pipe->align;
+	return pipe->slots + (pipe->head & (pipe->count - 1)) * pipe->slot_size + pipe->align;
+}
+
+// pass the reserved slot to the writer
+void ICACHE_FLASH_ATTR rboot_pipe_commit(rboot_pipe *pipe, uint16_t len) {
+	pipe->len[pipe->head & (pipe->count - 1)] = len;
+	pipe->align = (pipe->align + len) % 4;
+	// the data and length are in place before the writer can see the slot
+	PIPE_BARRIER();
+	pipe->head++;
+}
+
+// slots waiting to be written
+uint8_t ICACHE_FLASH_ATTR rboot_pipe_level(rboot_pipe *pipe) {
+	return (uint8_t)(pipe->head - pipe->tail);
+}
+
+// whether the receiver should hold off, with hysteresis between the marks
+bool ICACHE_FLASH_ATTR rboot_pipe_throttle(rboot_pipe *pipe) {
+	uint8_t level = rboot_pipe_level(pipe);
+	if (level >= pipe->high_mark) {
+		pipe->throttled = 1;
+	} else if (level <= pipe->low_mark) {
+		pipe->throttled = 0;
+	}
+	return (pipe->throttled != 0);
+}
+
+// write the next slot straight from the pipe, or when there's nothing
+// waiting erase the sector after the current one ready for it (while
+// writing a rom, only if it starts before the next unchecked header)
+bool ICACHE_FLASH_ATTR rboot_pipe_write(rboot_pipe *pipe, rboot_write_status *status) {
+	uint8_t *data;
+	uint32_t len;
+	int32_t next;
+
+	if (pipe->head == pipe->tail) {
+		next = status->last_sector_erased + 1;
+		if (next <= (int32_t)(status->start_addr / SECTOR_SIZE) + 1
+			&& (uint32_t)(next + 1) * SECTOR_SIZE <= pipe->end_addr
+			&& (status->admit == ADMIT_NONE
+				|| (status->admit != ADMIT_FAILED && (uint32_t)next * SECTOR_SIZE < status->next_header))) {
+			status->last_sector_erased = next;
+			return (spi_flash_erase_sector(next) == SPI_FLASH_RESULT_OK);
 		}
+		return true;
+	}
 
-		// write current chunk
-		//os_printf("write addr: 0x%08x, len: 0x%04x\r\n", status->start_addr, len);
-		if (spi_flash_write(status->start_addr, (uint32_t *)((void*)buffer), len) == SPI_FLASH_RESULT_OK) {
-			ret = true;
-			status->start_addr += len;
+	// nothing is read from the slot until head shows it is committed
+	PIPE_BARRIER();
+
+	// put the carried over bytes in front of the data
+	data = pipe->slots + (pipe->tail & (pipe->count - 1)) * pipe->slot_size;
+	memcpy(data, status->extra_bytes, status->extra_count);
+	len = status->extra_count + pipe->len[pipe->tail & (pipe->count - 1)];
+	status->extra_count = len % 4;
+	len -= status->extra_count;
+	memcpy(status->extra_bytes, data + len, status->extra_count);
+
+	if (!write_words(status, data, len)) {
+		return false;
+	}
+	// and done with before it is handed back
+	PIPE_BARRIER();
+	pipe->tail++;
+	return true;
+}
+
+#ifdef BOOT_INSTALL_ENABLED
+// request rboot installs the packed rom written to the staging area
+// (starting at BOOT_STAGING_ADDR + SECTOR_SIZE) on next boot
+bool ICACHE_FLASH_ATTR rboot_set_install(uint8_t rom, uint32_t packed_len, uint32_t image_len) {
+	rboot_install install;
+	uint32_t readpos;
+	uint32_t readend;
+	uint32_t blockhdr;
+	uint32_t outlen;
+
+	if (image_len == 0 || image_len > rboot_get_slot_size(rom)
+		|| image_len > BOOT_INSTALL_MAX_SECTORS * SECTOR_SIZE) {
+		return false;
+	}
+
+	// check the block structure of the packed rom covers the whole image,
+	// so rboot won't find a problem part way through installing it
+	readpos = BOOT_STAGING_ADDR + SECTOR_SIZE;
+	readend = readpos + packed_len;
+	for (outlen = 0; outlen < image_len; outlen += blockhdr >> 16) {
+		if (readpos >= readend || readend - readpos < sizeof(blockhdr)) return false;
+		spi_flash_read(readpos, &blockhdr, sizeof(blockhdr));
+		readpos += sizeof(blockhdr);
+		if ((blockhdr >> 16) == 0 || (blockhdr >> 16) > SECTOR_SIZE
+			|| (blockhdr & 0xffff) > readend - readpos) {
+			return false;
 		}
-	//}
+		readpos += ((blockhdr & 0xffff) + 3) & ~3;
+	}
+	if (outlen != image_len) return false;
 
-	vPortFree(buffer, 0, 0);
-	return ret;
+	// only the record itself is written, progress words are left erased
+	install.magic = BOOT_INSTALL_MAGIC;
+	install.target_rom = rom;
+	install.unused[0] = install.unused[1] = 0;
+	install.packed_len = packed_len;
+	install.image_len = image_len;
+	install.chksum = calc_chksum(&install.target_rom, &install.chksum);
+
+	if (spi_flash_erase_sector(BOOT_STAGING_ADDR / SECTOR_SIZE) != SPI_FLASH_RESULT_OK) {
+		return false;
+	}
+	return (spi_flash_write(BOOT_STAGING_ADDR, (uint32_t*)&install,
+		(uint8_t*)install.progress - (uint8_t*)&install) == SPI_FLASH_RESULT_OK);
+}
+#endif
+
+#ifdef BOOT_PLAN_ENABLED
+// build a boot plan for a rom by walking its headers on the flash,
+// call after writing a new rom and pass the result to rboot_set_boot_plan
+bool ICACHE_FLASH_ATTR rboot_create_boot_plan(uint8_t rom, rboot_plan *plan) {
+	rboot_config conf;
+	rboot_plan_section *section;
+	uint32_t header[4];
+	uint32_t buffer[64];
+	uint32_t readpos;
+	uint32_t pos, len;
+	uint8_t count;
+
+	conf = rboot_get_config();
+	if (rom >= conf.count) return false;
+
+	memset(plan, 0, sizeof(rboot_plan));
+	plan->rom_addr = readpos = conf.roms[rom];
+
+	// 16 bytes covers the standard or the new (irom first) header
+	spi_flash_read(readpos, header, sizeof(header));
+	if (((uint8_t*)header)[0] == 0xea && ((uint8_t*)header)[1] == 0x04) {
+#ifdef BOOT_IROM_CHKSUM
+		// irom is checked by rboot, but not loaded
+		section = &plan->sections[plan->count++];
+		section->flash = readpos + sizeof(header);
+		section->address = 0;
+		section->length = header[3];
+#endif
+		// skip to the normal header following the irom section
+		readpos += sizeof(header) + header[3];
+		spi_flash_read(readpos, header, 8);
+	} else if (((uint8_t*)header)[0] != 0xe9) {
+		return false;
+	}
+
+	plan->load_addr = readpos;
+	plan->header[0] = header[0];
+	plan->header[1] = header[1];
+	readpos += 8;
+
+	count = ((uint8_t*)header)[1];
+	if (plan->count + count > BOOT_PLAN_MAX_SECTIONS) return false;
+	while (count-- > 0) {
+		// section header is ram address & length
+		spi_flash_read(readpos, header, 8);
+		readpos += 8;
+		section = &plan->sections[plan->count++];
+		section->flash = readpos;
+		section->address = header[0];
+		section->length = header[1];
+		readpos += header[1];
+	}
+
+	// digest of the sections loaded to ram, rboot checks it with the xor
+	plan->digest = DIGEST_INIT;
+	for (count = 0; count < plan->count; count++) {
+		section = &plan->sections[count];
+		for (pos = 0; section->address != 0 && pos < section->length; pos += len) {
+			len = (section->length - pos < sizeof(buffer)) ? section->length - pos : sizeof(buffer);
+			spi_flash_read(section->flash + pos, buffer, len);
+			plan->digest = calc_digest(plan->digest, (uint8_t*)buffer, len);
+		}
+	}
+
+	// rom checksum is the last byte of the following 16 byte block
+	spi_flash_read((readpos | 0x0f) & ~3, header, 4);
+	plan->rom_chksum = ((uint8_t*)header)[3];
+
+	return true;
+}
+
+// get the stored boot plan for a rom
+bool ICACHE_FLASH_ATTR rboot_get_boot_plan(uint8_t rom, rboot_plan *plan) {
+	if (rom >= MAX_ROMS) return false;
+	spi_flash_read(BOOT_CONFIG_SECTOR * SECTOR_SIZE + BOOT_PLAN_OFFSET(rom),
+		(uint32_t*)plan, sizeof(rboot_plan));
+	return (plan->magic == BOOT_PLAN_MAGIC
+		&& plan->chksum == calc_chksum((uint8_t*)plan, (uint8_t*)&plan->chksum));
+}
+
+// store the boot plan for a rom, or clear it if plan is NULL
+// preserves the contents of the rest of the config sector
+bool ICACHE_FLASH_ATTR rboot_set_boot_plan(uint8_t rom, rboot_plan *plan) {
+	rboot_config_txn txn;
+
+	if (rom >= MAX_ROMS) return false;
+
+	if (!rboot_config_begin(&txn)) {
+		return false;
+	}
+
+	if (plan) {
+		plan->magic = BOOT_PLAN_MAGIC;
+		plan->chksum = calc_chksum((uint8_t*)plan, (uint8_t*)&plan->chksum);
+		memcpy(txn.sector + BOOT_PLAN_OFFSET(rom), plan, sizeof(rboot_plan));
+	} else {
+		memset(txn.sector + BOOT_PLAN_OFFSET(rom), 0xff, sizeof(rboot_plan));
+	}
+	return rboot_config_commit(&txn);
+}
+#endif
+
+#ifdef BOOT_PARTITIONS
+// get the partition table, false if there isn't a valid one
+bool ICACHE_FLASH_ATTR rboot_get_part_table(rboot_part_table *table) {
+	uint8_t loop;
+	spi_flash_read(BOOT_CONFIG_SECTOR * SECTOR_SIZE + BOOT_PART_TABLE_OFFSET,
+		(uint32_t*)table, sizeof(rboot_part_table));
+	if (table->magic != BOOT_PART_MAGIC || table->count > BOOT_PART_MAX
+		|| table->chksum != calc_chksum((uint8_t*)table->parts, (uint8_t*)(table + 1))) {
+		return false;
+	}
+	for (loop = 0; loop < table->count; loop++) {
+		if (table->by_type[loop] >= table->count) return false;
+	}
+	return true;
+}
+
+// sort, index, validate and store a partition table
+// preserves the contents of the rest of the config sector
+bool ICACHE_FLASH_ATTR rboot_set_part_table(rboot_part_table *table) {
+	rboot_partition part;
+	rboot_partition *a;
+	rboot_partition *b;
+	rboot_config_txn txn;
+	uint8_t loop;
+	uint8_t pos;
+	uint8_t index;
+
+	if (table->count > BOOT_PART_MAX) return false;
+
+	// sort by name
+	for (loop = 1; loop < table->count; loop++) {
+		part = table->parts[loop];
+		for (pos = loop; pos > 0
+			&& strncmp(table->parts[pos - 1].name, part.name, BOOT_PART_NAME_LEN) > 0; pos--) {
+			table->parts[pos] = table->parts[pos - 1];
+		}
+		table->parts[pos] = part;
+	}
+
+	// index by type
+	for (loop = 0; loop < table->count; loop++) {
+		for (pos = loop; pos > 0 && table->parts[table->by_type[pos - 1]].type > table->parts[loop].type; pos--) {
+			table->by_type[pos] = table->by_type[pos - 1];
+		}
+		table->by_type[pos] = loop;
+	}
+	for (; loop < BOOT_PART_MAX; loop++) {
+		table->by_type[loop] = 0xff;
+	}
+
+	for (loop = 0; loop < table->count; loop++) {
+		a = &table->parts[loop];
+		// unique names
+		if (loop > 0 && strncmp(table->parts[loop - 1].name, a->name, BOOT_PART_NAME_LEN) == 0) {
+			return false;
+		}
+		// whole sectors, clear of rboot & its config, within one 1MB block
+		if ((a->offset % SECTOR_SIZE) != 0 || a->size == 0 || (a->size % SECTOR_SIZE) != 0
+			|| a->offset < (BOOT_CONFIG_SECTOR + 1) * SECTOR_SIZE
+			|| (a->offset / 0x100000) != ((a->offset + a->size - 1) / 0x100000)) {
+			return false;
+		}
+		// no overlaps
+		for (index = loop + 1; index < table->count; index++) {
+			b = &table->parts[index];
+			if (a->offset < b->offset + b->size && b->offset < a->offset + a->size) {
+				return false;
+			}
+		}
+	}
+
+	if (!rboot_config_begin(&txn)) {
+		return false;
+	}
+
+	table->magic = BOOT_PART_MAGIC;
+	table->chksum = calc_chksum((uint8_t*)table->parts, (uint8_t*)(table + 1));
+
+	memcpy(txn.sector + BOOT_PART_TABLE_OFFSET, table, sizeof(rboot_part_table));
+	return rboot_config_commit(&txn);
+}
+
+// find a partition by name, binary search of the name sorted table
+bool ICACHE_FLASH_ATTR rboot_find_partition(const char *name, rboot_partition *part) {
+	rboot_part_table table;
+	uint8_t low = 0;
+	uint8_t high;
+	uint8_t mid;
+	int cmp;
+
+	if (!rboot_get_part_table(&table)) return false;
+
+	high = table.count;
+	while (low < high) {
+		mid = (low + high) / 2;
+		cmp = strncmp(table.parts[mid].name, name, BOOT_PART_NAME_LEN);
+		if (cmp == 0) {
+			*part = table.parts[mid];
+			return true;
+		} else if (cmp < 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return false;
+}
+
+// find the nth partition of a type, binary search of the type index
+bool ICACHE_FLASH_ATTR rboot_find_partition_type(uint8_t type, uint8_t n, rboot_partition *part) {
+	rboot_part_table table;
+	uint8_t low = 0;
+	uint8_t high;
+	uint8_t mid;
+
+	if (!rboot_get_part_table(&table)) return false;
+
+	// first partition of this type
+	high = table.count;
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (table.parts[table.by_type[mid]].type < type) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+
+	if (low + n >= table.count || table.parts[table.by_type[low + n]].type != type) {
+		return false;
+	}
+	*part = table.parts[table.by_type[low + n]];
+	return true;
+}
+#endif
+
+// the 1MB block of flash mapped at RBOOT_FLASH_MAP_ADDR
+static uint32_t ICACHE_FLASH_ATTR get_mapped_block(void) {
+#ifdef BOOT_BIG_FLASH
+	extern uint8_t rBoot_mmap_1;
+	extern uint8_t rBoot_mmap_2;
+	return rBoot_mmap_2 * 2 + rBoot_mmap_1;
+#else
+	return 0;
+#endif
+}
+
+// open an asset partition, mapping it if it is in the mapped block
+bool ICACHE_FLASH_ATTR rboot_assets_open(uint32_t addr, rboot_assets *assets) {
+	rboot_assets_header header;
+
+	spi_flash_read(addr, (uint32_t*)&header, sizeof(header));
+	if (header.magic != RBOOT_ASSETS_MAGIC || header.length < sizeof(header)
+		|| header.count > (header.length - sizeof(header)) / sizeof(rboot_asset_entry)) {
+		return false;
+	}
+
+	assets->addr = addr;
+	assets->count = header.count;
+	assets->length = header.length;
+	assets->base = NULL;
+	if (addr / 0x100000 == get_mapped_block()
+		&& (addr + header.length - 1) / 0x100000 == get_mapped_block()) {
+		assets->base = (const uint32_t*)(RBOOT_FLASH_MAP_ADDR + (addr % 0x100000));
+	}
+	return true;
+}
+
+// read a word of an open asset partition, from the mapping if possible
+static uint32_t ICACHE_FLASH_ATTR asset_word(rboot_assets *assets, uint32_t offset) {
+	uint32_t word;
+
+	if (assets->base) {
+		return assets->base[offset / sizeof(uint32_t)];
+	}
+	spi_flash_read(assets->addr + offset, &word, sizeof(word));
+	return word;
+}
+
+// check the name stored for a file, as different names can share a hash
+static bool ICACHE_FLASH_ATTR asset_name_matches(rboot_assets *assets, uint32_t offset, const char *name) {
+	uint32_t len = strlen(name) + 1;
+	uint32_t pos, word;
+
+	if ((offset & 3) != 0 || offset > assets->length || len > assets->length - offset) {
+		return false;
+	}
+	for (pos = 0; pos < len; pos += sizeof(word)) {
+		word = asset_word(assets, offset + pos);
+		if (memcmp(&word, name + pos, (len - pos < sizeof(word)) ? len - pos : sizeof(word)) != 0) {
+			return false;
+		}
+	}
+	return true;
 }
 
+// find a file, binary search of the index by name hash
+bool ICACHE_FLASH_ATTR rboot_asset_find(rboot_assets *assets, const char *name, rboot_asset *asset) {
+	rboot_asset_entry entry;
+	const rboot_asset_entry *index;
+	uint32_t hash;
+	uint32_t low = 0;
+	uint32_t high = assets->count;
+	uint32_t mid;
+
+	hash = calc_digest(DIGEST_INIT, (uint8_t*)name, strlen(name));
+	index = (const rboot_asset_entry*)(assets->base + sizeof(rboot_assets_header) / sizeof(uint32_t));
+
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (assets->base) {
+			// word loads, safe from mapped flash
+			entry.name_hash = index[mid].name_hash;
+			entry.name_offset = index[mid].name_offset;
+			entry.offset = index[mid].offset;
+			entry.length = index[mid].length;
+		} else {
+			spi_flash_read(assets->addr + sizeof(rboot_assets_header) + mid * sizeof(rboot_asset_entry),
+				(uint32_t*)&entry, sizeof(entry));
+		}
+		if (entry.name_hash == hash) {
+			// hashes are unique, so it's this file or none, and it
+			// must lie within the partition
+			if (!asset_name_matches(assets, entry.name_offset, name)
+				|| (entry.offset & 3) != 0 || entry.offset > assets->length
+				|| entry.length > assets->length - entry.offset) {
+				return false;
+			}
+			asset->addr = assets->addr + entry.offset;
+			asset->length = entry.length;
+			asset->data = assets->base ? assets->base + entry.offset / sizeof(uint32_t) : NULL;
+			return true;
+		} else if (entry.name_hash < hash) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return false;
+}
+
+// copy part of a file, from the mapping if possible
+bool ICACHE_FLASH_ATTR rboot_asset_read(rboot_asset *asset, uint32_t pos, uint32_t *data, uint32_t len) {
+	uint32_t loop;
+
+	if (pos > asset->length || len > ((asset->length - pos + 3) & ~3)) return false;
+
+	if (asset->data) {
+		for (loop = 0; loop < len / sizeof(uint32_t); loop++) {
+			data[loop] = asset->data[pos / sizeof(uint32_t) + loop];
+		}
+		return true;
+	}
+	return (spi_flash_read(asset->addr + pos, data, len) == SPI_FLASH_RESULT_OK);
+}
+
+// open an installed rom for serving, only if every block is intact
+bool ICACHE_FLASH_ATTR rboot_image_open(uint8_t rom, rboot_image *image) {
+	rboot_block_table table;
+	uint32_t tableaddr;
+	uint32_t romaddr;
+	uint16_t block;
+
+	tableaddr = get_block_table(rom, &table, &romaddr);
+	if (tableaddr == 0) return false;
+
+	image->blocks = (table.length + RBOOT_BLOCK_SIZE - 1) / RBOOT_BLOCK_SIZE;
+	for (block = 0; block < image->blocks; block++) {
+		if (flash_digest(romaddr + (block * RBOOT_BLOCK_SIZE), get_block_len(&table, block))
+			!= get_block_digest(tableaddr, block)) {
+			return false;
+		}
+	}
+
+	image->addr = romaddr;
+	image->table_addr = tableaddr;
+	image->length = table.length;
+	image->digest = table.table_digest;
+	image->data = NULL;
+	if (romaddr / 0x100000 == get_mapped_block()
+		&& (romaddr + table.length - 1) / 0x100000 == get_mapped_block()) {
+		image->data = (const uint32_t*)(RBOOT_FLASH_MAP_ADDR + (romaddr % 0x100000));
+	}
+	return true;
+}
+
+// copy part of the manifest, the block table as stored after the rom
+bool ICACHE_FLASH_ATTR rboot_image_read_manifest(rboot_image *image, uint32_t pos, uint32_t *data, uint32_t len) {
+	if (pos > RBOOT_MANIFEST_LEN(image->blocks) || len > RBOOT_MANIFEST_LEN(image->blocks) - pos) {
+		return false;
+	}
+	return (spi_flash_read(image->table_addr + pos, data, len) == SPI_FLASH_RESULT_OK);
+}
+
+// copy part of an image, from the mapping if possible
+bool ICACHE_FLASH_ATTR rboot_image_read(rboot_image *image, uint32_t pos, uint32_t *data, uint32_t len) {
+	uint32_t loop;
+
+	if (pos > image->length || len > image->length - pos) return false;
+
+	if (image->data) {
+		for (loop = 0; loop < len / sizeof(uint32_t); loop++) {
+			data[loop] = image->data[pos / sizeof(uint32_t) + loop];
+		}
+		return true;
+	}
+	return (spi_flash_read(image->addr + pos, data, len) == SPI_FLASH_RESULT_OK);
+}
+
+uint32_t ICACHE_FLASH_ATTR rboot_image_read_block(rboot_image *image, uint16_t block, uint32_t *data) {
+	uint32_t len;
+
+	if (block >= image->blocks) return 0;
+	len = image->length - (block * RBOOT_BLOCK_SIZE);
+	if (len > RBOOT_BLOCK_SIZE) len = RBOOT_BLOCK_SIZE;
+	return rboot_image_read(image, block * RBOOT_BLOCK_SIZE, data, len) ? len : 0;
+}
+
+// check a manifest from another device is whole and matches its own digest
+bool ICACHE_FLASH_ATTR rboot_check_manifest(const rboot_block_table *manifest, uint32_t len) {
+	uint32_t blocks;
+
+	if (len < sizeof(rboot_block_table) || manifest->magic != RBOOT_BLOCK_TABLE_MAGIC
+		|| (manifest->length & 3) != 0) {
+		return false;
+	}
+	blocks = (manifest->length + RBOOT_BLOCK_SIZE - 1) / RBOOT_BLOCK_SIZE;
+	if (RBOOT_MANIFEST_LEN(blocks) > SECTOR_SIZE || len < RBOOT_MANIFEST_LEN(blocks)) {
+		return false;
+	}
+	return (manifest->table_digest
+		== calc_digest(DIGEST_INIT, (uint8_t*)(manifest + 1), blocks * sizeof(uint32_t)));
+}
+
+// check a block from another device against the manifest
+bool ICACHE_FLASH_ATTR rboot_check_manifest_block(const rboot_block_table *manifest, uint16_t block, const uint8_t *data) {
+	const uint32_t *digests = (const uint32_t*)(manifest + 1);
+
+	if (block >= (manifest->length + RBOOT_BLOCK_SIZE - 1) / RBOOT_BLOCK_SIZE) return false;
+	return (calc_digest(DIGEST_INIT, (uint8_t*)data, get_block_len((rboot_block_table*)manifest, block))
+		== digests[block]);
+}
+
+#ifdef BOOT_HISTORY_ADDR
+// read a boot history entry, false if unused or only partly written
+static bool ICACHE_FLASH_ATTR read_history(uint32_t pos, rboot_history_entry *entry) {
+	spi_flash_read(BOOT_HISTORY_ADDR + (pos * sizeof(rboot_history_entry)),
+		(uint32_t*)entry, sizeof(rboot_history_entry));
+	return (entry->count != 0xffffffff
+		&& entry->chksum == calc_chksum((uint8_t*)entry, &entry->chksum));
+}
+
+uint16_t ICACHE_FLASH_ATTR rboot_get_boot_history(rboot_history_entry *entries, uint16_t max) {
+	rboot_history_entry entry;
+	uint32_t first[2];
+	uint32_t count;
+	uint32_t low, high, mid;
+	uint16_t pos, step;
+	uint16_t found = 0;
+	uint8_t sec;
+
+	// find the sector in use and the first free entry in it, as rBoot does
+	for (sec = 0; sec < 2; sec++) {
+		first[sec] = read_history(sec * BOOT_HISTORY_ENTRIES, &entry) ? entry.count : 0;
+	}
+	sec = (first[1] > first[0]) ? 1 : 0;
+	if (first[sec] == 0 || max == 0) {
+		return 0;
+	}
+	low = 1;
+	high = BOOT_HISTORY_ENTRIES;
+	while (low < high) {
+		mid = (low + high) / 2;
+		spi_flash_read(BOOT_HISTORY_ADDR + (sec * SECTOR_SIZE) + (mid * sizeof(rboot_history_entry)),
+			&count, sizeof(count));
+		if (count == 0xffffffff) {
+			high = mid;
+		} else {
+			low = mid + 1;
+		}
+	}
+
+	// walk back through the used part of this sector then the other,
+	// each entry must be older than the last to be sure it is in order
+	count = first[sec] + low;
+	pos = (sec * BOOT_HISTORY_ENTRIES) + low;
+	for (step = 0; step < low + BOOT_HISTORY_ENTRIES && found < max; step++) {
+		pos = (pos == 0) ? (2 * BOOT_HISTORY_ENTRIES) - 1 : pos - 1;
+		if (read_history(pos, &entries[found]) && entries[found].count < count) {
+			count = entries[found].count;
+			found++;
+		}
+	}
+	return found;
+}
+#endif
+
 #ifdef BOOT_RTC_ENABLED
 bool ICACHE_FLASH_ATTR rboot_get_rtc_data(rboot_rtc_data *rtc) {
 	if (system_rtc_mem_read(RBOOT_RTC_ADDR, rtc, sizeof(rboot_rtc_data))) {
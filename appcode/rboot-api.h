@@ -30,8 +30,123 @@ typedef struct {
 	int32_t last_sector_erased;
 	uint8_t extra_count;
 	uint8_t extra_bytes[4];
+	uint8_t admit;           // which rom header is expected next, when writing a rom slot
+	uint8_t sections;        // section headers still to come
+	uint8_t held;            // bytes of the header held back until it has been checked
+	uint32_t header[4];
+	uint32_t next_header;    // flash address of the next header
+	uint32_t slot_end;       // end of the rom slot, 0 if not writing one
 } rboot_write_status;
 
+/**	@brief  Structure for a config sector transaction
+ *  @note   Holds a copy of the whole config sector, change the rBoot config
+ *          and anything else kept in the sector (app settings, slot metadata)
+ *          in it between rboot_config_begin and rboot_config_commit.
+ *	@see    rboot_config_begin
+*/
+typedef struct {
+	rboot_config *config;      ///< The rBoot config, at the start of sector
+	uint8_t *sector;           ///< Copy of the config sector, SECTOR_SIZE bytes
+} rboot_config_txn;
+
+#define RBOOT_PIPE_MAX_SLOTS 16
+
+/**	@brief  Structure for a pipe of slots between network receive and the flash writer
+ *  @note   Written by one producer (the receive callback) and one consumer
+ *          (the writer), each only changing its own index, so no locking is
+ *          needed. The indexes are volatile and only updated once the slot
+ *          they hand over is filled or written. The user application should not modify the contents of
+ *          this structure.
+ *	@see    rboot_pipe_init
+*/
+typedef struct {
+	uint8_t *slots;            ///< count slots of slot_size bytes
+	uint16_t slot_size;        ///< Size of each slot, including up to 3 bytes kept free in front
+	uint8_t count;             ///< Quantity of slots
+	uint8_t high_mark;         ///< Slots in use to start throttling at
+	uint8_t low_mark;          ///< Slots in use to stop throttling at
+	uint8_t throttled;         ///< Current throttle state
+	uint8_t align;             ///< Bytes committed so far, mod 4
+	volatile uint8_t head;     ///< Next slot to fill, only changed by the producer
+	volatile uint8_t tail;     ///< Next slot to write, only changed by the consumer
+	uint16_t len[RBOOT_PIPE_MAX_SLOTS]; ///< Data committed to each slot
+	uint32_t end_addr;         ///< Flash address erase ahead stops at
+} rboot_pipe;
+
+#define RBOOT_BLOCK_TABLE_MAGIC 0x6b6c4254
+#define RBOOT_BLOCK_SIZE SECTOR_SIZE
+
+/**	@brief  Header of the per block digest table stored with a ROM
+ *  @note   The table is stored in the last sector of the ROM slot and is
+ *          followed by one 32 bit digest for each RBOOT_BLOCK_SIZE block of
+ *          the ROM, so it can cover up to 4MB.
+ *	@see    rboot_write_block_table
+*/
+typedef struct {
+	uint32_t magic;          ///< Should be RBOOT_BLOCK_TABLE_MAGIC
+	uint32_t length;         ///< Length of the ROM covered by the table
+	uint32_t table_digest;   ///< Digest of the block digests that follow
+} rboot_block_table;
+
+#define RBOOT_ASSETS_MAGIC 0x54455341
+#define RBOOT_FLASH_MAP_ADDR 0x40200000
+
+/**	@brief  Header of an asset partition
+ *  @note   Followed by count rboot_asset_entry, sorted by name_hash, then the
+ *          file names (nul terminated) and data. Everything is 4 byte aligned.
+ *	@see    rboot_assets_open
+*/
+typedef struct {
+	uint32_t magic;          ///< Should be RBOOT_ASSETS_MAGIC
+	uint32_t count;          ///< Quantity of files
+	uint32_t length;         ///< Length of the whole partition image
+} rboot_assets_header;
+
+/**	@brief  Index entry for a file in an asset partition
+*/
+typedef struct {
+	uint32_t name_hash;      ///< FNV-1a digest of the file name, unique in the partition
+	uint32_t name_offset;    ///< Offset of the nul terminated file name from the start of the partition, 4 byte aligned
+	uint32_t offset;         ///< Offset of the file from the start of the partition, 4 byte aligned
+	uint32_t length;         ///< Length of the file
+} rboot_asset_entry;
+
+/**	@brief  Structure for an open asset partition
+ *  @note   The user application should not modify the contents of this
+ *          structure.
+*/
+typedef struct {
+	uint32_t addr;           ///< Flash address of the partition
+	uint32_t count;          ///< Quantity of files
+	uint32_t length;         ///< Length of the whole partition image
+	const uint32_t *base;    ///< Mapped address of the partition, NULL if it isn't mapped
+} rboot_assets;
+
+/**	@brief  Structure describing a file found in an asset partition
+*/
+typedef struct {
+	uint32_t addr;           ///< Flash address of the file
+	uint32_t length;         ///< Length of the file
+	const uint32_t *data;    ///< Mapped address of the file, NULL if it isn't mapped
+} rboot_asset;
+
+/**	@brief  Structure for an installed ROM opened to serve to other devices
+ *  @note   The user application should not modify the contents of this
+ *          structure.
+ *	@see    rboot_image_open
+*/
+typedef struct {
+	uint32_t addr;           ///< Flash address of the ROM
+	uint32_t table_addr;     ///< Flash address of its block table (the manifest)
+	uint32_t length;         ///< Length of the image
+	uint32_t digest;         ///< Digest of the block digests, identifies the image
+	uint16_t blocks;         ///< Quantity of RBOOT_BLOCK_SIZE blocks
+	const uint32_t *data;    ///< Mapped address of the ROM, NULL if it isn't mapped
+} rboot_image;
+
+/** @brief  Length of the manifest of an image, its block table and digests */
+#define RBOOT_MANIFEST_LEN(blocks) (sizeof(rboot_block_table) + ((blocks) * sizeof(uint32_t)))
+
 /**	@brief	Read rBoot configuration from flash
  *	@retval rboot_config Copy of the rBoot configuration
  *  @note   Returns rboot_config (defined in rboot.h) allowing you to modify any values
@@ -49,6 +164,30 @@ rboot_config ICACHE_FLASH_ATTR rboot_get_config(void);
 */
 bool ICACHE_FLASH_ATTR rboot_set_config(rboot_config *conf);
 
+/**	@brief	Start a transaction of changes to the config sector
+ *	@param	txn Pointer to a transaction, for the changes
+ *	@retval bool True on success, false if there isn't the ram for it
+ *  @note   Several changes (the current ROM, app settings etc.) can then be
+ *          made to the copy in txn and written with one erase and write by
+ *          rboot_config_commit, or dropped with rboot_config_abort.
+*/
+bool ICACHE_FLASH_ATTR rboot_config_begin(rboot_config_txn *txn);
+
+/**	@brief	Write the changes of a transaction to flash
+ *	@param	txn Pointer to the transaction, ended by this call
+ *	@retval bool True on success
+ *  @note   Updates the config checksum (if enabled). Nothing is written if
+ *          nothing changed. With BOOT_CONFIG_JOURNAL_ADDR the write is atomic,
+ *          if power is lost part way through rBoot finishes it at the next
+ *          boot, else the sector may be left blank.
+*/
+bool ICACHE_FLASH_ATTR rboot_config_commit(rboot_config_txn *txn);
+
+/**	@brief	Drop the changes of a transaction
+ *	@param	txn Pointer to the transaction, ended by this call
+*/
+void ICACHE_FLASH_ATTR rboot_config_abort(rboot_config_txn *txn);
+
 /** @brief  Get index of current ROM
  *  @retval uint8_t Index of the current ROM
  *  @note   Get the currently selected boot ROM (this will be the currently
@@ -71,6 +210,12 @@ bool ICACHE_FLASH_ATTR rboot_set_current_rom(uint8_t rom);
  *          start_addr is the address on the SPI flash to write from. Returns a status structure which
  *          must be passed back on each write. The contents of the structure should not
  *          be modified by the calling code.
+ *  @note   If start_addr is the start of a rom slot in the config the data must be
+ *          a rom image. Each header is checked before anything after it is erased
+ *          or written: the magic, entry point, flash size, that the irom and each
+ *          section fit in the slot and that each section loads to ram (or, for the
+ *          irom of a single link image, is linked for this slot). Nothing at all is
+ *          erased for a bad image header, and the write fails at the first bad one.
 */
 rboot_write_status ICACHE_FLASH_ATTR rboot_write_init(uint32_t start_addr);
 
@@ -80,6 +225,8 @@ rboot_write_status ICACHE_FLASH_ATTR rboot_write_init(uint32_t start_addr);
  *          outstanding bytes are written (if data so far hasn't been a multiple
  *          of 4 bytes there will be a few bytes unwritten, until you call
  *          this function).
+ *  @return False if the last bytes couldn't be written or, when writing a rom
+ *          slot, the image was refused or is incomplete
 */
 bool ICACHE_FLASH_ATTR rboot_write_end(rboot_write_status *status);
 
@@ -92,9 +239,336 @@ bool ICACHE_FLASH_ATTR rboot_write_end(rboot_write_status *status);
  *  tracked automatically. This method is likely to be called each time a packet
  *  of OTA data is received over the network.
  *  @note   Call rboot_write_init before calling this function to get the rboot_write_status structure
+ *  @return False on a write error or, when writing a rom slot, a bad rom header
 */
 bool ICACHE_FLASH_ATTR rboot_write_flash(rboot_write_status *status, uint8_t *data, uint16_t len);
 
+/** @brief  Set up a pipe between network receive and the flash writer
+ *  @param  pipe Pointer to the pipe to set up
+ *  @param  status Write status from rboot_write_init, used by the writer
+ *  @param  slots Buffer of count * slot_size bytes, 4 byte aligned
+ *  @param  slot_size Size of each slot, a multiple of 4 (up to 3 bytes at
+ *          the start are kept free for the writer)
+ *  @param  count Quantity of slots, a power of 2 up to RBOOT_PIPE_MAX_SLOTS
+ *  @param  end_addr Flash address the write will not go beyond, for erase ahead
+ *  @return True on success, false if the arguments are invalid
+ *  @note   Received data is placed straight into a slot and written to flash
+ *          from there, so a slow flash erase only fills the pipe rather than
+ *          stalling packet processing. Call rboot_write_end once the pipe has
+ *          been drained.
+*/
+bool ICACHE_FLASH_ATTR rboot_pipe_init(rboot_pipe *pipe, rboot_write_status *status,
+	uint8_t *slots, uint16_t slot_size, uint8_t count, uint32_t end_addr);
+
+/** @brief  Reserve a slot to receive data in to
+ *  @param  pipe Pointer to the pipe
+ *  @param  space Set to the bytes that can be placed in the slot
+ *  @return Pointer to fill with data, NULL if every slot is in use
+ *  @note   Producer side. Fill in place then pass it on with rboot_pipe_commit.
+*/
+uint8_t* ICACHE_FLASH_ATTR rboot_pipe_reserve(rboot_pipe *pipe, uint16_t *space);
+
+/** @brief  Pass the reserved slot on to the writer
+ *  @param  pipe Pointer to the pipe
+ *  @param  len Bytes placed in the slot, up to the space given by rboot_pipe_reserve
+ *  @note   Producer side.
+*/
+void ICACHE_FLASH_ATTR rboot_pipe_commit(rboot_pipe *pipe, uint16_t len);
+
+/** @brief  Get the quantity of slots waiting to be written
+ *  @param  pipe Pointer to the pipe
+ *  @return Slots in use
+*/
+uint8_t ICACHE_FLASH_ATTR rboot_pipe_level(rboot_pipe *pipe);
+
+/** @brief  Check whether the receiver should hold off
+ *  @param  pipe Pointer to the pipe
+ *  @return True once the pipe fills to high_mark, until it drains to low_mark
+ *  @note   Producer side. Use to hold and unhold the connection (e.g.
+ *          espconn_recv_hold) so the sender's window follows the pipe.
+*/
+bool ICACHE_FLASH_ATTR rboot_pipe_throttle(rboot_pipe *pipe);
+
+/** @brief  Write the next slot of the pipe to flash
+ *  @param  pipe Pointer to the pipe
+ *  @param  status Write status given to rboot_pipe_init
+ *  @return True on success, false on a flash error
+ *  @note   Consumer side, call from a task or timer while rboot_pipe_level is
+ *          non-zero. When the pipe is empty the next sector is erased ahead
+ *          instead, so it is ready before its data arrives.
+*/
+bool ICACHE_FLASH_ATTR rboot_pipe_write(rboot_pipe *pipe, rboot_write_status *status);
+
+/** @brief  Get the size of a ROM slot
+ *  @param  rom Index of the ROM
+ *  @retval uint32_t Size of the slot in bytes, 0 if the ROM index is not valid
+ *  @note   A slot runs up to the next ROM above it, the end of its 1MB block
+ *          or the end of the flash, whichever comes first (as used by rBoot).
+*/
+uint32_t ICACHE_FLASH_ATTR rboot_get_slot_size(uint8_t rom);
+
+/** @brief  Create and store the block digest table for a ROM
+ *  @param  rom Index of the ROM
+ *  @param  length Length of the ROM image in bytes
+ *  @retval bool True on success
+ *  @note   Call after writing (and verifying) a new ROM. The table is written
+ *          to the last sector of the slot, so the ROM must not use it.
+*/
+bool ICACHE_FLASH_ATTR rboot_write_block_table(uint8_t rom, uint32_t length);
+
+/** @brief  Check the blocks of a ROM against its digest table
+ *  @param  rom Index of the ROM
+ *  @param  first First block to check
+ *  @param  count Maximum quantity of blocks to check (so checking can be done
+ *          a few blocks at a time)
+ *  @param  bad Optional bitmap, a bit is set for each bad block found (bit
+ *          n of byte n / 8 for block n)
+ *  @retval int32_t Quantity of bad blocks found, or -1 if there is no valid
+ *          digest table for the ROM
+*/
+int32_t ICACHE_FLASH_ATTR rboot_check_blocks(uint8_t rom, uint16_t first, uint16_t count, uint8_t *bad);
+
+/** @brief  Repair the bad blocks of a ROM from another ROM slot
+ *  @param  rom Index of the ROM to repair
+ *  @param  src_rom Index of the ROM to copy good blocks from
+ *  @retval int32_t Quantity of blocks that could not be repaired, or -1 if
+ *          there is no valid digest table for the ROM
+ *  @note   A block is only copied if the source block matches the digest
+ *          expected for the damaged ROM, e.g. an identical image in another
+ *          1MB block when using a single link big flash layout. Only
+ *          sectors holding bad blocks are erased and rewritten.
+*/
+int32_t ICACHE_FLASH_ATTR rboot_repair_blocks(uint8_t rom, uint8_t src_rom);
+
+/** @brief  Repair a single block of a ROM with supplied data
+ *  @param  rom Index of the ROM to repair
+ *  @param  block Index of the block
+ *  @param  data RBOOT_BLOCK_SIZE bytes of replacement data (the final block
+ *          may be short, in which case only the bytes covered are used)
+ *  @retval bool True if the data matched the expected digest and was written
+ *  @note   Use with a ranged download of just the bad blocks. The data must
+ *          be 4 byte aligned.
+*/
+bool ICACHE_FLASH_ATTR rboot_repair_block(uint8_t rom, uint16_t block, uint8_t *data);
+
+#if defined(BOOT_GOLDEN_ROM) || defined(BOOT_DIRTY_MAP_ADDR)
+/** @brief  Request a factory reset on the next boot
+ *  @param  enable True to request a factory reset, false to cancel a request
+ *  @retval bool True on success
+ *  @note   rBoot writes the default config (keeping the ROM slots, slot wear
+ *          and partition table), clears the rest of the config sector (the
+ *          app settings area), erases the dirty sectors of the reset region
+ *          (BOOT_DIRTY_MAP_ADDR) and restores the golden ROM over ROM 0
+ *          (BOOT_GOLDEN_ROM). A reset cut short by a power cut is resumed at
+ *          the next boot. The request uses the first word at offset 0x100 of
+ *          the config sector, so don't keep app settings there.
+*/
+bool ICACHE_FLASH_ATTR rboot_set_factory_reset(bool enable);
+#endif
+
+#ifdef BOOT_DIRTY_MAP_ADDR
+/** @brief  Mark sectors of the factory reset region as written
+ *  @param  addr Flash address of the write
+ *  @param  len Length of the write
+ *  @retval bool True on success
+ *  @note   Factory reset only erases sectors of the reset region (BOOT_RESET_ADDR
+ *          & BOOT_RESET_SIZE) that have been marked. Writes outside the region
+ *          are ignored. Call before writing, if not using rboot_flash_write.
+*/
+bool ICACHE_FLASH_ATTR rboot_mark_dirty(uint32_t addr, uint32_t len);
+
+/** @brief  Write to flash, tracking writes to the factory reset region
+ *  @param  addr Flash address to write to
+ *  @param  data Pointer to the (4 byte aligned) data to write
+ *  @param  len Length of the data, must be a multiple of 4
+ *  @retval bool True on success
+ *  @note   Use in place of spi_flash_write for app settings & data in the
+ *          factory reset region. rboot_write_flash does this automatically.
+*/
+bool ICACHE_FLASH_ATTR rboot_flash_write(uint32_t addr, uint32_t *data, uint32_t len);
+#endif
+
+#ifdef BOOT_INSTALL_ENABLED
+/** @brief  Request installation of a packed ROM from the staging area
+ *  @param  rom Index of the ROM slot to install in to
+ *  @param  packed_len Length of the packed ROM
+ *  @param  image_len Length of the ROM once unpacked
+ *  @retval bool True on success
+ *  @note   Write the packed ROM (see rboot_install in rboot.h for the format)
+ *          starting one sector after BOOT_STAGING_ADDR, e.g. with
+ *          rboot_write_init(BOOT_STAGING_ADDR + SECTOR_SIZE), and verify it
+ *          before calling this. On the next boot rBoot will unpack it in to
+ *          the ROM slot and make it the current ROM.
+*/
+bool ICACHE_FLASH_ATTR rboot_set_install(uint8_t rom, uint32_t packed_len, uint32_t image_len);
+#endif
+
+#ifdef BOOT_PLAN_ENABLED
+/** @brief  Create a boot plan for a ROM by reading its headers from flash
+ *  @param  rom Index of the ROM to create the plan for
+ *  @param  plan Pointer to a rboot_plan structure to be populated
+ *  @retval bool True on success, false if the ROM is not valid or has too
+ *          many sections to fit in a plan
+ *  @note   Call after writing a new ROM, then store the plan with
+ *          rboot_set_boot_plan. Alternatively an OTA process that already
+ *          knows the section layout can fill in the plan itself.
+*/
+bool ICACHE_FLASH_ATTR rboot_create_boot_plan(uint8_t rom, rboot_plan *plan);
+
+/** @brief  Get the stored boot plan for a ROM
+ *  @param  rom Index of the ROM
+ *  @param  plan Pointer to a rboot_plan structure to be populated
+ *  @retval bool True on success, false if no plan/invalid checksum
+*/
+bool ICACHE_FLASH_ATTR rboot_get_boot_plan(uint8_t rom, rboot_plan *plan);
+
+/** @brief  Store a boot plan for a ROM
+ *  @param  rom Index of the ROM
+ *  @param  plan Pointer to the plan to store, or NULL to clear it
+ *  @retval bool True on success
+ *  @note   The magic and checksum will be set for you. The plan is stored
+ *          at BOOT_PLAN_OFFSET in the config sector, while maintaining the
+ *          contents of the rest of the sector. rboot_write_end, the OTA
+ *          library and rBoot's installer clear the plan of a slot they
+ *          write a new ROM to.
+*/
+bool ICACHE_FLASH_ATTR rboot_set_boot_plan(uint8_t rom, rboot_plan *plan);
+#endif
+
+#ifdef BOOT_PARTITIONS
+/** @brief  Get the partition table
+ *  @param  table Pointer to a rboot_part_table structure to be populated
+ *  @retval bool True on success, false if no table/invalid checksum
+*/
+bool ICACHE_FLASH_ATTR rboot_get_part_table(rboot_part_table *table);
+
+/** @brief  Store the partition table
+ *  @param  table Pointer to the table, with count and parts filled in
+ *  @retval bool True on success, false if the partitions are not valid
+ *  @note   Partitions may be given in any order, they are sorted by name and
+ *          the type index, magic and checksum are set for you. Fails if any
+ *          name is repeated, or a partition is not whole sectors, overlaps
+ *          another or the config, or crosses a 1MB boundary. Partitions are
+ *          not checked against ROM slots. The table is stored at
+ *          BOOT_PART_TABLE_OFFSET in the config sector, while maintaining the
+ *          contents of the rest of the sector.
+*/
+bool ICACHE_FLASH_ATTR rboot_set_part_table(rboot_part_table *table);
+
+/** @brief  Find a partition by name
+ *  @param  name Name of the partition
+ *  @param  part Pointer to a rboot_partition structure to be populated
+ *  @retval bool True if found
+*/
+bool ICACHE_FLASH_ATTR rboot_find_partition(const char *name, rboot_partition *part);
+
+/** @brief  Find a partition by type
+ *  @param  type Type of the partition (PART_TYPE_xxx)
+ *  @param  n Which partition of that type, from 0
+ *  @param  part Pointer to a rboot_partition structure to be populated
+ *  @retval bool True if found
+*/
+bool ICACHE_FLASH_ATTR rboot_find_partition_type(uint8_t type, uint8_t n, rboot_partition *part);
+#endif
+
+/** @brief  Open an asset partition
+ *  @param  addr Flash address of the partition (sector aligned)
+ *  @param  assets Pointer to a rboot_assets structure to be populated
+ *  @retval bool True on success, false if there is no asset partition there
+ *  @note   If the partition is in the 1MB block of flash mapped for the
+ *          running ROM (always the first 1MB without BOOT_BIG_FLASH) its
+ *          files can be used in place, with no copying, through the data
+ *          pointers returned by rboot_asset_find.
+*/
+bool ICACHE_FLASH_ATTR rboot_assets_open(uint32_t addr, rboot_assets *assets);
+
+/** @brief  Find a file in an asset partition
+ *  @param  assets Pointer to the open partition
+ *  @param  name Name of the file
+ *  @param  asset Pointer to a rboot_asset structure to be populated
+ *  @retval bool True if found, false if not or if its index entry is bad
+ *  @note   Mapped flash must only be read with aligned 32 bit loads, reading
+ *          single bytes through asset->data will crash. Use
+ *          rboot_asset_read when asset->data is NULL.
+*/
+bool ICACHE_FLASH_ATTR rboot_asset_find(rboot_assets *assets, const char *name, rboot_asset *asset);
+
+/** @brief  Copy part of a file from an asset partition
+ *  @param  asset Pointer to the file
+ *  @param  pos Position in the file to read from, a multiple of 4
+ *  @param  data Pointer to a (4 byte aligned) buffer
+ *  @param  len Length to read, a multiple of 4 (can read past the end of
+ *          the file up to the next multiple of 4)
+ *  @retval bool True on success
+*/
+bool ICACHE_FLASH_ATTR rboot_asset_read(rboot_asset *asset, uint32_t pos, uint32_t *data, uint32_t len);
+
+/** @brief  Open an installed ROM to serve to other devices
+ *  @param  rom Index of the ROM
+ *  @param  image Pointer to a rboot_image structure to be populated
+ *  @retval bool True on success, false if the ROM has no valid block table
+ *          or any block doesn't match it
+ *  @note   Every block is checked, so open the image once and keep it open
+ *          while serving. If the ROM is in the 1MB block of flash mapped for
+ *          the running ROM (e.g. it is the running ROM) it is read through
+ *          the mapping. Don't use the image once its slot is rewritten.
+*/
+bool ICACHE_FLASH_ATTR rboot_image_open(uint8_t rom, rboot_image *image);
+
+/** @brief  Copy part of the manifest of an open image
+ *  @param  image Pointer to the open image
+ *  @param  pos Position in the manifest to read from, a multiple of 4
+ *  @param  data Pointer to a (4 byte aligned) buffer
+ *  @param  len Length to read, a multiple of 4
+ *  @retval bool True on success
+ *  @note   The manifest is the rboot_block_table followed by the digest of
+ *          each block, RBOOT_MANIFEST_LEN(image->blocks) bytes in all.
+*/
+bool ICACHE_FLASH_ATTR rboot_image_read_manifest(rboot_image *image, uint32_t pos, uint32_t *data, uint32_t len);
+
+/** @brief  Copy part of an open image
+ *  @param  image Pointer to the open image
+ *  @param  pos Position in the image to read from, a multiple of 4
+ *  @param  data Pointer to a (4 byte aligned) buffer
+ *  @param  len Length to read, a multiple of 4
+ *  @retval bool True on success
+*/
+bool ICACHE_FLASH_ATTR rboot_image_read(rboot_image *image, uint32_t pos, uint32_t *data, uint32_t len);
+
+/** @brief  Copy a block of an open image
+ *  @param  image Pointer to the open image
+ *  @param  block Index of the block
+ *  @param  data Pointer to a (4 byte aligned) buffer of RBOOT_BLOCK_SIZE bytes
+ *  @retval uint32_t Length of the block (the last one may be short), 0 on error
+*/
+uint32_t ICACHE_FLASH_ATTR rboot_image_read_block(rboot_image *image, uint16_t block, uint32_t *data);
+
+/** @brief  Check a manifest received from another device
+ *  @param  manifest Pointer to the whole manifest
+ *  @param  len Length of the manifest received
+ *  @retval bool True if the manifest is complete and its digests are intact
+*/
+bool ICACHE_FLASH_ATTR rboot_check_manifest(const rboot_block_table *manifest, uint32_t len);
+
+/** @brief  Check a block received from another device against its manifest
+ *  @param  manifest Pointer to the whole manifest, already checked
+ *  @param  block Index of the block
+ *  @param  data The block (the last one may be short)
+ *  @retval bool True if the block matches its digest
+*/
+bool ICACHE_FLASH_ATTR rboot_check_manifest_block(const rboot_block_table *manifest, uint16_t block, const uint8_t *data);
+
+#ifdef BOOT_HISTORY_ADDR
+/** @brief  Read the boot history
+ *  @param  entries Pointer to an array of rboot_history_entry to be populated
+ *  @param  max Size of the array
+ *  @retval uint16_t Quantity of entries read, the latest boot first
+ *  @note   Entries only partly written (power lost as rBoot wrote them) are
+ *          skipped, so there can be gaps in the boot counts.
+*/
+uint16_t ICACHE_FLASH_ATTR rboot_get_boot_history(rboot_history_entry *entries, uint16_t max);
+#endif
+
 #ifdef BOOT_RTC_ENABLED
 /** @brief  Get rBoot status/control data from RTC data area
  *  @param  rtc Pointer to a rboot_rtc_data structure to be populated
@@ -31,35 +31,21 @@ void IRAM_ATTR Cache_Read_Enable_New(void);
 void IRAM_ATTR Cache_Read_Enable_New(void) {
 	
 	if (rBoot_mmap_1 == 0xff) {
+		// rboot left the block to map in rtc memory, checked by its
+		// magic and checksum, no flash access needed, the word is read
+		// directly as the sdk rtc functions aren't in iram
 		uint32_t val;
-		rboot_config conf;
+		rboot_rtc_mmap rtc_mmap __attribute__((aligned(4)));
 
-		SPIRead(BOOT_CONFIG_SECTOR * SECTOR_SIZE, &conf, sizeof(rboot_config));
-
-#ifdef BOOT_RTC_ENABLED
-		// rtc support here isn't written ideally, we don't read the whole structure and
-		// we don't check the checksum. However this code is only run on first boot, so
-		// the rtc data should have just been set and the user app won't have had chance
-		// to corrupt it or suspend or anything else that might upset it. And if
-		// it were bad what should we do anyway? We can't just ignore bad data here, we
-		// need it. But the main reason is that this code must be in iram, which is in
-		// very short supply, doing this "properly" increases the size about 3x
-
-		// used only to calculate offset into structure, should get optimized out
-		rboot_rtc_data rtc;
-		uint8_t off = (uint8_t*)&rtc.last_rom - (uint8_t*)&rtc;
-		// get the four bytes containing the one of interest
-		volatile uint32_t *rtcd = (uint32_t*)(0x60001100 + (RBOOT_RTC_ADDR*4) + (off & ~3));
-		val = *rtcd;
-		// extract the one of interest
-		val = ((uint8_t*)&val)[off & 3];
-		// get address of rom
-		val = conf.roms[val];
-#else
-		val = conf.roms[conf.current_rom];
-#endif
-
-		val /= 0x100000;
+		*(uint32_t*)&rtc_mmap = *((volatile uint32_t*)0x60001100 + RBOOT_RTC_MMAP_ADDR);
+		if (rtc_mmap.magic == RBOOT_MMAP_MAGIC && rtc_mmap.chksum == RBOOT_MMAP_CHKSUM(rtc_mmap.block)) {
+			val = rtc_mmap.block;
+		} else {
+			// older rboot, map the current rom
+			rboot_config conf;
+			SPIRead(BOOT_CONFIG_SECTOR * SECTOR_SIZE, &conf, sizeof(rboot_config));
+			val = conf.roms[conf.current_rom] / 0x100000;
+		}
 
 		rBoot_mmap_2 = val / 2;
 		rBoot_mmap_1 = val % 2;
@@ -12,10 +12,6 @@
 #define LED_GPIO_NUM 2  // Default to GPIO2 (common for ESP-12 modules)
 #endif
 
-// Factory reset flag in RTC memory
-#define FACTORY_RESET_MAGIC 0x1AC3F5E7
-#define FACTORY_RESET_FLAG_ADDR (RBOOT_RTC_ADDR + 128) // After rBoot RTC data
-
 // LED control functions
 static inline void led_init(void) {
     // Configure LED GPIO as output
@@ -45,19 +41,6 @@ static inline void led_blink(int count, int delay_ms) {
     }
 }
 
-// Check if factory reset is requested
-static uint8_t check_factory_reset(void) {
-    uint32_t flag = 0;
-    system_rtc_mem(FACTORY_RESET_FLAG_ADDR, &flag, sizeof(flag), RBOOT_RTC_READ);
-    return (flag == FACTORY_RESET_MAGIC);
-}
-
-// Set factory reset flag
-void rboot_set_factory_reset(uint8_t enable) {
-    uint32_t flag = enable ? FACTORY_RESET_MAGIC : 0;
-    system_rtc_mem(FACTORY_RESET_FLAG_ADDR, &flag, sizeof(flag), RBOOT_RTC_WRITE);
-}
-
 // Get current boot ROM
 uint8_t rboot_get_current_rom(void) {
     rboot_config romconf;
@@ -65,68 +48,48 @@ uint8_t rboot_get_current_rom(void) {
     return romconf.current_rom;
 }
 
-// Set boot ROM for next boot
-uint8_t rboot_set_boot_rom(uint8_t rom) {
-    rboot_config romconf;
-    if (SPIRead(BOOT_CONFIG_SECTOR * SECTOR_SIZE, &romconf, sizeof(romconf)) != 0) {
+// Write the config sector as rBoot's write_config does, through the
+// journal if there is one, so a power cut leaves the old or new sector
+static uint8_t write_config_sector(uint8_t *buffer) {
+#ifdef BOOT_CONFIG_JOURNAL_ADDR
+    uint32_t zero = 0;
+    if (SPIEraseSector(BOOT_CONFIG_JOURNAL_ADDR / SECTOR_SIZE) != 0
+        || SPIWrite(BOOT_CONFIG_JOURNAL_ADDR + sizeof(uint32_t), buffer + sizeof(uint32_t), SECTOR_SIZE - sizeof(uint32_t)) != 0
+        || SPIWrite(BOOT_CONFIG_JOURNAL_ADDR, buffer, sizeof(uint32_t)) != 0) {
         return 0;
     }
-    
-    if (rom >= romconf.count) {
-        return 0;
-    }
-    
-    romconf.current_rom = rom;
-    
-    // Write back to flash
-    if (SPIEraseSector(BOOT_CONFIG_SECTOR) != 0) {
-        return 0;
-    }
-    
-    if (SPIWrite(BOOT_CONFIG_SECTOR * SECTOR_SIZE, &romconf, sizeof(romconf)) != 0) {
+#endif
+    if (SPIEraseSector(BOOT_CONFIG_SECTOR) != 0
+        || SPIWrite(BOOT_CONFIG_SECTOR * SECTOR_SIZE, buffer, SECTOR_SIZE) != 0) {
         return 0;
     }
-    
+#ifdef BOOT_CONFIG_JOURNAL_ADDR
+    SPIWrite(BOOT_CONFIG_JOURNAL_ADDR, &zero, sizeof(zero));
+#endif
     return 1;
 }
 
-// Perform factory reset
-static void perform_factory_reset(void) {
-    // Blink LED to indicate factory reset
-    for (int i = 0; i < 5; i++) {
-        led_on();
-        ets_delay_us(100000); // 100ms
-        led_off();
-        ets_delay_us(100000);
+// Set boot ROM for next boot, the rest of the config sector (slot
+// metadata, boot plans, partition table and app settings) is kept
+uint8_t rboot_set_boot_rom(uint8_t rom) {
+    uint8_t buffer[SECTOR_SIZE] __attribute__((aligned(4)));
+    rboot_config *romconf = (rboot_config*)buffer;
+
+    if (SPIRead(BOOT_CONFIG_SECTOR * SECTOR_SIZE, buffer, SECTOR_SIZE) != 0) {
+        return 0;
     }
-    
-    // Reset to default configuration
-    rboot_config romconf;
-    uint32_t flashsize = 0x100000; // Default to 1MB
-    
-    // Get actual flash size if possible
-    uint32_t id = 0;
-    if (SPIRead(0, &id, 4) == 0) {
-        // Parse flash ID to get size (simplified)
-        if ((id & 0xFF) == 0x40) { // 16MBit
-            flashsize = 0x200000;
-        } else if ((id & 0xFF) == 0x30) { // 32MBit
-            flashsize = 0x400000;
-        }
+
+    if (rom >= romconf->count) {
+        return 0;
     }
-    
-    // Create default config
-    default_config(&romconf, flashsize);
-    
-    // Write config to flash
-    SPIEraseSector(BOOT_CONFIG_SECTOR);
-    SPIWrite(BOOT_CONFIG_SECTOR * SECTOR_SIZE, &romconf, sizeof(romconf));
-    
-    // Clear factory reset flag
-    rboot_set_factory_reset(0);
-    
-    // Reboot
-    asm volatile ("break 0,0");
+
+    romconf->current_rom = rom;
+#ifdef BOOT_CONFIG_CHKSUM
+    romconf->chksum = calc_chksum((uint8_t*)romconf, (uint8_t*)&romconf->chksum);
+#endif
+
+    // Write back to flash
+    return write_config_sector(buffer);
 }
 
 // Rest of the existing code...
@@ -142,15 +105,10 @@ void call_user_start(void) {
     // Initialize LED for status feedback
     led_init();
     
-    // Check for factory reset
-    if (check_factory_reset()) {
-        perform_factory_reset();
-    }
-    
     // Indicate boot start with LED
     led_on();
     
-    // Find and boot image
+    // Find and boot image, find_image carries out any factory reset
     addr = find_image();
     
     // Indicate successful boot with LED
@@ -170,15 +128,10 @@ void call_user_start(void) {
     // Initialize LED for status feedback
     led_init();
     
-    // Check for factory reset
-    if (check_factory_reset()) {
-        perform_factory_reset();
-    }
-    
     // Indicate boot start with LED
     led_on();
     
-    // Find and boot image
+    // Find and boot image, find_image carries out any factory reset
     __asm volatile (
         "call0 find_image\n\t"    // find a good rom to boot
         "movi a2, 0\n\t"          // clear a2 (just in case)
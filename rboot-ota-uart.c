@@ -0,0 +1,322 @@
+/**
+ * @file rboot-ota-uart.c
+ * @brief rBoot OTA over a serial (UART/RS-485) link
+ * @author Richard A Burton <richardaburton@gmail.com>
+ * @version 1.0
+ * @date 2023
+ *
+ * @copyright Copyright (c) 2023 Richard A Burton. See license.txt for license terms.
+ */
+
+#include "rboot-ota-uart.h"
+#include <string.h>
+
+// Frame parser steps
+#define STEP_SYNC    0
+#define STEP_TYPE    1
+#define STEP_SEQ     2
+#define STEP_LEN_LO  3
+#define STEP_LEN_HI  4
+#define STEP_PAYLOAD 5
+#define STEP_CRC_LO  6
+#define STEP_CRC_HI  7
+
+// Packed payload steps
+#define UNPACK_TOKEN     0
+#define UNPACK_LITERAL   1
+#define UNPACK_OFFSET_LO 2
+#define UNPACK_OFFSET_HI 3
+
+#define CRC_INIT 0xffff
+
+// Forward declarations
+static uint16_t crc_byte(uint16_t crc, uint8_t byte);
+static void header_done(uart_ota_t *rx);
+static void unpack_byte(uart_ota_t *rx, uint8_t byte);
+static void frame_done(uart_ota_t *rx);
+static void write_held(uart_ota_t *rx);
+static void send_frame(uart_ota_t *rx, uint8_t type, uint8_t seq, const uint8_t *payload, uint8_t len);
+static void send_ack(uart_ota_t *rx);
+static void send_result(uart_ota_t *rx);
+
+ota_result_t rboot_ota_uart_init(uart_ota_t *rx, ota_handle_t *ota, uint8_t *slots,
+    uint8_t window, uart_ota_send_t send, void *arg) {
+    if (!rx || !ota || !slots || !send || ((uint32_t)slots & 3) != 0
+        || window == 0 || window > UART_OTA_MAX_WINDOW || (window & (window - 1)) != 0) {
+        return OTA_ERR_INVALID_ARGS;
+    }
+
+    memset(rx, 0, sizeof(uart_ota_t));
+    rx->ota = ota;
+    rx->send = send;
+    rx->send_arg = arg;
+    rx->slots = slots;
+    rx->window = window;
+    rx->step = STEP_SYNC;
+    rx->result = OTA_PENDING;
+    return OTA_OK;
+}
+
+ota_result_t rboot_ota_uart_feed(uart_ota_t *rx, const uint8_t *data, uint32_t len) {
+    uint8_t byte;
+
+    if (!rx || (!data && len > 0)) {
+        return OTA_ERR_INVALID_ARGS;
+    }
+
+    while (len > 0) {
+        byte = *data++;
+        len--;
+
+        if (rx->step == STEP_SYNC) {
+            if (byte == UART_OTA_SYNC) {
+                rx->crc = CRC_INIT;
+                rx->step = STEP_TYPE;
+            }
+            continue;
+        }
+
+        if (rx->step < STEP_CRC_LO) {
+            rx->crc = crc_byte(rx->crc, byte);
+        }
+        switch (rx->step) {
+        case STEP_TYPE:
+            rx->type = byte;
+            rx->step = STEP_SEQ;
+            break;
+        case STEP_SEQ:
+            rx->seq = byte;
+            rx->step = STEP_LEN_LO;
+            break;
+        case STEP_LEN_LO:
+            rx->frame_len = byte;
+            rx->step = STEP_LEN_HI;
+            break;
+        case STEP_LEN_HI:
+            rx->frame_len |= (uint16_t)byte << 8;
+            header_done(rx);
+            break;
+        case STEP_PAYLOAD:
+            if (rx->type == UART_OTA_PACKED) {
+                unpack_byte(rx, byte);
+            } else if (rx->dest) {
+                rx->dest[rx->pos] = byte;
+            }
+            if (++rx->pos == rx->frame_len) {
+                rx->step = STEP_CRC_LO;
+            }
+            break;
+        case STEP_CRC_LO:
+            rx->frame_crc = byte;
+            rx->step = STEP_CRC_HI;
+            break;
+        default:
+            rx->frame_crc |= (uint16_t)byte << 8;
+            frame_done(rx);
+            rx->step = STEP_SYNC;
+            break;
+        }
+    }
+
+    return rx->result;
+}
+
+// CRC-16/CCITT, bitwise as frames are short
+static uint16_t crc_byte(uint16_t crc, uint8_t byte) {
+    uint8_t i;
+
+    crc ^= (uint16_t)byte << 8;
+    for (i = 0; i < 8; i++) {
+        crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+// Decide where the payload goes, straight into the frame's slot if it
+// is within the window and not already held
+static void header_done(uart_ota_t *rx) {
+    uint8_t offset = rx->seq - rx->base;
+    uint8_t slot = rx->seq & (rx->window - 1);
+
+    // Probably lost sync on a stray sync byte
+    if ((rx->type != UART_OTA_DATA && rx->type != UART_OTA_PACKED && rx->type != UART_OTA_END)
+        || rx->frame_len > UART_OTA_FRAME_MAX) {
+        rx->step = STEP_SYNC;
+        return;
+    }
+
+    rx->dest = NULL;
+    if (rx->type != UART_OTA_END && offset < rx->window
+        && !(rx->held & ((uint32_t)1 << slot)) && rx->result == OTA_PENDING) {
+        rx->dest = rx->slots + slot * UART_OTA_FRAME_MAX;
+    }
+    rx->pos = 0;
+    rx->out = 0;
+    rx->unpack = UNPACK_TOKEN;
+    rx->step = (rx->frame_len > 0) ? STEP_PAYLOAD : STEP_CRC_LO;
+}
+
+// Unpack the next byte of a PACKED payload straight into its slot, see
+// unpack_block in rboot.c, a frame that doesn't unpack is dropped
+static void unpack_byte(uart_ota_t *rx, uint8_t byte) {
+    uint8_t loop;
+
+    if (!rx->dest) {
+        return;
+    }
+
+    switch (rx->unpack) {
+    case UNPACK_TOKEN:
+        if (byte < 0x80) {
+            rx->run = byte + 1;
+            rx->unpack = UNPACK_LITERAL;
+        } else {
+            rx->run = (byte & 0x7f) + 3;
+            rx->unpack = UNPACK_OFFSET_LO;
+        }
+        break;
+    case UNPACK_LITERAL:
+        if (rx->out == UART_OTA_FRAME_MAX) {
+            rx->dest = NULL;
+            break;
+        }
+        rx->dest[rx->out++] = byte;
+        if (--rx->run == 0) {
+            rx->unpack = UNPACK_TOKEN;
+        }
+        break;
+    case UNPACK_OFFSET_LO:
+        rx->offset = byte;
+        rx->unpack = UNPACK_OFFSET_HI;
+        break;
+    default:
+        // copy from earlier in the frame, may overlap
+        rx->offset |= (uint16_t)byte << 8;
+        if (rx->offset == 0 || rx->offset > rx->out || rx->run > UART_OTA_FRAME_MAX - rx->out) {
+            rx->dest = NULL;
+            break;
+        }
+        for (loop = 0; loop < rx->run; loop++) {
+            rx->dest[rx->out + loop] = rx->dest[rx->out - rx->offset + loop];
+        }
+        rx->out += rx->run;
+        rx->unpack = UNPACK_TOKEN;
+        break;
+    }
+}
+
+// A whole frame has arrived, hold it if it is good and new
+static void frame_done(uart_ota_t *rx) {
+    uint8_t offset = rx->seq - rx->base;
+    uint8_t slot = rx->seq & (rx->window - 1);
+
+    if (rx->frame_crc != rx->crc) {
+        // Dropped, the ACK shows the sender what is still missing
+        if (rx->result == OTA_PENDING) {
+            send_ack(rx);
+        }
+        return;
+    }
+
+    // Already finished, the sender missed the result
+    if (rx->result != OTA_PENDING) {
+        send_result(rx);
+        return;
+    }
+
+    // Stopped part way through a packed token
+    if (rx->type == UART_OTA_PACKED && rx->unpack != UNPACK_TOKEN) {
+        rx->dest = NULL;
+    }
+
+    if (offset < rx->window && !(rx->held & ((uint32_t)1 << slot))) {
+        if (rx->type == UART_OTA_END) {
+            rx->ends |= (uint32_t)1 << slot;
+        } else if (!rx->dest) {
+            // Didn't have somewhere to put it
+            send_ack(rx);
+            return;
+        }
+        rx->len[slot] = (rx->type == UART_OTA_PACKED) ? rx->out : rx->frame_len;
+        rx->held |= (uint32_t)1 << slot;
+        write_held(rx);
+    }
+
+    if (rx->result == OTA_PENDING) {
+        send_ack(rx);
+    } else {
+        send_result(rx);
+    }
+}
+
+// Write out the frames held in order from base, up to the first missing one
+static void write_held(uart_ota_t *rx) {
+    uint8_t slot = rx->base & (rx->window - 1);
+    uint32_t bit = (uint32_t)1 << slot;
+    ota_result_t result;
+
+    while (rx->held & bit) {
+        if (rx->ends & bit) {
+            rx->result = rboot_ota_end(rx->ota);
+            rx->held = 0;
+            rx->ends = 0;
+            return;
+        }
+
+        // Slots are word aligned, so written from where they are
+        result = rboot_ota_write(rx->ota, rx->slots + slot * UART_OTA_FRAME_MAX, rx->len[slot]);
+        if (result != OTA_OK) {
+            rboot_ota_cancel(rx->ota);
+            rx->result = result;
+            rx->held = 0;
+            return;
+        }
+
+        rx->held &= ~bit;
+        rx->base++;
+        slot = rx->base & (rx->window - 1);
+        bit = (uint32_t)1 << slot;
+    }
+}
+
+static void send_frame(uart_ota_t *rx, uint8_t type, uint8_t seq, const uint8_t *payload, uint8_t len) {
+    uint8_t frame[13];
+    uint16_t crc = CRC_INIT;
+    uint8_t i;
+
+    frame[0] = UART_OTA_SYNC;
+    frame[1] = type;
+    frame[2] = seq;
+    frame[3] = len;
+    frame[4] = 0;
+    memcpy(frame + 5, payload, len);
+    for (i = 1; i < 5 + len; i++) {
+        crc = crc_byte(crc, frame[i]);
+    }
+    frame[5 + len] = crc & 0xff;
+    frame[6 + len] = crc >> 8;
+    rx->send(frame, 7 + len, rx->send_arg);
+}
+
+// Report the next frame needed, and the ones after it already held
+static void send_ack(uart_ota_t *rx) {
+    uint8_t bitmap[4];
+    uint32_t held = 0;
+    uint8_t n;
+
+    for (n = 1; n < rx->window; n++) {
+        if (rx->held & ((uint32_t)1 << ((rx->base + n) & (rx->window - 1)))) {
+            held |= (uint32_t)1 << n;
+        }
+    }
+    bitmap[0] = held & 0xff;
+    bitmap[1] = (held >> 8) & 0xff;
+    bitmap[2] = (held >> 16) & 0xff;
+    bitmap[3] = held >> 24;
+    send_frame(rx, UART_OTA_ACK, rx->base, bitmap, sizeof(bitmap));
+}
+
+static void send_result(uart_ota_t *rx) {
+    uint8_t result = (uint8_t)rx->result;
+    send_frame(rx, UART_OTA_RESULT, rx->base, &result, 1);
+}
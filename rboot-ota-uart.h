@@ -0,0 +1,134 @@
+/**
+ * @file rboot-ota-uart.h
+ * @brief rBoot OTA over a serial (UART/RS-485) link
+ * @author Richard A Burton <richardaburton@gmail.com>
+ * @version 1.0
+ * @date 2023
+ *
+ * @copyright Copyright (c) 2023 Richard A Burton. See license.txt for license terms.
+ */
+
+#ifndef __RBOOT_OTA_UART_H__
+#define __RBOOT_OTA_UART_H__
+
+#include "rboot-ota.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** @defgroup ota_uart Serial OTA
+ *  @brief Sliding window OTA receiver for links without Wi-Fi
+ *
+ *  Every frame is:
+ *  - sync byte UART_OTA_SYNC
+ *  - type, seq, then the payload length as 16 bits little endian
+ *  - the payload
+ *  - CRC-16/CCITT (0x1021, initial 0xffff) of type to the end of the
+ *    payload, 16 bits little endian
+ *
+ *  The sender may have up to window DATA frames outstanding, with seq
+ *  counting up mod 256. The last frame is END, with the next seq after the
+ *  data. The receiver answers every frame with an ACK carrying the next seq
+ *  it needs and a bitmap of the frames after that it already holds, so the
+ *  sender only resends what was lost. Frames that
+ *  fail their CRC are dropped and the sender resends them on the next ACK
+ *  (or its own timeout). Once END is reached the update is finished and a
+ *  RESULT frame carries the ota_result_t.
+ *
+ *  A PACKED frame is a DATA frame whose payload is packed in the format of
+ *  the rboot_install blocks (see rboot.h), with back references only within
+ *  the frame. It is unpacked as it arrives, straight into its slot, and must
+ *  unpack to no more than UART_OTA_FRAME_MAX bytes. The host sender,
+ *  tools/rboot-uart-send.c, packs each frame that gets smaller.
+ *  @{
+ */
+
+#define UART_OTA_SYNC        0xa5
+
+/** @brief Frame types */
+#define UART_OTA_DATA        0x01   // Payload is update data
+#define UART_OTA_END         0x02   // No payload, the update is complete
+#define UART_OTA_PACKED      0x03   // Payload is packed update data
+#define UART_OTA_ACK         0x81   // Payload is the bitmap of frames held after seq, 32 bits little endian
+#define UART_OTA_RESULT      0x82   // Payload is one byte of ota_result_t
+
+/** @brief Largest DATA payload, a multiple of 4 so frames are written from where they are */
+#ifndef UART_OTA_FRAME_MAX
+#define UART_OTA_FRAME_MAX   256
+#endif
+
+/** @brief Largest window, limited by the ACK bitmap */
+#define UART_OTA_MAX_WINDOW  32
+
+/**
+ * @brief Send bytes back over the link
+ *
+ * @param data Bytes to send
+ * @param len Number of bytes
+ * @param arg As given to rboot_ota_uart_init
+ */
+typedef void (*uart_ota_send_t)(const uint8_t *data, uint16_t len, void *arg);
+
+// Serial OTA receiver state
+typedef struct {
+    ota_handle_t *ota;       // OTA session being written
+    uart_ota_send_t send;    // Sends ACK and RESULT frames
+    void *send_arg;          // Passed to send
+    uint8_t *slots;          // window * UART_OTA_FRAME_MAX bytes, frames held until they can be written in order
+    uint16_t len[UART_OTA_MAX_WINDOW]; // Payload held in each slot
+    uint32_t held;           // Slots holding a frame, bit n for slot n
+    uint32_t ends;           // Slots holding the END frame
+    uint8_t window;          // Frames the sender may have outstanding, a power of 2
+    uint8_t base;            // Next seq to write
+    uint8_t step;            // Part of the frame being parsed
+    uint8_t type;            // Type of the frame being parsed
+    uint8_t seq;             // Seq of the frame being parsed
+    uint16_t frame_len;      // Payload length of the frame being parsed
+    uint16_t pos;            // Bytes of the payload parsed
+    uint16_t crc;            // CRC so far of the frame being parsed
+    uint16_t frame_crc;      // CRC sent with the frame being parsed
+    uint8_t *dest;           // Where the payload goes, NULL to discard it
+    uint16_t out;            // Bytes unpacked from a PACKED frame
+    uint16_t offset;         // Back reference being parsed
+    uint8_t run;             // Bytes left of the literal run or back reference
+    uint8_t unpack;          // Part of the packed payload being parsed
+    ota_result_t result;     // OTA_PENDING until the update ends
+} uart_ota_t;
+
+/**
+ * @brief Start receiving an update over a serial link
+ *
+ * The OTA session must already have been begun (e.g. with rboot_ota_begin),
+ * the receiver writes it and ends it.
+ *
+ * @param rx Pointer to receiver state
+ * @param ota Pointer to an active OTA handle
+ * @param slots Buffer of window * UART_OTA_FRAME_MAX bytes, 4 byte aligned
+ * @param window Frames the sender may have outstanding, a power of 2 up to UART_OTA_MAX_WINDOW
+ * @param send Function to send bytes back to the sender
+ * @param arg Passed to send
+ * @return ota_result_t OTA_OK on success, error code otherwise
+ */
+ota_result_t rboot_ota_uart_init(uart_ota_t *rx, ota_handle_t *ota, uint8_t *slots,
+    uint8_t window, uart_ota_send_t send, void *arg);
+
+/**
+ * @brief Pass received bytes to the receiver
+ *
+ * Call with whatever the UART has received, in pieces of any size.
+ *
+ * @param rx Pointer to receiver state
+ * @param data Received bytes
+ * @param len Number of bytes
+ * @return ota_result_t OTA_PENDING until the update ends, then its result
+ */
+ota_result_t rboot_ota_uart_feed(uart_ota_t *rx, const uint8_t *data, uint32_t len);
+
+/** @} */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __RBOOT_OTA_UART_H__ */
@@ -11,62 +11,202 @@
 #include "rboot-ota.h"
 #include "rboot-private.h"
 #include <string.h>
+#include <stddef.h>
 
-// Static variables
-static ota_handle_t *current_ota = NULL;
+// Active sessions
+static ota_handle_t *active_sessions = NULL;
 
 // Forward declarations
-static ota_result_t verify_image(uint32_t addr, uint32_t length);
+static ota_result_t verify_image(uint32_t addr, uint32_t length, uint8_t *irom_chksum);
+static ota_result_t xor_flash(uint32_t addr, uint32_t len, uint8_t *chksum);
+static ota_result_t record_irom(uint8_t rom, uint8_t chksum, uint8_t good);
+#ifdef BOOT_RTC_ENABLED
+static void set_temp_rom(uint8_t rom);
+#endif
 static uint32_t get_rom_address(uint8_t rom);
+static void get_slot_meta(rboot_slot_meta *meta);
+static ota_result_t open_session(ota_handle_t *handle);
+static void close_session(ota_handle_t *handle);
+static uint8_t is_active(ota_handle_t *handle);
+static ota_result_t claim_range(ota_handle_t *handle, uint32_t addr, uint32_t len);
+static void start_write(ota_handle_t *handle, uint32_t addr);
+static ota_result_t load_config_sector(uint8_t *buffer, rboot_config **config, rboot_slot_meta **meta);
+static ota_result_t save_config_sector(rboot_config *config);
+static ota_result_t commit_slot(ota_handle_t *handle, uint8_t boot);
+static uint32_t flash_digest(uint32_t addr, uint32_t len);
+static ota_result_t start_payload(ota_bundle_t *bundle);
+static ota_result_t write_reloc(ota_handle_t *handle, const uint8_t *data, uint32_t size);
+static ota_result_t finish_payload(ota_bundle_t *bundle);
+static uint8_t data_range_ok(rboot_config *config, uint32_t addr, uint32_t len);
+static ota_result_t write_queued(ota_handle_t *handle);
+static uint8_t queued_ready(ota_handle_t *handle);
+static ota_result_t admit_header(ota_handle_t *handle);
+static uint32_t get_slot_room(uint32_t addr);
+static ota_result_t write_direct(ota_handle_t *handle, const uint8_t *data, uint32_t size);
+static ota_result_t write_sparse(ota_handle_t *handle, const uint8_t *data, uint32_t size);
+static ota_result_t skip_erased(ota_handle_t *handle, uint32_t len);
+static ota_result_t erase_sector(ota_handle_t *handle, uint32_t addr);
+static ota_result_t program_flash(ota_handle_t *handle, uint32_t addr, void *src, uint32_t len);
+static void advance(ota_handle_t *handle, uint32_t len);
+static void sector_done(ota_handle_t *handle, uint32_t offset);
+static void end_call(ota_handle_t *handle, uint32_t start);
 
 // External functions
 extern uint32_t SPIRead(uint32_t addr, void *outptr, uint32_t len);
 extern uint32_t SPIEraseSector(int sector);
 extern uint32_t SPIWrite(uint32_t addr, void *inptr, uint32_t len);
 
-// Internal buffer for OTA operations
+// Internal buffer for OTA operations, the pool
+// until the app supplies one with rboot_ota_set_pool
+#ifndef OTA_NO_STATIC_BUFFER
 static uint8_t ota_buffer[OTA_BUFFER_SIZE] __attribute__((aligned(4)));
+static uint8_t *pool_buffers = ota_buffer;
+static uint8_t pool_count = 1;
+#else
+static uint8_t *pool_buffers = NULL;
+static uint8_t pool_count = 0;
+#endif
+static uint32_t pool_used = 0;
 
-// ROM header structure for verification
-typedef struct {
-    uint8_t magic;
-    uint8_t count;
-    uint8_t flags1;
-    uint8_t flags2;
-    void *entry;
-} rom_header_t;
+#if OTA_BUFFER_SIZE < SECTOR_SIZE
+#error "OTA_BUFFER_SIZE must be at least SECTOR_SIZE"
+#endif
+#if OTA_BUFFER_SIZE % OTA_PAGE_SIZE != 0
+#error "OTA_BUFFER_SIZE must be a multiple of OTA_PAGE_SIZE"
+#endif
+
+#define BUNDLE_TOC_HEADER_SIZE offsetof(ota_bundle_toc_t, entries)
+
+// End of the 1MB of flash mapped at IROM_MAP_ADDR
+#define IROM_MAP_END  0x40300000
+
+// Relocatable stream steps
+#define RELOC_HEADER 0
+#define RELOC_BITMAP 1
+#define RELOC_SECTOR 2
+
+ota_result_t rboot_ota_set_pool(uint8_t *buffers, uint8_t count) {
+    // A NULL pool releases the buffers, until another is set
+    if ((!buffers && count != 0) || (buffers && count == 0)
+        || count > 32 || ((uint32_t)buffers & 3) != 0) {
+        return OTA_ERR_INVALID_ARGS;
+    }
+
+    // Can't swap buffers out from under active sessions
+    if (rboot_ota_is_in_progress()) {
+        return OTA_ERR_IN_PROGRESS;
+    }
+
+    pool_buffers = buffers;
+    pool_count = count;
+    pool_used = 0;
+    return OTA_OK;
+}
 
 ota_result_t rboot_ota_begin(ota_handle_t *handle, uint8_t target_rom, uint32_t max_size) {
+    ota_result_t result;
+    uint32_t addr;
+
     if (!handle || target_rom >= MAX_ROMS) {
         return OTA_ERR_INVALID_ARGS;
     }
 
-    // Check if another OTA is in progress
-    if (rboot_ota_is_in_progress()) {
+    addr = get_rom_address(target_rom);
+    if (addr == 0) {
+        return OTA_ERR_INVALID_ARGS;
+    }
+
+    // Clearing a session still running would break the active list
+    if (is_active(handle)) {
         return OTA_ERR_IN_PROGRESS;
     }
 
-    // Initialize handle
+    // Initialize handle, with a buffer from the pool
     memset(handle, 0, sizeof(ota_handle_t));
+    result = open_session(handle);
+    if (result != OTA_OK) {
+        return result;
+    }
+    start_write(handle, addr);
     handle->target_rom = target_rom;
-    handle->target_addr = get_rom_address(target_rom);
-    handle->buffer = ota_buffer;
-    handle->buffer_size = OTA_BUFFER_SIZE;
-    handle->state = OTA_STATE_READY;
-    
-    // Allocate buffer if not already done
-    if (!handle->buffer) {
-        return OTA_ERR_NO_MEM;
+
+    // Without a size it could use the rest of its slot, and
+    // progress isn't known until rboot_ota_set_size
+    handle->total_size = max_size;
+    if (max_size == 0) {
+        max_size = get_slot_room(addr);
+    } else if (max_size > get_slot_room(addr)) {
+        close_session(handle);
+        return OTA_ERR_INVALID_ARGS;
+    }
+    result = claim_range(handle, addr, max_size);
+    if (result != OTA_OK) {
+        close_session(handle);
+        return result;
     }
 
-    // Set as current OTA operation
-    current_ota = handle;
+    // Nothing is erased until the ROM header has been checked
+    handle->admit = 1;
     handle->state = OTA_STATE_STARTED;
     
     return OTA_OK;
 }
 
+ota_result_t rboot_ota_check_header(const uint8_t *header, uint32_t addr, uint32_t max_size) {
+    uint32_t words[OTA_HEADER_LEN / sizeof(uint32_t)];
+    uint32_t device;
+
+    if (!header || max_size < OTA_HEADER_LEN) {
+        return OTA_ERR_INVALID_ARGS;
+    }
+    memcpy(words, header, OTA_HEADER_LEN);
+
+    // Checked against the flash size in rBoot's own header
+    if (SPIRead(0, &device, sizeof(device)) != 0) {
+        return OTA_ERR_FLASH;
+    }
+    if (!check_rom_header(words, addr, max_size, device >> 24)) {
+        return OTA_ERR_INVALID_IMAGE;
+    }
+
+    return OTA_OK;
+}
+
+ota_result_t rboot_ota_begin_reloc(ota_handle_t *handle, ota_reloc_t *reloc, uint8_t target_rom, uint32_t max_size) {
+    ota_result_t result;
+
+    if (!reloc) {
+        return OTA_ERR_INVALID_ARGS;
+    }
+
+    result = rboot_ota_begin(handle, target_rom, max_size);
+    if (result == OTA_OK) {
+        memset(reloc, 0, sizeof(ota_reloc_t));
+        handle->reloc = reloc;
+        handle->admit = 0;
+    }
+    return result;
+}
+
+ota_result_t rboot_ota_begin_sparse(ota_handle_t *handle, ota_sparse_t *sparse, uint8_t target_rom, uint32_t max_size) {
+    ota_result_t result;
+
+    if (!sparse) {
+        return OTA_ERR_INVALID_ARGS;
+    }
+
+    result = rboot_ota_begin(handle, target_rom, max_size);
+    if (result == OTA_OK) {
+        memset(sparse, 0, sizeof(ota_sparse_t));
+        handle->sparse = sparse;
+    }
+    return result;
+}
+
 ota_result_t rboot_ota_write(ota_handle_t *handle, const uint8_t *data, uint32_t size) {
+    ota_result_t result;
+    uint32_t start = OTA_TIME_US();
+
     if (!handle || !data || size == 0) {
         return OTA_ERR_INVALID_ARGS;
     }
@@ -75,60 +215,205 @@ ota_result_t rboot_ota_write(ota_handle_t *handle, const uint8_t *data, uint32_t
         return OTA_ERR_INVALID_ARGS;
     }
 
+    // Would overtake queued data, beyond the part word carried over
+    // or the part header held for checking, a whole header queued by
+    // rboot_ota_submit is checked by rboot_ota_poll instead
+    if ((handle->queued >= 4 && !handle->admit)
+        || (handle->admit && handle->queued >= OTA_HEADER_LEN)
+        || (handle->reloc && handle->queued > 0)) {
+        return OTA_ERR_IN_PROGRESS;
+    }
+
     handle->state = OTA_STATE_WRITING;
-    uint32_t remaining = size;
-    const uint8_t *src = data;
-    
-    while (remaining > 0) {
-        uint32_t to_copy = (remaining < handle->buffer_size) ? remaining : handle->buffer_size;
-        
-        // Copy data to buffer
-        memcpy(handle->buffer, src, to_copy);
-        
-        // Write to flash
-        if (SPIWrite(handle->target_addr + handle->write_offset, handle->buffer, to_copy) != 0) {
-            handle->state = OTA_STATE_ERROR;
-            return OTA_ERR_WRITE;
-        }
-        
-        // Update counters
-        handle->write_offset += to_copy;
-        handle->written_size += to_copy;
-        src += to_copy;
-        remaining -= to_copy;
-        
-        // Erase next sector if needed
-        if ((handle->write_offset % SECTOR_SIZE) == 0) {
-            int sector = (handle->target_addr + handle->write_offset) / SECTOR_SIZE;
-            if (SPIEraseSector(sector) != 0) {
-                handle->state = OTA_STATE_ERROR;
-                return OTA_ERR_ERASE;
-            }
+    handle->metrics.bytes_received += size;
+    if (handle->reloc) {
+        result = write_reloc(handle, data, size);
+    } else if (handle->sparse) {
+        result = write_sparse(handle, data, size);
+    } else {
+        result = write_direct(handle, data, size);
+    }
+    end_call(handle, start);
+
+    return result;
+}
+
+ota_result_t rboot_ota_set_size(ota_handle_t *handle, uint32_t size) {
+    if (!handle || size == 0 || size > handle->max_size) {
+        return OTA_ERR_INVALID_ARGS;
+    }
+    handle->total_size = size;
+    return OTA_OK;
+}
+
+ota_result_t rboot_ota_set_callback(ota_handle_t *handle, ota_sector_cb_t callback, void *arg) {
+    if (!handle || !is_active(handle)) {
+        return OTA_ERR_INVALID_ARGS;
+    }
+    handle->sector_cb = callback;
+    handle->sector_arg = arg;
+    return OTA_OK;
+}
+
+const ota_metrics_t *rboot_ota_get_metrics(ota_handle_t *handle) {
+    uint32_t elapsed;
+
+    if (!handle) {
+        return NULL;
+    }
+    elapsed = OTA_TIME_US() - handle->metrics.start_us;
+    if (elapsed > 0) {
+        handle->metrics.avg_bps = (uint32_t)((uint64_t)handle->metrics.bytes_written * 1000000 / elapsed);
+    }
+    return &handle->metrics;
+}
+
+ota_result_t rboot_ota_submit(ota_handle_t *handle, const uint8_t *data, uint32_t size, uint32_t *accepted) {
+    uint32_t pos, len;
+    uint32_t start = OTA_TIME_US();
+
+    if (!handle || !data || !accepted || handle->reloc || handle->sparse) {
+        return OTA_ERR_INVALID_ARGS;
+    }
+    *accepted = 0;
+
+    if (handle->state != OTA_STATE_STARTED && handle->state != OTA_STATE_WRITING) {
+        return OTA_ERR_INVALID_ARGS;
+    }
+
+    // Stay within the claimed range
+    if (size > handle->max_size - handle->write_offset - handle->queued) {
+        handle->state = OTA_STATE_ERROR;
+        return OTA_ERR_INVALID_ARGS;
+    }
+    handle->state = OTA_STATE_WRITING;
+
+    // Queued data sits in the buffer at its offset in the image, so a page
+    // never wraps round the end of it
+    if (size > handle->buffer_size - handle->queued) {
+        size = handle->buffer_size - handle->queued;
+    }
+    while (*accepted < size) {
+        pos = (handle->write_offset + handle->queued) % handle->buffer_size;
+        len = handle->buffer_size - pos;
+        if (len > size - *accepted) {
+            len = size - *accepted;
         }
+        memcpy(handle->buffer + pos, data + *accepted, len);
+        handle->queued += len;
+        *accepted += len;
     }
-    
+    handle->metrics.bytes_received += *accepted;
+    handle->metrics.bytes_copied += *accepted;
+    handle->metrics.copy_us += OTA_TIME_US() - start;
+    end_call(handle, start);
+
     return OTA_OK;
 }
 
+ota_result_t rboot_ota_poll(ota_handle_t *handle, uint32_t budget_us) {
+    ota_result_t result;
+    uint32_t start = OTA_TIME_US();
+
+    if (!handle || handle->state != OTA_STATE_WRITING) {
+        return (handle && handle->state == OTA_STATE_STARTED) ? OTA_OK : OTA_ERR_INVALID_ARGS;
+    }
+
+    // Only whole words can be written until the end
+    if (!queued_ready(handle)) {
+        return OTA_OK;
+    }
+    if (budget_us < rboot_ota_poll_cost(handle)) {
+        return OTA_PENDING;
+    }
+
+    result = write_queued(handle);
+    end_call(handle, start);
+    if (result != OTA_OK) {
+        handle->state = OTA_STATE_ERROR;
+        return result;
+    }
+    return queued_ready(handle) ? OTA_PENDING : OTA_OK;
+}
+
+uint32_t rboot_ota_poll_cost(ota_handle_t *handle) {
+    if (!handle || !queued_ready(handle)) {
+        return 0;
+    }
+    return (handle->write_offset >= handle->erased_to) ? OTA_ERASE_US : OTA_PROGRAM_US;
+}
+
+uint32_t rboot_ota_queue_space(ota_handle_t *handle) {
+    if (!handle || handle->reloc || handle->sparse) {
+        return 0;
+    }
+    return handle->buffer_size - handle->queued;
+}
+
 ota_result_t rboot_ota_end(ota_handle_t *handle) {
+    uint32_t tail, len;
+    ota_result_t result;
+
     if (!handle || handle->state != OTA_STATE_WRITING) {
         return OTA_ERR_INVALID_ARGS;
     }
 
-    // Verify the written data
+    // Too short to even have a header
+    if (handle->admit && handle->queued < OTA_HEADER_LEN) {
+        rboot_ota_cancel(handle);
+        return OTA_ERR_INVALID_IMAGE;
+    }
+
+    // Write out anything still queued, the last few bytes padded to a word
+    while (handle->queued >= 4) {
+        result = write_queued(handle);
+        if (result != OTA_OK) {
+            rboot_ota_cancel(handle);
+            return (result == OTA_ERR_INVALID_IMAGE) ? result : OTA_ERR_WRITE;
+        }
+    }
+    if (handle->queued > 0) {
+        tail = 0xffffffff;
+        memcpy(&tail, handle->buffer + handle->write_offset % handle->buffer_size, handle->queued);
+        // It may start a sector of its own
+        if (handle->write_offset >= handle->erased_to
+            && erase_sector(handle, (handle->target_addr + handle->write_offset) & ~(SECTOR_SIZE - 1)) != OTA_OK) {
+            rboot_ota_cancel(handle);
+            return OTA_ERR_ERASE;
+        }
+        if (program_flash(handle, handle->target_addr + handle->write_offset, &tail, sizeof(tail)) != OTA_OK) {
+            rboot_ota_cancel(handle);
+            return OTA_ERR_WRITE;
+        }
+        len = handle->queued;
+        handle->queued = 0;
+        advance(handle, len);
+    }
+
+    // The last sector is complete too
+    if (handle->write_offset % SECTOR_SIZE != 0) {
+        sector_done(handle, handle->write_offset);
+    }
+
+    // Verify the written data, a relocated ROM must be complete
     handle->state = OTA_STATE_VERIFYING;
-    ota_result_t result = verify_image(handle->target_addr, handle->write_offset);
+    result = verify_image(handle->target_addr, handle->write_offset, &handle->irom_chksum);
+    if (handle->reloc && handle->reloc->image_pos != handle->reloc->header.image_len) {
+        result = OTA_ERR_VERIFY;
+    }
     
     if (result == OTA_OK) {
         handle->state = OTA_STATE_COMPLETE;
         // Set this as the boot ROM for next boot
-        rboot_set_boot_rom(handle->target_rom);
+        result = commit_slot(handle, 1);
     } else {
         handle->state = OTA_STATE_ERROR;
+        // Still record the wear
+        commit_slot(handle, 0);
     }
     
-    // Clear current OTA operation
-    current_ota = NULL;
+    // Finished with the session
+    close_session(handle);
     
     return result;
 }
@@ -136,14 +421,328 @@ ota_result_t rboot_ota_end(ota_handle_t *handle) {
 void rboot_ota_cancel(ota_handle_t *handle) {
     if (handle) {
         handle->state = OTA_STATE_ERROR;
-        if (current_ota == handle) {
-            current_ota = NULL;
+        if (is_active(handle)) {
+            // Sectors already erased still count towards wear, with
+            // none there's nothing to record
+            if (handle->metrics.sectors_erased > 0) {
+                commit_slot(handle, 0);
+            }
+            close_session(handle);
+        }
+    }
+}
+
+ota_result_t rboot_ota_pick_slot(uint8_t *rom) {
+    rboot_config config;
+    rboot_slot_meta meta;
+    uint8_t pass;
+    uint8_t i;
+    uint8_t best = 0xff;
+
+    if (!rom) {
+        return OTA_ERR_INVALID_ARGS;
+    }
+
+    if (SPIRead(BOOT_CONFIG_SECTOR * SECTOR_SIZE, &config, sizeof(config)) != 0) {
+        return OTA_ERR_FLASH;
+    }
+    get_slot_meta(&meta);
+
+    // Least worn slot that isn't current, avoiding the fallback
+    // ROM unless it's the only other slot (e.g. two slot layouts)
+    for (pass = 0; pass < 2 && best == 0xff; pass++) {
+        for (i = 0; i < config.count && i < MAX_ROMS; i++) {
+            if (i == config.current_rom || (pass == 0 && i == meta.fallback_rom)) {
+                continue;
+            }
+            if (best == 0xff || meta.wear[i].erases < meta.wear[best].erases
+                || (meta.wear[i].erases == meta.wear[best].erases
+                    && meta.wear[i].generation < meta.wear[best].generation)) {
+                best = i;
+            }
+        }
+    }
+
+    if (best == 0xff) {
+        return OTA_ERR_NO_UPDATE;
+    }
+    *rom = best;
+    return OTA_OK;
+}
+
+ota_result_t rboot_ota_bundle_begin(ota_bundle_t *bundle) {
+    ota_result_t result;
+
+    if (!bundle) {
+        return OTA_ERR_INVALID_ARGS;
+    }
+    if (is_active(&bundle->ota)) {
+        return OTA_ERR_IN_PROGRESS;
+    }
+
+    // Each payload claims its range as it starts
+    memset(bundle, 0, sizeof(ota_bundle_t));
+    result = open_session(&bundle->ota);
+    if (result != OTA_OK) {
+        return result;
+    }
+    bundle->ota.state = OTA_STATE_STARTED;
+
+    return OTA_OK;
+}
+
+ota_result_t rboot_ota_bundle_write(ota_bundle_t *bundle, const uint8_t *data, uint32_t size) {
+    ota_result_t result;
+    uint32_t toc_size;
+    uint32_t len;
+
+    if (!bundle || !data || !is_active(&bundle->ota)
+        || bundle->ota.state == OTA_STATE_ERROR) {
+        return OTA_ERR_INVALID_ARGS;
+    }
+
+    while (size > 0) {
+        // Gather the table of contents, header first
+        toc_size = BUNDLE_TOC_HEADER_SIZE;
+        if (bundle->toc_received >= BUNDLE_TOC_HEADER_SIZE) {
+            toc_size += bundle->toc.count * sizeof(ota_bundle_entry_t);
+        }
+        if (bundle->toc_received < toc_size) {
+            len = toc_size - bundle->toc_received;
+            if (len > size) {
+                len = size;
+            }
+            memcpy((uint8_t*)&bundle->toc + bundle->toc_received, data, len);
+            bundle->toc_received += len;
+            data += len;
+            size -= len;
+
+            if (bundle->toc_received == BUNDLE_TOC_HEADER_SIZE) {
+                if (bundle->toc.magic != OTA_BUNDLE_MAGIC || bundle->toc.count == 0
+                    || bundle->toc.count > OTA_BUNDLE_MAX_ENTRIES) {
+                    bundle->ota.state = OTA_STATE_ERROR;
+                    return OTA_ERR_INVALID_IMAGE;
+                }
+            } else if (bundle->toc_received == toc_size) {
+                // Table complete, start the first payload
+                result = start_payload(bundle);
+                if (result != OTA_OK) {
+                    bundle->ota.state = OTA_STATE_ERROR;
+                    return result;
+                }
+            }
+            continue;
+        }
+
+        // Route data to the current payload
+        if (bundle->entry >= bundle->toc.count) {
+            bundle->ota.state = OTA_STATE_ERROR;
+            return OTA_ERR_INVALID_IMAGE;
+        }
+        len = bundle->toc.entries[bundle->entry].length - bundle->ota.write_offset - bundle->ota.queued;
+        if (len > size) {
+            len = size;
+        }
+        result = rboot_ota_write(&bundle->ota, data, len);
+        if (result != OTA_OK) {
+            return result;
+        }
+        data += len;
+        size -= len;
+
+        if (bundle->ota.write_offset == bundle->toc.entries[bundle->entry].length) {
+            result = finish_payload(bundle);
+            if (result != OTA_OK) {
+                bundle->ota.state = OTA_STATE_ERROR;
+                return result;
+            }
+        }
+    }
+
+    return OTA_OK;
+}
+
+ota_result_t rboot_ota_bundle_end(ota_bundle_t *bundle) {
+    rboot_config *config;
+    rboot_slot_meta *meta;
+    ota_bundle_entry_t *entry;
+    ota_result_t result;
+    uint8_t i;
+
+    if (!bundle || !is_active(&bundle->ota)) {
+        return OTA_ERR_INVALID_ARGS;
+    }
+
+    if (bundle->ota.state == OTA_STATE_ERROR || bundle->toc.count == 0
+        || bundle->entry != bundle->toc.count) {
+        bundle->ota.state = OTA_STATE_ERROR;
+        close_session(&bundle->ota);
+        return OTA_ERR_VERIFY;
+    }
+
+    // All payloads verified, switch them over together
+    result = load_config_sector(bundle->ota.buffer, &config, &meta);
+    if (result != OTA_OK) {
+        bundle->ota.state = OTA_STATE_ERROR;
+        close_session(&bundle->ota);
+        return result;
+    }
+    for (i = 0; i < bundle->toc.count; i++) {
+        entry = &bundle->toc.entries[i];
+        if (entry->type == OTA_BUNDLE_ROM) {
+            meta->wear[entry->id].erases += bundle->rom_erased;
+            meta->wear[entry->id].generation++;
+            meta->fallback_rom = config->current_rom;
+            config->current_rom = entry->id;
+#ifdef BOOT_PLAN_ENABLED
+            // Any boot plan was for the ROM this one replaced
+            memset((uint8_t*)config + BOOT_PLAN_OFFSET(entry->id), 0xff, sizeof(rboot_plan));
+#endif
+#ifdef BOOT_IROM_DEFERRED
+            // rBoot checks it in full until the app has checked the irom
+            meta->irom_valid &= ~(1 << entry->id);
+#endif
+        } else {
+            meta->data_select ^= (1 << entry->id);
+        }
+    }
+    result = save_config_sector(config);
+    close_session(&bundle->ota);
+
+    bundle->ota.state = (result == OTA_OK) ? OTA_STATE_COMPLETE : OTA_STATE_ERROR;
+    return result;
+}
+
+void rboot_ota_bundle_cancel(ota_bundle_t *bundle) {
+    if (bundle) {
+        bundle->ota.state = OTA_STATE_ERROR;
+        if (is_active(&bundle->ota)) {
+            close_session(&bundle->ota);
+        }
+    }
+}
+
+uint8_t rboot_ota_data_copy(uint8_t id) {
+    rboot_slot_meta meta;
+    if (id >= OTA_BUNDLE_MAX_DATA) {
+        return 0;
+    }
+    get_slot_meta(&meta);
+    return (meta.data_select >> id) & 1;
+}
+
+ota_result_t rboot_ota_irom_verify_begin(ota_irom_verify_t *verify, uint8_t rom) {
+    uint32_t buffer[BUFFER_SIZE / sizeof(uint32_t)];
+    rom_header_new *header = (rom_header_new*)buffer;
+    section_header *section = (section_header*)buffer;
+    uint32_t addr;
+    uint32_t end;
+    uint32_t pos;
+    uint32_t irom;
+    uint32_t irom_len;
+    uint8_t chksum = CHKSUM_INIT;
+    uint8_t count;
+
+    if (!verify) {
+        return OTA_ERR_INVALID_ARGS;
+    }
+    memset(verify, 0, sizeof(ota_irom_verify_t));
+    verify->rom = rom;
+
+    addr = get_rom_address(rom);
+    if (addr == 0) {
+        return OTA_ERR_INVALID_ARGS;
+    }
+    end = addr + get_slot_room(addr);
+
+    if (SPIRead(addr, header, sizeof(rom_header_new)) != 0) {
+        return OTA_ERR_FLASH;
+    }
+    if (header->magic != ROM_MAGIC_NEW1 || header->count != ROM_MAGIC_NEW2) {
+        // No irom in the checksum, nothing to do
+        return OTA_OK;
+    }
+    if (header->len > end - addr - sizeof(rom_header_new)) {
+        return OTA_ERR_VERIFY;
+    }
+    irom = addr + sizeof(rom_header_new);
+    irom_len = header->len;
+
+    // rBoot checks the ram sections every boot, here they just give
+    // what the irom should come to
+    pos = irom + irom_len;
+    if (end - pos < sizeof(rom_header) || SPIRead(pos, header, sizeof(rom_header)) != 0
+        || header->magic != ROM_MAGIC) {
+        return OTA_ERR_VERIFY;
+    }
+    pos += sizeof(rom_header);
+    for (count = header->count; count > 0; count--) {
+        if (end - pos < sizeof(section_header) || SPIRead(pos, section, sizeof(section_header)) != 0) {
+            return OTA_ERR_VERIFY;
+        }
+        pos += sizeof(section_header);
+        if (section->length > end - pos || xor_flash(pos, section->length, &chksum) != OTA_OK) {
+            return OTA_ERR_VERIFY;
+        }
+        pos += section->length;
+    }
+    pos |= 0x0f;
+    if (pos >= end || SPIRead(pos & ~3, buffer, sizeof(uint32_t)) != 0) {
+        return OTA_ERR_VERIFY;
+    }
+    verify->expected = ((uint8_t*)buffer)[pos & 3] ^ chksum;
+    verify->pos = irom;
+    verify->end = irom + irom_len;
+
+    return OTA_PENDING;
+}
+
+ota_result_t rboot_ota_irom_verify_poll(ota_irom_verify_t *verify, uint32_t budget_us) {
+    uint32_t start = OTA_TIME_US();
+    uint32_t len;
+    ota_result_t result;
+
+    if (!verify) {
+        return OTA_ERR_INVALID_ARGS;
+    }
+
+    // A piece at a time, at least one per call
+    while (verify->pos < verify->end) {
+        len = verify->end - verify->pos;
+        if (len > BUFFER_SIZE) {
+            len = BUFFER_SIZE;
+        }
+        if (xor_flash(verify->pos, len, &verify->chksum) != OTA_OK) {
+            return OTA_ERR_FLASH;
+        }
+        verify->pos += len;
+        if (OTA_TIME_US() - start >= budget_us) {
+            break;
         }
     }
+    if (verify->pos < verify->end) {
+        return OTA_PENDING;
+    }
+    if (verify->end == 0 || verify->recorded) {
+        return verify->result;
+    }
+
+    // Record the result for rBoot, kept until it is saved
+    verify->result = (verify->chksum == verify->expected) ? OTA_OK : OTA_ERR_VERIFY;
+    result = record_irom(verify->rom, verify->chksum, verify->result == OTA_OK);
+    if (result == OTA_ERR_NO_MEM || result == OTA_ERR_IN_PROGRESS) {
+        // No buffer free for the config sector, try again next call
+        return OTA_PENDING;
+    }
+    if (result != OTA_OK) {
+        verify->result = result;
+    }
+    verify->recorded = 1;
+    return verify->result;
 }
 
 uint8_t rboot_ota_is_in_progress(void) {
-    return (current_ota != NULL) ? 1 : 0;
+    return (active_sessions != NULL) ? 1 : 0;
 }
 
 ota_state_t rboot_ota_get_status(ota_handle_t *handle, uint8_t *progress) {
@@ -152,8 +751,10 @@ ota_state_t rboot_ota_get_status(ota_handle_t *handle, uint8_t *progress) {
     }
     
     if (progress) {
-        if (handle->total_size > 0) {
-            *progress = (handle->written_size * 100) / handle->total_size;
+        if (handle->written_size >= handle->total_size && handle->total_size > 0) {
+            *progress = 100;
+        } else if (handle->total_size > 0) {
+            *progress = ((uint64_t)handle->written_size * 100) / handle->total_size;
         } else {
             *progress = 0;
         }
@@ -163,17 +764,982 @@ ota_state_t rboot_ota_get_status(ota_handle_t *handle, uint8_t *progress) {
 }
 
 // Helper functions
-static ota_result_t verify_image(uint32_t addr, uint32_t length) {
-    // Simple verification: check ROM header magic number
-    rom_header_t header;
-    if (SPIRead(addr, &header, sizeof(header)) != 0) {
+
+// Walk the ROM headers and sections, as rBoot will, and check the checksum,
+// irom_chksum is set to the XOR of the irom section if it is included
+static ota_result_t verify_image(uint32_t addr, uint32_t length, uint8_t *irom_chksum) {
+    uint32_t buffer[BUFFER_SIZE / sizeof(uint32_t)];
+    rom_header_new *header = (rom_header_new*)buffer;
+    section_header *section = (section_header*)buffer;
+    uint32_t end = addr + length;
+    uint32_t pos = addr;
+    uint8_t chksum = CHKSUM_INIT;
+    uint8_t count;
+    uint8_t irom = 0;
+
+    if (length < sizeof(rom_header_new) || SPIRead(pos, header, sizeof(rom_header_new)) != 0) {
         return OTA_ERR_VERIFY;
     }
-    
-    if (header.magic != 0xE9) {  // Standard ROM magic number
-        return OTA_ERR_VERIFY;
+
+    if (header->magic == ROM_MAGIC_NEW1 && header->count == ROM_MAGIC_NEW2) {
+        if (header->len > length - sizeof(rom_header_new)) {
+            return OTA_ERR_VERIFY;
+        }
+#ifdef BOOT_IROM_CHKSUM
+        // irom section is checksummed too, treat it as the first section
+        pos += sizeof(rom_header);
+        count = 1;
+        irom = 1;
+#else
+        // skip it, to the normal header that follows
+        pos += sizeof(rom_header_new) + header->len;
+        if (end - pos < sizeof(rom_header) || SPIRead(pos, header, sizeof(rom_header)) != 0) {
+            return OTA_ERR_VERIFY;
+        }
+#endif
     }
-    
+    if (!irom) {
+        if (header->magic != ROM_MAGIC) {
+            return OTA_ERR_VERIFY;
+        }
+        count = header->count;
+        pos += sizeof(rom_header);
+    }
+
+    for (; count > 0; count--) {
+        if (end - pos < sizeof(section_header) || SPIRead(pos, section, sizeof(section_header)) != 0) {
+            return OTA_ERR_VERIFY;
+        }
+        pos += sizeof(section_header);
+        if (section->length > end - pos) {
+            return OTA_ERR_VERIFY;
+        }
+
+        if (irom) {
+            *irom_chksum = 0;
+            if (xor_flash(pos, section->length, irom_chksum) != OTA_OK) {
+                return OTA_ERR_VERIFY;
+            }
+            chksum ^= *irom_chksum;
+        } else if (xor_flash(pos, section->length, &chksum) != OTA_OK) {
+            return OTA_ERR_VERIFY;
+        }
+        pos += section->length;
+
+        if (irom) {
+            // irom done, now the normal header
+            irom = 0;
+            if (end - pos < sizeof(rom_header) || SPIRead(pos, header, sizeof(rom_header)) != 0
+                || header->magic != ROM_MAGIC) {
+                return OTA_ERR_VERIFY;
+            }
+            count = header->count + 1;
+            pos += sizeof(rom_header);
+        }
+    }
+
+    // checksum is the last byte of the next 16
+    pos |= 0x0f;
+    if (pos >= end || SPIRead(pos & ~3, buffer, sizeof(uint32_t)) != 0
+        || ((uint8_t*)buffer)[pos & 3] != chksum) {
+        return OTA_ERR_VERIFY;
+    }
+
+    return OTA_OK;
+}
+
+// XOR len bytes of flash from addr into chksum
+static ota_result_t xor_flash(uint32_t addr, uint32_t len, uint8_t *chksum) {
+    uint32_t buffer[BUFFER_SIZE / sizeof(uint32_t)];
+    uint32_t readlen;
+    uint32_t i;
+
+    for (; len > 0; len -= readlen) {
+        readlen = (len < BUFFER_SIZE) ? len : BUFFER_SIZE;
+        if (SPIRead(addr, buffer, readlen) != 0) {
+            return OTA_ERR_FLASH;
+        }
+        for (i = 0; i < readlen; i++) {
+            *chksum ^= ((uint8_t*)buffer)[i];
+        }
+        addr += readlen;
+    }
+    return OTA_OK;
+}
+
+// Record a ROM's irom checksum for rBoot or, if it's bad, go back to the
+// fallback ROM (with a temp boot straight there too if there's RTC data)
+static ota_result_t record_irom(uint8_t rom, uint8_t chksum, uint8_t good) {
+    ota_handle_t temp;
+    rboot_config *config;
+    rboot_slot_meta *meta;
+    ota_result_t result;
+    uint8_t rollback = 0xff;
+
+    if (good) {
+#ifdef BOOT_IROM_DEFERRED
+        // Nothing to write if it's already recorded
+        rboot_slot_meta current;
+        get_slot_meta(&current);
+        if ((current.irom_valid & (1 << rom)) && current.irom_chksum[rom] == chksum) {
+            return OTA_OK;
+        }
+#else
+        return OTA_OK;
+#endif
+    }
+
+    // Borrow a buffer for the config sector
+    memset(&temp, 0, sizeof(ota_handle_t));
+    result = open_session(&temp);
+    if (result != OTA_OK) {
+        return result;
+    }
+    result = load_config_sector(temp.buffer, &config, &meta);
+    if (result == OTA_OK) {
+        if (good) {
+#ifdef BOOT_IROM_DEFERRED
+            meta->irom_chksum[rom] = chksum;
+            meta->irom_valid |= 1 << rom;
+#endif
+        } else {
+#ifdef BOOT_IROM_DEFERRED
+            // rBoot must check it in full
+            meta->irom_valid &= ~(1 << rom);
+#endif
+            if (meta->fallback_rom == rom) {
+                meta->fallback_rom = 0xff;
+            }
+            if (config->current_rom == rom && meta->fallback_rom < config->count) {
+                rollback = meta->fallback_rom;
+                config->current_rom = rollback;
+            }
+        }
+        result = save_config_sector(config);
+    }
+    close_session(&temp);
+
+#ifdef BOOT_RTC_ENABLED
+    if (rollback != 0xff) {
+        set_temp_rom(rollback);
+    }
+#endif
+    return result;
+}
+
+// Relocate the marked words of the sector in the buffer, keeping track of
+// how the ROM checksum changes, and correct it if it's in this sector
+static ota_result_t patch_sector(ota_handle_t *handle, uint32_t len) {
+    ota_reloc_t *reloc = handle->reloc;
+    uint32_t *words = (uint32_t*)handle->buffer;
+    uint32_t low = IROM_MAP_ADDR + (handle->target_addr % 0x100000);
+    uint32_t old;
+    uint32_t diff;
+    uint32_t i;
+
+    for (i = 0; i < len / sizeof(uint32_t); i++) {
+        if (reloc->bitmap[i / 8] & (1 << (i % 8))) {
+            old = words[i];
+            // must be an irom address before and after
+            if (old < reloc->header.link_base || old >= IROM_MAP_END
+                || old + reloc->delta < low || old + reloc->delta >= IROM_MAP_END) {
+                return OTA_ERR_INVALID_IMAGE;
+            }
+            words[i] = old + reloc->delta;
+            if (reloc->image_pos + i * sizeof(uint32_t) >= reloc->header.chksum_from) {
+                diff = old ^ words[i];
+                reloc->chksum_fix ^= diff ^ (diff >> 8) ^ (diff >> 16) ^ (diff >> 24);
+            }
+        }
+    }
+
+    if (reloc->header.chksum_pos >= reloc->image_pos
+        && reloc->header.chksum_pos < reloc->image_pos + len) {
+        handle->buffer[reloc->header.chksum_pos - reloc->image_pos] ^= reloc->chksum_fix;
+    }
+    return OTA_OK;
+}
+
+// Take a relocatable ROM stream: the header then, for each sector of the
+// image, its relocation bitmap and the sector, which is gathered in the
+// buffer, relocated and then written
+static ota_result_t write_reloc(ota_handle_t *handle, const uint8_t *data, uint32_t size) {
+    ota_reloc_t *reloc = handle->reloc;
+    ota_result_t result;
+    uint8_t *dest;
+    uint32_t want;
+    uint32_t len;
+    uint32_t start;
+
+    while (size > 0) {
+        if (reloc->step == RELOC_HEADER) {
+            dest = (uint8_t*)&reloc->header;
+            want = sizeof(ota_reloc_header_t);
+        } else if (reloc->image_pos >= reloc->header.image_len) {
+            // more than the image
+            handle->state = OTA_STATE_ERROR;
+            return OTA_ERR_INVALID_IMAGE;
+        } else if (reloc->step == RELOC_BITMAP) {
+            dest = reloc->bitmap;
+            want = OTA_RELOC_BITMAP;
+        } else {
+            dest = handle->buffer;
+            want = reloc->header.image_len - reloc->image_pos;
+            if (want > SECTOR_SIZE) {
+                want = SECTOR_SIZE;
+            }
+        }
+
+        len = want - reloc->received;
+        if (len > size) {
+            len = size;
+        }
+        start = OTA_TIME_US();
+        memcpy(dest + reloc->received, data, len);
+        handle->metrics.bytes_copied += len;
+        handle->metrics.copy_us += OTA_TIME_US() - start;
+        reloc->received += len;
+        data += len;
+        size -= len;
+        if (reloc->received < want) {
+            continue;
+        }
+        reloc->received = 0;
+
+        if (reloc->step == RELOC_HEADER) {
+            if (reloc->header.magic != OTA_RELOC_MAGIC || reloc->header.image_len == 0
+                || (reloc->header.image_len & 3) != 0
+                || reloc->header.chksum_pos >= reloc->header.image_len
+                || reloc->header.image_len > handle->max_size
+                || reloc->header.link_base < IROM_MAP_ADDR || reloc->header.link_base >= IROM_MAP_END
+                || (handle->target_addr % SECTOR_SIZE) != 0) {
+                handle->state = OTA_STATE_ERROR;
+                return OTA_ERR_INVALID_IMAGE;
+            }
+            reloc->delta = IROM_MAP_ADDR + (handle->target_addr % 0x100000) - reloc->header.link_base;
+            handle->total_size = reloc->header.image_len;
+            reloc->step = RELOC_BITMAP;
+        } else if (reloc->step == RELOC_BITMAP) {
+            reloc->step = RELOC_SECTOR;
+        } else {
+            result = patch_sector(handle, want);
+            if (result == OTA_OK) {
+                result = erase_sector(handle, handle->target_addr + reloc->image_pos);
+            }
+            if (result == OTA_OK) {
+                result = program_flash(handle, handle->target_addr + reloc->image_pos, handle->buffer, want);
+            }
+            if (result != OTA_OK) {
+                handle->state = OTA_STATE_ERROR;
+                return result;
+            }
+            reloc->image_pos += want;
+            advance(handle, want);
+            reloc->step = RELOC_BITMAP;
+        }
+    }
+
+    return OTA_OK;
+}
+
+// Read the slot metadata, or a blank set if there isn't any yet
+static void get_slot_meta(rboot_slot_meta *meta) {
+    if (SPIRead(BOOT_CONFIG_SECTOR * SECTOR_SIZE + BOOT_SLOT_META_OFFSET, meta, sizeof(rboot_slot_meta)) != 0
+        || meta->magic != BOOT_SLOT_META_MAGIC) {
+        memset(meta, 0, sizeof(rboot_slot_meta));
+        meta->magic = BOOT_SLOT_META_MAGIC;
+        meta->fallback_rom = 0xff;
+    }
+}
+
+#if defined(BOOT_CONFIG_CHKSUM) || defined(BOOT_RTC_ENABLED)
+static uint8_t calc_chksum(uint8_t *start, uint8_t *end) {
+    uint8_t chksum = CHKSUM_INIT;
+    while (start < end) {
+        chksum ^= *start;
+        start++;
+    }
+    return chksum;
+}
+#endif
+
+#ifdef BOOT_RTC_ENABLED
+extern uint8_t system_rtc_mem_read(uint8_t src_addr, void *des_addr, uint16_t load_size);
+extern uint8_t system_rtc_mem_write(uint8_t des_addr, const void *src_addr, uint16_t save_size);
+
+// Have rBoot boot a ROM once, through the RTC data
+static void set_temp_rom(uint8_t rom) {
+    rboot_rtc_data rtc;
+    if (!system_rtc_mem_read(RBOOT_RTC_ADDR, &rtc, sizeof(rboot_rtc_data))
+        || rtc.chksum != calc_chksum((uint8_t*)&rtc, (uint8_t*)&rtc.chksum)) {
+        rtc.magic = RBOOT_RTC_MAGIC;
+        rtc.last_mode = MODE_STANDARD;
+        rtc.last_rom = 0;
+    }
+    rtc.next_mode = MODE_TEMP_ROM;
+    rtc.temp_rom = rom;
+    rtc.chksum = calc_chksum((uint8_t*)&rtc, (uint8_t*)&rtc.chksum);
+    system_rtc_mem_write(RBOOT_RTC_ADDR, &rtc, sizeof(rboot_rtc_data));
+}
+#endif
+
+// Do the next step of writing queued data, erasing the sector it is in
+// or programming whole words of it up to the end of the page
+static ota_result_t write_queued(ota_handle_t *handle) {
+    uint32_t addr = handle->target_addr + handle->write_offset;
+    uint32_t len;
+
+    if (handle->admit && admit_header(handle) != OTA_OK) {
+        return OTA_ERR_INVALID_IMAGE;
+    }
+
+    if (handle->write_offset >= handle->erased_to) {
+        return erase_sector(handle, addr - addr % SECTOR_SIZE);
+    }
+
+    len = OTA_PAGE_SIZE - (addr % OTA_PAGE_SIZE);
+    if (len > (handle->queued & ~3)) {
+        len = handle->queued & ~3;
+    }
+    if (program_flash(handle, addr, handle->buffer + handle->write_offset % handle->buffer_size, len) != OTA_OK) {
+        return OTA_ERR_WRITE;
+    }
+    handle->queued -= len;
+    advance(handle, len);
+    return OTA_OK;
+}
+
+// Write straight from the caller's memory where it is word aligned, using
+// the buffer only to realign data and to carry part words between calls
+static ota_result_t write_direct(ota_handle_t *handle, const uint8_t *data, uint32_t size) {
+    uint8_t *carry;
+    uint32_t len;
+    uint32_t start;
+    ota_result_t result;
+
+    // Stay within the claimed range
+    if (size > handle->max_size - handle->write_offset - handle->queued) {
+        handle->state = OTA_STATE_ERROR;
+        return OTA_ERR_INVALID_ARGS;
+    }
+
+    // Hold the start of a ROM back until its header has been checked
+    if (handle->admit) {
+        len = OTA_HEADER_LEN - handle->queued;
+        if (len > size) {
+            len = size;
+        }
+        memcpy(handle->buffer + handle->queued, data, len);
+        handle->metrics.bytes_copied += len;
+        handle->queued += len;
+        data += len;
+        size -= len;
+        if (handle->queued < OTA_HEADER_LEN) {
+            return OTA_OK;
+        }
+        result = admit_header(handle);
+        if (result == OTA_OK) {
+            result = erase_sector(handle, handle->target_addr & ~(SECTOR_SIZE - 1));
+        }
+        if (result == OTA_OK) {
+            result = program_flash(handle, handle->target_addr, handle->buffer, OTA_HEADER_LEN);
+        }
+        if (result != OTA_OK) {
+            handle->state = OTA_STATE_ERROR;
+            return result;
+        }
+        handle->queued = 0;
+        advance(handle, OTA_HEADER_LEN);
+    }
+
+    while (size > 0) {
+        // Always erase before programming
+        if (handle->write_offset >= handle->erased_to) {
+            if (erase_sector(handle, (handle->target_addr + handle->write_offset) & ~(SECTOR_SIZE - 1)) != OTA_OK) {
+                handle->state = OTA_STATE_ERROR;
+                return OTA_ERR_ERASE;
+            }
+        }
+
+        // Complete a part word carried over from the last call, it sits
+        // where queued data would
+        carry = handle->buffer + handle->write_offset % handle->buffer_size;
+        if (handle->queued > 0 || size < 4) {
+            len = 4 - handle->queued;
+            if (len > size) {
+                len = size;
+            }
+            memcpy(carry + handle->queued, data, len);
+            handle->metrics.bytes_copied += len;
+            handle->queued += len;
+            data += len;
+            size -= len;
+            if (handle->queued < 4) {
+                break;
+            }
+            if (program_flash(handle, handle->target_addr + handle->write_offset, carry, 4) != OTA_OK) {
+                handle->state = OTA_STATE_ERROR;
+                return OTA_ERR_WRITE;
+            }
+            handle->queued = 0;
+            advance(handle, 4);
+            continue;
+        }
+
+        // Whole words, without crossing into a sector not yet erased
+        len = SECTOR_SIZE - (handle->write_offset % SECTOR_SIZE);
+        if (len > (size & ~3)) {
+            len = size & ~3;
+        }
+
+        // SPIWrite needs aligned source data, and can't read from mapped flash
+        if (((uint32_t)data & 3) == 0
+            && ((uint32_t)data < IROM_MAP_ADDR || (uint32_t)data >= IROM_MAP_END)) {
+            result = program_flash(handle, handle->target_addr + handle->write_offset, (void*)data, len);
+        } else {
+            if (len > handle->buffer_size) {
+                len = handle->buffer_size;
+            }
+            start = OTA_TIME_US();
+            memcpy(handle->buffer, data, len);
+            handle->metrics.bytes_copied += len;
+            handle->metrics.copy_us += OTA_TIME_US() - start;
+            result = program_flash(handle, handle->target_addr + handle->write_offset, handle->buffer, len);
+        }
+        if (result != OTA_OK) {
+            handle->state = OTA_STATE_ERROR;
+            return OTA_ERR_WRITE;
+        }
+
+        advance(handle, len);
+        data += len;
+        size -= len;
+    }
+    
+    return OTA_OK;
+}
+
+// Split a sparse stream into its records, writing the literal runs
+static ota_result_t write_sparse(ota_handle_t *handle, const uint8_t *data, uint32_t size) {
+    ota_sparse_t *sparse = handle->sparse;
+    ota_result_t result;
+    uint32_t len;
+
+    while (size > 0) {
+        // Gather the record length, little endian
+        if (sparse->received < sizeof(sparse->record)) {
+            sparse->record |= (uint32_t)*data++ << (8 * sparse->received);
+            size--;
+            if (++sparse->received < sizeof(sparse->record)) {
+                continue;
+            }
+            if (sparse->record & OTA_SPARSE_SKIP) {
+                result = skip_erased(handle, sparse->record & ~OTA_SPARSE_SKIP);
+                if (result != OTA_OK) {
+                    handle->state = OTA_STATE_ERROR;
+                    return result;
+                }
+                sparse->received = 0;
+                sparse->record = 0;
+            } else {
+                sparse->left = sparse->record;
+            }
+        }
+
+        len = (sparse->left < size) ? sparse->left : size;
+        if (len > 0) {
+            result = write_direct(handle, data, len);
+            if (result != OTA_OK) {
+                return result;
+            }
+            data += len;
+            size -= len;
+            sparse->left -= len;
+        }
+        if (sparse->left == 0) {
+            sparse->received = 0;
+            sparse->record = 0;
+        }
+    }
+
+    return OTA_OK;
+}
+
+// Move on over a run that is to stay erased, erasing any sectors it
+// reaches that haven't been yet, but programming nothing
+static ota_result_t skip_erased(ota_handle_t *handle, uint32_t len) {
+    uint32_t end;
+
+    if (handle->queued > 0 || handle->admit || (len & 3) != 0) {
+        return OTA_ERR_INVALID_IMAGE;
+    }
+    if (len > handle->max_size - handle->write_offset) {
+        return OTA_ERR_INVALID_ARGS;
+    }
+
+    end = handle->write_offset + len;
+    while (handle->erased_to < end) {
+        if (erase_sector(handle, (handle->target_addr + handle->erased_to) & ~(SECTOR_SIZE - 1)) != OTA_OK) {
+            return OTA_ERR_ERASE;
+        }
+    }
+    handle->metrics.bytes_skipped += len;
+    advance(handle, len);
+    return OTA_OK;
+}
+
+// Erase the sector at addr, unless it is already blank
+static ota_result_t erase_sector(ota_handle_t *handle, uint32_t addr) {
+    uint32_t words[64];
+    uint32_t start = OTA_TIME_US();
+    uint32_t pos;
+    uint8_t i;
+    uint8_t blank = 1;
+
+    // Reading is far quicker than an erase
+    for (pos = 0; pos < SECTOR_SIZE && blank; pos += sizeof(words)) {
+        if (SPIRead(addr + pos, words, sizeof(words)) != 0) {
+            blank = 0;
+            break;
+        }
+        for (i = 0; i < 64; i++) {
+            if (words[i] != 0xffffffff) {
+                blank = 0;
+                break;
+            }
+        }
+    }
+
+    if (blank) {
+        handle->metrics.sectors_skipped++;
+    } else {
+        if (SPIEraseSector(addr / SECTOR_SIZE) != 0) {
+            return OTA_ERR_ERASE;
+        }
+        handle->metrics.sectors_erased++;
+    }
+    handle->erased_to = addr + SECTOR_SIZE - handle->target_addr;
+    handle->metrics.erase_us += OTA_TIME_US() - start;
+    return OTA_OK;
+}
+
+// Program len bytes at addr
+static ota_result_t program_flash(ota_handle_t *handle, uint32_t addr, void *src, uint32_t len) {
+    uint32_t start = OTA_TIME_US();
+
+    if (SPIWrite(addr, src, len) != 0) {
+        return OTA_ERR_WRITE;
+    }
+    handle->metrics.bytes_written += len;
+    handle->metrics.program_us += OTA_TIME_US() - start;
+    return OTA_OK;
+}
+
+// Move the write position on, noting each sector completed
+static void advance(ota_handle_t *handle, uint32_t len) {
+    uint32_t from = handle->write_offset;
+
+    handle->write_offset += len;
+    handle->written_size += len;
+    while (from / SECTOR_SIZE != handle->write_offset / SECTOR_SIZE) {
+        from = (from / SECTOR_SIZE + 1) * SECTOR_SIZE;
+        sector_done(handle, from);
+    }
+}
+
+// A sector is complete up to offset, update the throughput and
+// tell the app
+static void sector_done(ota_handle_t *handle, uint32_t offset) {
+    uint32_t now = OTA_TIME_US();
+    uint32_t sector = (offset - 1) - (offset - 1) % SECTOR_SIZE;
+
+    if (now != handle->metrics.sector_us) {
+        handle->metrics.rate_bps = (uint32_t)((uint64_t)(offset - sector) * 1000000 / (now - handle->metrics.sector_us));
+    }
+    handle->metrics.sector_us = now;
+    if (now != handle->metrics.start_us) {
+        handle->metrics.avg_bps = (uint32_t)((uint64_t)handle->metrics.bytes_written * 1000000 / (now - handle->metrics.start_us));
+    }
+    if (handle->sector_cb) {
+        handle->sector_cb(handle, handle->target_addr + sector, handle->sector_arg);
+    }
+}
+
+// Record how long a call into the api blocked for
+static void end_call(ota_handle_t *handle, uint32_t start) {
+    uint32_t stall = OTA_TIME_US() - start;
+
+    if (stall > handle->metrics.max_stall_us) {
+        handle->metrics.max_stall_us = stall;
+    }
+}
+
+// Whether enough is queued to write, whole words or the whole header
+static uint8_t queued_ready(ota_handle_t *handle) {
+    return (handle->queued >= (handle->admit ? OTA_HEADER_LEN : 4)) ? 1 : 0;
+}
+
+// Check the header at the start of the buffer, before anything is erased
+static ota_result_t admit_header(ota_handle_t *handle) {
+    ota_result_t result;
+
+    result = rboot_ota_check_header(handle->buffer, handle->target_addr, handle->max_size);
+    if (result == OTA_OK) {
+        handle->admit = 0;
+    }
+    return result;
+}
+
+// Room for a ROM at addr, up to the next slot or the end of its 1MB block
+static uint32_t get_slot_room(uint32_t addr) {
+    rboot_config config;
+    uint32_t room = 0x100000 - (addr % 0x100000);
+    uint8_t i;
+
+    if (SPIRead(BOOT_CONFIG_SECTOR * SECTOR_SIZE, &config, sizeof(config)) == 0) {
+        for (i = 0; i < config.count && i < MAX_ROMS; i++) {
+            if (config.roms[i] > addr && config.roms[i] - addr < room) {
+                room = config.roms[i] - addr;
+            }
+        }
+    }
+    return room;
+}
+
+// Take a buffer from the pool and join the active sessions
+static ota_result_t open_session(ota_handle_t *handle) {
+    uint8_t i;
+
+    for (i = 0; i < pool_count; i++) {
+        if (!(pool_used & ((uint32_t)1 << i))) {
+            pool_used |= ((uint32_t)1 << i);
+            handle->buffer = pool_buffers + i * OTA_BUFFER_SIZE;
+            handle->buffer_size = OTA_BUFFER_SIZE;
+            handle->metrics.start_us = OTA_TIME_US();
+            handle->metrics.sector_us = handle->metrics.start_us;
+            handle->next = active_sessions;
+            active_sessions = handle;
+            return OTA_OK;
+        }
+    }
+    return OTA_ERR_NO_MEM;
+}
+
+// Leave the active sessions and return the buffer to the pool
+static void close_session(ota_handle_t *handle) {
+    ota_handle_t **link;
+
+    for (link = &active_sessions; *link; link = &(*link)->next) {
+        if (*link == handle) {
+            *link = handle->next;
+            break;
+        }
+    }
+    pool_used &= ~((uint32_t)1 << ((handle->buffer - pool_buffers) / OTA_BUFFER_SIZE));
+    handle->buffer = NULL;
+    handle->next = NULL;
+}
+
+// Whether a handle is one of the active sessions
+static uint8_t is_active(ota_handle_t *handle) {
+    ota_handle_t *session;
+
+    for (session = active_sessions; session; session = session->next) {
+        if (session == handle) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Claim the flash a session will write, refused if another
+// active session has claimed any of it
+static ota_result_t claim_range(ota_handle_t *handle, uint32_t addr, uint32_t len) {
+    ota_handle_t *other;
+
+    for (other = active_sessions; other; other = other->next) {
+        if (other != handle && other->max_size > 0
+            && addr < other->target_addr + other->max_size
+            && other->target_addr < addr + len) {
+            return OTA_ERR_IN_PROGRESS;
+        }
+    }
+    handle->target_addr = addr;
+    handle->max_size = len;
+    return OTA_OK;
+}
+
+// Prepare a handle to write from the start of addr
+static void start_write(ota_handle_t *handle, uint32_t addr) {
+    handle->target_addr = addr;
+    handle->max_size = 0;
+    handle->write_offset = 0;
+    handle->queued = 0;
+    handle->erased_to = 0;
+    handle->total_size = 0;
+    handle->written_size = 0;
+    handle->reloc = NULL;
+    handle->sparse = NULL;
+    handle->admit = 0;
+    handle->state = OTA_STATE_READY;
+}
+
+// Read the whole config sector into a session's buffer for updating, with
+// blank slot metadata if there isn't any yet (so only call once writing
+// has finished)
+static ota_result_t load_config_sector(uint8_t *buffer, rboot_config **config, rboot_slot_meta **meta) {
+    *config = (rboot_config*)buffer;
+    *meta = (rboot_slot_meta*)(buffer + BOOT_SLOT_META_OFFSET);
+
+    if (SPIRead(BOOT_CONFIG_SECTOR * SECTOR_SIZE, buffer, SECTOR_SIZE) != 0) {
+        return OTA_ERR_FLASH;
+    }
+    if ((*meta)->magic != BOOT_SLOT_META_MAGIC) {
+        memset(*meta, 0, sizeof(rboot_slot_meta));
+        (*meta)->magic = BOOT_SLOT_META_MAGIC;
+        (*meta)->fallback_rom = 0xff;
+    }
+    return OTA_OK;
+}
+
+// Write back the config sector from load_config_sector, through the
+// journal if there is one (magic word last) so rBoot can finish it
+static ota_result_t save_config_sector(rboot_config *config) {
+#ifdef BOOT_CONFIG_JOURNAL_ADDR
+    uint32_t zero = 0;
+#endif
+#ifdef BOOT_CONFIG_CHKSUM
+    config->chksum = calc_chksum((uint8_t*)config, (uint8_t*)&config->chksum);
+#endif
+#ifdef BOOT_CONFIG_JOURNAL_ADDR
+    if (SPIEraseSector(BOOT_CONFIG_JOURNAL_ADDR / SECTOR_SIZE) != 0) {
+        return OTA_ERR_ERASE;
+    }
+    if (SPIWrite(BOOT_CONFIG_JOURNAL_ADDR + sizeof(uint32_t), (uint32_t*)config + 1, SECTOR_SIZE - sizeof(uint32_t)) != 0
+        || SPIWrite(BOOT_CONFIG_JOURNAL_ADDR, config, sizeof(uint32_t)) != 0) {
+        return OTA_ERR_WRITE;
+    }
+#endif
+    if (SPIEraseSector(BOOT_CONFIG_SECTOR) != 0) {
+        return OTA_ERR_ERASE;
+    }
+    if (SPIWrite(BOOT_CONFIG_SECTOR * SECTOR_SIZE, config, SECTOR_SIZE) != 0) {
+        return OTA_ERR_WRITE;
+    }
+#ifdef BOOT_CONFIG_JOURNAL_ADDR
+    SPIWrite(BOOT_CONFIG_JOURNAL_ADDR, &zero, sizeof(zero));
+#endif
+    return OTA_OK;
+}
+
+// Record the sectors erased by this update in the slot metadata and, if
+// requested, make it the boot ROM, all in a single config sector write
+static ota_result_t commit_slot(ota_handle_t *handle, uint8_t boot) {
+    rboot_config *config;
+    rboot_slot_meta *meta;
+    ota_result_t result;
+
+    result = load_config_sector(handle->buffer, &config, &meta);
+    if (result != OTA_OK) {
+        return result;
+    }
+    if (handle->target_rom >= config->count) {
+        return OTA_ERR_INVALID_ARGS;
+    }
+
+    // Sectors found blank weren't erased
+    meta->wear[handle->target_rom].erases += handle->metrics.sectors_erased;
+    meta->wear[handle->target_rom].generation++;
+
+#ifdef BOOT_PLAN_ENABLED
+    // Any boot plan was for the ROM this one replaced
+    memset((uint8_t*)config + BOOT_PLAN_OFFSET(handle->target_rom), 0xff, sizeof(rboot_plan));
+#endif
+
+#ifdef BOOT_IROM_DEFERRED
+    // rBoot can trust the irom of a verified ROM, until the app checks it
+    meta->irom_valid &= ~(1 << handle->target_rom);
+    if (boot) {
+        meta->irom_chksum[handle->target_rom] = handle->irom_chksum;
+        meta->irom_valid |= 1 << handle->target_rom;
+    }
+#endif
+
+    if (boot) {
+        // The ROM we are running is now the known good fallback
+        if (config->current_rom != handle->target_rom) {
+            meta->fallback_rom = config->current_rom;
+        }
+        config->current_rom = handle->target_rom;
+    }
+
+    return save_config_sector(config);
+}
+
+// Digest a payload as written to flash, len must be a multiple of 4
+static uint32_t flash_digest(uint32_t addr, uint32_t len) {
+    uint32_t buffer[64];
+    uint32_t digest = DIGEST_INIT;
+    uint32_t readlen;
+    uint32_t i;
+    while (len > 0) {
+        readlen = (len < sizeof(buffer)) ? len : sizeof(buffer);
+        if (SPIRead(addr, buffer, readlen) != 0) {
+            return ~digest;
+        }
+        for (i = 0; i < readlen; i++) {
+            digest = (digest ^ ((uint8_t*)buffer)[i]) * DIGEST_PRIME;
+        }
+        addr += readlen;
+        len -= readlen;
+    }
+    return digest;
+}
+
+// Check the table of contents is sound, then start writing the
+// payload of the current entry to its inactive location
+static ota_result_t start_payload(ota_bundle_t *bundle) {
+    ota_bundle_entry_t *entry;
+    rboot_config config;
+    uint32_t digest = DIGEST_INIT;
+    uint32_t seen = 0;
+    uint32_t i;
+
+    if (bundle->entry == 0) {
+        for (i = 0; i < bundle->toc.count * sizeof(ota_bundle_entry_t); i++) {
+            digest = (digest ^ ((uint8_t*)bundle->toc.entries)[i]) * DIGEST_PRIME;
+        }
+        if (digest != bundle->toc.digest) {
+            return OTA_ERR_INVALID_IMAGE;
+        }
+        if (SPIRead(BOOT_CONFIG_SECTOR * SECTOR_SIZE, &config, sizeof(config)) != 0) {
+            return OTA_ERR_FLASH;
+        }
+        for (i = 0; i < bundle->toc.count; i++) {
+            entry = &bundle->toc.entries[i];
+            if (entry->length == 0 || (entry->length & 3) != 0) {
+                return OTA_ERR_INVALID_IMAGE;
+            }
+            if (entry->type == OTA_BUNDLE_ROM) {
+                // one ROM, not over the one we are running, that fits its slot
+                if (entry->id >= config.count || entry->id >= MAX_ROMS
+                    || entry->id == config.current_rom || (seen & (1 << OTA_BUNDLE_MAX_DATA))
+                    || entry->length > get_slot_room(config.roms[entry->id])) {
+                    return OTA_ERR_INVALID_IMAGE;
+                }
+                seen |= (1 << OTA_BUNDLE_MAX_DATA);
+            } else if (entry->type == OTA_BUNDLE_DATA) {
+                if (entry->id >= OTA_BUNDLE_MAX_DATA || (seen & (1 << entry->id))
+                    || !data_range_ok(&config, entry->addr[0], entry->length)
+                    || !data_range_ok(&config, entry->addr[1], entry->length)
+                    || (entry->addr[0] < entry->addr[1] + entry->length
+                        && entry->addr[1] < entry->addr[0] + entry->length)) {
+                    return OTA_ERR_INVALID_IMAGE;
+                }
+                seen |= (1 << entry->id);
+            } else {
+                return OTA_ERR_INVALID_IMAGE;
+            }
+        }
+    }
+
+    entry = &bundle->toc.entries[bundle->entry];
+    if (entry->type == OTA_BUNDLE_ROM) {
+        // The erase count runs on across payloads, note where this one starts
+        bundle->rom_erased = bundle->ota.metrics.sectors_erased;
+        start_write(&bundle->ota, get_rom_address(entry->id));
+        bundle->ota.target_rom = entry->id;
+        bundle->ota.admit = 1;
+    } else {
+        start_write(&bundle->ota, entry->addr[!rboot_ota_data_copy(entry->id)]);
+    }
+    if (claim_range(&bundle->ota, bundle->ota.target_addr, entry->length) != OTA_OK) {
+        return OTA_ERR_IN_PROGRESS;
+    }
+    bundle->ota.total_size = entry->length;
+    bundle->ota.state = OTA_STATE_STARTED;
+    return OTA_OK;
+}
+
+// Whether a copy of a bundle data partition can be written at addr: sector
+// aligned, in the flash and clear of rBoot and its config, then either in
+// one of the partitions or clear of every ROM slot
+static uint8_t data_range_ok(rboot_config *config, uint32_t addr, uint32_t len) {
+    uint32_t end = addr + len;
+    uint32_t device, flashsize;
+    uint8_t i;
+#ifdef BOOT_PARTITIONS
+    rboot_part_table table;
+    uint8_t *pos;
+    uint8_t chksum = CHKSUM_INIT;
+#endif
+
+    if ((addr % SECTOR_SIZE) != 0 || end < addr || addr < 2 * SECTOR_SIZE) {
+        return 0;
+    }
+    if (SPIRead(0, &device, sizeof(device)) != 0) {
+        return 0;
+    }
+    flashsize = flash_size_kb(device >> 24) * 1024;
+    if (flashsize > 0 && end > flashsize) {
+        return 0;
+    }
+#ifdef BOOT_CONFIG_JOURNAL_ADDR
+    if (addr < BOOT_CONFIG_JOURNAL_ADDR + SECTOR_SIZE && BOOT_CONFIG_JOURNAL_ADDR < end) {
+        return 0;
+    }
+#endif
+#ifdef BOOT_HISTORY_ADDR
+    if (addr < BOOT_HISTORY_ADDR + 2 * SECTOR_SIZE && BOOT_HISTORY_ADDR < end) {
+        return 0;
+    }
+#endif
+
+#ifdef BOOT_PARTITIONS
+    if (SPIRead(BOOT_CONFIG_SECTOR * SECTOR_SIZE + BOOT_PART_TABLE_OFFSET, &table, sizeof(table)) == 0
+        && table.magic == BOOT_PART_MAGIC && table.count <= BOOT_PART_MAX) {
+        for (pos = (uint8_t*)table.parts; pos < (uint8_t*)(&table + 1); pos++) {
+            chksum ^= *pos;
+        }
+        for (i = 0; i < table.count && chksum == table.chksum; i++) {
+            if (addr >= table.parts[i].offset
+                && end <= table.parts[i].offset + table.parts[i].size) {
+                return 1;
+            }
+        }
+    }
+#endif
+
+    for (i = 0; i < config->count && i < MAX_ROMS; i++) {
+        if (addr < get_slot_end(config, i, flashsize) && config->roms[i] < end) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Verify the payload just written, then move on to the next
+static ota_result_t finish_payload(ota_bundle_t *bundle) {
+    ota_bundle_entry_t *entry = &bundle->toc.entries[bundle->entry];
+    uint8_t irom_chksum;
+
+    bundle->ota.state = OTA_STATE_VERIFYING;
+    if (flash_digest(bundle->ota.target_addr, entry->length) != entry->digest) {
+        return OTA_ERR_VERIFY;
+    }
+    if (entry->type == OTA_BUNDLE_ROM) {
+        if (verify_image(bundle->ota.target_addr, entry->length, &irom_chksum) != OTA_OK) {
+            return OTA_ERR_VERIFY;
+        }
+        // Sectors found blank weren't erased
+        bundle->rom_erased = bundle->ota.metrics.sectors_erased - bundle->rom_erased;
+    }
+
+    bundle->entry++;
+    if (bundle->entry < bundle->toc.count) {
+        return start_payload(bundle);
+    }
+    bundle->ota.state = OTA_STATE_COMPLETE;
     return OTA_OK;
 }
 
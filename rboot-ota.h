@@ -30,11 +30,37 @@ extern "C" {
 #define OTA_UPDATE_TIMEOUT_MS 300000  // 5 minutes
 #endif
 
-// OTA buffer size (must be multiple of flash sector size)
+// OTA buffer size (must be multiple of flash sector size), each
+// concurrent session needs one, see rboot_ota_set_pool
 #ifndef OTA_BUFFER_SIZE
 #define OTA_BUFFER_SIZE 4096
 #endif
 
+// Uncomment to leave out the built in OTA buffer, so no RAM is
+// used while idle and rboot_ota_set_pool must be called first
+//#define OTA_NO_STATIC_BUFFER
+
+// Worst case flash timings, used by rboot_ota_poll to keep within its budget
+#ifndef OTA_ERASE_US
+#define OTA_ERASE_US 50000    // Erase one sector
+#endif
+#ifndef OTA_PROGRAM_US
+#define OTA_PROGRAM_US 1000   // Program one page
+#endif
+
+// Time source for the OTA metrics, in microseconds
+#ifndef OTA_TIME_US
+#define OTA_TIME_US() system_get_time()
+extern uint32_t system_get_time(void);
+#endif
+
+// Start of a ROM checked before anything is erased, the header and
+// the first section header (or the new style header)
+#define OTA_HEADER_LEN 16
+
+// Flash page, the most rboot_ota_poll programs at once
+#define OTA_PAGE_SIZE 256
+
 // OTA status codes
 typedef enum {
     OTA_OK = 0,            // Operation successful
@@ -47,7 +73,8 @@ typedef enum {
     OTA_ERR_WRITE,          // Write operation failed
     OTA_ERR_ERASE,          // Erase operation failed
     OTA_ERR_IN_PROGRESS,    // OTA already in progress
-    OTA_ERR_NO_UPDATE       // No update available
+    OTA_ERR_NO_UPDATE,      // No update available
+    OTA_PENDING             // Queued data still to be written
 } ota_result_t;
 
 // OTA update state
@@ -60,33 +87,238 @@ typedef enum {
     OTA_STATE_ERROR         // Error occurred
 } ota_state_t;
 
-// OTA update handle
+/** @brief Relocatable ROM stream magic, "RLOC" */
+#define OTA_RELOC_MAGIC 0x434f4c52
+/** @brief Bytes of relocation bitmap before each sector of ROM, one bit per word */
+#define OTA_RELOC_BITMAP (SECTOR_SIZE / 4 / 8)
+
+/**
+ * @brief Relocatable ROM stream header
+ * 
+ * Followed, for each sector of the ROM image, by an OTA_RELOC_BITMAP byte
+ * bitmap marking the words that hold irom addresses (bit n of byte n/8 for
+ * word n) and then the sector of image itself (shorter for the last).
+ */
+typedef struct {
+    uint32_t magic;          // OTA_RELOC_MAGIC
+    uint32_t link_base;      // Mapped address of the slot the ROM was linked for (0x40200000 + offset in its 1MB block)
+    uint32_t image_len;      // Length of the ROM image
+    uint32_t chksum_from;    // Image offset the ROM checksum covers from (after the irom section, unless irom chksum)
+    uint32_t chksum_pos;     // Image offset of the ROM checksum byte
+} ota_reloc_header_t;
+
+// Relocation state for an OTA update
+typedef struct {
+    ota_reloc_header_t header; // Stream header
+    uint8_t bitmap[OTA_RELOC_BITMAP]; // Words of the current sector to relocate
+    uint32_t received;       // Bytes received of the current header, bitmap or sector
+    uint32_t image_pos;      // Image offset of the current sector
+    uint32_t delta;          // Amount added to each marked word
+    uint8_t step;            // Expecting header, bitmap or sector
+    uint8_t chksum_fix;      // Change to the ROM checksum from patches so far
+} ota_reloc_t;
+
+/** @brief Sparse stream record length bit marking a skip rather than a literal run */
+#define OTA_SPARSE_SKIP 0x80000000
+
+// Sparse stream state, each record is a 32 bit little endian length, with
+// OTA_SPARSE_SKIP set to leave that many bytes erased, otherwise followed by
+// that many bytes of literal data
+typedef struct {
+    uint32_t record;         // Record being received
+    uint32_t left;           // Literal bytes of the record still to come
+    uint8_t received;        // Bytes received of the record length
+} ota_sparse_t;
+
+// OTA session metrics, times in microseconds
 typedef struct {
+    uint32_t bytes_received; // Bytes passed in by the app
+    uint32_t bytes_written;  // Bytes programmed to flash
+    uint32_t bytes_skipped;  // Bytes of a sparse stream left erased
+    uint32_t bytes_copied;   // Bytes copied into the buffer rather than programmed from where they were
+    uint32_t erase_us;       // Time spent erasing, including checking for blank sectors
+    uint32_t program_us;     // Time spent programming
+    uint32_t copy_us;        // Time spent copying into the buffer
+    uint32_t max_stall_us;   // Longest single call into the OTA api
+    uint16_t sectors_erased; // Sectors erased
+    uint16_t sectors_skipped; // Sectors already blank, so not erased
+    uint32_t rate_bps;       // Throughput over the last sector, bytes per second
+    uint32_t avg_bps;        // Throughput since the session began, bytes per second
+    uint32_t start_us;       // When the session began
+    uint32_t sector_us;      // When the last sector was completed
+} ota_metrics_t;
+
+struct ota_handle;
+
+// Called as each sector of an update is completed
+typedef void (*ota_sector_cb_t)(struct ota_handle *handle, uint32_t sector_addr, void *arg);
+
+// OTA update handle
+typedef struct ota_handle {
     uint32_t target_addr;    // Target flash address
+    uint32_t max_size;       // Size of flash claimed from target_addr
     uint32_t write_offset;   // Current write offset
     uint32_t total_size;     // Total size of update
     uint32_t written_size;   // Number of bytes written
     uint8_t *buffer;         // Data buffer
     uint32_t buffer_size;    // Size of data buffer
+    uint32_t queued;         // Bytes submitted but not yet written, from write_offset
+    uint32_t erased_to;      // Offset flash has been erased up to
+    uint8_t admit;           // ROM header still to be checked, nothing erased yet
     ota_state_t state;       // Current state
     uint8_t target_rom;      // Target ROM slot
+    ota_reloc_t *reloc;      // Relocation state, NULL unless relocating
+    ota_sparse_t *sparse;    // Sparse stream state, NULL unless sparse
+    struct ota_handle *next; // Next active session
+    uint8_t irom_chksum;     // XOR of the irom section, recorded for rBoot with the ROM
+    ota_metrics_t metrics;   // Performance of the session
+    ota_sector_cb_t sector_cb; // Called as each sector is completed, or NULL
+    void *sector_arg;        // Passed to sector_cb
 } ota_handle_t;
 
+/** @brief Bundle magic, "BNDL" */
+#define OTA_BUNDLE_MAGIC 0x4c444e42
+/** @brief Maximum payloads in a bundle */
+#define OTA_BUNDLE_MAX_ENTRIES 4
+/** @brief Maximum data partition ids (bits in rboot_slot_meta.data_select) */
+#define OTA_BUNDLE_MAX_DATA 8
+
+/** @brief Bundle payload types */
+#define OTA_BUNDLE_ROM  0   // ROM, written to slot id
+#define OTA_BUNDLE_DATA 1   // Data, written to the inactive copy of partition id
+
+/**
+ * @brief Bundle table of contents entry
+ * 
+ * Payloads follow the table of contents in entry order, each padded to
+ * a multiple of 4 bytes.
+ */
+typedef struct {
+    uint8_t type;            // OTA_BUNDLE_ROM or OTA_BUNDLE_DATA
+    uint8_t id;              // ROM slot, or data partition id
+    uint8_t unused[2];       // Padding, 0xff
+    uint32_t addr[2];        // Flash address of data copies A and B (not used for ROMs)
+    uint32_t length;         // Payload length
+    uint32_t digest;         // FNV-1a digest of the payload
+} ota_bundle_entry_t;
+
+/**
+ * @brief Bundle table of contents
+ * 
+ * Starts the bundle stream, only count entries are sent.
+ */
+typedef struct {
+    uint32_t magic;          // OTA_BUNDLE_MAGIC
+    uint8_t count;           // Quantity of entries
+    uint8_t unused[3];       // Padding, 0xff
+    uint32_t digest;         // FNV-1a digest of the entries
+    ota_bundle_entry_t entries[OTA_BUNDLE_MAX_ENTRIES];
+} ota_bundle_toc_t;
+
+// OTA bundle handle
+typedef struct {
+    ota_bundle_toc_t toc;    // Table of contents, as received
+    uint32_t toc_received;   // Bytes of the table of contents received
+    uint8_t entry;           // Payload currently being written
+    uint32_t rom_erased;     // Sectors erased writing the ROM payload
+    ota_handle_t ota;        // Writer for the current payload
+} ota_bundle_t;
+
 /** @} */ // end of ota
 
+/**
+ * @brief Supply the buffers for OTA sessions
+ * 
+ * Each active session (update or bundle) takes one OTA_BUFFER_SIZE buffer
+ * from the pool, so count sets how many can run at once. Without a pool
+ * there is a single built in buffer, so one session at a time. A NULL pool
+ * releases the buffers, so heap allocated ones can be freed between updates.
+ * 
+ * @param buffers count * OTA_BUFFER_SIZE bytes, 4 byte aligned, that must stay valid, or NULL
+ * @param count Number of buffers (up to 32), 0 with a NULL pool
+ * @return ota_result_t OTA_OK on success, OTA_ERR_IN_PROGRESS if sessions are active
+ */
+ota_result_t rboot_ota_set_pool(uint8_t *buffers, uint8_t count);
+
 /**
  * @brief Initialize OTA update
  * 
+ * Sessions are independent, any number can run at once (up to the buffers
+ * in the pool) as long as they write to different areas of flash.
+ * 
  * @param handle Pointer to OTA handle structure
  * @param target_rom Target ROM slot for update
  * @param max_size Maximum size of the update
- * @return ota_result_t OTA_OK on success, error code otherwise
+ * @return ota_result_t OTA_OK on success, OTA_ERR_IN_PROGRESS if the handle
+ *         is already in use, error code otherwise
  */
 ota_result_t rboot_ota_begin(ota_handle_t *handle, uint8_t target_rom, uint32_t max_size);
 
+/**
+ * @brief Check a ROM header before writing it
+ * 
+ * rboot_ota_begin holds back the first OTA_HEADER_LEN bytes of an update and
+ * checks them with this before erasing anything, so an image that could
+ * never boot from the slot doesn't destroy what is there. Also for apps
+ * writing ROMs some other way. Checks:
+ * - the magic, and that the entry point is in iram
+ * - for a new style (irom first) ROM, that the irom section fits max_size
+ * - for an old style ROM, that the first section is loaded to iram or dram,
+ *   or if it is irom that it was linked for where the slot is mapped
+ * - that the ROM wasn't built for a larger flash than rBoot's header gives
+ * 
+ * max_size given to rboot_ota_begin is also checked against the room the
+ * slot has, up to the next slot or the end of its 1MB block.
+ * 
+ * @param header First OTA_HEADER_LEN bytes of the ROM
+ * @param addr Flash address the ROM is for
+ * @param max_size Room for the ROM at addr
+ * @return ota_result_t OTA_OK if the ROM is acceptable, OTA_ERR_INVALID_IMAGE if not
+ */
+ota_result_t rboot_ota_check_header(const uint8_t *header, uint32_t addr, uint32_t max_size);
+
+/**
+ * @brief Initialize OTA update of a relocatable ROM
+ * 
+ * Lets one build of a ROM be installed in any slot, instead of linking it
+ * separately for each. The stream written with rboot_ota_write is then an
+ * ota_reloc_header_t and the ROM, interleaved with bitmaps of the words that
+ * hold irom addresses, which are moved to suit the slot's offset within its
+ * 1MB block as each sector is written. The ROM checksum is corrected to
+ * match, and rboot_ota_end checks it.
+ * 
+ * @param handle Pointer to OTA handle structure
+ * @param reloc Pointer to relocation state, must stay valid until the update ends
+ * @param target_rom Target ROM slot for update
+ * @param max_size Maximum size of the update
+ * @return ota_result_t OTA_OK on success, error code otherwise
+ */
+ota_result_t rboot_ota_begin_reloc(ota_handle_t *handle, ota_reloc_t *reloc, uint8_t target_rom, uint32_t max_size);
+
+/**
+ * @brief Initialize OTA update from a sparse stream
+ * 
+ * Images, and data partitions especially, often have long runs of 0xff
+ * padding. In a sparse stream these are sent as skip records, the sectors
+ * they cover are erased but nothing is programmed there. The stream written
+ * with rboot_ota_write is a sequence of records, see ota_sparse_t. Skips and
+ * the literal runs before them must be multiples of 4 bytes.
+ * 
+ * @param handle Pointer to OTA handle structure
+ * @param sparse Pointer to sparse stream state, must stay valid until the update ends
+ * @param target_rom Target ROM slot for update
+ * @param max_size Maximum size of the update
+ * @return ota_result_t OTA_OK on success, error code otherwise
+ */
+ota_result_t rboot_ota_begin_sparse(ota_handle_t *handle, ota_sparse_t *sparse, uint8_t target_rom, uint32_t max_size);
+
 /**
  * @brief Write data to flash during OTA update
  * 
+ * Word aligned data in RAM is programmed straight from where it is, other
+ * data is copied through the session buffer first. Chunks can be any size,
+ * a part word left over is held until the next call (or rboot_ota_end).
+ * 
  * @param handle Pointer to OTA handle structure
  * @param data Pointer to data to write
  * @param size Size of data to write
@@ -94,9 +326,99 @@ ota_result_t rboot_ota_begin(ota_handle_t *handle, uint8_t target_rom, uint32_t
  */
 ota_result_t rboot_ota_write(ota_handle_t *handle, const uint8_t *data, uint32_t size);
 
+/**
+ * @brief Set the length of the update, for progress
+ * 
+ * Defaults to the max_size given to rboot_ota_begin. Call once the real
+ * length is known (e.g. from the Content-Length of the download).
+ * 
+ * @param handle Pointer to OTA handle structure
+ * @param size Length of the update
+ * @return ota_result_t OTA_OK on success, error code otherwise
+ */
+ota_result_t rboot_ota_set_size(ota_handle_t *handle, uint32_t size);
+
+/**
+ * @brief Set a function to call as each sector is completed
+ * 
+ * Called after the sector is programmed (the last one from rboot_ota_end,
+ * before it is verified), e.g. to report progress or feed a watchdog.
+ * 
+ * @param handle Pointer to an active OTA handle
+ * @param callback Function to call, or NULL for none
+ * @param arg Passed to the callback
+ * @return ota_result_t OTA_OK on success, error code otherwise
+ */
+ota_result_t rboot_ota_set_callback(ota_handle_t *handle, ota_sector_cb_t callback, void *arg);
+
+/**
+ * @brief Get the performance metrics of an OTA session
+ * 
+ * Valid until the handle is reused, including after the update has ended.
+ * 
+ * @param handle Pointer to OTA handle structure
+ * @return const ota_metrics_t* The metrics, with avg_bps brought up to date
+ */
+const ota_metrics_t *rboot_ota_get_metrics(ota_handle_t *handle);
+
+/**
+ * @brief Queue OTA data to be written by rboot_ota_poll
+ * 
+ * Copies as much of the data as will fit into the session's buffer and
+ * returns at once, without touching flash. When less than size is accepted
+ * the buffer is full, so the network layer should hold off (e.g. stop
+ * reading the connection) and offer the rest again after polling.
+ * Can't be mixed with rboot_ota_write while data is queued, or used for a
+ * relocated or sparse update.
+ * 
+ * @param handle Pointer to OTA handle structure
+ * @param data Pointer to data to queue
+ * @param size Size of data
+ * @param accepted Set to the number of bytes queued
+ * @return ota_result_t OTA_OK on success (even if not all accepted), error code otherwise
+ */
+ota_result_t rboot_ota_submit(ota_handle_t *handle, const uint8_t *data, uint32_t size, uint32_t *accepted);
+
+/**
+ * @brief Write some queued OTA data
+ * 
+ * Does at most one flash operation, a sector erase or a page program, and
+ * only if it is expected to take no longer than budget_us (see OTA_ERASE_US
+ * and OTA_PROGRAM_US). Call regularly, e.g. from a timer or task, yielding to
+ * the rest of the system in between.
+ * 
+ * @param handle Pointer to OTA handle structure
+ * @param budget_us Time available for this call, in microseconds
+ * @return ota_result_t OTA_OK when all queued data is on flash, OTA_PENDING if
+ *         more remains, error code otherwise
+ */
+ota_result_t rboot_ota_poll(ota_handle_t *handle, uint32_t budget_us);
+
+/**
+ * @brief Get the time the next rboot_ota_poll step needs
+ * 
+ * An erase can't be split, so a budget smaller than this never progresses.
+ * 
+ * @param handle Pointer to OTA handle structure
+ * @return uint32_t Microseconds needed, 0 if nothing is queued
+ */
+uint32_t rboot_ota_poll_cost(ota_handle_t *handle);
+
+/**
+ * @brief Get the space free to queue OTA data
+ * 
+ * For sizing the receive window offered to the sender.
+ * 
+ * @param handle Pointer to OTA handle structure
+ * @return uint32_t Bytes rboot_ota_submit would accept now
+ */
+uint32_t rboot_ota_queue_space(ota_handle_t *handle);
+
 /**
  * @brief Finalize OTA update
  * 
+ * Any data still queued by rboot_ota_submit is written first.
+ * 
  * @param handle Pointer to OTA handle structure
  * @return ota_result_t OTA_OK on success, error code otherwise
  */
@@ -109,6 +431,115 @@ ota_result_t rboot_ota_end(ota_handle_t *handle);
  */
 void rboot_ota_cancel(ota_handle_t *handle);
 
+/**
+ * @brief Pick the ROM slot to use for the next OTA update
+ * 
+ * Chooses the least worn slot (by sectors erased, then ROMs written), that
+ * is not the current ROM and, on layouts with 3 or more slots, not the known
+ * good fallback ROM. Wear is recorded in the slot metadata in the config
+ * sector by rboot_ota_end and rboot_ota_cancel.
+ * 
+ * @param rom Pointer to store the chosen ROM slot
+ * @return ota_result_t OTA_OK on success, OTA_ERR_NO_UPDATE if there is no other slot
+ */
+ota_result_t rboot_ota_pick_slot(uint8_t *rom);
+
+/**
+ * @brief Start receiving an OTA bundle
+ * 
+ * A bundle carries a ROM and/or data partitions (e.g. web assets) in one
+ * stream. Each payload is written to an inactive location and checked
+ * against its digest as it completes, nothing changes until
+ * rboot_ota_bundle_end switches them all over in one config write.
+ * 
+ * @param bundle Pointer to bundle handle structure
+ * @return ota_result_t OTA_OK on success, OTA_ERR_IN_PROGRESS if the bundle
+ *         is already in use, error code otherwise
+ */
+ota_result_t rboot_ota_bundle_begin(ota_bundle_t *bundle);
+
+/**
+ * @brief Write bundle data, as received
+ * 
+ * @param bundle Pointer to bundle handle structure
+ * @param data Pointer to data to write
+ * @param size Size of data to write, any amount
+ * @return ota_result_t OTA_OK on success, error code otherwise
+ */
+ota_result_t rboot_ota_bundle_write(ota_bundle_t *bundle, const uint8_t *data, uint32_t size);
+
+/**
+ * @brief Finish an OTA bundle
+ * 
+ * Once every payload has been received and verified, selects the new ROM
+ * for the next boot and the new copy of each data partition together.
+ * 
+ * @param bundle Pointer to bundle handle structure
+ * @return ota_result_t OTA_OK on success, error code otherwise
+ */
+ota_result_t rboot_ota_bundle_end(ota_bundle_t *bundle);
+
+/**
+ * @brief Cancel an OTA bundle
+ * 
+ * @param bundle Pointer to bundle handle structure
+ */
+void rboot_ota_bundle_cancel(ota_bundle_t *bundle);
+
+/**
+ * @brief Get the active copy of a bundle data partition
+ * 
+ * @param id Data partition id
+ * @return uint8_t 0 for copy A (addr[0]), 1 for copy B (addr[1])
+ */
+uint8_t rboot_ota_data_copy(uint8_t id);
+
+// Background irom check state, see rboot_ota_irom_verify_begin
+typedef struct {
+    uint32_t pos;            // Flash address of the next irom byte to check
+    uint32_t end;            // End of the irom section, 0 if there's nothing to check
+    uint8_t rom;             // ROM being checked
+    uint8_t expected;        // irom checksum the ROM's stored checksum needs
+    uint8_t chksum;          // irom checksum so far
+    uint8_t recorded;        // Result has been saved for rBoot
+    ota_result_t result;     // Result once recorded
+} ota_irom_verify_t;
+
+/**
+ * @brief Start checking the irom section of a ROM in the background
+ * 
+ * With BOOT_IROM_DEFERRED rBoot only checks the ram sections of a ROM at
+ * boot, using the irom checksum recorded when the ROM was written, and
+ * leaves the (much larger) irom section to the app. Start this soon after
+ * boot for the running ROM and call rboot_ota_irom_verify_poll from a timer
+ * until it finishes. Without BOOT_IROM_DEFERRED it still checks the irom
+ * and rolls back a bad ROM, it just has nothing to record for rBoot.
+ * 
+ * @param verify Pointer to check state
+ * @param rom ROM slot to check, usually rboot_get_current_rom()
+ * @return ota_result_t OTA_PENDING to carry on with rboot_ota_irom_verify_poll,
+ *         OTA_OK if the ROM has no irom in its checksum, error code otherwise
+ */
+ota_result_t rboot_ota_irom_verify_begin(ota_irom_verify_t *verify, uint8_t rom);
+
+/**
+ * @brief Check the next part of the irom section
+ * 
+ * Reads for up to about budget_us (at least one piece per call). Once the
+ * whole section has been read a good checksum is recorded for rBoot. A bad
+ * one stops rBoot trusting the irom of the ROM and, if it is the boot ROM,
+ * makes the fallback ROM the boot ROM again (and with BOOT_RTC_ENABLED sets
+ * a temp boot of it), so the app should then restart. The config sector
+ * write needs an OTA buffer, if none is free it is retried on the next call.
+ * 
+ * @param verify Pointer to check state
+ * @param budget_us Time to spend in this call, in microseconds
+ * @return ota_result_t OTA_PENDING until the check is done, then OTA_OK if
+ *         the irom is good, OTA_ERR_VERIFY if not, or the error that stopped
+ *         the result being saved
+ */
+ota_result_t rboot_ota_irom_verify_poll(ota_irom_verify_t *verify, uint32_t budget_us);
+
 /**
  * @brief Set next boot ROM
  * 
@@ -22,6 +22,27 @@
 // stage2 read chunk maximum size (limit for SPIRead)
 #define READ_SIZE 0x1000
 
+// flash read cache line size, must be a power of 2, reads smaller
+// than this are served from a single aligned cache line (1 turns the
+// cache off, every read going to the flash)
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 0x100
+#endif
+
+// ram areas rom sections may be loaded in to, iram stops
+// short of the stage2a loader at the top (see rboot-stage2a.ld)
+#define IRAM_START 0x40100000
+#define IRAM_END   0x4010fc00
+#define DRAM_START 0x3ffe8000
+#define DRAM_END   0x3fffc000
+
+// where each 1MB block of flash is mapped
+#define IROM_MAP_ADDR 0x40200000
+
+// set in the address passed to stage2a when it is
+// the address of a boot plan rather than a rom header
+#define BOOT_PLAN_FLAG 0x01
+
 // esp8266 built in rom functions
 extern uint32_t SPIRead(uint32_t addr, void *outptr, uint32_t len);
 extern uint32_t SPIEraseSector(int);
@@ -30,6 +51,7 @@ extern void ets_printf(char*, ...);
 extern void ets_delay_us(int);
 extern void ets_memset(void*, uint8_t, uint32_t);
 extern void ets_memcpy(void*, const void*, uint32_t);
+extern int ets_memcmp(const void*, const void*, uint32_t);
 
 // functions we'll call by address
 typedef void stage2a(uint32_t);
@@ -42,11 +64,11 @@ typedef struct {
 	uint8_t count;
 	uint8_t flags1;
 	uint8_t flags2;
-	usercode* entry;
+	uint32_t entry;
 } rom_header;
 
 typedef struct {
-	uint8_t* address;
+	uint32_t address;
 	uint32_t length;
 } section_header;
 
@@ -65,6 +87,118 @@ typedef struct {
 	uint32_t len; // length of irom section
 } rom_header_new;
 
+// read-through cache for the small header & checksum reads made while
+// finding a rom, lives on the stack as rboot has no initialised data
+typedef struct {
+	uint32_t addr;
+	uint8_t data[CACHE_LINE_SIZE];
+} flash_cache;
+
+// find the end of a rom slot, the start of the next rom above it, the end
+// of the 1MB block it's in or the end of the flash, whichever comes first
+static inline uint32_t get_slot_end(rboot_config *romconf, int32_t rom, uint32_t flashsize) {
+
+	uint32_t start = romconf->roms[rom];
+	uint32_t end = (start | 0xfffff) + 1;
+	uint8_t loop;
+
+	if (flashsize > start && flashsize < end) {
+		end = flashsize;
+	}
+	for (loop = 0; loop < romconf->count && loop < MAX_ROMS; loop++) {
+		if (romconf->roms[loop] > start && romconf->roms[loop] < end) {
+			end = romconf->roms[loop];
+		}
+	}
+
+	return end;
+}
+
+// flash size in KB given by the flags byte of a rom header, 0 if unknown
+static inline uint32_t flash_size_kb(uint8_t flags2) {
+	switch (flags2 >> 4) {
+		case 0: return 512;
+		case 1: return 256;
+		case 2: return 1024;
+		case 3: case 5: return 2048;
+		case 4: case 6: return 4096;
+		case 8: return 8192;
+		case 9: return 16384;
+		default: return 0;
+	}
+}
+
+// check the first 16 bytes of a rom (as words) before anything is erased
+// for it at addr, with max_size room: the magic, an entry point in iram,
+// for a new style rom that the irom fits, for an old style rom that the
+// first section loads to iram or dram or is irom linked for where addr is
+// mapped, and that it wasn't built for more flash than device_flags2 (the
+// flags of rboot's own header) gives, shared by the ota and app writers
+static inline uint8_t check_rom_header(const uint32_t *words, uint32_t addr, uint32_t max_size, uint8_t device_flags2) {
+
+	const uint8_t *header = (const uint8_t*)words;
+	uint32_t image_kb, device_kb;
+
+	if (max_size < sizeof(rom_header_new) || words[1] < IRAM_START || words[1] >= IRAM_END) {
+		return 0;
+	}
+
+	if (header[0] == ROM_MAGIC_NEW1 && header[1] == ROM_MAGIC_NEW2) {
+		if ((words[3] & 3) != 0 || words[3] > max_size - sizeof(rom_header_new)) {
+			return 0;
+		}
+	} else if (header[0] == ROM_MAGIC && header[1] > 0) {
+		if (words[2] >= IRAM_START && words[2] < IRAM_END) {
+			if (words[3] > IRAM_END - words[2]) return 0;
+		} else if (words[2] >= DRAM_START && words[2] < DRAM_END) {
+			if (words[3] > DRAM_END - words[2]) return 0;
+		} else if (words[2] != IROM_MAP_ADDR + (addr % 0x100000) + sizeof(rom_header_new)
+			|| words[3] > max_size - sizeof(rom_header_new)) {
+			return 0;
+		}
+	} else {
+		return 0;
+	}
+
+	image_kb = flash_size_kb(header[3]);
+	device_kb = flash_size_kb(device_flags2);
+	if (image_kb > 0 && device_kb > 0 && image_kb > device_kb) {
+		return 0;
+	}
+	return 1;
+}
+
+// 32 bit FNV-1a, for rom block, bundle payload and boot plan digests
+#define DIGEST_INIT  0x811c9dc5
+#define DIGEST_PRIME 0x01000193
+
+// a factory reset that restores a golden rom or erases dirty sectors
+// records its progress, so it can resume after a power cut
+#if defined(BOOT_GOLDEN_ROM) || defined(BOOT_DIRTY_MAP_ADDR)
+#define BOOT_RESET_RESUME
+#endif
+
+#ifdef BOOT_DIRTY_MAP_ADDR
+#if !defined(BOOT_RESET_ADDR) || !defined(BOOT_RESET_SIZE)
+#error "BOOT_RESET_ADDR and BOOT_RESET_SIZE must be set to use BOOT_DIRTY_MAP_ADDR"
+#endif
+#endif
+
+// factory reset progress, kept in the config sector (in the app
+// settings area, which is cleared once the factory reset is complete)
+#define RESTORE_MAGIC 0x52545352
+// left in place of the magic by the app to ask for a factory reset
+#define RESET_REQUEST_MAGIC 0x51525352
+#define RESTORE_OFFSET 0x100
+#define RESTORE_MAX_SECTORS 256
+typedef struct {
+	uint32_t magic;
+	uint32_t golden;  // golden rom address, from the config before the reset
+	uint32_t working; // address of rom 0, which the golden rom is copied over
+	uint32_t size;    // bytes to copy, 0 if there is no golden rom
+	uint32_t progress[RESTORE_MAX_SECTORS]; // cleared to 0 as each sector is restored
+} restore_record;
+
 // RTC reset reason values
 enum rst_reason {
 	REASON_DEFAULT_RST		= 0,
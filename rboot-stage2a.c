@@ -11,6 +11,41 @@
 
 #include "rboot-private.h"
 
+#ifdef BOOT_PLAN_ENABLED
+// load the sections listed in a boot plan, already verified by rboot
+usercode* NOINLINE load_plan(uint32_t readpos) {
+
+	uint8_t sectcurrent;
+	uint8_t *writepos;
+	uint32_t remaining;
+
+	rboot_plan plan;
+
+	// read the plan
+	SPIRead(readpos, &plan, sizeof(rboot_plan));
+
+	for (sectcurrent = 0; sectcurrent < plan.count; sectcurrent++) {
+
+		readpos = plan.sections[sectcurrent].flash;
+		writepos = (uint8_t*)plan.sections[sectcurrent].address;
+		remaining = plan.sections[sectcurrent].length;
+
+		// checksum only section (irom), not loaded
+		if (writepos == 0) continue;
+
+		while (remaining > 0) {
+			uint32_t readlen = (remaining < READ_SIZE) ? remaining : READ_SIZE;
+			SPIRead(readpos, writepos, readlen);
+			readpos += readlen;
+			writepos += readlen;
+			remaining -= readlen;
+		}
+	}
+
+	return (void*)((rom_header*)plan.header)->entry;
+}
+#endif
+
 usercode* NOINLINE load_rom(uint32_t readpos) {
 	
 	uint8_t sectcount;
@@ -20,13 +55,19 @@ usercode* NOINLINE load_rom(uint32_t readpos) {
 	
 	rom_header header;
 	section_header section;
+
+#ifdef BOOT_PLAN_ENABLED
+	if (readpos & BOOT_PLAN_FLAG) {
+		return load_plan(readpos & ~BOOT_PLAN_FLAG);
+	}
+#endif
 	
 	// read rom header
 	SPIRead(readpos, &header, sizeof(rom_header));
 	readpos += sizeof(rom_header);
 
 	// create function pointer for entry point
-	usercode = header.entry;
+	usercode = (void*)header.entry;
 	
 	// copy all the sections
 	for (sectcount = header.count; sectcount > 0; sectcount--) {
@@ -36,7 +77,7 @@ usercode* NOINLINE load_rom(uint32_t readpos) {
 		readpos += sizeof(section_header);
 
 		// get section address and length
-		writepos = section.address;
+		writepos = (uint8_t*)section.address;
 		remaining = section.length;
 		
 		while (remaining > 0) {
@@ -48,7 +48,68 @@ static inline void led_blink(int count, int delay_ms) {
     }
 }
 
-static uint32_t check_image(uint32_t readpos) {
+// read from flash, reads smaller than a cache line are served from the
+// cache (refilling it as needed), larger reads go straight to the flash
+static uint32_t flash_read(flash_cache *cache, uint32_t addr, void *outptr, uint32_t len) {
+
+	uint8_t *out = (uint8_t*)outptr;
+	uint32_t linepos;
+	uint32_t copylen;
+
+	if (len >= CACHE_LINE_SIZE) {
+		return SPIRead(addr, outptr, len);
+	}
+
+	while (len > 0) {
+		linepos = addr & (CACHE_LINE_SIZE - 1);
+		if (cache->addr != addr - linepos) {
+			// miss, fill the aligned line containing addr
+			cache->addr = addr - linepos;
+			if (SPIRead(cache->addr, cache->data, CACHE_LINE_SIZE) != 0) {
+				cache->addr = 0xffffffff;
+				return 1;
+			}
+		}
+		// copy what we can from this line, a read that
+		// straddles two lines will loop round for the rest
+		copylen = CACHE_LINE_SIZE - linepos;
+		if (copylen > len) copylen = len;
+		ets_memcpy(out, cache->data + linepos, copylen);
+		out += copylen;
+		addr += copylen;
+		len -= copylen;
+	}
+
+	return 0;
+}
+
+// erase and write must go through these so the cache is never stale
+static uint32_t flash_erase_sector(flash_cache *cache, int sector) {
+	cache->addr = 0xffffffff;
+	return SPIEraseSector(sector);
+}
+
+static uint32_t flash_write(flash_cache *cache, uint32_t addr, void *inptr, uint32_t len) {
+	cache->addr = 0xffffffff;
+	return SPIWrite(addr, inptr, len);
+}
+
+// check a section will be loaded entirely within iram or dram
+static uint8_t check_dest(uint32_t addr, uint32_t len) {
+	if (addr >= IRAM_START && addr <= IRAM_END) {
+		return (len <= IRAM_END - addr);
+	}
+	if (addr >= DRAM_START && addr <= DRAM_END) {
+		return (len <= DRAM_END - addr);
+	}
+	return 0;
+}
+
+// check the rom at readpos, nothing past slotend will be read so
+// corrupt headers can't make us read more than the slot size, irom
+// is the recorded checksum of the irom section to use instead of
+// reading it (BOOT_IROM_DEFERRED), or -1
+static uint32_t check_image(flash_cache *cache, uint32_t readpos, uint32_t slotend, int16_t irom) {
 
 	uint8_t buffer[BUFFER_SIZE];
 	uint8_t sectcount;
@@ -61,12 +122,13 @@ static uint32_t check_image(uint32_t readpos) {
 	rom_header_new *header = (rom_header_new*)buffer;
 	section_header *section = (section_header*)buffer;
 
-	if (readpos == 0 || readpos == 0xffffffff) {
+	if (readpos == 0 || readpos == 0xffffffff || readpos >= slotend
+		|| slotend - readpos <= sizeof(rom_header_new)) {
 		return 0;
 	}
 
 	// read rom header
-	if (SPIRead(readpos, header, sizeof(rom_header_new)) != 0) {
+	if (flash_read(cache, readpos, header, sizeof(rom_header_new)) != 0) {
 		return 0;
 	}
 
@@ -78,6 +140,9 @@ static uint32_t check_image(uint32_t readpos) {
 		sectcount = header->count;
 	} else if (header->magic == ROM_MAGIC_NEW1 && header->count == ROM_MAGIC_NEW2) {
 		// new type, has extra header and irom section first
+		if (header->len >= slotend - readpos - sizeof(rom_header_new)) {
+			return 0;
+		}
 		romaddr = readpos + header->len + sizeof(rom_header_new);
 #ifdef BOOT_IROM_CHKSUM
 		// we will set the real section count later, when we read the header
@@ -89,7 +154,8 @@ static uint32_t check_image(uint32_t readpos) {
 		// skip the extra header and irom section
 		readpos = romaddr;
 		// read the normal header that follows
-		if (SPIRead(readpos, header, sizeof(rom_header)) != 0) {
+		if (slotend - readpos <= sizeof(rom_header)
+			|| flash_read(cache, readpos, header, sizeof(rom_header)) != 0) {
 			return 0;
 		}
 		sectcount = header->count;
@@ -103,19 +169,41 @@ static uint32_t check_image(uint32_t readpos) {
 	for (sectcurrent = 0; sectcurrent < sectcount; sectcurrent++) {
 
 		// read section header
-		if (SPIRead(readpos, section, sizeof(section_header)) != 0) {
+		if (slotend - readpos <= sizeof(section_header)
+			|| flash_read(cache, readpos, section, sizeof(section_header)) != 0) {
 			return 0;
 		}
 		readpos += sizeof(section_header);
 
+		// section must fit in the slot, leaving room for the
+		// checksum, and (unless it's irom) be loaded into ram
+		if (section->length >= slotend - readpos
+#ifdef BOOT_IROM_CHKSUM
+			|| (sectcount != 0xff && !check_dest(section->address, section->length))
+#else
+			|| !check_dest(section->address, section->length)
+#endif
+			) {
+			return 0;
+		}
+
 		// get section address and length
 		remaining = section->length;
 
+#ifdef BOOT_IROM_DEFERRED
+		if (sectcount == 0xff && irom >= 0) {
+			// leave the irom to the app, use the checksum it recorded
+			chksum ^= (uint8_t)irom;
+			readpos += remaining;
+			remaining = 0;
+		}
+#endif
+
 		while (remaining > 0) {
 			// work out how much to read, up to BUFFER_SIZE
 			uint32_t readlen = (remaining < BUFFER_SIZE) ? remaining : BUFFER_SIZE;
 			// read the block
-			if (SPIRead(readpos, buffer, readlen) != 0) {
+			if (flash_read(cache, readpos, buffer, readlen) != 0) {
 				return 0;
 			}
 			// increment next read position
@@ -132,7 +220,8 @@ static uint32_t check_image(uint32_t readpos) {
 		if (sectcount == 0xff) {
 			// just processed the irom section, now
 			// read the normal header that follows
-			if (SPIRead(readpos, header, sizeof(rom_header)) != 0) {
+			if (slotend - readpos <= sizeof(rom_header)
+				|| flash_read(cache, readpos, header, sizeof(rom_header)) != 0) {
 				return 0;
 			}
 			sectcount = header->count + 1;
@@ -143,7 +232,7 @@ static uint32_t check_image(uint32_t readpos) {
 
 	// round up to next 16 and get checksum
 	readpos = readpos | 0x0f;
-	if (SPIRead(readpos, buffer, 1) != 0) {
+	if (flash_read(cache, readpos, buffer, 1) != 0) {
 		return 0;
 	}
 
@@ -219,7 +308,8 @@ static int get_gpio(int gpio_num) {
 
 // return '1' if we should do a gpio boot
 static int perform_gpio_boot(rboot_config *romconf) {
-	if (romconf->mode & MODE_GPIO_ROM == 0) {
+	// the pin is only looked at when the config asks for a gpio mode
+	if ((romconf->mode & (MODE_GPIO_ROM | MODE_GPIO_SKIP)) == 0) {
 		return 0;
 	}
 
@@ -233,7 +323,7 @@ static int perform_gpio_boot(rboot_config *romconf) {
 
 #endif
 
-#ifdef BOOT_RTC_ENABLED
+#if defined(BOOT_RTC_ENABLED) || defined(BOOT_BIG_FLASH)
 uint32_t system_rtc_mem(int32_t addr, void *buff, int32_t length, uint32_t mode) {
 
     int32_t blocks;
@@ -264,7 +354,7 @@ uint32_t system_rtc_mem(int32_t addr, void *buff, int32_t length, uint32_t mode)
 }
 #endif
 
-#ifdef BOOT_BAUDRATE
+#if defined(BOOT_BAUDRATE) || defined(BOOT_HISTORY_ADDR)
 static enum rst_reason get_reset_reason(void) {
 
 	// reset reason is stored @ offset 0 in system rtc memory
@@ -274,7 +364,9 @@ static enum rst_reason get_reset_reason(void) {
 }
 #endif
 
-#if defined(BOOT_CONFIG_CHKSUM) || defined(BOOT_RTC_ENABLED)
+#if defined(BOOT_CONFIG_CHKSUM) || defined(BOOT_RTC_ENABLED) || defined(BOOT_PLAN_ENABLED) \
+	|| defined(BOOT_INSTALL_ENABLED) || defined(BOOT_PARTITIONS) || defined(BOOT_HISTORY_ADDR) \
+	|| defined(BOOT_BIG_FLASH)
 // calculate checksum for block of data
 // from start up to (but excluding) end
 static uint8_t calc_chksum(uint8_t *start, uint8_t *end) {
@@ -287,6 +379,352 @@ static uint8_t calc_chksum(uint8_t *start, uint8_t *end) {
 }
 #endif
 
+#ifdef BOOT_PARTITIONS
+// check the partition table in the config sector is present and intact
+static uint8_t check_part_table(rboot_part_table *table) {
+	uint8_t loop;
+	if (table->magic != BOOT_PART_MAGIC || table->count > BOOT_PART_MAX
+		|| table->chksum != calc_chksum((uint8_t*)table->parts, (uint8_t*)(table + 1))) {
+		return 0;
+	}
+	for (loop = 0; loop < table->count; loop++) {
+		if (table->by_type[loop] >= table->count) return 0;
+	}
+	return 1;
+}
+
+// erase all partitions of a type, found by binary search of the type index
+static void erase_part_type(flash_cache *cache, rboot_part_table *table, uint8_t type, uint32_t flashsize) {
+	rboot_partition *part;
+	uint32_t sec;
+	uint8_t low = 0;
+	uint8_t high = table->count;
+	uint8_t mid;
+
+	// first partition of this type
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (table->parts[table->by_type[mid]].type < type) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+
+	for (; low < table->count; low++) {
+		part = &table->parts[table->by_type[low]];
+		if (part->type != type) break;
+		// never the boot loader or config
+		for (sec = part->offset / SECTOR_SIZE; sec < (part->offset + part->size) / SECTOR_SIZE
+			&& sec < flashsize / SECTOR_SIZE; sec++) {
+			if (sec > BOOT_CONFIG_SECTOR) {
+				flash_erase_sector(cache, sec);
+			}
+		}
+	}
+}
+#endif
+
+#ifdef BOOT_PLAN_ENABLED
+
+#if MAX_ROMS > 16
+#error "Too many roms to store boot plans in the config sector (disable BOOT_PLAN_ENABLED)"
+#endif
+
+// check a boot plan still describes the rom in its slot and verify
+// the rom checksum using the plan, without reading any section headers,
+// irom is as for check_image
+static uint32_t check_plan(flash_cache *cache, rboot_plan *plan, uint32_t romaddr, uint32_t slotend, int16_t irom) {
+
+	uint8_t buffer[BUFFER_SIZE];
+	uint32_t *header = (uint32_t*)buffer;
+	uint8_t chksum = CHKSUM_INIT;
+	uint32_t digest = DIGEST_INIT;
+	uint8_t sectcurrent;
+	uint32_t loop;
+	uint32_t readpos;
+	uint32_t remaining;
+
+	if (plan->magic != BOOT_PLAN_MAGIC || plan->rom_addr != romaddr
+		|| plan->count == 0 || plan->count > BOOT_PLAN_MAX_SECTIONS
+		|| plan->chksum != calc_chksum((uint8_t*)plan, (uint8_t*)&plan->chksum)) {
+		return 0;
+	}
+
+	// the load header must be unchanged
+	if (plan->load_addr < romaddr || plan->load_addr >= slotend
+		|| flash_read(cache, plan->load_addr, header, sizeof(rom_header)) != 0
+		|| header[0] != plan->header[0] || header[1] != plan->header[1]) {
+		return 0;
+	}
+
+	for (sectcurrent = 0; sectcurrent < plan->count; sectcurrent++) {
+		readpos = plan->sections[sectcurrent].flash;
+		remaining = plan->sections[sectcurrent].length;
+		// same bounds as check_image, irom (address 0) is not loaded
+		if (readpos < romaddr || readpos >= slotend || remaining >= slotend - readpos
+			|| (plan->sections[sectcurrent].address != 0
+				&& !check_dest(plan->sections[sectcurrent].address, remaining))) {
+			return 0;
+		}
+#ifdef BOOT_IROM_DEFERRED
+		if (plan->sections[sectcurrent].address == 0 && irom >= 0) {
+			chksum ^= (uint8_t)irom;
+			readpos += remaining;
+			remaining = 0;
+			irom = -1;
+		}
+#endif
+		while (remaining > 0) {
+			uint32_t readlen = (remaining < BUFFER_SIZE) ? remaining : BUFFER_SIZE;
+			if (flash_read(cache, readpos, buffer, readlen) != 0) {
+				return 0;
+			}
+			readpos += readlen;
+			remaining -= readlen;
+			for (loop = 0; loop < readlen; loop++) {
+				chksum ^= buffer[loop];
+			}
+			// the xor alone misses swapped or paired changes in what is loaded
+			if (plan->sections[sectcurrent].address != 0) {
+				for (loop = 0; loop < readlen; loop++) {
+					digest = (digest ^ buffer[loop]) * DIGEST_PRIME;
+				}
+			}
+		}
+	}
+
+	// stored checksum follows the last section, as for check_image
+	readpos = readpos | 0x0f;
+	if (flash_read(cache, readpos, buffer, 1) != 0) {
+		return 0;
+	}
+
+	if (buffer[0] != chksum || chksum != plan->rom_chksum || digest != plan->digest) {
+		return 0;
+	}
+
+	return plan->load_addr;
+}
+#endif
+
+#ifdef BOOT_IROM_DEFERRED
+
+#ifndef BOOT_IROM_CHKSUM
+#error "BOOT_IROM_DEFERRED needs BOOT_IROM_CHKSUM"
+#endif
+#if MAX_ROMS > 16
+#error "Too many roms to record irom checksums for (disable BOOT_IROM_DEFERRED)"
+#endif
+
+// the irom checksum recorded for a rom in the slot metadata, or -1
+static int16_t get_irom_chksum(uint8_t *confsect, int32_t rom) {
+
+	rboot_slot_meta *meta = (rboot_slot_meta*)(confsect + BOOT_SLOT_META_OFFSET);
+
+	if (meta->magic == BOOT_SLOT_META_MAGIC && (meta->irom_valid & (1 << rom))) {
+		return meta->irom_chksum[rom];
+	}
+	return -1;
+}
+#endif
+
+// check the rom in the given slot, if it has a valid boot plan return
+// the (flagged) plan address for stage2a, else check it the long way
+static uint32_t check_rom(flash_cache *cache, uint8_t *confsect, int32_t rom, uint32_t flashsize) {
+
+	rboot_config *romconf = (rboot_config*)confsect;
+	uint32_t slotend = get_slot_end(romconf, rom, flashsize);
+	uint32_t loadaddr;
+#ifdef BOOT_IROM_DEFERRED
+	int16_t irom = get_irom_chksum(confsect, rom);
+#else
+	int16_t irom = -1;
+#endif
+
+#ifdef BOOT_PLAN_ENABLED
+	if (check_plan(cache, (rboot_plan*)(confsect + BOOT_PLAN_OFFSET(rom)), romconf->roms[rom], slotend, irom) != 0) {
+		ets_printf("Using boot plan for rom %d.\r\n", rom);
+		return (BOOT_CONFIG_SECTOR * SECTOR_SIZE + BOOT_PLAN_OFFSET(rom)) | BOOT_PLAN_FLAG;
+	}
+#endif
+
+	loadaddr = check_image(cache, romconf->roms[rom], slotend, irom);
+	if (loadaddr == 0 && irom >= 0) {
+		// the recorded irom checksum may be stale, check it all
+		loadaddr = check_image(cache, romconf->roms[rom], slotend, -1);
+	}
+	return loadaddr;
+}
+
+#ifdef BOOT_INSTALL_ENABLED
+
+#ifndef BOOT_STAGING_ADDR
+#error "BOOT_STAGING_ADDR must be set to use BOOT_INSTALL_ENABLED"
+#endif
+
+// unpack one block of a packed rom, see rboot_install in rboot.h for the
+// format, back references are only within the block so the sector being
+// unpacked is the only memory needed, returns 0 if the block is bad
+static uint8_t unpack_block(flash_cache *cache, uint32_t readpos, uint32_t packedlen, uint8_t *out, uint32_t outlen) {
+
+	uint32_t readend = readpos + packedlen;
+	uint32_t outpos = 0;
+	uint32_t offset;
+	uint32_t len;
+	uint32_t loop;
+	uint8_t token[3];
+
+	// stored block
+	if (packedlen == outlen) {
+		return (flash_read(cache, readpos, out, outlen) == 0);
+	}
+
+	while (readpos < readend) {
+		if (flash_read(cache, readpos, token, 1) != 0) {
+			return 0;
+		}
+		readpos++;
+		if (token[0] < 0x80) {
+			// literal run
+			len = token[0] + 1;
+			if (len > outlen - outpos || len > readend - readpos
+				|| flash_read(cache, readpos, out + outpos, len) != 0) {
+				return 0;
+			}
+			readpos += len;
+		} else {
+			// copy from earlier in the block, may overlap
+			len = (token[0] & 0x7f) + 3;
+			if (readend - readpos < 2 || flash_read(cache, readpos, token + 1, 2) != 0) {
+				return 0;
+			}
+			readpos += 2;
+			offset = token[1] | (token[2] << 8);
+			if (offset == 0 || offset > outpos || len > outlen - outpos) {
+				return 0;
+			}
+			for (loop = 0; loop < len; loop++) {
+				out[outpos + loop] = out[outpos - offset + loop];
+			}
+		}
+		outpos += len;
+	}
+
+	return (outpos == outlen);
+}
+
+// unpack each sector of a packed rom from the staging area in to the
+// slot at romaddr, skipping sectors already marked as done in progress
+static uint8_t install_rom(flash_cache *cache, uint8_t *buffer, uint32_t progaddr,
+	uint32_t romaddr, uint32_t imagelen, uint32_t packedlen) {
+
+	uint32_t readpos = BOOT_STAGING_ADDR + SECTOR_SIZE;
+	uint32_t readend = readpos + packedlen;
+	uint32_t sector;
+	uint32_t progress;
+	uint32_t blockhdr;
+	uint32_t outlen;
+
+	for (sector = 0; sector * SECTOR_SIZE < imagelen; sector++) {
+
+		// block header is packed length and unpacked length
+		if (readpos >= readend || readend - readpos < sizeof(blockhdr)
+			|| flash_read(cache, readpos, &blockhdr, sizeof(blockhdr)) != 0) {
+			return 0;
+		}
+		readpos += sizeof(blockhdr);
+
+		outlen = imagelen - (sector * SECTOR_SIZE);
+		if (outlen > SECTOR_SIZE) outlen = SECTOR_SIZE;
+		if ((blockhdr >> 16) != outlen || (blockhdr & 0xffff) > readend - readpos) {
+			return 0;
+		}
+
+		if (flash_read(cache, progaddr + (sector * sizeof(progress)), &progress, sizeof(progress)) != 0) {
+			return 0;
+		}
+		if (progress != 0) {
+			// not installed yet, or interrupted part way through
+			ets_memset(buffer, 0xff, SECTOR_SIZE);
+			if (!unpack_block(cache, readpos, blockhdr & 0xffff, buffer, outlen)) {
+				return 0;
+			}
+			flash_erase_sector(cache, (romaddr / SECTOR_SIZE) + sector);
+			flash_write(cache, romaddr + (sector * SECTOR_SIZE), buffer, (outlen + 3) & ~3);
+			// mark done, clearing bits needs no erase
+			progress = 0;
+			flash_write(cache, progaddr + (sector * sizeof(progress)), &progress, sizeof(progress));
+		}
+
+		// packed blocks are padded to 4 bytes
+		readpos += ((blockhdr & 0xffff) + 3) & ~3;
+	}
+
+	return 1;
+}
+
+// clear the magic so the install isn't attempted again, after a successful
+// install only once the config selecting the new rom has been written, as
+// until then a power cut could lose that (repeating the install is cheap,
+// the progress words show every sector is done)
+static void clear_install(flash_cache *cache) {
+	uint32_t zero = 0;
+	flash_write(cache, BOOT_STAGING_ADDR, &zero, sizeof(zero));
+}
+
+// install (or finish installing) a pending packed rom from the staging area,
+// romconf is the (valid) config in buffer, which is used to unpack each sector
+// in to and read back afterward, returns the rom installed or -1 if no install
+// was pending (or it failed)
+static int32_t perform_install(flash_cache *cache, uint8_t *buffer, uint32_t flashsize) {
+
+	uint32_t record[4];
+	rboot_install *install = (rboot_install*)record;
+	rboot_config *romconf = (rboot_config*)buffer;
+	uint32_t progaddr = BOOT_STAGING_ADDR + ((uint8_t*)install->progress - (uint8_t*)install);
+	uint32_t romaddr;
+	uint32_t slotend;
+	uint32_t imagelen;
+	uint32_t packedlen;
+	int32_t rom;
+
+	// read the record, up to the progress words
+	if (flash_read(cache, BOOT_STAGING_ADDR, install, progaddr - BOOT_STAGING_ADDR) != 0
+		|| install->magic != BOOT_INSTALL_MAGIC
+		|| install->chksum != calc_chksum(&install->target_rom, &install->chksum)) {
+		return -1;
+	}
+	rom = install->target_rom;
+	imagelen = install->image_len;
+	packedlen = install->packed_len;
+
+	ets_printf("Installing rom %d from staging area.\r\n", rom);
+
+	// find the target slot
+	if (rom >= romconf->count || rom >= MAX_ROMS) {
+		rom = -1;
+	} else {
+		romaddr = romconf->roms[rom];
+		slotend = get_slot_end(romconf, rom, flashsize);
+		if (imagelen == 0 || imagelen > slotend - romaddr
+			|| imagelen > BOOT_INSTALL_MAX_SECTORS * SECTOR_SIZE
+			|| !install_rom(cache, buffer, progaddr, romaddr, imagelen, packedlen)) {
+			rom = -1;
+		}
+		// put the config back
+		flash_read(cache, BOOT_CONFIG_SECTOR * SECTOR_SIZE, buffer, SECTOR_SIZE);
+	}
+
+	if (rom < 0) {
+		ets_printf("Install failed.\r\n");
+		clear_install(cache);
+	}
+
+	return rom;
+}
+#endif
+
 #ifndef BOOT_CUSTOM_DEFAULT_CONFIG
 // populate the user fields of the default config
 // created on first boot or in case of corruption
@@ -303,6 +741,258 @@ static uint8_t default_config(rboot_config *romconf, uint32_t flashsize) {
 }
 #endif
 
+// check the config in the buffer is valid for this version of rBoot
+static uint8_t check_config(rboot_config *romconf) {
+	return (romconf->magic == BOOT_CONFIG_MAGIC && romconf->version == BOOT_CONFIG_VERSION
+#ifdef BOOT_CONFIG_CHKSUM
+		&& romconf->chksum == calc_chksum((uint8_t*)romconf, (uint8_t*)&romconf->chksum)
+#endif
+		);
+}
+
+// write the config sector from the buffer, then with a journal clear
+// the copy there now it is no longer needed
+static void commit_config(flash_cache *cache, uint8_t *buffer) {
+#ifdef BOOT_CONFIG_JOURNAL_ADDR
+	uint32_t zero = 0;
+#endif
+
+	flash_erase_sector(cache, BOOT_CONFIG_SECTOR);
+	flash_write(cache, BOOT_CONFIG_SECTOR * SECTOR_SIZE, buffer, SECTOR_SIZE);
+#ifdef BOOT_CONFIG_JOURNAL_ADDR
+	flash_write(cache, BOOT_CONFIG_JOURNAL_ADDR, &zero, sizeof(zero));
+#endif
+}
+
+// write the config sector from the buffer, with a journal the first word
+// (holding the config magic) is written last so a copy there is only
+// valid once it is complete
+static void write_config(flash_cache *cache, uint8_t *buffer) {
+#ifdef BOOT_CONFIG_JOURNAL_ADDR
+	flash_erase_sector(cache, BOOT_CONFIG_JOURNAL_ADDR / SECTOR_SIZE);
+	flash_write(cache, BOOT_CONFIG_JOURNAL_ADDR + sizeof(uint32_t),
+		buffer + sizeof(uint32_t), SECTOR_SIZE - sizeof(uint32_t));
+	flash_write(cache, BOOT_CONFIG_JOURNAL_ADDR, buffer, sizeof(uint32_t));
+#endif
+	commit_config(cache, buffer);
+}
+
+#ifdef BOOT_GOLDEN_ROM
+// compare a sector of the working rom with the golden rom
+static uint8_t sector_matches(flash_cache *cache, uint32_t golden, uint32_t working) {
+	uint8_t gbuf[BUFFER_SIZE] __attribute__((aligned(4)));
+	uint8_t wbuf[BUFFER_SIZE] __attribute__((aligned(4)));
+	uint32_t pos;
+
+	for (pos = 0; pos < SECTOR_SIZE; pos += BUFFER_SIZE) {
+		flash_read(cache, golden + pos, gbuf, BUFFER_SIZE);
+		flash_read(cache, working + pos, wbuf, BUFFER_SIZE);
+		if (ets_memcmp(gbuf, wbuf, BUFFER_SIZE) != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// note the golden rom and rom 0, which it is restored over, in the
+// restore record, so a resumed restore copies the same slots
+static void plan_golden_restore(rboot_config *romconf, restore_record *restore, uint32_t flashsize) {
+	uint32_t golden_end;
+
+	restore->size = 0;
+	if (BOOT_GOLDEN_ROM >= romconf->count || romconf->count > MAX_ROMS) {
+		return;
+	}
+	restore->golden = romconf->roms[BOOT_GOLDEN_ROM];
+	restore->working = romconf->roms[0];
+
+	// copy as much as fits in both slots
+	restore->size = get_slot_end(romconf, 0, flashsize) - restore->working;
+	golden_end = get_slot_end(romconf, BOOT_GOLDEN_ROM, flashsize);
+	if (golden_end - restore->golden < restore->size) {
+		restore->size = golden_end - restore->golden;
+	}
+}
+
+// restore the golden rom over rom 0 sector by sector, only erasing and
+// copying sectors that differ, each finished sector is checkpointed by
+// clearing its progress word (no erase needed) so a restore interrupted
+// by a power cut resumes where it left off
+static void restore_golden_rom(flash_cache *cache, restore_record *restore) {
+	uint8_t buf[BUFFER_SIZE] __attribute__((aligned(4)));
+	uint32_t progaddr = BOOT_CONFIG_SECTOR * SECTOR_SIZE + RESTORE_OFFSET
+		+ ((uint8_t*)restore->progress - (uint8_t*)restore);
+	uint32_t golden, working;
+	uint32_t sector;
+	uint32_t pos;
+	uint32_t done = 0;
+
+	for (sector = 0; sector < restore->size / SECTOR_SIZE && sector < RESTORE_MAX_SECTORS; sector++) {
+		if (restore->progress[sector] == 0) {
+			continue;
+		}
+		golden = restore->golden + sector * SECTOR_SIZE;
+		working = restore->working + sector * SECTOR_SIZE;
+		if (!sector_matches(cache, golden, working)) {
+			flash_erase_sector(cache, working / SECTOR_SIZE);
+			for (pos = 0; pos < SECTOR_SIZE; pos += BUFFER_SIZE) {
+				flash_read(cache, golden + pos, buf, BUFFER_SIZE);
+				flash_write(cache, working + pos, buf, BUFFER_SIZE);
+			}
+		}
+		flash_write(cache, progaddr + sector * sizeof(done), &done, sizeof(done));
+	}
+}
+#endif
+
+#ifdef BOOT_DIRTY_MAP_ADDR
+// erase the sectors of the reset region marked as written in the dirty
+// map (all of them if the map isn't armed yet), then re-arm the map, a
+// power cut part way through erases them again on the resumed reset
+static void erase_dirty_sectors(flash_cache *cache) {
+	uint32_t first = BOOT_RESET_ADDR / SECTOR_SIZE;
+	uint32_t sector;
+	uint32_t bits = 0;
+	uint32_t magic;
+
+	flash_read(cache, BOOT_DIRTY_MAP_ADDR, &magic, sizeof(magic));
+	for (sector = 0; sector < BOOT_RESET_SIZE / SECTOR_SIZE; sector++) {
+		if ((sector % 32) == 0 && magic == DIRTY_MAP_MAGIC) {
+			flash_read(cache, BOOT_DIRTY_MAP_ADDR + sizeof(magic) + (sector / 32) * sizeof(bits),
+				&bits, sizeof(bits));
+		}
+		// cleared bit, the sector has been written
+		if ((bits & (1 << (sector % 32))) == 0) {
+			flash_erase_sector(cache, first + sector);
+		}
+	}
+
+	magic = DIRTY_MAP_MAGIC;
+	flash_erase_sector(cache, BOOT_DIRTY_MAP_ADDR / SECTOR_SIZE);
+	flash_write(cache, BOOT_DIRTY_MAP_ADDR, &magic, sizeof(magic));
+}
+#endif
+
+#ifdef BOOT_RESET_RESUME
+// factory reset, requested by the app or resumed after a power cut, the
+// config returns to the default (keeping the rom slots, slot wear and
+// partition table, which describe the flash rather than settings) and the
+// rest of the sector, the app settings area, is cleared, a restore record
+// there tracks the rest of the work until it is complete
+static void factory_reset(flash_cache *cache, uint8_t *buffer, uint32_t flashsize) {
+	rboot_config *romconf = (rboot_config*)buffer;
+	restore_record *restore = (restore_record*)(buffer + RESTORE_OFFSET);
+	rboot_slot_meta *meta = (rboot_slot_meta*)(buffer + BOOT_SLOT_META_OFFSET);
+	uint32_t roms[MAX_ROMS];
+	uint8_t count;
+
+	if (restore->magic != RESTORE_MAGIC) {
+		ets_printf("Factory reset.\r\n");
+		count = romconf->count;
+		ets_memcpy(roms, romconf->roms, sizeof(roms));
+#ifdef BOOT_PARTITIONS
+		ets_memset(buffer, 0xff, BOOT_PART_TABLE_OFFSET);
+#else
+		ets_memset(buffer, 0xff, BOOT_SLOT_META_OFFSET);
+#endif
+		// boot plans too, rom 0 may be about to change
+		ets_memset(meta + 1, 0xff, SECTOR_SIZE - BOOT_SLOT_META_OFFSET - sizeof(rboot_slot_meta));
+		if (meta->magic == BOOT_SLOT_META_MAGIC) {
+			meta->fallback_rom = 0xff;
+		} else {
+			ets_memset(meta, 0xff, sizeof(rboot_slot_meta));
+		}
+
+		ets_memset(romconf, 0x00, sizeof(rboot_config));
+		romconf->magic = BOOT_CONFIG_MAGIC;
+		romconf->version = BOOT_CONFIG_VERSION;
+		default_config(romconf, flashsize);
+		if (count > 0 && count <= MAX_ROMS) {
+			romconf->count = count;
+			ets_memcpy(romconf->roms, roms, sizeof(roms));
+		}
+#ifdef BOOT_CONFIG_CHKSUM
+		romconf->chksum = calc_chksum((uint8_t*)romconf, (uint8_t*)&romconf->chksum);
+#endif
+
+		restore->magic = RESTORE_MAGIC;
+#ifdef BOOT_GOLDEN_ROM
+		plan_golden_restore(romconf, restore, flashsize);
+#endif
+		write_config(cache, buffer);
+	} else {
+		ets_printf("Resuming factory reset.\r\n");
+	}
+
+#ifdef BOOT_DIRTY_MAP_ADDR
+	erase_dirty_sectors(cache);
+#endif
+#ifdef BOOT_GOLDEN_ROM
+	restore_golden_rom(cache, restore);
+#endif
+
+	// complete, remove the record
+	ets_memset(restore, 0xff, sizeof(restore_record));
+	write_config(cache, buffer);
+}
+#endif
+
+#ifdef BOOT_HISTORY_ADDR
+// free running microsecond timer (the one system_get_time reads)
+#define TIMER_US (*(volatile uint32_t*)0x3ff20c00)
+
+// add an entry to the boot history, the sector in use is the one started
+// last and fills from the start, so a binary search finds the first free
+// entry in it, and only when it is full is the other sector erased
+static void write_history(flash_cache *cache, rboot_history_entry *entry, int32_t rom) {
+	rboot_history_entry first[2];
+	uint32_t base;
+	uint32_t count;
+	uint32_t low, high, mid;
+	uint8_t sec;
+
+	for (sec = 0; sec < 2; sec++) {
+		flash_read(cache, BOOT_HISTORY_ADDR + (sec * SECTOR_SIZE), &first[sec], sizeof(rboot_history_entry));
+		if (first[sec].chksum != calc_chksum((uint8_t*)&first[sec], &first[sec].chksum)) {
+			first[sec].count = 0;
+		}
+	}
+	sec = (first[1].count > first[0].count) ? 1 : 0;
+	base = BOOT_HISTORY_ADDR + (sec * SECTOR_SIZE);
+
+	if (first[sec].count == 0) {
+		// new log (or neither sector started cleanly)
+		entry->count = 1;
+		flash_erase_sector(cache, base / SECTOR_SIZE);
+	} else {
+		low = 1;
+		high = BOOT_HISTORY_ENTRIES;
+		while (low < high) {
+			mid = (low + high) / 2;
+			flash_read(cache, base + (mid * sizeof(rboot_history_entry)), &count, sizeof(count));
+			if (count == 0xffffffff) {
+				high = mid;
+			} else {
+				low = mid + 1;
+			}
+		}
+		// entries in a sector are consecutive boots, so the count
+		// follows even if the last one was only partly written
+		entry->count = first[sec].count + low;
+		if (low == BOOT_HISTORY_ENTRIES) {
+			base = BOOT_HISTORY_ADDR + ((sec ^ 1) * SECTOR_SIZE);
+			flash_erase_sector(cache, base / SECTOR_SIZE);
+		} else {
+			base += low * sizeof(rboot_history_entry);
+		}
+	}
+
+	entry->rom = (rom < 0) ? 0xff : rom;
+	entry->chksum = calc_chksum((uint8_t*)entry, &entry->chksum);
+	flash_write(cache, base, entry, sizeof(rboot_history_entry));
+}
+#endif
+
 // prevent this function being placed inline with main
 // to keep main's stack size as small as possible
 // don't mark as static or it'll be optimised out when
@@ -315,6 +1005,7 @@ uint32_t NOINLINE find_image(void) {
 	int32_t romToBoot;
 	uint8_t updateConfig = 0;
 	uint8_t buffer[SECTOR_SIZE];
+	flash_cache cache;
 #ifdef BOOT_GPIO_ENABLED
 	uint8_t gpio_boot = 0;
 #endif
@@ -325,6 +1016,16 @@ uint32_t NOINLINE find_image(void) {
 	rboot_rtc_data rtc;
 	uint8_t temp_boot = 0;
 #endif
+#ifdef BOOT_BIG_FLASH
+	// system_rtc_mem copies whole words
+	rboot_rtc_mmap rtc_mmap __attribute__((aligned(4)));
+#endif
+#ifdef BOOT_INSTALL_ENABLED
+	int32_t install;
+#endif
+#ifdef BOOT_HISTORY_ADDR
+	rboot_history_entry history;
+#endif
 
 	rboot_config *romconf = (rboot_config*)buffer;
 	rom_header *header = (rom_header*)buffer;
@@ -343,8 +1044,16 @@ uint32_t NOINLINE find_image(void) {
 
 	ets_printf("\r\nrBoot v1.4.2 - richardaburton@gmail.com\r\n");
 
+#ifdef BOOT_HISTORY_ADDR
+	ets_memset(&history, 0x00, sizeof(rboot_history_entry));
+	history.reset_reason = get_reset_reason();
+#endif
+
+	// nothing cached yet
+	cache.addr = 0xffffffff;
+
 	// read rom header
-	SPIRead(0, header, sizeof(rom_header));
+	flash_read(&cache, 0, header, sizeof(rom_header));
 
 	// print and get flash size
 	ets_printf("Flash Size:   ");
@@ -433,17 +1142,43 @@ uint32_t NOINLINE find_image(void) {
 #endif
 #ifdef BOOT_IROM_CHKSUM
 	ets_printf("rBoot Option: irom chksum\r\n");
+#endif
+#ifdef BOOT_IROM_DEFERRED
+	ets_printf("rBoot Option: Deferred irom check\r\n");
+#endif
+#ifdef BOOT_PLAN_ENABLED
+	ets_printf("rBoot Option: Boot plan\r\n");
+#endif
+#ifdef BOOT_INSTALL_ENABLED
+	ets_printf("rBoot Option: Install from staging (%x)\r\n", BOOT_STAGING_ADDR);
+#endif
+#ifdef BOOT_PARTITIONS
+	ets_printf("rBoot Option: Partition table\r\n");
+#endif
+#ifdef BOOT_CONFIG_JOURNAL_ADDR
+	ets_printf("rBoot Option: Config journal (%x)\r\n", BOOT_CONFIG_JOURNAL_ADDR);
+#endif
+#ifdef BOOT_HISTORY_ADDR
+	ets_printf("rBoot Option: Boot history (%x)\r\n", BOOT_HISTORY_ADDR);
+#endif
+#ifdef BOOT_GOLDEN_ROM
+	ets_printf("rBoot Option: Golden rom (%d)\r\n", BOOT_GOLDEN_ROM);
 #endif
 	ets_printf("\r\n");
 
+#ifdef BOOT_CONFIG_JOURNAL_ADDR
+	// a valid copy in the journal means a config write was interrupted
+	flash_read(&cache, BOOT_CONFIG_JOURNAL_ADDR, buffer, SECTOR_SIZE);
+	if (check_config(romconf)) {
+		ets_printf("Finishing interrupted config write.\r\n");
+		commit_config(&cache, buffer);
+	}
+#endif
+
 	// read boot config
-	SPIRead(BOOT_CONFIG_SECTOR * SECTOR_SIZE, buffer, SECTOR_SIZE);
+	flash_read(&cache, BOOT_CONFIG_SECTOR * SECTOR_SIZE, buffer, SECTOR_SIZE);
 	// fresh install or old version?
-	if (romconf->magic != BOOT_CONFIG_MAGIC || romconf->version != BOOT_CONFIG_VERSION
-#ifdef BOOT_CONFIG_CHKSUM
-		|| romconf->chksum != calc_chksum((uint8_t*)romconf, (uint8_t*)&romconf->chksum)
-#endif
-		) {
+	if (!check_config(romconf)) {
 		// create a default config for a standard 2 rom setup
 		ets_printf("Writing default boot config.\r\n");
 		ets_memset(romconf, 0x00, sizeof(rboot_config));
@@ -454,9 +1189,29 @@ uint32_t NOINLINE find_image(void) {
 		romconf->chksum = calc_chksum((uint8_t*)romconf, (uint8_t*)&romconf->chksum);
 #endif
 		// write new config sector
-		SPIEraseSector(BOOT_CONFIG_SECTOR);
-		SPIWrite(BOOT_CONFIG_SECTOR * SECTOR_SIZE, buffer, SECTOR_SIZE);
+		write_config(&cache, buffer);
+	}
+
+#ifdef BOOT_RESET_RESUME
+	// a factory reset requested by the app, or one cut short by a power cut
+	if (((restore_record*)(buffer + RESTORE_OFFSET))->magic == RESET_REQUEST_MAGIC
+		|| ((restore_record*)(buffer + RESTORE_OFFSET))->magic == RESTORE_MAGIC) {
+		factory_reset(&cache, buffer, flashsize);
 	}
+#endif
+
+#ifdef BOOT_INSTALL_ENABLED
+	// finish any pending install, a newly installed rom becomes the current rom
+	install = perform_install(&cache, buffer, flashsize);
+	if (install >= 0) {
+		romconf->current_rom = install;
+#ifdef BOOT_PLAN_ENABLED
+		// any plan was for the rom the install replaced
+		ets_memset(buffer + BOOT_PLAN_OFFSET(install), 0xff, sizeof(rboot_plan));
+#endif
+		updateConfig = 1;
+	}
+#endif
 
 	// try rom selected in the config, unless overriden by gpio/temp boot
 	romToBoot = romconf->current_rom;
@@ -473,6 +1228,9 @@ uint32_t NOINLINE find_image(void) {
 			}
 			ets_printf("Booting temp rom.\r\n");
 			temp_boot = 1;
+#ifdef BOOT_HISTORY_ADDR
+			history.mode = MODE_TEMP_ROM;
+#endif
 			romToBoot = rtc.temp_rom;
 		}
 	}
@@ -488,18 +1246,30 @@ uint32_t NOINLINE find_image(void) {
 		ets_printf("Booting GPIO-selected rom.\r\n");
 		romToBoot = romconf->gpio_rom;
 		gpio_boot = 1;
+#ifdef BOOT_HISTORY_ADDR
+		history.mode = MODE_GPIO_ROM;
+#endif
 #elif defined(BOOT_GPIO_SKIP_ENABLED)
 		romToBoot = romconf->current_rom + 1;
 		if (romToBoot >= romconf->count) {
 			romToBoot = 0;
 		}
 		romconf->current_rom = romToBoot;
+#ifdef BOOT_HISTORY_ADDR
+		history.mode = MODE_GPIO_SKIP;
+#endif
 #endif
 		updateConfig = 1;
 		if (romconf->mode & MODE_GPIO_ERASES_SDKCONFIG) {
 			ets_printf("Erasing SDK config sectors before booting.\r\n");
+#ifdef BOOT_PARTITIONS
+			if (check_part_table((rboot_part_table*)(buffer + BOOT_PART_TABLE_OFFSET))) {
+				erase_part_type(&cache, (rboot_part_table*)(buffer + BOOT_PART_TABLE_OFFSET),
+					PART_TYPE_SDKCONFIG, flashsize);
+			} else
+#endif
 			for (sec = 1; sec < 5; sec++) {
-				SPIEraseSector((flashsize / SECTOR_SIZE) - sec);
+				flash_erase_sector(&cache, (flashsize / SECTOR_SIZE) - sec);
 			}
 		}
 	}
@@ -515,13 +1285,22 @@ uint32_t NOINLINE find_image(void) {
 		updateConfig = 1;
 	}
 
+#ifdef BOOT_HISTORY_ADDR
+	history.selected_rom = romToBoot;
+	history.check_us = TIMER_US;
+#endif
+
 	// check rom is valid
-	loadAddr = check_image(romconf->roms[romToBoot]);
+	loadAddr = check_rom(&cache, buffer, romToBoot, flashsize);
 
 #ifdef BOOT_GPIO_ENABLED
 	if (gpio_boot && loadAddr == 0) {
 		// don't switch to backup for gpio-selected rom
 		ets_printf("GPIO boot rom (%d) is bad.\r\n", romToBoot);
+#ifdef BOOT_HISTORY_ADDR
+		history.check_us = TIMER_US - history.check_us;
+		write_history(&cache, &history, -1);
+#endif
 		return 0;
 	}
 #endif
@@ -533,6 +1312,10 @@ uint32_t NOINLINE find_image(void) {
 		rtc.next_mode = MODE_STANDARD;
 		rtc.chksum = calc_chksum((uint8_t*)&rtc, (uint8_t*)&rtc.chksum);
 		system_rtc_mem(RBOOT_RTC_ADDR, &rtc, sizeof(rboot_rtc_data), RBOOT_RTC_WRITE);
+#ifdef BOOT_HISTORY_ADDR
+		history.check_us = TIMER_US - history.check_us;
+		write_history(&cache, &history, -1);
+#endif
 		return 0;
 	}
 #endif
@@ -545,24 +1328,40 @@ uint32_t NOINLINE find_image(void) {
 		updateConfig = 1;
 		romToBoot--;
 		if (romToBoot < 0) romToBoot = romconf->count - 1;
+#ifdef BOOT_HISTORY_ADDR
+		history.fallbacks++;
+#endif
 		if (romToBoot == romconf->current_rom) {
 			// tried them all and all are bad!
 			ets_printf("No good rom available.\r\n");
+#ifdef BOOT_HISTORY_ADDR
+			history.check_us = TIMER_US - history.check_us;
+			write_history(&cache, &history, -1);
+#endif
 			return 0;
 		}
-		loadAddr = check_image(romconf->roms[romToBoot]);
+		loadAddr = check_rom(&cache, buffer, romToBoot, flashsize);
 	}
 
+#ifdef BOOT_HISTORY_ADDR
+	history.check_us = TIMER_US - history.check_us;
+#endif
+
 	// re-write config, if required
 	if (updateConfig) {
 		romconf->current_rom = romToBoot;
 #ifdef BOOT_CONFIG_CHKSUM
 		romconf->chksum = calc_chksum((uint8_t*)romconf, (uint8_t*)&romconf->chksum);
 #endif
-		SPIEraseSector(BOOT_CONFIG_SECTOR);
-		SPIWrite(BOOT_CONFIG_SECTOR * SECTOR_SIZE, buffer, SECTOR_SIZE);
+		write_config(&cache, buffer);
 	}
 
+#ifdef BOOT_INSTALL_ENABLED
+	if (install >= 0) {
+		clear_install(&cache);
+	}
+#endif
+
 #ifdef BOOT_RTC_ENABLED
 	// set rtc boot data for app to read
 	rtc.magic = RBOOT_RTC_MAGIC;
@@ -578,6 +1377,19 @@ uint32_t NOINLINE find_image(void) {
 	system_rtc_mem(RBOOT_RTC_ADDR, &rtc, sizeof(rboot_rtc_data), RBOOT_RTC_WRITE);
 #endif
 
+#ifdef BOOT_BIG_FLASH
+	// tell Cache_Read_Enable_New which block to map for the
+	// rom actually being booted, so it needn't work it out
+	rtc_mmap.magic = RBOOT_MMAP_MAGIC;
+	rtc_mmap.block = romconf->roms[romToBoot] / 0x100000;
+	rtc_mmap.chksum = calc_chksum((uint8_t*)&rtc_mmap, &rtc_mmap.chksum);
+	system_rtc_mem(RBOOT_RTC_MMAP_ADDR, &rtc_mmap, sizeof(rboot_rtc_mmap), RBOOT_RTC_WRITE);
+#endif
+
+#ifdef BOOT_HISTORY_ADDR
+	write_history(&cache, &history, romToBoot);
+#endif
+
 	ets_printf("Booting rom %d at %x, load addr %x.\r\n", romToBoot, romconf->roms[romToBoot], loadAddr);
 	// copy the loader to top of iram
 	ets_memcpy((void*)_text_addr, _text_data, _text_len);
@@ -595,6 +1407,9 @@ void call_user_start(void) {
 
 	addr = find_image();
 	if (addr != 0) {
+		loader = (stage2a*)entry_addr;
+		loader(addr);
+	}
 }
 
 #else
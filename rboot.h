@@ -51,6 +51,53 @@ extern "C" {
 // roms must be built with esptool2 using -iromchksum option
 //#define BOOT_IROM_CHKSUM
 
+// uncomment (with BOOT_IROM_CHKSUM) to only check the ram sections at
+// boot, using the irom checksum recorded for the rom when it was written
+// or last checked, the app then checks the irom in the background with
+// rboot_ota_irom_verify_begin/_poll
+//#define BOOT_IROM_DEFERRED
+
+// uncomment to allow roms to be verified & loaded from a precomputed
+// boot plan (written by the app) instead of walking the rom headers,
+// plans are stored at the end of the config sector
+//#define BOOT_PLAN_ENABLED
+
+// uncomment to enable installing packed (compressed) roms from a
+// staging area, rBoot unpacks the rom into its slot before booting
+// BOOT_STAGING_ADDR must be set to the (sector aligned) flash address
+// of the staging area, see readme for details
+//#define BOOT_INSTALL_ENABLED
+//#define BOOT_STAGING_ADDR 0xd0000
+
+// uncomment to have factory reset restore the read-only golden rom
+// in this slot over rom 0, only sectors that differ are rewritten
+//#define BOOT_GOLDEN_ROM 2
+
+// uncomment to track which sectors of the factory reset region (app
+// settings & data, BOOT_RESET_ADDR & BOOT_RESET_SIZE) have been written
+// since the last reset, so factory reset only erases those sectors, the
+// map is kept in the sector at BOOT_DIRTY_MAP_ADDR and is updated by the
+// flash write functions of the api
+//#define BOOT_DIRTY_MAP_ADDR 0xfa000
+//#define BOOT_RESET_ADDR 0xe0000
+//#define BOOT_RESET_SIZE 0x1a000
+
+// uncomment to enable a table of named partitions (sdk config, data,
+// logs etc.) stored in the config sector alongside the rom list, a GPIO
+// boot with MODE_GPIO_ERASES_SDKCONFIG then erases the PART_TYPE_SDKCONFIG
+// partitions instead of assuming the sdk config is the last 4 sectors
+//#define BOOT_PARTITIONS
+
+// uncomment to make writes of the config sector safe against losing
+// power part way through, each write goes to this spare sector first
+// and rBoot finishes an interrupted one at the next boot
+//#define BOOT_CONFIG_JOURNAL_ADDR 0xfb000
+
+// uncomment to keep a log of recent boots in the two sectors starting at
+// BOOT_HISTORY_ADDR, each boot adds one rboot_history_entry and a sector
+// is only erased when the log wraps round in to it
+//#define BOOT_HISTORY_ADDR 0xf8000
+
 // uncomment to add a boot delay, allows you time to connect
 // a terminal before rBoot starts to run and output messages
 // value is in microseconds
@@ -91,6 +138,32 @@ extern "C" {
 #define RBOOT_RTC_WRITE 0
 #define RBOOT_RTC_ADDR 64
 
+// with big flash rBoot leaves an rboot_rtc_mmap for the rom it booted in
+// this rtc block (after rboot_rtc_data), for Cache_Read_Enable_New
+#define RBOOT_RTC_MMAP_ADDR (RBOOT_RTC_ADDR + 4)
+#define RBOOT_MMAP_MAGIC 0x6d6d
+// checksum of an rboot_rtc_mmap for block, as calc_chksum works it out
+#define RBOOT_MMAP_CHKSUM(block) (CHKSUM_INIT ^ (RBOOT_MMAP_MAGIC & 0xff) ^ (RBOOT_MMAP_MAGIC >> 8) ^ (block))
+
+#define BOOT_INSTALL_MAGIC 0x4c4e5352
+#define BOOT_INSTALL_MAX_SECTORS 256
+
+#define DIRTY_MAP_MAGIC 0x59545244
+
+#define BOOT_SLOT_META_MAGIC 0x4154454d
+
+#define BOOT_PART_MAGIC 0x54524150
+#define BOOT_PART_NAME_LEN 8
+
+#define PART_TYPE_SDKCONFIG 0x01
+#define PART_TYPE_DATA      0x02
+#define PART_TYPE_ASSETS    0x03
+#define PART_TYPE_LOG       0x04
+#define PART_TYPE_USER      0x80
+
+#define BOOT_PLAN_MAGIC 0xb9
+#define BOOT_PLAN_MAX_SECTIONS 6
+
 // defaults for unset user options
 #ifndef BOOT_GPIO_NUM
 #define BOOT_GPIO_NUM 16
@@ -100,6 +173,10 @@ extern "C" {
 #define MAX_ROMS 4
 #endif
 
+#ifndef BOOT_PART_MAX
+#define BOOT_PART_MAX 12
+#endif
+
 /** @brief  Structure containing rBoot configuration
  *  @note   ROM addresses must be multiples of 0x1000 (flash sector aligned).
  *          Without BOOT_BIG_FLASH only the first 8Mbit (1MB) of the chip will
@@ -140,6 +217,166 @@ typedef struct {
 } rboot_rtc_data;
 #endif
 
+#ifdef BOOT_BIG_FLASH
+/** @brief  The 1MB flash block mapped for the rom rBoot booted
+ *  @note   Left by rBoot in the ESP RTC data area at RBOOT_RTC_MMAP_ADDR, so
+ *          Cache_Read_Enable_New needn't read the config from flash.
+ *  @ingroup rboot
+*/
+typedef struct {
+	uint16_t magic;           ///< Magic, identifies the mapping - should be RBOOT_MMAP_MAGIC
+	uint8_t block;            ///< The 1MB flash block holding the booted rom
+	uint8_t chksum;           ///< Checksum of this structure, see RBOOT_MMAP_CHKSUM
+} rboot_rtc_mmap;
+#endif
+
+#ifdef BOOT_PLAN_ENABLED
+/** @brief  Structure describing one section of a boot plan
+ *  @ingroup rboot
+*/
+typedef struct {
+	uint32_t flash;          ///< Flash address of the section data
+	uint32_t address;        ///< RAM address to load the data to, 0 for checksum only (irom)
+	uint32_t length;         ///< Length of the section data
+} rboot_plan_section;
+
+/** @brief  Structure containing a precomputed boot plan for a ROM slot
+ *  @note   Sections must be listed in the order they appear on the flash,
+ *          and must cover exactly the data included in the ROM checksum.
+ *          One plan per ROM is stored at the end of the config sector, see
+ *          BOOT_PLAN_OFFSET. A plan that doesn't match the ROM in its slot
+ *          (its load header, checksum and the digest of the sections loaded
+ *          to ram) is ignored and the ROM headers are parsed as normal.
+ *  @ingroup rboot
+*/
+typedef struct {
+	uint8_t magic;           ///< Our magic, identifies a boot plan - should be BOOT_PLAN_MAGIC
+	uint8_t count;           ///< Quantity of sections in the plan
+	uint8_t rom_chksum;      ///< Expected ROM checksum (the value stored in the ROM)
+	uint8_t unused;          ///< Padding (not used)
+	uint32_t rom_addr;       ///< Flash address of the ROM slot this plan is for
+	uint32_t load_addr;      ///< Flash address of the ROM's load header
+	uint32_t header[2];      ///< Copy of the load header (magic, count, flags & entry point)
+	rboot_plan_section sections[BOOT_PLAN_MAX_SECTIONS]; ///< Sections to verify and load
+	uint32_t digest;         ///< FNV-1a digest of the sections loaded to ram, in order
+	uint8_t chksum;          ///< Checksum of this structure
+	uint8_t padding[3];      ///< Padding (not used)
+} rboot_plan;
+
+// offset of each rom's boot plan in the config sector
+#define BOOT_PLAN_OFFSET(rom) (SECTOR_SIZE - ((MAX_ROMS - (rom)) * sizeof(rboot_plan)))
+#endif
+
+#ifdef BOOT_INSTALL_ENABLED
+/** @brief  Structure containing a pending install record
+ *  @note   Stored at the start of the staging area (BOOT_STAGING_ADDR), the
+ *          packed rom follows in the next sector. Each packed block is a
+ *          uint16_t packed length and uint16_t unpacked length, followed by
+ *          the packed data (padded to 4 bytes). Each block unpacks to one
+ *          sector of the rom. If the packed and unpacked lengths are equal
+ *          the block is stored, otherwise a control byte < 0x80 is followed
+ *          by that many + 1 literal bytes and a control byte >= 0x80 copies
+ *          (control & 0x7f) + 3 bytes from the uint16_t (little endian)
+ *          offset back in the sector being unpacked. As each sector of the
+ *          rom is written rBoot clears its progress word, so an interrupted
+ *          install can resume, and once complete (and the config selects
+ *          the new rom) the magic is cleared.
+ *  @ingroup rboot
+*/
+typedef struct {
+	uint32_t magic;          ///< Our magic, BOOT_INSTALL_MAGIC when an install is pending
+	uint8_t target_rom;      ///< ROM slot to unpack the packed rom in to
+	uint8_t unused[2];       ///< Padding (not used)
+	uint8_t chksum;          ///< Checksum of the fields after magic, up to this one
+	uint32_t packed_len;     ///< Length of the packed rom
+	uint32_t image_len;      ///< Length of the rom once unpacked
+	uint32_t progress[BOOT_INSTALL_MAX_SECTORS]; ///< Cleared to 0 as each sector is installed
+} rboot_install;
+#endif
+
+/** @brief  Structure containing wear information for a ROM slot
+ *  @ingroup rboot
+*/
+typedef struct {
+	uint32_t erases;         ///< Total sectors erased writing ROMs to this slot
+	uint32_t generation;     ///< Quantity of ROMs written to this slot
+} rboot_slot_wear;
+
+/** @brief  Structure containing ROM slot metadata
+ *  @note   Stored in the config sector at BOOT_SLOT_META_OFFSET, below any
+ *          boot plans, and maintained by the OTA code.
+ *  @ingroup rboot
+*/
+typedef struct {
+	uint32_t magic;          ///< Our magic, identifies slot metadata - should be BOOT_SLOT_META_MAGIC
+	uint8_t fallback_rom;    ///< Last known good ROM (the one running before the current ROM was installed), 0xff if none
+	uint8_t data_select;     ///< Active copy of each bundle data partition, bit n set = copy B of id n
+	uint16_t irom_valid;     ///< Bit n set if irom_chksum[n] is recorded (for BOOT_IROM_DEFERRED)
+	rboot_slot_wear wear[MAX_ROMS]; ///< Wear counters for each ROM slot
+	uint8_t irom_chksum[MAX_ROMS]; ///< XOR of the .irom0.text section of each ROM (for BOOT_IROM_DEFERRED)
+} rboot_slot_meta;
+
+#ifdef BOOT_PLAN_ENABLED
+#define BOOT_SLOT_META_OFFSET (BOOT_PLAN_OFFSET(0) - sizeof(rboot_slot_meta))
+#else
+#define BOOT_SLOT_META_OFFSET (SECTOR_SIZE - sizeof(rboot_slot_meta))
+#endif
+
+#ifdef BOOT_PARTITIONS
+/** @brief  Structure describing a flash partition
+ *  @ingroup rboot
+*/
+typedef struct {
+	char name[BOOT_PART_NAME_LEN]; ///< Name, padded with nuls (not terminated if it uses all 8 chars)
+	uint32_t offset;         ///< Flash address, sector aligned
+	uint32_t size;           ///< Size, a multiple of the sector size
+	uint8_t type;            ///< PART_TYPE_xxx, or PART_TYPE_USER and above for your own types
+	uint8_t flags;           ///< For app use
+	uint8_t unused[2];       ///< Padding (not used)
+} rboot_partition;
+
+/** @brief  Structure containing the partition table
+ *  @note   Stored in the config sector at BOOT_PART_TABLE_OFFSET. Partitions
+ *          are sorted by name, and by_type indexes them sorted by type, so
+ *          either can be found with a binary search. Partitions must not
+ *          overlap each other or the first two sectors, or cross a 1MB
+ *          boundary. Without a valid table rBoot behaves as before.
+ *  @ingroup rboot
+*/
+typedef struct {
+	uint32_t magic;          ///< Our magic, identifies a partition table - should be BOOT_PART_MAGIC
+	uint8_t count;           ///< Quantity of partitions
+	uint8_t chksum;          ///< Checksum of parts and by_type
+	uint8_t unused[2];       ///< Padding (not used)
+	rboot_partition parts[BOOT_PART_MAX]; ///< Partitions, sorted by name
+	uint8_t by_type[BOOT_PART_MAX]; ///< Indexes in to parts, sorted by type
+} rboot_part_table;
+
+#define BOOT_PART_TABLE_OFFSET (BOOT_SLOT_META_OFFSET - sizeof(rboot_part_table))
+#endif
+
+#ifdef BOOT_HISTORY_ADDR
+/** @brief  Structure containing a boot history entry
+ *  @note   Entries fill each sector of the log from the start, and the
+ *          sectors are used in turn, so the log holds the last 256 to 512
+ *          boots. Unused entries are left erased (count is 0xffffffff).
+ *  @ingroup rboot
+*/
+typedef struct {
+	uint32_t count;          ///< Boot count, from 1
+	uint32_t check_us;       ///< Time taken checking ROMs, in microseconds
+	uint8_t rom;             ///< ROM booted, 0xff if no good ROM was found
+	uint8_t selected_rom;    ///< ROM selected by the config, temp or GPIO boot (differs from rom after a fallback)
+	uint8_t mode;            ///< MODE_STANDARD, or MODE_TEMP_ROM, MODE_GPIO_ROM or MODE_GPIO_SKIP
+	uint8_t reset_reason;    ///< Reset reason, as rst_reason in the sdk
+	uint8_t fallbacks;       ///< Quantity of bad ROMs skipped
+	uint8_t unused[2];       ///< Padding (not used)
+	uint8_t chksum;          ///< Checksum of the entry, an entry only partly written won't match
+} rboot_history_entry;
+
+#define BOOT_HISTORY_ENTRIES (SECTOR_SIZE / sizeof(rboot_history_entry))
+#endif
+
 // override function to create default config, must be placed after type
 // and constant defines as it uses some of them, flashsize is the used size
 // (may be smaller than actual flash size if big flash mode is not enabled,
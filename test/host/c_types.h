@@ -0,0 +1,28 @@
+#ifndef __C_TYPES_H__
+#define __C_TYPES_H__
+
+// host stand in for the sdk c_types.h, just what rBoot's appcode uses
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef uint8_t uint8;
+typedef int8_t sint8;
+typedef int8_t int8;
+typedef uint16_t uint16;
+typedef int16_t sint16;
+typedef uint32_t uint32;
+typedef int32_t sint32;
+typedef int32_t int32;
+
+#define ICACHE_FLASH_ATTR
+#define IRAM_ATTR
+
+void *pvPortMalloc(size_t size, const char *file, int line);
+void vPortFree(void *ptr, const char *file, int line);
+bool system_rtc_mem_read(uint8 src_addr, void *des_addr, uint16 load_size);
+bool system_rtc_mem_write(uint8 des_addr, const void *src_addr, uint16 save_size);
+uint32 system_get_time(void);
+
+#endif
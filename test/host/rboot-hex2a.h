@@ -0,0 +1,8 @@
+// host stand in for the generated stage2a header, the loader is never
+// run on the host so find_image just copies this somewhere harmless
+
+extern unsigned char sim_iram[];
+#define _text_addr sim_iram
+static const unsigned char _text_data[] = {0};
+#define _text_len sizeof(_text_data)
+#define entry_addr 0
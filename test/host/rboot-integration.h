@@ -0,0 +1,12 @@
+#ifndef __RBOOT_INTEGRATION_H__
+#define __RBOOT_INTEGRATION_H__
+
+// host build of rBoot for the tests, stands in for the sdk gpio macros
+// that the real integration header pulls in
+
+#define GPIO_REG_WRITE(reg, val) ((void)(reg), (void)(val))
+#define GPIO_ENABLE_W1TS_ADDRESS 0
+#define GPIO_OUT_W1TS_ADDRESS 0
+#define GPIO_OUT_W1TC_ADDRESS 0
+
+#endif
@@ -0,0 +1,354 @@
+//////////////////////////////////////////////////
+// rBoot host tests, simulated esp8266 flash and rom functions.
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <c_types.h>
+#include <spi_flash.h>
+#include "rboot-private.h"
+#include "sim.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE MAP_FIXED
+#endif
+
+// hardware the code under test touches directly
+#define SIM_TIMER_PAGE 0x3ff20000
+#define SIM_TIMER_US   0x3ff20c00
+#define SIM_PERI_BASE  0x60000000
+#define SIM_PERI_SIZE  0x2000
+#define SIM_RTC_MEM    0x60001100
+#define SIM_MAP_ADDR   0x40200000
+#define SIM_MAP_SIZE   0x100000
+#define SIM_IRAM       0x40100000
+#define SIM_IRAM_SIZE  0x10000
+#define SIM_DRAM       0x3ffe8000
+#define SIM_DRAM_SIZE  0x18000
+
+uint8_t *sim_flash;
+sim_stats sim;
+uint32_t sim_erase_count[SIM_SECTORS];
+uint32_t sim_time_us;
+int32_t sim_cut_at = -1;
+jmp_buf sim_power_cut;
+int sim_write_protect;
+uint32_t sim_realtime_div;
+int sim_failures;
+unsigned char sim_iram[0x400];
+
+static int flash_fd = -1;
+static uint32_t rand_state = 1;
+
+static void map_fixed(uint32_t addr, uint32_t len, int fd, off_t offset) {
+	void *want = (void*)(uintptr_t)addr;
+	void *got = mmap(want, len, PROT_READ | PROT_WRITE,
+		(fd < 0 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_SHARED) | MAP_FIXED_NOREPLACE, fd, offset);
+	if (got != want) {
+		fprintf(stderr, "sim: can't map %08x\n", addr);
+		exit(2);
+	}
+}
+
+void sim_init(void) {
+	flash_fd = memfd_create("sim_flash", 0);
+	if (flash_fd < 0 || ftruncate(flash_fd, SIM_FLASH_SIZE) != 0) {
+		fprintf(stderr, "sim: can't create flash\n");
+		exit(2);
+	}
+	sim_flash = mmap(0, SIM_FLASH_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, flash_fd, 0);
+	if (sim_flash == MAP_FAILED) {
+		fprintf(stderr, "sim: can't map flash\n");
+		exit(2);
+	}
+	map_fixed(SIM_TIMER_PAGE, 0x1000, -1, 0);
+	map_fixed(SIM_PERI_BASE, SIM_PERI_SIZE, -1, 0);
+	map_fixed(SIM_MAP_ADDR, SIM_MAP_SIZE, flash_fd, 0);
+	// where stage2a loads rom sections
+	map_fixed(SIM_IRAM, SIM_IRAM_SIZE, -1, 0);
+	map_fixed(SIM_DRAM, SIM_DRAM_SIZE, -1, 0);
+	sim_erase_all(0x100000);
+}
+
+void sim_map_block(uint8_t block) {
+	munmap((void*)SIM_MAP_ADDR, SIM_MAP_SIZE);
+	map_fixed(SIM_MAP_ADDR, SIM_MAP_SIZE, flash_fd, (off_t)block * SIM_MAP_SIZE);
+}
+
+void sim_erase_all(uint32_t flashsize) {
+	memset(sim_flash, 0xff, SIM_FLASH_SIZE);
+	memset(sim_erase_count, 0, sizeof(sim_erase_count));
+	sim_write_protect = 0;
+	memset((void*)SIM_PERI_BASE, 0, SIM_PERI_SIZE);
+	// bootloader header, as esptool2 writes it
+	sim_flash[0] = ROM_MAGIC;
+	sim_flash[1] = 0;
+	sim_flash[2] = 0;
+	sim_flash[3] = (flashsize >= 0x400000) ? 0x40 : (flashsize >= 0x200000) ? 0x30
+		: (flashsize >= 0x100000) ? 0x20 : 0x00;
+	sim_clear_stats();
+	sim_time_us = 0;
+	sim_tick(0);
+}
+
+void sim_clear_stats(void) {
+	memset(&sim, 0, sizeof(sim));
+	sim.read_low = 0xffffffff;
+}
+
+void sim_tick(uint32_t us) {
+	sim_time_us += us;
+	*(volatile uint32_t*)SIM_TIMER_US = sim_time_us;
+	if (sim_realtime_div != 0 && us >= sim_realtime_div) {
+		usleep(us / sim_realtime_div);
+	}
+}
+
+int sim_report(const char *name) {
+	if (sim_failures) {
+		printf("%s: %d check(s) failed\n", name, sim_failures);
+		return 1;
+	}
+	printf("%s: ok\n", name);
+	return 0;
+}
+
+void sim_seed(uint32_t seed) {
+	rand_state = seed ? seed : 1;
+}
+
+uint32_t sim_rand(void) {
+	// xorshift32
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 17;
+	rand_state ^= rand_state << 5;
+	return rand_state;
+}
+
+uint8_t sim_chksum(const uint8_t *start, const uint8_t *end) {
+	uint8_t chksum = CHKSUM_INIT;
+	while (start < end) {
+		chksum ^= *start++;
+	}
+	return chksum;
+}
+
+// count an erase or program, cutting the power if it's the chosen one
+static int power_op(void) {
+	return (int32_t)(sim.ops++) == sim_cut_at;
+}
+
+static uint32_t flash_read(uint32_t addr, void *outptr, uint32_t len) {
+	if (addr >= SIM_FLASH_SIZE || len > SIM_FLASH_SIZE - addr) {
+		return 1;
+	}
+	memcpy(outptr, sim_flash + addr, len);
+	sim.reads++;
+	sim.bytes_read += len;
+	if (addr < sim.read_low) sim.read_low = addr;
+	if (addr + len > sim.read_high) sim.read_high = addr + len;
+	sim_tick(len / SIM_READ_BYTES_PER_US);
+	return 0;
+}
+
+static uint32_t flash_erase(int sector) {
+	if (sector < 0 || sector >= SIM_SECTORS || sim_write_protect) {
+		return 1;
+	}
+	if (power_op()) {
+		// part erased, the rest left as it was
+		memset(sim_flash + (sector * SECTOR_SIZE), 0xff, SECTOR_SIZE / 2);
+		longjmp(sim_power_cut, 1);
+	}
+	memset(sim_flash + (sector * SECTOR_SIZE), 0xff, SECTOR_SIZE);
+	sim.erases++;
+	sim_erase_count[sector]++;
+	sim_tick(SIM_ERASE_US);
+	return 0;
+}
+
+static uint32_t flash_program(uint32_t addr, const void *inptr, uint32_t len) {
+	const uint8_t *in = (const uint8_t*)inptr;
+	uint32_t loop;
+
+	if ((addr & 3) || (len & 3) || addr >= SIM_FLASH_SIZE || len > SIM_FLASH_SIZE - addr
+		|| sim_write_protect) {
+		return 1;
+	}
+	if (power_op()) {
+		for (loop = 0; loop < len / 2; loop++) {
+			sim_flash[addr + loop] &= in[loop];
+		}
+		longjmp(sim_power_cut, 1);
+	}
+	for (loop = 0; loop < len; loop++) {
+		sim_flash[addr + loop] &= in[loop];
+	}
+	sim.programs++;
+	sim.bytes_programmed += len;
+	sim_tick(((len + 255) / 256) * SIM_PAGE_US);
+	return 0;
+}
+
+// esp8266 rom functions
+
+uint32_t SPIRead(uint32_t addr, void *outptr, uint32_t len) {
+	return flash_read(addr, outptr, len);
+}
+
+uint32_t SPIEraseSector(int sector) {
+	return flash_erase(sector);
+}
+
+uint32_t SPIWrite(uint32_t addr, void *inptr, uint32_t len) {
+	return flash_program(addr, inptr, len);
+}
+
+void ets_printf(char *fmt, ...) {
+	va_list args;
+	if (getenv("SIM_VERBOSE")) {
+		va_start(args, fmt);
+		vprintf(fmt, args);
+		va_end(args);
+	}
+}
+
+void ets_delay_us(int us) {
+	sim_tick(us);
+}
+
+void ets_memset(void *ptr, uint8_t val, uint32_t len) {
+	memset(ptr, val, len);
+}
+
+void ets_memcpy(void *dest, const void *src, uint32_t len) {
+	memcpy(dest, src, len);
+}
+
+int ets_memcmp(const void *a, const void *b, uint32_t len) {
+	return memcmp(a, b, len);
+}
+
+// sdk functions
+
+SpiFlashOpResult spi_flash_erase_sector(uint16 sec) {
+	return flash_erase(sec) ? SPI_FLASH_RESULT_ERR : SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult spi_flash_write(uint32 des_addr, uint32 *src_addr, uint32 size) {
+	return flash_program(des_addr, src_addr, size) ? SPI_FLASH_RESULT_ERR : SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult spi_flash_read(uint32 src_addr, uint32 *des_addr, uint32 size) {
+	return flash_read(src_addr, des_addr, size) ? SPI_FLASH_RESULT_ERR : SPI_FLASH_RESULT_OK;
+}
+
+bool system_rtc_mem_read(uint8 src_addr, void *des_addr, uint16 load_size) {
+	if (src_addr > 191 || load_size > (192 - src_addr) * 4) {
+		return false;
+	}
+	memcpy(des_addr, (uint8_t*)SIM_RTC_MEM + (src_addr * 4), load_size);
+	return true;
+}
+
+bool system_rtc_mem_write(uint8 des_addr, const void *src_addr, uint16 save_size) {
+	if (des_addr < 64 || des_addr > 191 || save_size > (192 - des_addr) * 4) {
+		return false;
+	}
+	memcpy((uint8_t*)SIM_RTC_MEM + (des_addr * 4), src_addr, save_size);
+	return true;
+}
+
+uint32 system_get_time(void) {
+	return sim_time_us;
+}
+
+void *pvPortMalloc(size_t size, const char *file, int line) {
+	return malloc(size);
+}
+
+void vPortFree(void *ptr, const char *file, int line) {
+	free(ptr);
+}
+
+// image and config builders
+
+static void put_words(uint32_t *pos, const void *data, uint32_t len) {
+	memcpy(sim_flash + *pos, data, len);
+	*pos += len;
+}
+
+uint32_t sim_write_rom(uint32_t addr, uint32_t irom_len, uint8_t count, uint32_t len, uint32_t seed) {
+	uint32_t pos = addr;
+	uint32_t loop;
+	uint8_t sect;
+	uint8_t chksum = CHKSUM_INIT;
+	rom_header_new newhdr;
+	rom_header header;
+	section_header section;
+
+	sim_seed(seed);
+	if (irom_len) {
+		newhdr.magic = ROM_MAGIC_NEW1;
+		newhdr.count = ROM_MAGIC_NEW2;
+		newhdr.flags1 = 0;
+		newhdr.flags2 = 0x20;
+		newhdr.entry = IRAM_START;
+		newhdr.add = 0;
+		newhdr.len = irom_len;
+		put_words(&pos, &newhdr, sizeof(newhdr));
+		for (loop = 0; loop < irom_len; loop++) {
+			sim_flash[pos] = seed ? (uint8_t)sim_rand() : (uint8_t)(loop / 16);
+#ifdef BOOT_IROM_CHKSUM
+			chksum ^= sim_flash[pos];
+#endif
+			pos++;
+		}
+	}
+	header.magic = ROM_MAGIC;
+	header.count = count;
+	header.flags1 = 0;
+	header.flags2 = 0x20;
+	header.entry = IRAM_START;
+	put_words(&pos, &header, sizeof(header));
+	for (sect = 0; sect < count; sect++) {
+		section.address = IRAM_START + (sect * len);
+		section.length = len;
+		put_words(&pos, &section, sizeof(section));
+		for (loop = 0; loop < len; loop++) {
+			sim_flash[pos] = seed ? (uint8_t)sim_rand() : (uint8_t)(loop / 16);
+			chksum ^= sim_flash[pos];
+			pos++;
+		}
+	}
+	// zero padding, checksum in the last byte of the 16 byte block
+	while ((pos & 0x0f) != 0x0f) {
+		sim_flash[pos++] = 0;
+	}
+	sim_flash[pos++] = chksum;
+	return pos - addr;
+}
+
+void sim_write_config(uint8_t count, const uint32_t *roms, uint8_t current) {
+	rboot_config *romconf = (rboot_config*)(sim_flash + BOOT_CONFIG_SECTOR * SECTOR_SIZE);
+
+	memset(sim_flash + BOOT_CONFIG_SECTOR * SECTOR_SIZE, 0xff, SECTOR_SIZE);
+	memset(romconf, 0, sizeof(rboot_config));
+	romconf->magic = BOOT_CONFIG_MAGIC;
+	romconf->version = BOOT_CONFIG_VERSION;
+	romconf->count = count;
+	romconf->current_rom = current;
+	memcpy(romconf->roms, roms, count * sizeof(uint32_t));
+#ifdef BOOT_CONFIG_CHKSUM
+	romconf->chksum = sim_chksum((uint8_t*)romconf, &romconf->chksum);
+#endif
+}
+
+void sim_read_config(rboot_config *romconf) {
+	memcpy(romconf, sim_flash + BOOT_CONFIG_SECTOR * SECTOR_SIZE, sizeof(rboot_config));
+}
@@ -0,0 +1,93 @@
+#ifndef __SIM_H__
+#define __SIM_H__
+
+//////////////////////////////////////////////////
+// rBoot host tests, simulated esp8266 flash and rom functions.
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <rboot.h>
+
+// simulated flash, nor semantics: erase sets a sector to 0xff and
+// programming can only clear bits
+#define SIM_FLASH_SIZE 0x400000
+#define SIM_SECTORS (SIM_FLASH_SIZE / SECTOR_SIZE)
+
+// worst case flash timings used for the simulated clock, in microseconds
+#define SIM_ERASE_US 45000
+#define SIM_PAGE_US 600
+#define SIM_READ_BYTES_PER_US 20
+
+// counters for every flash operation since sim_clear_stats
+typedef struct {
+	uint32_t reads;
+	uint32_t bytes_read;
+	uint32_t read_low;      // lowest address read
+	uint32_t read_high;     // one past the highest address read
+	uint32_t erases;
+	uint32_t programs;
+	uint32_t bytes_programmed;
+	uint32_t ops;           // erases and programs, what a power cut counts
+} sim_stats;
+
+extern uint8_t *sim_flash;
+extern sim_stats sim;
+extern uint32_t sim_erase_count[SIM_SECTORS];
+extern uint32_t sim_time_us;
+
+// power cut: the erase or program numbered sim_cut_at (counting from 0
+// in sim.ops) is left half done and sim_power_cut is longjmp'd to
+extern int32_t sim_cut_at;
+extern jmp_buf sim_power_cut;
+
+// run stmt with the power cut at op n, true if it was cut
+#define SIM_CUT_AT(n, stmt) \
+	(sim_cut_at = (n), sim.ops = 0, \
+	 setjmp(sim_power_cut) == 0 ? ((stmt), sim_cut_at = -1, 0) : (sim_cut_at = -1, 1))
+
+// while set every erase and program fails, as with a write protected chip
+extern int sim_write_protect;
+
+// while set flash operations also take real time, their simulated time
+// divided by this, for tests with threads
+extern uint32_t sim_realtime_div;
+
+extern int sim_failures;
+#define CHECK(cond) do { \
+		if (!(cond)) { \
+			printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			sim_failures++; \
+		} \
+	} while (0)
+
+// map the hardware registers and the flash window, call first
+void sim_init(void);
+// erase the whole flash and set the size in the bootloader header
+void sim_erase_all(uint32_t flashsize);
+void sim_clear_stats(void);
+// map the 1MB flash block the app would see at the flash map address
+void sim_map_block(uint8_t block);
+void sim_tick(uint32_t us);
+// exit status for main, with a summary line
+int sim_report(const char *name);
+
+// deterministic random numbers for fuzzing
+void sim_seed(uint32_t seed);
+uint32_t sim_rand(void);
+
+// xor checksum as rBoot uses for the config and rtc data
+uint8_t sim_chksum(const uint8_t *start, const uint8_t *end);
+
+// write a rom image at addr, new style (irom section first) when
+// irom_len is non zero, followed by count iram sections of len bytes,
+// with random data from seed (or, for seed 0, runs of repeated bytes
+// that pack well), returns the length of the image
+uint32_t sim_write_rom(uint32_t addr, uint32_t irom_len, uint8_t count, uint32_t len, uint32_t seed);
+// write (with checksum where enabled) a config with the given roms
+void sim_write_config(uint8_t count, const uint32_t *roms, uint8_t current);
+void sim_read_config(rboot_config *romconf);
+
+#endif
@@ -0,0 +1,5 @@
+// stage2a for the host tests, load_rom copies the rom sections in to
+// the simulated iram and dram, its entry point is never called
+
+#define call_user_start stage2a_call_user_start
+#include "../../rboot-stage2a.c"
@@ -0,0 +1,137 @@
+//////////////////////////////////////////////////
+// rBoot host tests, asset partitions.
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+// files are found by name in a partition in or out of the mapped 1MB of
+// flash, a name that only shares a digest with a file isn't found, and an
+// index entry that points outside the partition is refused
+
+#include <string.h>
+#include <stdlib.h>
+#include <c_types.h>
+#include "rboot-private.h"
+#include "rboot-api.h"
+#include "sim.h"
+
+#define MAPPED 0x80000
+#define UNMAPPED 0x180000
+#define FILES 3
+
+static const char *names[FILES] = {"index.html", "app.js", "style.css"};
+static rboot_asset_entry entries[FILES];
+
+static uint32_t name_hash(const char *name) {
+	uint32_t hash = 0x811c9dc5;
+
+	while (*name) {
+		hash = (hash ^ (uint8_t)*name++) * 0x01000193;
+	}
+	return hash;
+}
+
+static int by_hash(const void *a, const void *b) {
+	uint32_t ha = ((const rboot_asset_entry*)a)->name_hash;
+	uint32_t hb = ((const rboot_asset_entry*)b)->name_hash;
+	return (ha > hb) - (ha < hb);
+}
+
+// header, index sorted by hash, names, then each file filled with its number
+static void build(uint32_t addr) {
+	rboot_assets_header header;
+	uint32_t pos = sizeof(header) + sizeof(entries);
+	uint32_t loop;
+
+	for (loop = 0; loop < FILES; loop++) {
+		entries[loop].name_hash = name_hash(names[loop]);
+		entries[loop].name_offset = pos;
+		strcpy((char*)sim_flash + addr + pos, names[loop]);
+		pos += (strlen(names[loop]) + 4) & ~3;
+	}
+	for (loop = 0; loop < FILES; loop++) {
+		entries[loop].offset = pos;
+		entries[loop].length = 0x100 * (loop + 1) + 3;
+		memset(sim_flash + addr + pos, loop + 1, entries[loop].length);
+		pos += (entries[loop].length + 3) & ~3;
+	}
+	qsort(entries, FILES, sizeof(entries[0]), by_hash);
+	header.magic = RBOOT_ASSETS_MAGIC;
+	header.count = FILES;
+	header.length = pos;
+	memcpy(sim_flash + addr, &header, sizeof(header));
+	memcpy(sim_flash + addr + sizeof(header), entries, sizeof(entries));
+}
+
+static rboot_asset_entry *entry_for(uint32_t addr, const char *name) {
+	rboot_asset_entry *index = (rboot_asset_entry*)(sim_flash + addr + sizeof(rboot_assets_header));
+	uint32_t loop;
+
+	for (loop = 0; loop < FILES; loop++) {
+		if (index[loop].name_hash == name_hash(name)) return &index[loop];
+	}
+	return NULL;
+}
+
+// as if a file's name had the digest of another, keeping the index sorted
+static void give_hash(uint32_t addr, const char *from, const char *to) {
+	entry_for(addr, from)->name_hash = name_hash(to);
+	qsort(sim_flash + addr + sizeof(rboot_assets_header), FILES, sizeof(rboot_asset_entry), by_hash);
+}
+
+static void check_partition(uint32_t addr, uint8_t mapped) {
+	rboot_assets assets;
+	rboot_asset asset;
+	rboot_asset_entry *entry;
+	rboot_asset_entry saved;
+	uint32_t data[1];
+	uint32_t loop;
+
+	build(addr);
+	CHECK(rboot_assets_open(addr, &assets));
+	CHECK((assets.base != NULL) == mapped);
+	for (loop = 0; loop < FILES; loop++) {
+		CHECK(rboot_asset_find(&assets, names[loop], &asset));
+		CHECK(asset.length == 0x100 * (loop + 1) + 3);
+		CHECK(rboot_asset_read(&asset, 0xfc, data, 4));
+		CHECK(data[0] == 0x01010101 * (loop + 1));
+	}
+	CHECK(!rboot_asset_find(&assets, "missing.txt", &asset));
+
+	// another name with the digest of a file, or a prefix or extension of
+	// its name, isn't it
+	give_hash(addr, "style.css", "other.css");
+	CHECK(!rboot_asset_find(&assets, "other.css", &asset));
+	give_hash(addr, "other.css", "app.j");
+	CHECK(!rboot_asset_find(&assets, "app.j", &asset));
+	give_hash(addr, "app.j", "style.cssx");
+	CHECK(!rboot_asset_find(&assets, "style.cssx", &asset));
+	build(addr);
+
+	// entries outside the partition, or not aligned
+	entry = entry_for(addr, "index.html");
+	saved = *entry;
+	entry->length = assets.length - entry->offset + 1;
+	CHECK(!rboot_asset_find(&assets, "index.html", &asset));
+	entry->length = 0xffffffff;
+	CHECK(!rboot_asset_find(&assets, "index.html", &asset));
+	*entry = saved;
+	entry->offset += 2;
+	CHECK(!rboot_asset_find(&assets, "index.html", &asset));
+	*entry = saved;
+	entry->offset = assets.length + 4;
+	entry->length = 0;
+	CHECK(!rboot_asset_find(&assets, "index.html", &asset));
+	*entry = saved;
+	entry->name_offset = assets.length - 4;
+	CHECK(!rboot_asset_find(&assets, "index.html", &asset));
+	*entry = saved;
+	CHECK(rboot_asset_find(&assets, "index.html", &asset));
+}
+
+int main(void) {
+	sim_init();
+	sim_erase_all(0x200000);
+	check_partition(MAPPED, 1);
+	check_partition(UNMAPPED, 0);
+	return sim_report("assets");
+}
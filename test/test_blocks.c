@@ -0,0 +1,110 @@
+//////////////////////////////////////////////////
+// rBoot host tests, per block digest table and local repair.
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+// damaged blocks of a rom are found from its digest table and repaired
+// from another slot (or supplied data) by rewriting only those blocks
+
+#include "../rboot.c"
+#include <string.h>
+#include <c_types.h>
+#include "rboot-api.h"
+#include "sim.h"
+
+#define ROM0 0x2000
+#define ROM1 0x82000
+
+static uint32_t romlen;
+
+static void setup(void) {
+	uint32_t roms[2] = {ROM0, ROM1};
+
+	sim_erase_all(0x100000);
+	// the same rom in both slots
+	romlen = sim_write_rom(ROM0, 0x8000, 3, 0x800, 20);
+	sim_write_rom(ROM1, 0x8000, 3, 0x800, 20);
+	sim_write_config(2, roms, 0);
+	CHECK(rboot_write_block_table(0, romlen));
+	CHECK(rboot_write_block_table(1, romlen));
+}
+
+static void damage(uint32_t addr, uint16_t block) {
+	sim_flash[addr + (block * RBOOT_BLOCK_SIZE) + 100] ^= 0x42;
+}
+
+static void test_check_and_repair(void) {
+	uint8_t bad[32];
+	uint16_t blocks;
+
+	setup();
+	blocks = (romlen + RBOOT_BLOCK_SIZE - 1) / RBOOT_BLOCK_SIZE;
+	memset(bad, 0, sizeof(bad));
+	CHECK(rboot_check_blocks(0, 0, blocks, bad) == 0);
+
+	damage(ROM0, 1);
+	damage(ROM0, 5);
+	damage(ROM0, blocks - 1);
+	CHECK(find_image() == ROM1 + sizeof(rom_header_new) + 0x8000);
+	CHECK(rboot_check_blocks(0, 0, blocks, bad) == 3);
+	CHECK(bad[0] == ((1 << 1) | (1 << 5)));
+	CHECK(bad[(blocks - 1) / 8] & (1 << ((blocks - 1) % 8)));
+	// just part of the range
+	CHECK(rboot_check_blocks(0, 2, 3, 0) == 0);
+
+	// repair only rewrites the bad blocks
+	sim_clear_stats();
+	CHECK(rboot_repair_blocks(0, 1) == 0);
+	CHECK(sim.erases == 3);
+	printf("blocks: repaired 3 of %u blocks with %u erases, %u bytes written\n",
+		blocks, sim.erases, sim.bytes_programmed);
+	CHECK(rboot_check_blocks(0, 0, blocks, 0) == 0);
+	CHECK(memcmp(sim_flash + ROM0, sim_flash + ROM1, romlen) == 0);
+	rboot_set_current_rom(0);
+	CHECK(find_image() == ROM0 + sizeof(rom_header_new) + 0x8000);
+}
+
+static void test_bad_source(void) {
+	uint8_t block[RBOOT_BLOCK_SIZE];
+
+	// the source block is bad too, so can't be used
+	setup();
+	damage(ROM0, 2);
+	damage(ROM1, 2);
+	damage(ROM0, 3);
+	CHECK(rboot_repair_blocks(0, 1) == 1);
+	CHECK(rboot_check_blocks(0, 0, 0xffff, 0) == 1);
+
+	// supplied data, only if it matches the digest
+	memcpy(block, sim_flash + ROM1 + (2 * RBOOT_BLOCK_SIZE), sizeof(block));
+	CHECK(!rboot_repair_block(0, 2, block));
+	block[100] ^= 0x42;
+	CHECK(rboot_repair_block(0, 2, block));
+	CHECK(rboot_check_blocks(0, 0, 0xffff, 0) == 0);
+	CHECK(!rboot_repair_block(0, 0xff, block));
+}
+
+static void test_bad_table(void) {
+	uint32_t table = ROM0 + rboot_get_slot_size(0) - SECTOR_SIZE;
+
+	setup();
+	sim_flash[table + sizeof(rboot_block_table) + 8] ^= 1;
+	CHECK(rboot_check_blocks(0, 0, 0xffff, 0) == -1);
+	CHECK(rboot_repair_blocks(0, 1) == -1);
+
+	setup();
+	((rboot_block_table*)(sim_flash + table))->length = 0x7fffffff;
+	CHECK(rboot_check_blocks(0, 0, 0xffff, 0) == -1);
+
+	// too long for the slot
+	setup();
+	CHECK(!rboot_write_block_table(0, rboot_get_slot_size(0)));
+}
+
+int main(void) {
+	sim_init();
+	test_check_and_repair();
+	test_bad_source();
+	test_bad_table();
+	return sim_report("blocks");
+}
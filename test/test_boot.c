@@ -0,0 +1,252 @@
+//////////////////////////////////////////////////
+// rBoot host tests, boot modes and the big flash mapping.
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+// rBoot boots the rom each mode asks for, the config's current rom (or the
+// one before when that is bad), a temp rom from the rtc data, the config's
+// gpio rom or, skipping, the next rom, and leaves the 1MB block holding it
+// in rtc memory, so the app's Cache_Read_Enable_New maps the right block
+// without reading the flash, and falls back to the config's current rom
+// when the block left there is damaged
+
+#include <string.h>
+#include "rboot-private.h"
+#include "sim.h"
+
+#define ROM0 0x2000
+#define ROM1 0x102000
+#define ROM2 0x202000
+#define ROM3 0x302000
+#define IROM_LEN 0x4000
+#define RTC_MEM 0x60001100
+// the level of gpio 16, the boot pin
+#define RTC_GPIO_IN_DATA 0x6000078c
+
+extern uint32_t find_image(void);
+extern void Cache_Read_Enable_New(void);
+extern uint8_t rBoot_mmap_1;
+extern uint8_t rBoot_mmap_2;
+
+static const uint32_t roms[4] = {ROM0, ROM1, ROM2, ROM3};
+static uint8_t mapped;
+
+// the rom function Cache_Read_Enable_New calls to map the block
+void Cache_Read_Enable(uint32_t odd_even, uint32_t mb_count, uint32_t no_idea) {
+	mapped = mb_count * 2 + odd_even;
+	sim_map_block(mapped);
+}
+
+// the boot pin, pulled high, low asks for a GPIO boot
+static void set_pin(uint8_t level) {
+	*(volatile uint32_t*)RTC_GPIO_IN_DATA = level;
+}
+
+// four roms, one in each 1MB block, the config for the current rom
+static void setup(uint8_t current) {
+	uint8_t loop;
+
+	sim_erase_all(0x400000);
+	sim_write_config(4, roms, current);
+	for (loop = 0; loop < 4; loop++) {
+		sim_write_rom(roms[loop], IROM_LEN, 2, 0x400, 140 + loop);
+	}
+	set_pin(1);
+}
+
+#if defined(BOOT_GPIO_ENABLED) || defined(BOOT_GPIO_SKIP_ENABLED)
+// the config's gpio mode and rom
+static void set_mode(uint8_t mode, uint8_t gpio_rom) {
+	rboot_config *romconf = (rboot_config*)(sim_flash + BOOT_CONFIG_SECTOR * SECTOR_SIZE);
+
+	romconf->mode = mode;
+	romconf->gpio_rom = gpio_rom;
+#ifdef BOOT_CONFIG_CHKSUM
+	romconf->chksum = sim_chksum((uint8_t*)romconf, &romconf->chksum);
+#endif
+}
+#endif
+
+static uint8_t current_rom(void) {
+	rboot_config conf;
+
+	sim_read_config(&conf);
+	return conf.current_rom;
+}
+
+// start the app as far as its flash mapping, true if the block holding rom
+// is mapped, reading the flash only if allowed to
+static uint8_t start_app(uint8_t rom, uint8_t may_read) {
+	rBoot_mmap_1 = 0xff;
+	rBoot_mmap_2 = 0xff;
+	sim_clear_stats();
+	Cache_Read_Enable_New();
+	if (!may_read) {
+		CHECK(sim.reads == 0);
+	}
+	return (mapped == roms[rom] / 0x100000
+		&& memcmp((uint8_t*)IROM_MAP_ADDR + roms[rom] % 0x100000, sim_flash + roms[rom], sizeof(rom_header_new)) == 0);
+}
+
+// boot, true if rom was booted in mode and the app maps it
+static uint8_t boot(uint8_t rom, uint8_t mode) {
+	rboot_rtc_mmap rtc_mmap;
+#ifdef BOOT_RTC_ENABLED
+	rboot_rtc_data rtc;
+#endif
+
+	if (find_image() != roms[rom] + sizeof(rom_header_new) + IROM_LEN) {
+		return 0;
+	}
+	memcpy(&rtc_mmap, (uint8_t*)RTC_MEM + RBOOT_RTC_MMAP_ADDR * 4, sizeof(rtc_mmap));
+	CHECK(rtc_mmap.magic == RBOOT_MMAP_MAGIC && rtc_mmap.block == roms[rom] / 0x100000);
+	CHECK(rtc_mmap.chksum == sim_chksum((uint8_t*)&rtc_mmap, &rtc_mmap.chksum));
+#ifdef BOOT_RTC_ENABLED
+	memcpy(&rtc, (uint8_t*)RTC_MEM + RBOOT_RTC_ADDR * 4, sizeof(rtc));
+	CHECK(rtc.magic == RBOOT_RTC_MAGIC && rtc.chksum == sim_chksum((uint8_t*)&rtc, &rtc.chksum));
+	CHECK(rtc.next_mode == MODE_STANDARD);
+	if (rtc.last_rom != rom || rtc.last_mode != mode) {
+		return 0;
+	}
+#endif
+	return start_app(rom, 0);
+}
+
+// the current rom, the one before when it is bad, and the app falling
+// back to the config when the block left for it is damaged
+static void test_standard(void) {
+#ifdef BOOT_RTC_ENABLED
+	// the mapping is after the rtc data, not over it
+	CHECK(RBOOT_RTC_ADDR * 4 + sizeof(rboot_rtc_data) <= RBOOT_RTC_MMAP_ADDR * 4);
+#endif
+
+	setup(2);
+	CHECK(boot(2, MODE_STANDARD));
+	CHECK(current_rom() == 2);
+
+	sim_flash[ROM2] = 0;
+	CHECK(boot(1, MODE_STANDARD));
+	CHECK(current_rom() == 1);
+
+	((uint8_t*)RTC_MEM)[RBOOT_RTC_MMAP_ADDR * 4 + 2] ^= 2;
+	CHECK(start_app(1, 1));
+	CHECK(sim.reads > 0);
+	// and with nothing left at all, as with an older rBoot
+	memset((uint8_t*)RTC_MEM + RBOOT_RTC_MMAP_ADDR * 4, 0, sizeof(rboot_rtc_mmap));
+	CHECK(start_app(1, 1));
+}
+
+#ifdef BOOT_RTC_ENABLED
+// the temp rom for one boot, then the current rom again, and a bad temp
+// rom isn't swapped for another
+static void test_temp(void) {
+	rboot_rtc_data rtc;
+
+	setup(0);
+	memset(&rtc, 0, sizeof(rtc));
+	rtc.magic = RBOOT_RTC_MAGIC;
+	rtc.next_mode = MODE_TEMP_ROM;
+	rtc.temp_rom = 3;
+	rtc.chksum = sim_chksum((uint8_t*)&rtc, &rtc.chksum);
+	memcpy((uint8_t*)RTC_MEM + RBOOT_RTC_ADDR * 4, &rtc, sizeof(rtc));
+	CHECK(boot(3, MODE_TEMP_ROM));
+	CHECK(current_rom() == 0);
+	CHECK(boot(0, MODE_STANDARD));
+
+	memcpy((uint8_t*)RTC_MEM + RBOOT_RTC_ADDR * 4, &rtc, sizeof(rtc));
+	sim_flash[ROM3] = 0;
+	CHECK(find_image() == 0);
+	CHECK(current_rom() == 0);
+	CHECK(boot(0, MODE_STANDARD));
+}
+#endif
+
+#ifdef BOOT_GPIO_ENABLED
+// the config's gpio rom while the pin is low, which then stays the current
+// rom, a bad gpio rom isn't swapped for another, and the pin is ignored
+// unless the config asks for gpio mode
+static void test_gpio(void) {
+	setup(0);
+	set_mode(MODE_STANDARD, 2);
+	set_pin(0);
+	CHECK(boot(0, MODE_STANDARD));
+
+	set_mode(MODE_GPIO_ROM, 2);
+	CHECK(boot(2, MODE_GPIO_ROM));
+	CHECK(current_rom() == 2);
+	set_pin(1);
+	CHECK(boot(2, MODE_STANDARD));
+
+	set_pin(0);
+	sim_flash[ROM2] = 0;
+	CHECK(find_image() == 0);
+}
+#endif
+
+#ifdef BOOT_GPIO_SKIP_ENABLED
+// each boot with the pin low moves on to the next rom, round to the first,
+// unless the config doesn't ask for skip mode
+static void test_gpio_skip(void) {
+	setup(3);
+	set_pin(0);
+	CHECK(boot(3, MODE_STANDARD));
+
+	set_mode(MODE_GPIO_SKIP, 0);
+	CHECK(boot(0, MODE_STANDARD));
+	CHECK(current_rom() == 0);
+	CHECK(boot(1, MODE_STANDARD));
+	set_pin(1);
+	CHECK(boot(1, MODE_STANDARD));
+	CHECK(current_rom() == 1);
+}
+#endif
+
+// the flash reads (each a separate spi transaction) a standard boot makes
+// for roms of a few sections, small and large: without the cache, one for
+// the flash header, the config, the rom's two headers and the checksum
+// byte, then for each section its header and every BUFFER_SIZE of it; with
+// it, headers and small sections share cache lines and the count is as
+// measured
+static void test_reads(void) {
+	static const uint8_t counts[] = {1, 3, 8};
+	static const uint32_t lens[] = {0x84, 0x400};
+#if CACHE_LINE_SIZE != 1
+	static const uint32_t cached[2][3] = {{4, 5, 8}, {9, 19, 44}};
+#endif
+	uint32_t uncached;
+	uint8_t c, l;
+
+	for (l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+		for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+			setup(1);
+			sim_write_rom(ROM1, IROM_LEN, counts[c], lens[l], 150);
+			uncached = 5 + counts[c] * (1 + (lens[l] + BUFFER_SIZE - 1) / BUFFER_SIZE);
+			sim_clear_stats();
+			CHECK(find_image() == ROM1 + sizeof(rom_header_new) + IROM_LEN);
+#if CACHE_LINE_SIZE == 1
+			CHECK(sim.reads == uncached);
+#else
+			CHECK(sim.reads == cached[l][c]);
+#endif
+			printf("boot: %u sections of %4u bytes, %2u spi reads (%2u uncached), %5u bytes\n",
+				counts[c], lens[l], sim.reads, uncached, sim.bytes_read);
+		}
+	}
+}
+
+int main(void) {
+	sim_init();
+	test_standard();
+	test_reads();
+#ifdef BOOT_RTC_ENABLED
+	test_temp();
+#endif
+#ifdef BOOT_GPIO_ENABLED
+	test_gpio();
+#endif
+#ifdef BOOT_GPIO_SKIP_ENABLED
+	test_gpio_skip();
+#endif
+	sim_map_block(0);
+	return sim_report("boot");
+}
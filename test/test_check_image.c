@@ -0,0 +1,168 @@
+//////////////////////////////////////////////////
+// rBoot host tests, fuzz the rom header and section parser.
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+// check_image must never read outside the slot, and with the read cache
+// never reads any part of the slot more than twice, whatever the headers
+// say, so a corrupt rom costs at most a bounded time before falling back
+
+#include "../rboot.c"
+#include <stdlib.h>
+#include <string.h>
+#include "sim.h"
+
+#ifndef FUZZ_ITERS
+#define FUZZ_ITERS 20000
+#endif
+
+#define SLOT_ADDR 0x2000
+
+// values likely to upset a length or address check
+static const uint32_t nasty[] = {
+	0, 1, 3, 4, 0x0f, 0x10, 0xff, 0x100, 0xfff, 0x1000,
+	0x7fffffff, 0x80000000, 0xfffffff0, 0xfffffffc, 0xffffffff,
+	IRAM_START, IRAM_END, IRAM_END - 4, DRAM_START, DRAM_END, DRAM_END - 4,
+};
+
+static uint32_t checked;
+static uint32_t valid;
+
+// check the rom at SLOT_ADDR, asserting the read bounds
+static uint32_t check_bounded(uint32_t slotend, int16_t irom) {
+	flash_cache cache;
+	uint32_t romaddr;
+
+	cache.addr = 0xffffffff;
+	sim_clear_stats();
+	romaddr = check_image(&cache, SLOT_ADDR, slotend, irom);
+	checked++;
+
+	CHECK(sim.reads == 0 || sim.read_low >= SLOT_ADDR);
+	CHECK(sim.read_high <= slotend);
+	CHECK(sim.bytes_read <= 2 * (slotend - SLOT_ADDR));
+	CHECK(romaddr == 0 || (romaddr >= SLOT_ADDR && romaddr < slotend));
+	if (sim_failures) {
+		printf("  slot %x-%x: %u reads, %u bytes from %x to %x, returned %x\n",
+			SLOT_ADDR, slotend, sim.reads, sim.bytes_read, sim.read_low, sim.read_high, romaddr);
+		exit(sim_report("check_image"));
+	}
+	if (romaddr) valid++;
+	return romaddr;
+}
+
+static void test_good_roms(void) {
+	uint32_t len;
+
+	sim_erase_all(0x100000);
+	len = sim_write_rom(SLOT_ADDR, 0, 3, 0x400, 1);
+	CHECK(check_bounded(SLOT_ADDR + 0x10000, -1) == SLOT_ADDR);
+	// exactly fits, and one byte short
+	CHECK(check_bounded(SLOT_ADDR + ((len + 0xfff) & ~0xfff), -1) == SLOT_ADDR);
+
+	sim_erase_all(0x100000);
+	len = sim_write_rom(SLOT_ADDR, 0x3000, 2, 0x200, 2);
+	CHECK(check_bounded(SLOT_ADDR + 0x10000, -1) == SLOT_ADDR + sizeof(rom_header_new) + 0x3000);
+	CHECK(check_bounded(SLOT_ADDR + 0x3000, -1) == 0);
+}
+
+static void test_huge_length(void) {
+	section_header *section;
+	uint32_t start;
+
+	// the case that used to read gigabytes
+	sim_erase_all(0x100000);
+	sim_write_rom(SLOT_ADDR, 0, 3, 0x400, 3);
+	section = (section_header*)(sim_flash + SLOT_ADDR + sizeof(rom_header));
+	section->length = 0xfffffff0;
+	start = sim_time_us;
+	CHECK(check_bounded(SLOT_ADDR + 0x80000, -1) == 0);
+	CHECK(sim.bytes_read <= CACHE_LINE_SIZE);
+	CHECK(sim_time_us - start < 1000);
+}
+
+// a good rom of random shape, then damaged
+static void fuzz_one(void) {
+	uint32_t slotlen = ((sim_rand() % 64) + 1) * SECTOR_SIZE;
+	uint32_t irom = (sim_rand() & 1) ? (sim_rand() % 0x4000) & ~3 : 0;
+	uint8_t count = (sim_rand() % 6) + 1;
+	uint32_t len = (sim_rand() % 0x800) & ~3;
+	uint32_t imglen;
+	uint32_t hits;
+	uint32_t pos;
+	uint32_t val;
+	uint8_t mode = sim_rand() % 4;
+
+	memset(sim_flash + SLOT_ADDR, 0xff, 0x48000);
+	imglen = sim_write_rom(SLOT_ADDR, irom, count, len, sim_rand());
+
+	if (mode == 0) {
+		// flip bytes, mostly in the headers
+		for (hits = (sim_rand() % 4) + 1; hits > 0; hits--) {
+			pos = (sim_rand() & 1) ? sim_rand() % 32 : sim_rand() % imglen;
+			sim_flash[SLOT_ADDR + pos] ^= (uint8_t)((sim_rand() % 255) + 1);
+		}
+	} else if (mode == 1) {
+		// drop a nasty value on a header word
+		pos = (sim_rand() % 8) * 4;
+		if (irom && (sim_rand() & 1)) {
+			pos = sizeof(rom_header_new) + irom + ((sim_rand() % 4) * 4);
+		}
+		val = nasty[sim_rand() % (sizeof(nasty) / sizeof(nasty[0]))];
+		memcpy(sim_flash + SLOT_ADDR + pos, &val, sizeof(val));
+	} else if (mode == 2) {
+		// random header with a valid magic, on random data
+		for (pos = 0; pos < 0x400; pos++) {
+			sim_flash[SLOT_ADDR + pos] = (uint8_t)sim_rand();
+		}
+		sim_flash[SLOT_ADDR] = (sim_rand() & 1) ? ROM_MAGIC : ROM_MAGIC_NEW1;
+		if (sim_flash[SLOT_ADDR] == ROM_MAGIC_NEW1) {
+			sim_flash[SLOT_ADDR + 1] = ROM_MAGIC_NEW2;
+		}
+		sim_flash[SLOT_ADDR + 1] |= (uint8_t)sim_rand() & 0xf0;
+	}
+	// mode 3 is left undamaged, but may not fit the slot
+
+	check_bounded(SLOT_ADDR + slotlen, -1);
+#ifdef BOOT_IROM_DEFERRED
+	check_bounded(SLOT_ADDR + slotlen, sim_rand() & 0xff);
+#endif
+}
+
+// many zero length sections, the most header reads a rom can make
+static void test_many_sections(void) {
+	rom_header *header;
+	uint32_t pos;
+
+	sim_erase_all(0x100000);
+	header = (rom_header*)(sim_flash + SLOT_ADDR);
+	header->magic = ROM_MAGIC;
+	header->count = 0xff;
+	header->entry = IRAM_START;
+	pos = SLOT_ADDR + sizeof(rom_header);
+	memset(sim_flash + pos, 0, 0xff * sizeof(section_header));
+	for (; pos < SLOT_ADDR + sizeof(rom_header) + 0xff * sizeof(section_header); pos += sizeof(section_header)) {
+		((section_header*)(sim_flash + pos))->address = IRAM_START;
+	}
+	check_bounded(SLOT_ADDR + SECTOR_SIZE, -1);
+	CHECK(sim.bytes_read <= SECTOR_SIZE);
+}
+
+int main(int argc, char **argv) {
+	uint32_t iter;
+	uint32_t iters = (argc > 1) ? strtoul(argv[1], 0, 0) : FUZZ_ITERS;
+
+	sim_init();
+	test_good_roms();
+	test_huge_length();
+	test_many_sections();
+
+	sim_erase_all(0x100000);
+	for (iter = 0; iter < iters; iter++) {
+		sim_seed(iter * 2654435761u + 1);
+		fuzz_one();
+	}
+	printf("check_image: %u images checked, %u valid\n", checked, valid);
+
+	return sim_report("check_image");
+}
@@ -0,0 +1,122 @@
+//////////////////////////////////////////////////
+// rBoot host tests, boot history log.
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+// each boot adds one entry with a single small program, the two sectors
+// of the log are only erased as it wraps, and the app reads back the
+// latest boots in order, even after a power cut part way through an entry
+
+#include "../rboot.c"
+#include <string.h>
+#include <c_types.h>
+#include "rboot-api.h"
+#include "sim.h"
+
+#define ROM0 0x2000
+#define ROM1 0x82000
+#define BOOTS 10000
+
+static void setup(void) {
+	uint32_t roms[2] = {ROM0, ROM1};
+
+	sim_erase_all(0x100000);
+	sim_write_rom(ROM0, 0x4000, 2, 0x400, 70);
+	sim_write_rom(ROM1, 0x4000, 2, 0x400, 71);
+	sim_write_config(2, roms, 0);
+}
+
+static uint32_t history_erases(void) {
+	return sim_erase_count[BOOT_HISTORY_ADDR / SECTOR_SIZE]
+		+ sim_erase_count[(BOOT_HISTORY_ADDR / SECTOR_SIZE) + 1];
+}
+
+static void test_boots(void) {
+	rboot_history_entry entries[BOOT_HISTORY_ENTRIES + 2];
+	rboot_history_entry entry;
+	flash_cache cache;
+	uint32_t loop, start, us, max_us = 0;
+	uint16_t found;
+
+	setup();
+	for (loop = 0; loop < BOOTS; loop++) {
+		CHECK(find_image() == ROM0 + sizeof(rom_header_new) + 0x4000);
+	}
+	CHECK(rboot_get_boot_history(entries, 1) == 1);
+	CHECK(entries[0].count == BOOTS);
+	CHECK(entries[0].rom == 0 && entries[0].selected_rom == 0);
+	CHECK(entries[0].mode == MODE_STANDARD && entries[0].fallbacks == 0);
+
+	// the log erases a sector each time it fills one
+	CHECK(history_erases() <= (BOOTS / BOOT_HISTORY_ENTRIES) + 1);
+	printf("history: %u erases of the log per %u boots\n", history_erases(), BOOTS);
+
+	// cost of adding an entry, on its own
+	for (loop = 0; loop < 2 * BOOT_HISTORY_ENTRIES; loop++) {
+		memset(&entry, 0, sizeof(entry));
+		cache.addr = 0xffffffff;
+		sim_clear_stats();
+		start = sim_time_us;
+		write_history(&cache, &entry, 0);
+		us = sim_time_us - start;
+		if (sim.erases == 0 && us > max_us) max_us = us;
+		CHECK(sim.programs == 1);
+	}
+	printf("history: adds at most %u us to a boot (%u with an erase on wrap)\n",
+		max_us, max_us + SIM_ERASE_US);
+
+	// read back in order, newest first, the whole log
+	found = rboot_get_boot_history(entries, BOOT_HISTORY_ENTRIES + 2);
+	CHECK(found > BOOT_HISTORY_ENTRIES && found <= 2 * BOOT_HISTORY_ENTRIES);
+	for (loop = 1; loop < found; loop++) {
+		CHECK(entries[loop].count == entries[loop - 1].count - 1);
+	}
+
+	// nothing is written for max 0
+	memset(entries, 0x5a, sizeof(entries[0]));
+	CHECK(rboot_get_boot_history(entries, 0) == 0);
+	CHECK(entries[0].count == 0x5a5a5a5a);
+}
+
+static void test_fallback(void) {
+	rboot_history_entry entries[2];
+
+	setup();
+	find_image();
+	// damage a ram section of rom 0
+	sim_flash[ROM0 + sizeof(rom_header_new) + 0x4000 + 0x20] ^= 1;
+	CHECK(find_image() == ROM1 + sizeof(rom_header_new) + 0x4000);
+	CHECK(rboot_get_boot_history(entries, 2) == 2);
+	CHECK(entries[0].rom == 1 && entries[0].selected_rom == 0 && entries[0].fallbacks == 1);
+	CHECK(entries[1].rom == 0 && entries[1].fallbacks == 0);
+	CHECK(entries[0].count == entries[1].count + 1);
+}
+
+// a power cut while an entry is programmed leaves it unreadable, and
+// the next boot carries on after it
+static void test_interrupted(void) {
+	rboot_history_entry entries[4];
+
+	setup();
+	find_image();
+	find_image();
+	sim.ops = 0;
+	find_image();
+	CHECK(sim.ops == 1);
+
+	setup();
+	find_image();
+	find_image();
+	CHECK(SIM_CUT_AT(0, find_image()));
+	find_image();
+	CHECK(rboot_get_boot_history(entries, 4) == 3);
+	CHECK(entries[0].count == 4 && entries[1].count == 2 && entries[2].count == 1);
+}
+
+int main(void) {
+	sim_init();
+	test_boots();
+	test_fallback();
+	test_interrupted();
+	return sim_report("history");
+}
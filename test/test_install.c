@@ -0,0 +1,178 @@
+//////////////////////////////////////////////////
+// rBoot host tests, installing packed roms from the staging area.
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+// a packed rom is unpacked in to its slot and booted, and an install
+// interrupted at any erase or program resumes on the next boot and
+// still ends up booting the complete rom
+
+#include "../rboot.c"
+#include <string.h>
+#include <c_types.h>
+#include "rboot-api.h"
+#include "sim.h"
+
+#define ROM0 0x2000
+#define ROM1 0x82000
+
+static uint8_t image[0x10000];
+static uint32_t imagelen;
+static uint32_t packedlen;
+
+// pack one block in the format unpack_block reads, greedy longest match
+static uint32_t pack_block(const uint8_t *in, uint32_t len, uint8_t *out) {
+	uint32_t pos = 0, outpos = 0, lit = 0;
+	uint32_t best, bestoff, off, n;
+
+	while (pos < len) {
+		best = 0;
+		bestoff = 0;
+		for (off = 1; off <= pos && off < 0x10000; off++) {
+			for (n = 0; n < 130 && pos + n < len && in[pos + n] == in[pos + n - off]; n++);
+			if (n > best) {
+				best = n;
+				bestoff = off;
+			}
+		}
+		if (best >= 3) {
+			if (lit) {
+				out[outpos - lit - 1] = lit - 1;
+				lit = 0;
+			}
+			out[outpos++] = 0x80 | (best - 3);
+			out[outpos++] = bestoff & 0xff;
+			out[outpos++] = bestoff >> 8;
+			pos += best;
+		} else {
+			if (lit == 0) outpos++;
+			out[outpos++] = in[pos++];
+			if (++lit == 128) {
+				out[outpos - lit - 1] = lit - 1;
+				lit = 0;
+			}
+		}
+	}
+	if (lit) {
+		out[outpos - lit - 1] = lit - 1;
+	}
+	// store it if packing didn't help
+	if (outpos >= len) {
+		memcpy(out, in, len);
+		outpos = len;
+	}
+	return outpos;
+}
+
+// pack the image in to the staging area and request the install
+static void stage(uint8_t rom) {
+	uint8_t block[SECTOR_SIZE * 2];
+	uint32_t pos = BOOT_STAGING_ADDR + SECTOR_SIZE;
+	uint32_t sector, len, plen, hdr;
+
+	for (sector = 0; sector * SECTOR_SIZE < imagelen; sector++) {
+		len = imagelen - (sector * SECTOR_SIZE);
+		if (len > SECTOR_SIZE) len = SECTOR_SIZE;
+		memset(block, 0, sizeof(block));
+		plen = pack_block(image + (sector * SECTOR_SIZE), len, block);
+		hdr = plen | (len << 16);
+		memcpy(sim_flash + pos, &hdr, sizeof(hdr));
+		memcpy(sim_flash + pos + sizeof(hdr), block, (plen + 3) & ~3);
+		pos += sizeof(hdr) + ((plen + 3) & ~3);
+	}
+	packedlen = pos - (BOOT_STAGING_ADDR + SECTOR_SIZE);
+	CHECK(rboot_set_install(rom, packedlen, imagelen));
+}
+
+static void setup(void) {
+	uint32_t roms[2] = {ROM0, ROM1};
+
+	sim_erase_all(0x100000);
+	sim_write_rom(ROM0, 0x4000, 2, 0x400, 30);
+	sim_write_rom(ROM1, 0x4000, 2, 0x400, 31);
+	sim_write_config(2, roms, 0);
+
+	// the new rom for slot 1, built past the end of the 1MB flash
+	imagelen = sim_write_rom(0x200000, 0x8000, 3, 0x800, 0);
+	memcpy(image, sim_flash + 0x200000, imagelen);
+	stage(1);
+}
+
+// the installed rom is complete and selected
+static void check_installed(void) {
+	rboot_config romconf;
+
+	CHECK(memcmp(sim_flash + ROM1, image, imagelen) == 0);
+	sim_read_config(&romconf);
+	CHECK(romconf.current_rom == 1);
+	CHECK(((rboot_install*)(sim_flash + BOOT_STAGING_ADDR))->magic != BOOT_INSTALL_MAGIC);
+}
+
+static void test_install(void) {
+	uint32_t start;
+
+	setup();
+	sim_clear_stats();
+	start = sim_time_us;
+	CHECK(find_image() == ROM1 + sizeof(rom_header_new) + 0x8000);
+	check_installed();
+	printf("install: %u byte rom packed to %u bytes, installed in %u us with %u erases\n",
+		imagelen, packedlen, sim_time_us - start, sim.erases);
+
+	// nothing left to do on the next boot
+	sim_clear_stats();
+	CHECK(find_image() == ROM1 + sizeof(rom_header_new) + 0x8000);
+	CHECK(sim.erases == 0);
+}
+
+static void test_bad_record(void) {
+	// damaged packed data, the slot is left alone
+	setup();
+	sim_flash[BOOT_STAGING_ADDR + SECTOR_SIZE + 4] = 0x7f;
+	sim_flash[BOOT_STAGING_ADDR + SECTOR_SIZE + 5] = 0x80;
+	find_image();
+	CHECK(((rboot_install*)(sim_flash + BOOT_STAGING_ADDR))->magic != BOOT_INSTALL_MAGIC);
+
+	// the api checks the block structure before requesting it
+	setup();
+	CHECK(!rboot_set_install(1, packedlen - 8, imagelen));
+	CHECK(!rboot_set_install(1, packedlen, imagelen + SECTOR_SIZE));
+	CHECK(!rboot_set_install(1, packedlen, 0x100000));
+}
+
+// cut the power at each erase and program of the install in turn
+static void test_interrupted(void) {
+	uint32_t ops;
+	uint32_t cut;
+	uint32_t resumed = 0;
+
+	setup();
+	sim.ops = 0;
+	find_image();
+	ops = sim.ops;
+
+	for (cut = 0; cut < ops; cut++) {
+		setup();
+		if (!SIM_CUT_AT(cut, find_image())) {
+			continue;
+		}
+		// and again, on the way back up
+		SIM_CUT_AT(cut / 2, find_image());
+		CHECK(find_image() == ROM1 + sizeof(rom_header_new) + 0x8000);
+		check_installed();
+		if (sim_failures) {
+			printf("  power cut at op %u of %u\n", cut, ops);
+			break;
+		}
+		resumed++;
+	}
+	printf("install: resumed after a power cut at each of %u ops\n", resumed);
+}
+
+int main(void) {
+	sim_init();
+	test_install();
+	test_bad_record();
+	test_interrupted();
+	return sim_report("install");
+}
@@ -0,0 +1,572 @@
+//////////////////////////////////////////////////
+// rBoot host tests, the OTA writer.
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+// edge cases of the OTA session api, mixing the ways data is given to a
+// session and the state it is left in when it ends or is cancelled
+
+#include "../rboot-ota.c"
+#include "sim.h"
+
+#define ROM0 0x2000
+#define ROM1 0x82000
+#define SCRATCH 0x200000
+
+static uint32_t romlen;
+
+// a rom for slot 1 built at the scratch address, slot 1 left erased
+static void setup(void) {
+	uint32_t roms[2] = {ROM0, ROM1};
+
+	sim_erase_all(0x100000);
+	sim_write_config(2, roms, 0);
+	sim_write_rom(ROM0, 0x4000, 2, 0x400, 90);
+	romlen = sim_write_rom(SCRATCH, 0x8000, 2, 0x800, 91);
+}
+
+// a header queued by submit is checked by poll, write waits for it
+static void test_submit_then_write(void) {
+	ota_handle_t handle;
+	uint8_t *rom = sim_flash + SCRATCH;
+	uint32_t accepted;
+
+	setup();
+	CHECK(rboot_ota_begin(&handle, 1, romlen) == OTA_OK);
+	CHECK(rboot_ota_submit(&handle, rom, 0x20, &accepted) == OTA_OK);
+	CHECK(accepted == 0x20);
+	CHECK(rboot_ota_write(&handle, rom + 0x20, 0x100) == OTA_ERR_IN_PROGRESS);
+	CHECK(handle.queued == 0x20);
+	while (rboot_ota_poll(&handle, 0xffffffff) == OTA_PENDING);
+	CHECK(!handle.admit);
+	CHECK(rboot_ota_write(&handle, rom + 0x20, romlen - 0x20) == OTA_OK);
+	CHECK(rboot_ota_end(&handle) == OTA_OK);
+	CHECK(memcmp(sim_flash + ROM1, rom, romlen) == 0);
+
+	// a part header can be finished by either
+	setup();
+	CHECK(rboot_ota_begin(&handle, 1, romlen) == OTA_OK);
+	CHECK(rboot_ota_submit(&handle, rom, 6, &accepted) == OTA_OK);
+	CHECK(rboot_ota_write(&handle, rom + 6, romlen - 6) == OTA_OK);
+	CHECK(rboot_ota_end(&handle) == OTA_OK);
+	CHECK(memcmp(sim_flash + ROM1, rom, romlen) == 0);
+}
+
+// a rom written in chunks of random sizes, from any alignment of the
+// caller's memory, arrives byte for byte
+static void test_chunks(void) {
+	static uint32_t words[0x2000 / sizeof(uint32_t)];
+	ota_handle_t handle;
+	uint8_t *rom = sim_flash + SCRATCH;
+	uint8_t *src;
+	uint32_t run, pos, len;
+
+	for (run = 0; run < 40 && !sim_failures; run++) {
+		setup();
+		sim_seed(run + 1);
+		CHECK(rboot_ota_begin(&handle, 1, romlen) == OTA_OK);
+		for (pos = 0; pos < romlen; pos += len) {
+			// small chunks for the first half of the runs, then up to
+			// more than a sector
+			len = 1 + sim_rand() % ((run < 20) ? 16 : sizeof(words) - 4);
+			if (len > romlen - pos) {
+				len = romlen - pos;
+			}
+			src = (uint8_t*)words + sim_rand() % 4;
+			memcpy(src, rom + pos, len);
+			CHECK(rboot_ota_write(&handle, src, len) == OTA_OK);
+		}
+		CHECK(rboot_ota_end(&handle) == OTA_OK);
+		CHECK(memcmp(sim_flash + ROM1, rom, romlen) == 0);
+	}
+}
+
+// bytes copied through the buffer, from word aligned memory and realigned
+// from odd addresses, for a buffered writer it would be all of them
+static void test_copies(void) {
+	static const uint32_t chunks[] = {4, 536, 1460, 4096};
+	static uint32_t words[0x1000 / sizeof(uint32_t) + 1];
+	ota_handle_t handle;
+	uint8_t *rom = sim_flash + SCRATCH;
+	uint32_t loop, pos, len, offset;
+
+	for (loop = 0; loop < sizeof(chunks) / sizeof(chunks[0]); loop++) {
+		for (offset = 0; offset < 2; offset++) {
+			setup();
+			sim_clear_stats();
+			CHECK(rboot_ota_begin(&handle, 1, romlen) == OTA_OK);
+			for (pos = 0; pos < romlen; pos += len) {
+				len = (romlen - pos < chunks[loop]) ? romlen - pos : chunks[loop];
+				memcpy((uint8_t*)words + offset, rom + pos, len);
+				CHECK(rboot_ota_write(&handle, (uint8_t*)words + offset, len) == OTA_OK);
+			}
+			CHECK(rboot_ota_end(&handle) == OTA_OK);
+			CHECK(memcmp(sim_flash + ROM1, rom, romlen) == 0);
+			if (offset == 0) {
+				// only the header held back to be checked, and a part
+				// word at the end
+				CHECK(handle.metrics.bytes_copied <= OTA_HEADER_LEN + 3);
+			} else {
+				CHECK(handle.metrics.bytes_copied == romlen);
+			}
+			printf("ota: %4u byte chunks %s, %5u of %u bytes copied, %4u programs\n",
+				chunks[loop], offset ? "unaligned" : "aligned  ", handle.metrics.bytes_copied, romlen, sim.programs);
+		}
+	}
+}
+
+// each poll keeps within its budget by the simulated clock, an erase is
+// left for a call given room for one (as an app would run it from a task
+// where it can block), the longest call and throughput for a few budgets
+static void test_poll_budget(void) {
+	static const uint32_t budgets[] = {OTA_PROGRAM_US, 5000, OTA_ERASE_US};
+	ota_handle_t handle;
+	uint8_t *rom = sim_flash + SCRATCH;
+	uint32_t loop, pos, len, accepted, budget, before, took, longest, long_calls, start;
+	ota_result_t result = OTA_OK;
+
+	for (loop = 0; loop < sizeof(budgets) / sizeof(budgets[0]); loop++) {
+		setup();
+		// an old rom to erase
+		sim_write_rom(ROM1, 0x10000, 2, 0x800, 92);
+		CHECK(rboot_ota_begin(&handle, 1, romlen) == OTA_OK);
+		longest = 0;
+		long_calls = 0;
+		start = sim_time_us;
+		for (pos = 0; (pos < romlen || result == OTA_PENDING) && !sim_failures; ) {
+			// packets as they arrive, as much as the queue takes
+			if (pos < romlen) {
+				len = (romlen - pos < 1460) ? romlen - pos : 1460;
+				CHECK(rboot_ota_submit(&handle, rom + pos, len, &accepted) == OTA_OK);
+				pos += accepted;
+			}
+
+			budget = budgets[loop];
+			if (rboot_ota_poll_cost(&handle) > budget) {
+				budget = rboot_ota_poll_cost(&handle);
+				long_calls++;
+			}
+			before = sim_time_us;
+			result = rboot_ota_poll(&handle, budget);
+			took = sim_time_us - before;
+			CHECK(result == OTA_OK || result == OTA_PENDING);
+			CHECK(took <= budget);
+			if (budget == budgets[loop] && took > longest) {
+				longest = took;
+			}
+		}
+		CHECK(rboot_ota_end(&handle) == OTA_OK);
+		CHECK(memcmp(sim_flash + ROM1, rom, romlen) == 0);
+		// a short budget never takes more than a program
+		if (budgets[loop] < OTA_ERASE_US) {
+			CHECK(longest <= OTA_PROGRAM_US && long_calls > 0);
+		}
+		printf("ota: poll budget %5u us, longest call %5u us, %2u calls given longer for an erase, %6u bytes/s\n",
+			budgets[loop], longest, long_calls, (uint32_t)((uint64_t)romlen * 1000000 / (sim_time_us - start)));
+	}
+}
+
+static uint32_t sector_calls;
+
+// each sector of the slot in turn
+static void count_sector(ota_handle_t *handle, uint32_t sector_addr, void *arg) {
+	CHECK(sector_addr == ROM1 + sector_calls * SECTOR_SIZE);
+	sector_calls++;
+}
+
+// the session metrics agree with the flash operations the simulator saw
+// and its clock, over a slot with an old rom in some of it
+static void test_metrics(void) {
+	static uint32_t words[1000 / sizeof(uint32_t)];
+	const ota_metrics_t *metrics;
+	ota_handle_t handle;
+	uint8_t *rom = sim_flash + SCRATCH;
+	uint32_t pos, len, before, longest = 0, start, elapsed, sectors;
+	uint8_t progress;
+
+	setup();
+	sim_write_rom(ROM1, 0x4000, 1, 0x400, 93);
+	sector_calls = 0;
+	CHECK(rboot_ota_begin(&handle, 1, romlen) == OTA_OK);
+	CHECK(rboot_ota_set_callback(&handle, count_sector, NULL) == OTA_OK);
+	sim_clear_stats();
+	start = sim_time_us;
+	for (pos = 0; pos < romlen; pos += len) {
+		len = (romlen - pos < sizeof(words)) ? romlen - pos : sizeof(words);
+		memcpy(words, rom + pos, len);
+		before = sim_time_us;
+		CHECK(rboot_ota_write(&handle, (uint8_t*)words, len) == OTA_OK);
+		if (sim_time_us - before > longest) {
+			longest = sim_time_us - before;
+		}
+		rboot_ota_get_status(&handle, &progress);
+		CHECK(progress == (uint64_t)(pos + len) * 100 / romlen);
+	}
+
+	// everything up to the end, which writes the slot's wear to the config
+	metrics = rboot_ota_get_metrics(&handle);
+	elapsed = sim_time_us - start;
+	sectors = (romlen + SECTOR_SIZE - 1) / SECTOR_SIZE;
+	CHECK(metrics->bytes_received == romlen);
+	CHECK(metrics->bytes_written == romlen && metrics->bytes_written == sim.bytes_programmed);
+	CHECK(metrics->bytes_copied == OTA_HEADER_LEN);
+	CHECK(metrics->sectors_erased == sim.erases && sim.erases > 0);
+	CHECK(metrics->sectors_erased + metrics->sectors_skipped == sectors && metrics->sectors_skipped > 0);
+	// an erase's time takes in reading the sector for the blank check
+	CHECK(metrics->program_us >= (romlen / OTA_PAGE_SIZE) * SIM_PAGE_US);
+	CHECK(metrics->erase_us >= sim.erases * SIM_ERASE_US);
+	CHECK(metrics->erase_us + metrics->program_us == elapsed);
+	CHECK(metrics->max_stall_us == longest);
+	CHECK(metrics->avg_bps == (uint32_t)((uint64_t)romlen * 1000000 / (sim_time_us - metrics->start_us)));
+	CHECK(sector_calls == romlen / SECTOR_SIZE);
+	CHECK(rboot_ota_end(&handle) == OTA_OK);
+	CHECK(sector_calls == sectors);
+	CHECK(rboot_ota_get_status(&handle, &progress) == OTA_STATE_COMPLETE && progress == 100);
+
+	printf("ota: metrics %u bytes in %u us, %u sectors erased %u skipped, erase %u us program %u us, longest call %u us, %u bytes/s\n",
+		metrics->bytes_written, elapsed, metrics->sectors_erased, metrics->sectors_skipped,
+		metrics->erase_us, metrics->program_us, metrics->max_stall_us, metrics->avg_bps);
+}
+
+// the last few bytes of an update, padded to a word by rboot_ota_end,
+// can be the start of a sector that still holds an old rom
+static void test_tail(void) {
+	ota_handle_t handle;
+	uint8_t *rom = sim_flash + SCRATCH;
+	uint8_t tail[2] = {0x12, 0x34};
+	uint32_t pos, accepted;
+
+	setup();
+	sim_write_rom(ROM1, 0x10000, 2, 0x800, 92);
+	// rom ends on a sector, with two bytes after it
+	romlen = sim_write_rom(SCRATCH, 0x8000, 1, 0xfd0, 93);
+	CHECK(romlen == 0x9000);
+	memcpy(rom + romlen, tail, sizeof(tail));
+
+	CHECK(rboot_ota_begin(&handle, 1, romlen + sizeof(tail)) == OTA_OK);
+	for (pos = 0; pos < romlen + sizeof(tail); pos += accepted) {
+		CHECK(rboot_ota_submit(&handle, rom + pos, romlen + sizeof(tail) - pos, &accepted) == OTA_OK);
+		while (rboot_ota_poll(&handle, 0xffffffff) == OTA_PENDING);
+	}
+	CHECK(handle.queued == sizeof(tail));
+	CHECK(handle.erased_to == romlen);
+	CHECK(rboot_ota_end(&handle) == OTA_OK);
+	CHECK(memcmp(sim_flash + ROM1, rom, romlen + sizeof(tail)) == 0);
+	CHECK(sim_flash[ROM1 + romlen + sizeof(tail)] == 0xff);
+}
+
+static uint32_t slot_erases(uint8_t rom) {
+	rboot_slot_meta *meta = (rboot_slot_meta*)(sim_flash + BOOT_CONFIG_SECTOR * SECTOR_SIZE + BOOT_SLOT_META_OFFSET);
+	return (meta->magic == BOOT_SLOT_META_MAGIC) ? meta->wear[rom].erases : 0;
+}
+
+// wear counts the sectors actually erased, not those written or found blank
+static void test_wear(void) {
+	ota_handle_t handle;
+	uint8_t *rom = sim_flash + SCRATCH;
+
+	// cancelled before anything was erased, the config isn't touched
+	setup();
+	sim_clear_stats();
+	CHECK(rboot_ota_begin(&handle, 1, romlen) == OTA_OK);
+	rboot_ota_cancel(&handle);
+	CHECK(sim.erases == 0 && sim.programs == 0);
+	CHECK(rboot_ota_begin(&handle, 1, romlen) == OTA_OK);
+	CHECK(rboot_ota_write(&handle, rom, 8) == OTA_OK);
+	rboot_ota_cancel(&handle);
+	CHECK(sim.erases == 0 && sim.programs == 0);
+
+	// blank slot, nothing to erase
+	CHECK(rboot_ota_begin(&handle, 1, romlen) == OTA_OK);
+	CHECK(rboot_ota_write(&handle, rom, SECTOR_SIZE + 0x100) == OTA_OK);
+	CHECK(handle.metrics.sectors_erased == 0);
+	rboot_ota_cancel(&handle);
+	CHECK(sim.erases == 0);
+	CHECK(rboot_ota_begin(&handle, 1, romlen) == OTA_OK);
+	CHECK(rboot_ota_write(&handle, rom, romlen) == OTA_OK);
+	CHECK(rboot_ota_end(&handle) == OTA_OK);
+	CHECK(slot_erases(1) == 2);
+
+	// over an old rom, only the sectors it or the cancelled update held
+	// are erased
+	setup();
+	sim_write_rom(ROM1, 0x2000, 1, 0x100, 94);
+	CHECK(rboot_ota_begin(&handle, 1, romlen) == OTA_OK);
+	CHECK(rboot_ota_write(&handle, rom, SECTOR_SIZE * 5) == OTA_OK);
+	rboot_ota_cancel(&handle);
+	CHECK(slot_erases(1) == 3);
+	CHECK(rboot_ota_begin(&handle, 1, romlen) == OTA_OK);
+	CHECK(rboot_ota_write(&handle, rom, romlen) == OTA_OK);
+	CHECK(rboot_ota_end(&handle) == OTA_OK);
+	CHECK(slot_erases(1) == 3 + 5);
+}
+
+// two sessions, to slots 1 and 2, fed in turns as their links deliver
+#define ROM2 0xc2000
+#define CHUNK 1460
+// time for a link to deliver a chunk, about 1Mbit/s
+#define CHUNK_US 11680
+
+static uint8_t pool[2 * OTA_BUFFER_SIZE] __attribute__((aligned(4)));
+
+static void setup_two(uint32_t *len1, uint32_t *len2) {
+	uint32_t roms[3] = {ROM0, ROM1, ROM2};
+
+	sim_erase_all(0x100000);
+	sim_write_config(3, roms, 0);
+	sim_write_rom(ROM0, 0x4000, 2, 0x400, 95);
+	*len1 = sim_write_rom(SCRATCH, 0x8000, 2, 0x800, 96);
+	*len2 = sim_write_rom(SCRATCH + 0x10000, 0x6000, 3, 0x400, 97);
+}
+
+// write the next chunk of a rom, if there's any left
+static void feed(ota_handle_t *handle, const uint8_t *rom, uint32_t len) {
+	uint32_t pos = handle->write_offset + handle->queued;
+
+	if (pos < len) {
+		CHECK(rboot_ota_write(handle, rom + pos, (len - pos < CHUNK) ? len - pos : CHUNK) == OTA_OK);
+	}
+}
+
+static void test_two_sessions(void) {
+	ota_handle_t one, two;
+	ota_bundle_t bundle;
+	uint8_t *rom1 = sim_flash + SCRATCH;
+	uint8_t *rom2 = sim_flash + SCRATCH + 0x10000;
+	uint32_t len1, len2, start, us_serial, us_both;
+
+	CHECK(rboot_ota_set_pool(pool, 2) == OTA_OK);
+
+	// writes from the two interleaved, at odd offsets
+	setup_two(&len1, &len2);
+	CHECK(rboot_ota_begin(&one, 1, len1) == OTA_OK);
+	CHECK(rboot_ota_begin(&two, 2, len2) == OTA_OK);
+	while ((one.write_offset + one.queued < len1 || two.write_offset + two.queued < len2) && !sim_failures) {
+		feed(&one, rom1, len1);
+		feed(&two, rom2, len2);
+	}
+	CHECK(rboot_ota_end(&one) == OTA_OK);
+	CHECK(rboot_ota_end(&two) == OTA_OK);
+	CHECK(memcmp(sim_flash + ROM1, rom1, len1) == 0);
+	CHECK(memcmp(sim_flash + ROM2, rom2, len2) == 0);
+	CHECK(!rboot_ota_is_in_progress());
+
+	// beginning again on a handle in use leaves both sessions running
+	CHECK(rboot_ota_begin(&one, 1, len1) == OTA_OK);
+	CHECK(rboot_ota_begin(&two, 2, len2) == OTA_OK);
+	CHECK(rboot_ota_begin(&one, 1, len1) == OTA_ERR_IN_PROGRESS);
+	CHECK(is_active(&one) && is_active(&two));
+	rboot_ota_cancel(&one);
+	CHECK(!is_active(&one) && is_active(&two));
+	CHECK(rboot_ota_bundle_begin(&bundle) == OTA_OK);
+	CHECK(rboot_ota_bundle_begin(&bundle) == OTA_ERR_IN_PROGRESS);
+	CHECK(is_active(&bundle.ota) && is_active(&two));
+	rboot_ota_bundle_cancel(&bundle);
+	rboot_ota_cancel(&two);
+	CHECK(!rboot_ota_is_in_progress());
+
+	// combined rate from two links, one update after the other as with a
+	// single session, or both at once
+	setup_two(&len1, &len2);
+	start = sim_time_us;
+	CHECK(rboot_ota_begin(&one, 1, len1) == OTA_OK);
+	while (one.write_offset + one.queued < len1 && !sim_failures) {
+		sim_tick(CHUNK_US);
+		feed(&one, rom1, len1);
+	}
+	CHECK(rboot_ota_end(&one) == OTA_OK);
+	CHECK(rboot_ota_begin(&two, 2, len2) == OTA_OK);
+	while (two.write_offset + two.queued < len2 && !sim_failures) {
+		sim_tick(CHUNK_US);
+		feed(&two, rom2, len2);
+	}
+	CHECK(rboot_ota_end(&two) == OTA_OK);
+	us_serial = sim_time_us - start;
+
+	setup_two(&len1, &len2);
+	start = sim_time_us;
+	CHECK(rboot_ota_begin(&one, 1, len1) == OTA_OK);
+	CHECK(rboot_ota_begin(&two, 2, len2) == OTA_OK);
+	while ((one.write_offset + one.queued < len1 || two.write_offset + two.queued < len2) && !sim_failures) {
+		sim_tick(CHUNK_US);
+		feed(&one, rom1, len1);
+		feed(&two, rom2, len2);
+	}
+	CHECK(rboot_ota_end(&one) == OTA_OK);
+	CHECK(rboot_ota_end(&two) == OTA_OK);
+	us_both = sim_time_us - start;
+	CHECK(us_both < us_serial);
+	printf("ota: two updates of %u bytes over two links, %u bytes/s one at a time, %u bytes/s at once\n",
+		len1 + len2, (uint32_t)((uint64_t)(len1 + len2) * 1000000 / us_serial),
+		(uint32_t)((uint64_t)(len1 + len2) * 1000000 / us_both));
+
+	CHECK(rboot_ota_set_pool(ota_buffer, 1) == OTA_OK);
+}
+
+// a bundle of a rom for slot 1 and two copies of data partition 0, on a
+// 2MB flash so there's room for the data outside the rom slots
+#define DATA_LEN 0x1800
+#define DATA0 0x100000
+#define DATA1 0x110000
+
+static uint8_t stream[0x90000];
+
+static uint32_t digest(const uint8_t *data, uint32_t len) {
+	uint32_t hash = DIGEST_INIT;
+
+	while (len--) {
+		hash = (hash ^ *data++) * DIGEST_PRIME;
+	}
+	return hash;
+}
+
+static void setup_bundle(void) {
+	uint32_t roms[2] = {ROM0, ROM1};
+
+	sim_erase_all(0x200000);
+	sim_write_config(2, roms, 0);
+	sim_write_rom(ROM0, 0x4000, 2, 0x400, 98);
+	romlen = sim_write_rom(SCRATCH, 0x8000, 2, 0x800, 99);
+}
+
+// send the whole bundle, claiming a rom of length rom_len
+static ota_result_t send_bundle(uint32_t rom_len, uint32_t data0, uint32_t data1) {
+	ota_bundle_toc_t *toc = (ota_bundle_toc_t*)stream;
+	ota_bundle_t bundle;
+	ota_result_t result;
+	uint32_t pos = BUNDLE_TOC_HEADER_SIZE + 2 * sizeof(ota_bundle_entry_t);
+
+	memset(stream, 0xff, sizeof(stream));
+	toc->magic = OTA_BUNDLE_MAGIC;
+	toc->count = 2;
+	toc->entries[0].type = OTA_BUNDLE_ROM;
+	toc->entries[0].id = 1;
+	toc->entries[0].length = rom_len;
+	memcpy(stream + pos, sim_flash + SCRATCH, romlen);
+	toc->entries[0].digest = digest(stream + pos, rom_len);
+	pos += rom_len;
+	toc->entries[1].type = OTA_BUNDLE_DATA;
+	toc->entries[1].id = 0;
+	toc->entries[1].addr[0] = data0;
+	toc->entries[1].addr[1] = data1;
+	toc->entries[1].length = DATA_LEN;
+	memset(stream + pos, 0x5a, DATA_LEN);
+	toc->entries[1].digest = digest(stream + pos, DATA_LEN);
+	pos += DATA_LEN;
+	toc->digest = digest((uint8_t*)toc->entries, 2 * sizeof(ota_bundle_entry_t));
+
+	CHECK(rboot_ota_bundle_begin(&bundle) == OTA_OK);
+	result = rboot_ota_bundle_write(&bundle, stream, pos);
+	if (result != OTA_OK) {
+		rboot_ota_bundle_cancel(&bundle);
+		return result;
+	}
+	return rboot_ota_bundle_end(&bundle);
+}
+
+// refused before anything is erased, the config is put back in case it wasn't
+static void check_refused(uint32_t rom_len, uint32_t data0, uint32_t data1) {
+	uint8_t config[SECTOR_SIZE];
+
+	memcpy(config, sim_flash + BOOT_CONFIG_SECTOR * SECTOR_SIZE, SECTOR_SIZE);
+	sim_clear_stats();
+	CHECK(send_bundle(rom_len, data0, data1) == OTA_ERR_INVALID_IMAGE);
+	CHECK(sim.erases == 0 && sim.programs == 0);
+	memcpy(sim_flash + BOOT_CONFIG_SECTOR * SECTOR_SIZE, config, SECTOR_SIZE);
+}
+
+static void test_bundle_ranges(void) {
+	setup_bundle();
+	CHECK(send_bundle(romlen, DATA0, DATA1) == OTA_OK);
+	CHECK(memcmp(sim_flash + ROM1, sim_flash + SCRATCH, romlen) == 0);
+	CHECK(sim_flash[DATA1] == 0x5a && sim_flash[DATA1 + DATA_LEN - 1] == 0x5a);
+	CHECK(rboot_ota_data_copy(0) == 1);
+
+	setup_bundle();
+	// a rom longer than its slot
+	check_refused(0x80000, DATA0, DATA1);
+	// data not sector aligned
+	check_refused(romlen, DATA0 + 0x100, DATA1);
+	check_refused(romlen, DATA0, DATA1 + 4);
+	// over rBoot or its config, a rom slot or the end of the flash
+	check_refused(romlen, 0, DATA1);
+	check_refused(romlen, DATA0, BOOT_CONFIG_SECTOR * SECTOR_SIZE);
+	check_refused(romlen, ROM0 + 0x10000, DATA1);
+	check_refused(romlen, DATA0, 0xf0000);
+	check_refused(romlen, DATA0, 0x1ff000);
+	check_refused(romlen, 0xfffff000, DATA1);
+	// copies over each other
+	check_refused(romlen, DATA0, DATA0 + SECTOR_SIZE);
+}
+
+#ifdef BOOT_PARTITIONS
+// in a rom slot, but in a partition
+static void test_bundle_partition(void) {
+	rboot_part_table *table = (rboot_part_table*)(sim_flash + BOOT_CONFIG_SECTOR * SECTOR_SIZE + BOOT_PART_TABLE_OFFSET);
+
+	setup_bundle();
+	memset(table, 0, sizeof(rboot_part_table));
+	table->magic = BOOT_PART_MAGIC;
+	table->count = 1;
+	memcpy(table->parts[0].name, "assets", 6);
+	table->parts[0].offset = 0xf0000;
+	table->parts[0].size = 0x8000;
+	table->parts[0].type = PART_TYPE_ASSETS;
+	table->chksum = sim_chksum((uint8_t*)table->parts, (uint8_t*)(table + 1));
+	check_refused(romlen, DATA0, 0xf0000 - SECTOR_SIZE);
+	check_refused(romlen, DATA0, 0xf7000);
+	CHECK(send_bundle(romlen, DATA0, 0xf0000) == OTA_OK);
+	CHECK(sim_flash[0xf0000] == 0x5a);
+}
+#endif
+
+#ifdef BOOT_PLAN_ENABLED
+// a plan for slot 1, as the app stores one
+static void set_plan(void) {
+	rboot_plan *plan = (rboot_plan*)(sim_flash + BOOT_CONFIG_SECTOR * SECTOR_SIZE + BOOT_PLAN_OFFSET(1));
+
+	memset(plan, 0, sizeof(rboot_plan));
+	plan->magic = BOOT_PLAN_MAGIC;
+	plan->count = 1;
+	plan->rom_addr = ROM1;
+	plan->chksum = sim_chksum((uint8_t*)plan, &plan->chksum);
+}
+
+// a rom written by a session or a bundle clears the plan of its slot
+static void test_plan_cleared(void) {
+	ota_handle_t handle;
+	uint8_t *plan = sim_flash + BOOT_CONFIG_SECTOR * SECTOR_SIZE + BOOT_PLAN_OFFSET(1);
+
+	setup();
+	set_plan();
+	CHECK(rboot_ota_begin(&handle, 1, romlen) == OTA_OK);
+	CHECK(rboot_ota_write(&handle, sim_flash + SCRATCH, romlen) == OTA_OK);
+	CHECK(rboot_ota_end(&handle) == OTA_OK);
+	CHECK(plan[0] == 0xff && plan[sizeof(rboot_plan) - 1] == 0xff);
+
+	setup_bundle();
+	set_plan();
+	CHECK(send_bundle(romlen, DATA0, DATA1) == OTA_OK);
+	CHECK(plan[0] == 0xff && plan[sizeof(rboot_plan) - 1] == 0xff);
+}
+#endif
+
+int main(void) {
+	sim_init();
+	test_submit_then_write();
+	test_chunks();
+	test_copies();
+	test_poll_budget();
+	test_metrics();
+	test_tail();
+	test_wear();
+	test_two_sessions();
+	test_bundle_ranges();
+#ifdef BOOT_PARTITIONS
+	test_bundle_partition();
+#endif
+#ifdef BOOT_PLAN_ENABLED
+	test_plan_cleared();
+#endif
+	return sim_report("ota");
+}
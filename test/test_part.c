@@ -0,0 +1,200 @@
+//////////////////////////////////////////////////
+// rBoot host tests, the partition table.
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+// a table given in any order is stored sorted by name with an index sorted
+// by type, the same whether the host tool or rboot_set_part_table builds
+// it, each partition is then found by name and by type, and a table with
+// partitions that overlap or cross a 1MB boundary is refused by both
+
+#define RBOOT_PART_NO_MAIN
+#include "../tools/rboot-part.c"
+#include <c_types.h>
+#include "rboot-private.h"
+#include "rboot-api.h"
+#include "sim.h"
+
+#define ROM0 0x2000
+#define ROM1 0x102000
+#define PARTS 7
+
+// the layout, in no order, two of each type but the sdk config
+static const char *layout[PARTS] = {
+	"store  data       0x200000 1m",
+	"sdkcfg sdkconfig  0x3fc000 16k  # the sdk's own",
+	"www    assets     0x300000 512k 1",
+	"logs   log        0x3f0000 48k",
+	"cal    data       0x1fe000 8k   2",
+	"trace  log        0x3e0000 64k",
+	"fonts  assets     0x380000 0x40000",
+};
+
+static uint8_t *stored;
+
+static void setup(void) {
+	uint32_t roms[2] = {ROM0, ROM1};
+
+	sim_erase_all(0x400000);
+	sim_write_config(2, roms, 0);
+	stored = sim_flash + BOOT_CONFIG_SECTOR * SECTOR_SIZE + BOOT_PART_TABLE_OFFSET;
+}
+
+// the layout read by the tool's parser
+static void parse(rboot_part_table *table) {
+	char line[64];
+	uint8_t loop;
+
+	memset(table, 0, sizeof(rboot_part_table));
+	for (loop = 0; loop < PARTS; loop++) {
+		strcpy(line, layout[loop]);
+		CHECK(part_parse(line, &table->parts[table->count++]) == 1);
+	}
+}
+
+// the layout lines the tool reads, and those it doesn't
+static void test_parse(void) {
+	static const char *bad[] = {
+		"toolongname data 0x10000 4k",
+		"a nosuchtype 0x10000 4k",
+		"a data 0x10000",
+		"a data 0x10000 4q",
+		"a data 0x10000 4k 0x100",
+		"a data 0x10000 4k 1 2",
+	};
+	rboot_partition part;
+	char line[64];
+	uint8_t loop;
+
+	strcpy(line, "  # a comment");
+	CHECK(part_parse(line, &part) == 0);
+	strcpy(line, "\r\n");
+	CHECK(part_parse(line, &part) == 0);
+	strcpy(line, "eightchr 0x90 0x10000 2m 7\n");
+	CHECK(part_parse(line, &part) == 1);
+	CHECK(memcmp(part.name, "eightchr", BOOT_PART_NAME_LEN) == 0);
+	CHECK(part.type == 0x90 && part.offset == 0x10000 && part.size == 0x200000 && part.flags == 7);
+	for (loop = 0; loop < sizeof(bad) / sizeof(bad[0]); loop++) {
+		strcpy(line, bad[loop]);
+		CHECK(part_parse(line, &part) == -1);
+	}
+}
+
+// sorted by name, the index by type (then name), and what the tool builds
+// is what rboot_set_part_table stores
+static void test_sort(void) {
+	rboot_part_table tool, api;
+	uint8_t loop;
+
+	parse(&tool);
+	api = tool;
+	CHECK(part_build(&tool) == NULL);
+	for (loop = 1; loop < PARTS; loop++) {
+		CHECK(strncmp(tool.parts[loop - 1].name, tool.parts[loop].name, BOOT_PART_NAME_LEN) < 0);
+		CHECK(tool.parts[tool.by_type[loop - 1]].type < tool.parts[tool.by_type[loop]].type
+			|| (tool.parts[tool.by_type[loop - 1]].type == tool.parts[tool.by_type[loop]].type
+				&& tool.by_type[loop - 1] < tool.by_type[loop]));
+	}
+	CHECK(tool.by_type[PARTS] == 0xff);
+
+	setup();
+	CHECK(rboot_set_part_table(&api));
+	CHECK(memcmp(stored, &tool, sizeof(tool)) == 0);
+	CHECK(memcmp(&api, &tool, sizeof(tool)) == 0);
+
+	// and the tool's image, as written to a new device, is read back
+	setup();
+	part_sector(&tool, sim_flash + BOOT_CONFIG_SECTOR * SECTOR_SIZE);
+	CHECK(rboot_get_part_table(&api));
+	CHECK(memcmp(&api, &tool, sizeof(tool)) == 0);
+}
+
+// each partition found by name and as the nth of its type, and nothing
+// for a name or type that isn't there, reading the table once a lookup
+static void test_lookup(void) {
+	rboot_part_table table;
+	rboot_partition part;
+	uint8_t loop, n;
+
+	parse(&table);
+	setup();
+	CHECK(rboot_set_part_table(&table));
+	for (loop = 0; loop < PARTS; loop++) {
+		sim_clear_stats();
+		CHECK(rboot_find_partition(table.parts[loop].name, &part));
+		CHECK(memcmp(&part, &table.parts[loop], sizeof(part)) == 0);
+		CHECK(sim.reads == 1);
+	}
+	CHECK(rboot_find_partition("data", &part) == false);
+	CHECK(rboot_find_partition("", &part) == false);
+
+	for (loop = 0; loop < PARTS; loop++) {
+		// which of its type it is, by offset in the index
+		for (n = 0; loop - n > 0 && table.parts[table.by_type[loop - n - 1]].type == table.parts[table.by_type[loop]].type; n++);
+		CHECK(rboot_find_partition_type(table.parts[table.by_type[loop]].type, n, &part));
+		CHECK(memcmp(&part, &table.parts[table.by_type[loop]], sizeof(part)) == 0);
+	}
+	CHECK(rboot_find_partition_type(PART_TYPE_DATA, 1, &part) && part.offset == 0x200000);
+	CHECK(rboot_find_partition_type(PART_TYPE_DATA, 2, &part) == false);
+	CHECK(rboot_find_partition_type(PART_TYPE_SDKCONFIG, 1, &part) == false);
+	CHECK(rboot_find_partition_type(PART_TYPE_USER, 0, &part) == false);
+}
+
+// one partition of the layout changed, refused by the tool, and by
+// rboot_set_part_table leaving the stored table as it was
+static void refused(uint8_t index, uint32_t offset, uint32_t size, const char *why) {
+	rboot_part_table tool, api;
+	const char *error;
+
+	parse(&tool);
+	tool.parts[index].offset = offset;
+	tool.parts[index].size = size;
+	api = tool;
+	error = part_build(&tool);
+	CHECK(error != NULL && strcmp(error, why) == 0);
+
+	setup();
+	parse(&tool);
+	CHECK(rboot_set_part_table(&tool));
+	memcpy(&tool, stored, sizeof(tool));
+	CHECK(rboot_set_part_table(&api) == false);
+	CHECK(memcmp(stored, &tool, sizeof(tool)) == 0);
+}
+
+static void test_refused(void) {
+	// cal and fonts moved over the first 1MB boundary, clear of the rest
+	refused(4, 0xff000, 0x2000, "crosses a 1MB boundary");
+	refused(6, 0xf0000, 0x20000, "crosses a 1MB boundary");
+	// cal moved in to the last sector of store, the first of www, and trace
+	// over logs and sdkcfg
+	refused(4, 0x2ff000, 0x1000, "overlaps another");
+	refused(4, 0x300000, 0x1000, "overlaps another");
+	refused(5, 0x3f8000, 0x8000, "overlaps another");
+	// over rBoot or its config, or part sectors
+	refused(4, 0x1000, 0x1000, "over rBoot or its config");
+	refused(4, 0x2800, 0x1000, "not whole sectors");
+	refused(4, 0x2000, 0, "not whole sectors");
+}
+
+// partitions that only touch (as www and fonts do), and one ending at a
+// 1MB boundary, are fine
+static void test_edges(void) {
+	rboot_part_table table;
+
+	parse(&table);
+	table.parts[4].offset = 0x2000;
+	table.parts[4].size = 0xfe000;
+	CHECK(part_build(&table) == NULL);
+	setup();
+	CHECK(rboot_set_part_table(&table));
+}
+
+int main(void) {
+	sim_init();
+	test_parse();
+	test_sort();
+	test_lookup();
+	test_refused();
+	test_edges();
+	return sim_report("part");
+}
@@ -0,0 +1,217 @@
+//////////////////////////////////////////////////
+// rBoot host tests, serving installed roms to peer devices.
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+// a fleet of simulated devices, each with its own flash, fetches a rom
+// from an upstream device and, once a device has it, from each other,
+// over a lossy loopback link, checking every block against the manifest
+
+#include <string.h>
+#include <stdlib.h>
+#include <c_types.h>
+#include "rboot-private.h"
+#include "rboot-api.h"
+#include "sim.h"
+
+#define FLASH_SIZE 0x200000
+#define ROM0 0x2000
+#define ROM1 0x102000
+#define DEVICES 8
+#define CORRUPT_PERCENT 1
+
+// per device state, its flash is swapped in to the simulated flash to use it
+typedef struct {
+	uint8_t *flash;
+	rboot_write_status status;
+	rboot_image image;
+	uint16_t next;           // next block it needs
+} device;
+
+static device fleet[DEVICES];
+static int32_t current = -1;
+static uint32_t romlen;
+static uint32_t manifest[SECTOR_SIZE / sizeof(uint32_t)];
+static uint32_t block[RBOOT_BLOCK_SIZE / sizeof(uint32_t)];
+static uint32_t refetched;
+
+static void use(int32_t dev) {
+	if (dev != current) {
+		if (current >= 0) {
+			memcpy(fleet[current].flash, sim_flash, FLASH_SIZE);
+		}
+		memcpy(sim_flash, fleet[dev].flash, FLASH_SIZE);
+		current = dev;
+	}
+}
+
+// the running rom on every device, the new rom only upstream (device 0)
+static void setup(void) {
+	uint32_t roms[2] = {ROM0, ROM1};
+	uint32_t len;
+	int32_t dev;
+
+	current = -1;
+	for (dev = 0; dev < DEVICES; dev++) {
+		sim_erase_all(FLASH_SIZE);
+		sim_write_config(2, roms, 0);
+		len = sim_write_rom(ROM0, 0x10000, 2, 0x800, 80);
+		CHECK(rboot_write_block_table(0, len));
+		if (dev == 0) {
+			romlen = sim_write_rom(ROM1, 0x60000, 3, 0x800, 81);
+			CHECK(rboot_write_block_table(1, romlen));
+			CHECK(rboot_image_open(1, &fleet[dev].image));
+		}
+		if (!fleet[dev].flash) {
+			fleet[dev].flash = malloc(FLASH_SIZE);
+		}
+		memcpy(fleet[dev].flash, sim_flash, FLASH_SIZE);
+		fleet[dev].status = rboot_write_init(ROM1);
+		fleet[dev].next = 0;
+	}
+}
+
+static void test_read(void) {
+	rboot_image image;
+	uint32_t data[0x100];
+
+	setup();
+	use(0);
+	// the running rom is read through the mapping, the other isn't
+	CHECK(rboot_image_open(0, &image));
+	CHECK(image.data != NULL);
+	CHECK(rboot_image_read(&image, 0x1234 & ~3, data, sizeof(data)));
+	CHECK(memcmp(data, sim_flash + ROM0 + (0x1234 & ~3), sizeof(data)) == 0);
+	CHECK(rboot_image_open(1, &image));
+	CHECK(image.data == NULL);
+	CHECK(rboot_image_read(&image, 0x5678 & ~3, data, sizeof(data)));
+	CHECK(memcmp(data, sim_flash + ROM1 + (0x5678 & ~3), sizeof(data)) == 0);
+	CHECK(!rboot_image_read(&image, romlen & ~3, data, sizeof(data)));
+	CHECK(rboot_image_read_block(&image, image.blocks - 1, block) == romlen - (image.blocks - 1) * RBOOT_BLOCK_SIZE);
+	CHECK(rboot_image_read_block(&image, image.blocks, block) == 0);
+
+	// a damaged rom isn't served
+	sim_flash[ROM1 + 0x20000] ^= 1;
+	CHECK(!rboot_image_open(1, &image));
+	sim_flash[ROM1 + 0x20000] ^= 1;
+}
+
+// send a block from one device to another, true if it arrived intact
+static uint8_t transfer(int32_t from, int32_t to, uint8_t real) {
+	uint32_t len;
+	uint8_t corrupt = (sim_rand() % 100) < CORRUPT_PERCENT;
+
+	if (real) {
+		use(from);
+		len = rboot_image_read_block(&fleet[from].image, fleet[to].next, block);
+		CHECK(len != 0);
+		if (corrupt) {
+			((uint8_t*)block)[sim_rand() % len] ^= 1 << (sim_rand() % 8);
+		}
+		use(to);
+		if (!rboot_check_manifest_block((rboot_block_table*)manifest, fleet[to].next, (uint8_t*)block)) {
+			CHECK(corrupt);
+			refetched++;
+			return 0;
+		}
+		CHECK(!corrupt);
+		CHECK(rboot_write_flash(&fleet[to].status, (uint8_t*)block, len));
+	} else if (corrupt) {
+		return 0;
+	}
+	return 1;
+}
+
+// an upstream that can send upstream blocks per tick and, with peers,
+// devices that have the rom sending a block each, every device taking
+// one block per tick, returns the ticks for the whole fleet to have it
+static uint32_t run_fleet(uint32_t devices, uint32_t blocks, uint32_t upstream, uint8_t peers, uint8_t real) {
+	static uint16_t next[1000];
+	static uint8_t complete[1000];
+	uint32_t ticks = 0;
+	uint32_t done = 1;
+	uint32_t dev, server, sent, from;
+
+	memset(next, 0, sizeof(next));
+	memset(complete, 0, sizeof(complete));
+	complete[0] = 1;
+	while (done < devices) {
+		ticks++;
+		// the devices that can serve this tick
+		server = 1;
+		sent = 0;
+		for (dev = 1; dev < devices; dev++) {
+			if (complete[dev]) continue;
+			// upstream first, then the next peer with the rom
+			if (sent < upstream) {
+				from = 0;
+				sent++;
+			} else {
+				if (!peers) break;
+				while (server < devices && complete[server] != 1) server++;
+				if (server >= devices) break;
+				from = server++;
+			}
+			if (real) fleet[dev].next = next[dev];
+			if (transfer(from, dev, real)) {
+				next[dev]++;
+			}
+			if (next[dev] == blocks) {
+				complete[dev] = 2;
+			}
+		}
+		// a device serves from the tick after it finishes
+		for (dev = 1; dev < devices; dev++) {
+			if (complete[dev] == 2) {
+				complete[dev] = 1;
+				done++;
+				if (real) {
+					use(dev);
+					CHECK(rboot_write_end(&fleet[dev].status));
+					CHECK(rboot_write_block_table(1, romlen));
+					CHECK(rboot_image_open(1, &fleet[dev].image));
+					CHECK(fleet[dev].image.digest == ((rboot_block_table*)manifest)->table_digest);
+					CHECK(memcmp(sim_flash + ROM1, fleet[0].flash + ROM1, romlen) == 0);
+				}
+			}
+		}
+	}
+	return ticks;
+}
+
+static void test_fleet(void) {
+	uint32_t upstream, blocks, single, peer;
+
+	setup();
+	use(0);
+	blocks = fleet[0].image.blocks;
+	CHECK(rboot_image_read_manifest(&fleet[0].image, 0, manifest, RBOOT_MANIFEST_LEN(blocks)));
+	CHECK(rboot_check_manifest((rboot_block_table*)manifest, RBOOT_MANIFEST_LEN(blocks)));
+	CHECK(!rboot_check_manifest((rboot_block_table*)manifest, RBOOT_MANIFEST_LEN(blocks) - 4));
+
+	// every device fetches the rom for real, from upstream and its peers
+	sim_seed(1);
+	refetched = 0;
+	run_fleet(DEVICES, blocks, 1, 1, 1);
+	CHECK(refetched > 0);
+	printf("peer: %u devices fetched the rom, %u damaged blocks caught and fetched again\n",
+		DEVICES - 1, refetched);
+
+	// fleet completion time of 100 devices, in ticks of one block per link
+	for (upstream = 1; upstream <= 16; upstream *= 4) {
+		sim_seed(2);
+		single = run_fleet(101, blocks, upstream, 0, 0);
+		sim_seed(2);
+		peer = run_fleet(101, blocks, upstream, 1, 0);
+		CHECK(peer < single);
+		printf("peer: 100 devices, %u blocks, upstream %2u blocks/tick: single source %5u ticks, peer serving %4u ticks\n",
+			blocks, upstream, single, peer);
+	}
+}
+
+int main(void) {
+	sim_init();
+	test_read();
+	test_fleet();
+	return sim_report("peer");
+}
@@ -0,0 +1,222 @@
+//////////////////////////////////////////////////
+// rBoot host tests, the receive to flash pipe.
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+// a receive thread fills the pipe while a writer thread drains it to
+// flash, the rom arrives byte for byte whatever the chunk sizes and
+// interleaving, and with flash operations taking real time a receive is
+// no longer held up by an erase as it is writing straight to flash
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <c_types.h>
+#include "rboot-private.h"
+#include "rboot-api.h"
+#include "sim.h"
+
+#define ROM0 0x2000
+#define ROM1 0x82000
+#define SLOT_SIZE 0x400
+// a full sized tcp segment
+#define PACKET 1460
+// flash operations take a tenth of their simulated time for real
+#define REALTIME_DIV 10
+
+static uint8_t image[0x20000];
+static uint32_t image_len;
+static uint32_t slots[RBOOT_PIPE_MAX_SLOTS * SLOT_SIZE / sizeof(uint32_t)];
+
+static rboot_write_status status;
+static rboot_pipe pipe_;
+static int received;
+static int failed;
+
+// receive side settings and results
+static uint32_t seed;
+static uint32_t interval_us;
+static uint8_t direct;
+static uint32_t max_latency_us;
+static uint64_t total_latency_us;
+static uint32_t packets;
+
+static uint64_t now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// the receive thread's own random numbers, sim_rand isn't shared
+static uint32_t next_rand(void) {
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+static void setup(void) {
+	uint32_t roms[2] = {ROM0, ROM1};
+
+	sim_erase_all(0x100000);
+	image_len = sim_write_rom(ROM1, 0x18000, 3, 0x800, 110);
+	memcpy(image, sim_flash + ROM1, image_len);
+	sim_erase_all(0x100000);
+	sim_write_config(2, roms, 0);
+	status = rboot_write_init(ROM1);
+	received = 0;
+	failed = 0;
+	max_latency_us = 0;
+	total_latency_us = 0;
+	packets = 0;
+}
+
+// receive the image, paced at interval_us a packet when set, each packet
+// placed in the pipe (or, direct, written straight to flash) before the
+// next is taken, as a receive callback would
+static void *receive(void *arg) {
+	uint64_t start = now_us(), arrival, latency;
+	uint32_t pos, len, done, n;
+	uint16_t space;
+	uint8_t *slot;
+
+	for (pos = 0; pos < image_len && !__atomic_load_n(&failed, __ATOMIC_ACQUIRE); pos += len) {
+		len = interval_us ? PACKET : 1 + next_rand() % PACKET;
+		if (len > image_len - pos) len = image_len - pos;
+		arrival = start + (uint64_t)packets * interval_us;
+		while (now_us() < arrival) {
+			usleep(50);
+		}
+		if (!interval_us) arrival = now_us();
+
+		if (direct) {
+			if (!rboot_write_flash(&status, image + pos, len)) {
+				__atomic_store_n(&failed, 1, __ATOMIC_RELEASE);
+			}
+		} else {
+			for (done = 0; done < len; done += n) {
+				slot = rboot_pipe_reserve(&pipe_, &space);
+				if (!slot) {
+					sched_yield();
+					n = 0;
+					continue;
+				}
+				n = (len - done < space) ? len - done : space;
+				memcpy(slot, image + pos + done, n);
+				rboot_pipe_commit(&pipe_, n);
+			}
+		}
+
+		latency = now_us() - arrival;
+		if (latency > max_latency_us) max_latency_us = latency;
+		total_latency_us += latency;
+		packets++;
+	}
+	__atomic_store_n(&received, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+// drain the pipe to flash until the receive is done and it is empty
+static void *writer(void *arg) {
+	uint8_t level;
+
+	while (!__atomic_load_n(&received, __ATOMIC_ACQUIRE) || rboot_pipe_level(&pipe_) != 0) {
+		level = rboot_pipe_level(&pipe_);
+		if (!rboot_pipe_write(&pipe_, &status)) {
+			__atomic_store_n(&failed, 1, __ATOMIC_RELEASE);
+			break;
+		}
+		if (level == 0) {
+			usleep(20);
+		}
+	}
+	return NULL;
+}
+
+// one transfer, true if the image reached the slot intact
+static uint8_t transfer(uint8_t count) {
+	pthread_t rx, wr;
+
+	if (!direct) {
+		CHECK(rboot_pipe_init(&pipe_, &status, (uint8_t*)slots, SLOT_SIZE, count, ROM1 + 0x80000));
+		pthread_create(&wr, NULL, writer, NULL);
+	}
+	pthread_create(&rx, NULL, receive, NULL);
+	pthread_join(rx, NULL);
+	if (!direct) {
+		pthread_join(wr, NULL);
+	}
+	return (!failed && rboot_write_end(&status) && memcmp(sim_flash + ROM1, image, image_len) == 0);
+}
+
+// random chunks as fast as they can be taken, through pipes of each size
+static void test_threads(void) {
+	static const uint8_t counts[] = {2, 4, 16};
+	uint32_t loop, run;
+
+	interval_us = 0;
+	direct = 0;
+	for (loop = 0; loop < sizeof(counts) / sizeof(counts[0]); loop++) {
+		for (run = 0; run < 8; run++) {
+			setup();
+			seed = run * 31 + counts[loop];
+			CHECK(transfer(counts[loop]));
+		}
+	}
+
+	// and with the writer held up by real erase times
+	sim_realtime_div = REALTIME_DIV;
+	setup();
+	seed = 7;
+	CHECK(transfer(4));
+	sim_realtime_div = 0;
+}
+
+// a packet every 40ms (of simulated time) written straight to flash, then
+// through pipes of a few sizes, receive latency is the time from a packet
+// arriving to the receive callback returning
+static void test_benchmark(void) {
+	static const uint8_t counts[] = {2, 4, 8};
+	uint64_t start;
+	uint32_t us, direct_avg;
+	uint32_t loop;
+
+	sim_realtime_div = REALTIME_DIV;
+	interval_us = 40000 / REALTIME_DIV;
+
+	setup();
+	direct = 1;
+	start = now_us();
+	CHECK(transfer(0));
+	us = (uint32_t)(now_us() - start) * REALTIME_DIV;
+	direct_avg = (uint32_t)(total_latency_us * REALTIME_DIV / packets);
+	printf("pipe: direct write      %6u bytes/s, receive latency max %6u us avg %6u us\n",
+		(uint32_t)((uint64_t)image_len * 1000000 / us), max_latency_us * REALTIME_DIV, direct_avg);
+
+	direct = 0;
+	for (loop = 0; loop < sizeof(counts) / sizeof(counts[0]); loop++) {
+		setup();
+		start = now_us();
+		CHECK(transfer(counts[loop]));
+		us = (uint32_t)(now_us() - start) * REALTIME_DIV;
+		// with room for a packet besides the slot being written an erase
+		// (45ms) no longer holds up the receive, the average as the
+		// longest can be the host scheduling the threads
+		if ((counts[loop] - 1) * SLOT_SIZE >= PACKET) {
+			CHECK(total_latency_us * REALTIME_DIV / packets < direct_avg);
+		}
+		printf("pipe: %2u slots of %4u  %6u bytes/s, receive latency max %6u us avg %6u us\n",
+			counts[loop], SLOT_SIZE, (uint32_t)((uint64_t)image_len * 1000000 / us),
+			max_latency_us * REALTIME_DIV, (uint32_t)(total_latency_us * REALTIME_DIV / packets));
+	}
+	sim_realtime_div = 0;
+}
+
+int main(void) {
+	sim_init();
+	test_threads();
+	test_benchmark();
+	return sim_report("pipe");
+}
@@ -0,0 +1,158 @@
+//////////////////////////////////////////////////
+// rBoot host tests, boot plans.
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+// a rom booted from its plan loads exactly what the header walk would,
+// for less flash reading, and a plan that no longer matches its slot
+// (or is damaged) is ignored
+
+#include "../rboot.c"
+#include <string.h>
+#include <c_types.h>
+#include "rboot-api.h"
+#include "sim.h"
+
+#define ROM0 0x2000
+#define ROM1 0x82000
+
+extern usercode* load_rom(uint32_t readpos);
+
+static uint8_t iram[0x8000];
+
+// boot as far as stage2a, returning the load address, with the
+// simulated time and flash read of find_image in *us and *bytes
+static uint32_t boot(uint32_t *us, uint32_t *bytes) {
+	uint32_t addr;
+	uint32_t start = sim_time_us;
+
+	sim_clear_stats();
+	addr = find_image();
+	if (us) *us = sim_time_us - start;
+	if (bytes) *bytes = sim.bytes_read;
+	memset((void*)IRAM_START, 0, sizeof(iram));
+	if (addr != 0) {
+		CHECK(load_rom(addr) == (usercode*)IRAM_START);
+	}
+	return addr;
+}
+
+static void setup(uint32_t irom, uint8_t count, uint32_t len) {
+	uint32_t roms[2] = {ROM0, ROM1};
+
+	sim_erase_all(0x100000);
+	sim_write_rom(ROM0, irom, count, len, 10);
+	sim_write_rom(ROM1, irom, count, len, 11);
+	sim_write_config(2, roms, 0);
+}
+
+// the plan must load what the headers do, and be quicker to check
+static void test_plan_matches(uint32_t irom, uint8_t count, uint32_t len) {
+	rboot_plan plan;
+	uint32_t addr, us_walk, us_plan, read_walk, read_plan;
+
+	setup(irom, count, len);
+	addr = boot(&us_walk, &read_walk);
+	CHECK(addr != 0 && !(addr & BOOT_PLAN_FLAG));
+	memcpy(iram, (void*)IRAM_START, sizeof(iram));
+
+	CHECK(rboot_create_boot_plan(0, &plan));
+	CHECK(rboot_set_boot_plan(0, &plan));
+	addr = boot(&us_plan, &read_plan);
+	CHECK(addr == ((BOOT_CONFIG_SECTOR * SECTOR_SIZE + BOOT_PLAN_OFFSET(0)) | BOOT_PLAN_FLAG));
+	CHECK(memcmp(iram, (void*)IRAM_START, sizeof(iram)) == 0);
+	CHECK(read_plan <= read_walk);
+
+	printf("plan: irom %5u, %u x %4u byte sections: header walk %6u us %6u bytes, plan %6u us %6u bytes\n",
+		irom, count, len, us_walk, read_walk, us_plan, read_plan);
+}
+
+static void test_plan_stale(void) {
+	rboot_plan plan;
+	uint32_t addr;
+
+	// a new rom with a different layout in the slot
+	setup(0x4000, 3, 0x400);
+	CHECK(rboot_create_boot_plan(0, &plan));
+	CHECK(rboot_set_boot_plan(0, &plan));
+	memset(sim_flash + ROM0, 0xff, 0x10000);
+	sim_write_rom(ROM0, 0x2000, 2, 0x300, 12);
+	addr = boot(0, 0);
+	CHECK(addr == ROM0 + sizeof(rom_header_new) + 0x2000);
+
+	// same layout, different contents
+	setup(0x4000, 3, 0x400);
+	CHECK(rboot_create_boot_plan(0, &plan));
+	CHECK(rboot_set_boot_plan(0, &plan));
+	memset(sim_flash + ROM0, 0xff, 0x10000);
+	sim_write_rom(ROM0, 0x4000, 3, 0x400, 13);
+	addr = boot(0, 0);
+	CHECK(addr == ROM0 + sizeof(rom_header_new) + 0x4000);
+
+	// the same bit changed in two bytes of a ram section, the rom
+	// checksum is unchanged but not the digest
+	setup(0x4000, 3, 0x400);
+	CHECK(rboot_create_boot_plan(0, &plan));
+	CHECK(rboot_set_boot_plan(0, &plan));
+	sim_flash[plan.sections[plan.count - 1].flash + 4] ^= 0x08;
+	sim_flash[plan.sections[plan.count - 1].flash + 0x100] ^= 0x08;
+	addr = boot(0, 0);
+	CHECK(addr == ROM0 + sizeof(rom_header_new) + 0x4000);
+
+	// damaged plan
+	setup(0x4000, 3, 0x400);
+	CHECK(rboot_create_boot_plan(0, &plan));
+	CHECK(rboot_set_boot_plan(0, &plan));
+	sim_flash[BOOT_CONFIG_SECTOR * SECTOR_SIZE + BOOT_PLAN_OFFSET(0) + 12] ^= 0x10;
+	addr = boot(0, 0);
+	CHECK(addr == ROM0 + sizeof(rom_header_new) + 0x4000);
+
+	// a plan pointing outside the slot
+	setup(0x4000, 3, 0x400);
+	CHECK(rboot_create_boot_plan(0, &plan));
+	plan.sections[plan.count - 1].length = 0xfffff000;
+	CHECK(rboot_set_boot_plan(0, &plan));
+	addr = boot(0, 0);
+	CHECK(addr == ROM0 + sizeof(rom_header_new) + 0x4000);
+
+	// cleared plan
+	setup(0x4000, 3, 0x400);
+	CHECK(rboot_create_boot_plan(0, &plan));
+	CHECK(rboot_set_boot_plan(0, &plan));
+	CHECK(rboot_set_boot_plan(0, NULL));
+	CHECK(!rboot_get_boot_plan(0, &plan));
+	addr = boot(0, 0);
+	CHECK(addr == ROM0 + sizeof(rom_header_new) + 0x4000);
+}
+
+// writing a new rom to a slot clears its plan
+static void test_plan_cleared(void) {
+	rboot_write_status status;
+	rboot_plan plan;
+	uint8_t rom[0x6000];
+	uint32_t len;
+
+	setup(0x4000, 3, 0x400);
+	len = sim_write_rom(ROM1 + 0x40000, 0x4000, 3, 0x400, 14);
+	memcpy(rom, sim_flash + ROM1 + 0x40000, len);
+	CHECK(rboot_create_boot_plan(0, &plan));
+	CHECK(rboot_set_boot_plan(0, &plan));
+	CHECK(rboot_create_boot_plan(1, &plan));
+	CHECK(rboot_set_boot_plan(1, &plan));
+
+	status = rboot_write_init(ROM1);
+	CHECK(rboot_write_flash(&status, rom, len));
+	CHECK(rboot_write_end(&status));
+	CHECK(!rboot_get_boot_plan(1, &plan));
+	CHECK(rboot_get_boot_plan(0, &plan));
+}
+
+int main(void) {
+	sim_init();
+	test_plan_matches(0, 3, 0x400);
+	test_plan_matches(0x10000, 3, 0x400);
+	test_plan_matches(0x40000, 4, 0x1000);
+	test_plan_stale();
+	test_plan_cleared();
+	return sim_report("plan");
+}
@@ -0,0 +1,177 @@
+//////////////////////////////////////////////////
+// rBoot host tests, relocating roms during OTA.
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+// a rom linked for slot 0, sent as a relocatable stream in chunks of any
+// size, lands in slot 1 with its irom addresses moved and its checksum
+// corrected, so rBoot boots it, and a bad stream is refused
+
+#include "../rboot-ota.c"
+#include <stdlib.h>
+#include "sim.h"
+
+#define ROM0 0x2000
+#define ROM1 0x82000
+#define IROM_LEN 0x6000
+#define SCRATCH 0x200000
+
+extern uint32_t find_image(void);
+
+static uint8_t image[0x10000];
+static uint8_t expect[0x10000];
+static uint8_t bitmaps[0x10000 / SECTOR_SIZE][OTA_RELOC_BITMAP];
+static uint8_t stream[0x12000];
+static uint32_t imagelen;
+static uint32_t streamlen;
+
+// mark a word of the image as an irom address, linked for slot 0
+static void mark(uint32_t pos, uint32_t target, uint32_t chksum_from) {
+	uint32_t old, new, diff;
+	uint32_t word = pos / 4;
+
+	memcpy(&old, image + pos, 4);
+	new = IROM_MAP_ADDR + ROM0 + target;
+	memcpy(image + pos, &new, 4);
+	if (pos >= chksum_from) {
+		diff = old ^ new;
+		image[imagelen - 1] ^= diff ^ (diff >> 8) ^ (diff >> 16) ^ (diff >> 24);
+	}
+	bitmaps[word / (SECTOR_SIZE / 4)][(word % (SECTOR_SIZE / 4)) / 8] |= 1 << (word % 8);
+}
+
+// build the rom for slot 0, what it should be in slot 1 and the stream
+static void build(uint32_t nmarks) {
+	ota_reloc_header_t header;
+	uint32_t chksum_from;
+	uint32_t loop, pos, len, val, diff;
+
+	imagelen = sim_write_rom(SCRATCH, IROM_LEN, 3, 0x800, 40);
+	imagelen = (imagelen + 3) & ~3;
+	memcpy(image, sim_flash + SCRATCH, imagelen);
+	memset(sim_flash + SCRATCH, 0xff, sizeof(image));
+	memset(bitmaps, 0, sizeof(bitmaps));
+#ifdef BOOT_IROM_CHKSUM
+	chksum_from = 0;
+#else
+	chksum_from = sizeof(rom_header_new) + IROM_LEN;
+#endif
+
+	// irom addresses in the irom section and the last ram section
+	for (loop = 0; loop < nmarks; loop++) {
+		pos = (loop & 1) ? sizeof(rom_header_new) + ((sim_rand() % (IROM_LEN / 4)) * 4)
+			: imagelen - 0x800 + ((sim_rand() % 0x1f0) * 4);
+		mark(pos, ((sim_rand() % 0x20000) & ~3), chksum_from);
+	}
+
+	// the same with each marked word moved to slot 1
+	memcpy(expect, image, imagelen);
+	for (pos = 0; pos < imagelen; pos += 4) {
+		if (bitmaps[pos / SECTOR_SIZE][((pos % SECTOR_SIZE) / 4) / 8] & (1 << ((pos / 4) % 8))) {
+			memcpy(&val, expect + pos, 4);
+			diff = val ^ (val + ROM1 - ROM0);
+			val += ROM1 - ROM0;
+			memcpy(expect + pos, &val, 4);
+			if (pos >= chksum_from) {
+				expect[imagelen - 1] ^= diff ^ (diff >> 8) ^ (diff >> 16) ^ (diff >> 24);
+			}
+		}
+	}
+
+	header.magic = OTA_RELOC_MAGIC;
+	header.link_base = IROM_MAP_ADDR + ROM0;
+	header.image_len = imagelen;
+	header.chksum_from = chksum_from;
+	header.chksum_pos = imagelen - 1;
+	memcpy(stream, &header, sizeof(header));
+	streamlen = sizeof(header);
+	for (pos = 0; pos < imagelen; pos += len) {
+		len = (imagelen - pos < SECTOR_SIZE) ? imagelen - pos : SECTOR_SIZE;
+		memcpy(stream + streamlen, bitmaps[pos / SECTOR_SIZE], OTA_RELOC_BITMAP);
+		memcpy(stream + streamlen + OTA_RELOC_BITMAP, image + pos, len);
+		streamlen += OTA_RELOC_BITMAP + len;
+	}
+}
+
+static void setup(void) {
+	uint32_t roms[2] = {ROM0, ROM1};
+
+	sim_erase_all(0x100000);
+	sim_write_config(2, roms, 0);
+	sim_write_rom(ROM0, 0x4000, 2, 0x400, 41);
+}
+
+// send the stream in random sized chunks
+static ota_result_t send(uint32_t len) {
+	ota_handle_t handle;
+	ota_reloc_t reloc;
+	ota_result_t result;
+	uint32_t pos, chunk;
+
+	result = rboot_ota_begin_reloc(&handle, &reloc, 1, 0);
+	CHECK(result == OTA_OK);
+	for (pos = 0; pos < len && result == OTA_OK; pos += chunk) {
+		chunk = (sim_rand() % 700) + 1;
+		if (chunk > len - pos) chunk = len - pos;
+		result = rboot_ota_write(&handle, stream + pos, chunk);
+	}
+	if (result == OTA_OK) {
+		return rboot_ota_end(&handle);
+	}
+	rboot_ota_cancel(&handle);
+	return result;
+}
+
+static void test_round_trip(void) {
+	uint32_t run;
+
+	for (run = 0; run < 20; run++) {
+		setup();
+		sim_seed(run + 1);
+		build(1 + run * 10);
+		CHECK(send(streamlen) == OTA_OK);
+		CHECK(memcmp(sim_flash + ROM1, expect, imagelen) == 0);
+		CHECK(find_image() == ROM1 + sizeof(rom_header_new) + IROM_LEN);
+	}
+}
+
+static void test_bad_streams(void) {
+	ota_reloc_header_t *header = (ota_reloc_header_t*)stream;
+	uint32_t addr = IROM_MAP_ADDR + 0x100000;
+
+	// cut short
+	setup();
+	build(10);
+	CHECK(send(streamlen - 100) == OTA_ERR_VERIFY);
+
+	// too long
+	setup();
+	build(10);
+	CHECK(send(streamlen + 4) == OTA_ERR_INVALID_IMAGE);
+
+	// a marked word that isn't an irom address in the slot
+	setup();
+	build(10);
+	memcpy(stream + sizeof(ota_reloc_header_t) + OTA_RELOC_BITMAP, &addr, 4);
+	stream[sizeof(ota_reloc_header_t)] |= 1;
+	CHECK(send(streamlen) == OTA_ERR_INVALID_IMAGE);
+
+	// header damage
+	setup();
+	build(10);
+	header->image_len += 2;
+	CHECK(send(streamlen) == OTA_ERR_INVALID_IMAGE);
+	header->image_len -= 2;
+	header->link_base = 0x40100000;
+	CHECK(send(streamlen) == OTA_ERR_INVALID_IMAGE);
+
+	// no session was left open
+	CHECK(!rboot_ota_is_in_progress());
+}
+
+int main(void) {
+	sim_init();
+	test_round_trip();
+	test_bad_streams();
+	return sim_report("reloc");
+}
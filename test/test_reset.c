@@ -0,0 +1,261 @@
+//////////////////////////////////////////////////
+// rBoot host tests, factory reset.
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+// a factory reset requested by the app returns the config to the default,
+// keeping the rom slots, clears the app settings, restores the golden rom
+// over rom 0 only erasing the sectors that differ, and erases only the
+// sectors of the reset region written since the last reset, a power cut
+// at any point of the reset is resumed on the next boot
+
+#include "../rboot.c"
+#include <string.h>
+#include <c_types.h>
+#include "rboot-api.h"
+#include "sim.h"
+
+#define ROM0 0x2000
+#define ROM1 0x82000
+#define GOLDEN 0xc2000
+#define RESTORE_SIZE (0x100000 - GOLDEN)
+#define SETTINGS (BOOT_CONFIG_SECTOR * SECTOR_SIZE + 0x800)
+
+static uint32_t golden_len;
+
+// golden rom in slot 2, rom 0 a copy of it with changed sectors spread
+// through the slot, or all of it different, and some app settings
+static void setup(uint32_t changed) {
+	uint32_t roms[3] = {ROM0, ROM1, GOLDEN};
+	uint32_t sector, pos;
+
+	sim_erase_all(0x100000);
+	golden_len = sim_write_rom(GOLDEN, 0x10000, 3, 0x800, 50);
+	sim_write_rom(ROM1, 0x10000, 3, 0x800, 51);
+	memcpy(sim_flash + ROM0, sim_flash + GOLDEN, RESTORE_SIZE);
+	if (changed == RESTORE_SIZE / SECTOR_SIZE) {
+		sim_seed(52);
+		for (pos = 0; pos < RESTORE_SIZE; pos++) {
+			sim_flash[ROM0 + pos] = (uint8_t)sim_rand();
+		}
+	} else {
+		for (sector = 0; sector < changed; sector++) {
+			sim_flash[ROM0 + (sector * 7 % (RESTORE_SIZE / SECTOR_SIZE)) * SECTOR_SIZE + 9] ^= 0x55;
+		}
+	}
+	sim_write_config(3, roms, 1);
+	memset(sim_flash + SETTINGS, 0x12, 0x100);
+	sim_clear_stats();
+}
+
+// rom 0 is the golden rom (if there is one), the slots are kept and the settings gone
+static void check_reset(void) {
+	rboot_config romconf;
+
+	sim_read_config(&romconf);
+#ifdef BOOT_GOLDEN_ROM
+	CHECK(memcmp(sim_flash + ROM0, sim_flash + GOLDEN, RESTORE_SIZE) == 0);
+#endif
+	CHECK(romconf.magic == BOOT_CONFIG_MAGIC && romconf.current_rom == 0);
+	CHECK(romconf.count == 3 && romconf.roms[2] == GOLDEN);
+	CHECK(sim_flash[SETTINGS] == 0xff && sim_flash[SETTINGS + 0xff] == 0xff);
+	CHECK(*(uint32_t*)(sim_flash + BOOT_CONFIG_SECTOR * SECTOR_SIZE + RESTORE_OFFSET) == 0xffffffff);
+}
+
+static void test_request(void) {
+	setup(2);
+	CHECK(rboot_set_factory_reset(true));
+	find_image();
+	check_reset();
+
+	// and only once
+	sim_clear_stats();
+	find_image();
+	CHECK(sim.erases == 0);
+
+	// a request taken back before the next boot does nothing
+	setup(2);
+	CHECK(rboot_set_factory_reset(true));
+	CHECK(rboot_set_factory_reset(false));
+	sim_clear_stats();
+	CHECK(find_image() == ROM1 + sizeof(rom_header_new) + 0x10000);
+	CHECK(sim.erases == 0);
+	CHECK(sim_flash[SETTINGS] == 0x12);
+}
+
+#ifdef BOOT_GOLDEN_ROM
+// restore time for an almost identical working rom against a fully
+// different one, the first only erases the sectors that changed
+static void test_benchmark(void) {
+	static const uint32_t changed[] = {0, 2, 8, RESTORE_SIZE / SECTOR_SIZE};
+	uint32_t loop, start;
+
+	for (loop = 0; loop < sizeof(changed) / sizeof(changed[0]); loop++) {
+		setup(changed[loop]);
+		CHECK(rboot_set_factory_reset(true));
+		sim_clear_stats();
+		start = sim_time_us;
+		find_image();
+		check_reset();
+		// the sectors restored and two writes of the config sector,
+		// each through the journal
+		CHECK(sim.erases == changed[loop] + 4);
+		printf("reset: %2u of %u sectors different, %2u erases, restored in %7u us\n",
+			changed[loop], RESTORE_SIZE / SECTOR_SIZE, sim.erases, sim_time_us - start);
+	}
+}
+
+// cut the power at each erase and program of the reset, boot again and
+// it is finished, the config sector is written through the journal
+static void test_interrupted(void) {
+	uint32_t ops, cut;
+
+	setup(RESTORE_SIZE / SECTOR_SIZE);
+	CHECK(rboot_set_factory_reset(true));
+	sim.ops = 0;
+	find_image();
+	ops = sim.ops;
+
+	for (cut = 0; cut < ops; cut++) {
+		setup(RESTORE_SIZE / SECTOR_SIZE);
+		CHECK(rboot_set_factory_reset(true));
+		CHECK(SIM_CUT_AT(cut, find_image()));
+		find_image();
+		check_reset();
+		if (sim_failures) {
+			printf("  power cut at op %u of %u\n", cut, ops);
+			break;
+		}
+	}
+	printf("reset: restore finished after a power cut at each of %u ops\n", ops);
+}
+#endif
+
+#ifdef BOOT_DIRTY_MAP_ADDR
+#define RESET_SECTORS (BOOT_RESET_SIZE / SECTOR_SIZE)
+
+// write some of the reset region through the api, marking it dirty
+static void write_data(uint32_t sectors) {
+	static uint32_t data[0x100 / sizeof(uint32_t)];
+	uint32_t sector;
+
+	memset(data, 0x34, sizeof(data));
+	for (sector = 0; sector < sectors; sector++) {
+		CHECK(rboot_flash_write(BOOT_RESET_ADDR + (sector * 5 % RESET_SECTORS) * SECTOR_SIZE + 0x80,
+			data, sizeof(data)));
+	}
+}
+
+static uint8_t reset_region_erased(void) {
+	uint32_t pos;
+
+	for (pos = 0; pos < BOOT_RESET_SIZE; pos++) {
+		if (sim_flash[BOOT_RESET_ADDR + pos] != 0xff) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void test_dirty(void) {
+	uint32_t sector, erased = 0;
+
+	// until the first reset arms the map every sector is erased
+	setup(0);
+	write_data(3);
+	CHECK(rboot_set_factory_reset(true));
+	find_image();
+	check_reset();
+	CHECK(reset_region_erased());
+	for (sector = 0; sector < RESET_SECTORS; sector++) {
+		erased += sim_erase_count[BOOT_RESET_ADDR / SECTOR_SIZE + sector];
+	}
+	CHECK(erased == RESET_SECTORS);
+	CHECK(*(uint32_t*)(sim_flash + BOOT_DIRTY_MAP_ADDR) == DIRTY_MAP_MAGIC);
+
+	// then only the sectors written since, the map is re-armed
+	write_data(3);
+	write_data(2);
+	CHECK(!reset_region_erased());
+	CHECK(rboot_set_factory_reset(true));
+	sim_clear_stats();
+	find_image();
+	CHECK(reset_region_erased());
+	// the dirty sectors, the map and two journalled writes of the config
+	CHECK(sim.erases == 3 + 1 + 4);
+	CHECK(*(uint32_t*)(sim_flash + BOOT_DIRTY_MAP_ADDR + sizeof(uint32_t)) == 0xffffffff);
+}
+
+// reset time with a few sectors written against erasing all the region,
+// as a reset does before the map is armed
+static void test_dirty_benchmark(void) {
+	static const uint32_t written[] = {0, 2, 8, RESET_SECTORS};
+	uint32_t loop, start, full_us;
+
+	setup(0);
+	CHECK(rboot_set_factory_reset(true));
+	sim_clear_stats();
+	start = sim_time_us;
+	find_image();
+	full_us = sim_time_us - start;
+	printf("reset: full erase of the %u sector region, %2u erases in %7u us\n",
+		RESET_SECTORS, sim.erases, full_us);
+
+	for (loop = 0; loop < sizeof(written) / sizeof(written[0]); loop++) {
+		write_data(written[loop]);
+		CHECK(rboot_set_factory_reset(true));
+		sim_clear_stats();
+		start = sim_time_us;
+		find_image();
+		CHECK(reset_region_erased());
+		CHECK(sim.erases == written[loop] + 1 + 4);
+		if (written[loop] < RESET_SECTORS) {
+			CHECK(sim_time_us - start < full_us);
+		}
+		printf("reset: %2u of %u sectors written, %2u erases in %7u us\n",
+			written[loop], RESET_SECTORS, sim.erases, sim_time_us - start);
+	}
+}
+
+// cut the power at each erase and program of a reset with dirty sectors,
+// boot again and they are erased and the map armed
+static void test_dirty_interrupted(void) {
+	uint32_t cut;
+
+	for (cut = 0; ; cut++) {
+		setup(0);
+		CHECK(rboot_set_factory_reset(true));
+		find_image();
+		write_data(6);
+		CHECK(rboot_set_factory_reset(true));
+		if (!SIM_CUT_AT(cut, find_image())) {
+			break;
+		}
+		find_image();
+		check_reset();
+		CHECK(reset_region_erased());
+		CHECK(*(uint32_t*)(sim_flash + BOOT_DIRTY_MAP_ADDR) == DIRTY_MAP_MAGIC);
+		CHECK(*(uint32_t*)(sim_flash + BOOT_DIRTY_MAP_ADDR + sizeof(uint32_t)) == 0xffffffff);
+		if (sim_failures) {
+			printf("  power cut at op %u\n", cut);
+			return;
+		}
+	}
+	printf("reset: dirty sectors erased after a power cut at each of %u ops\n", cut);
+}
+#endif
+
+int main(void) {
+	sim_init();
+	test_request();
+#ifdef BOOT_GOLDEN_ROM
+	test_benchmark();
+	test_interrupted();
+#endif
+#ifdef BOOT_DIRTY_MAP_ADDR
+	test_dirty();
+	test_dirty_benchmark();
+	test_dirty_interrupted();
+#endif
+	return sim_report("reset");
+}
@@ -0,0 +1,160 @@
+//////////////////////////////////////////////////
+// rBoot host tests, sparse OTA streams.
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+// roms encoded by the host tool and written as a sparse stream, in
+// chunks of any size, arrive byte for byte over an old rom, the erased
+// runs left erased rather than sent and programmed, with fewer bytes sent
+// and pages programmed than writing the image as it is
+
+#define RBOOT_SPARSE_NO_MAIN
+#include "../tools/rboot-sparse.c"
+#include "sim.h"
+
+#define ROM0 0x2000
+#define ROM1 0x82000
+#define SCRATCH 0x200000
+#define IMAGE_LEN 0x20000
+// where the file system is in the irom of the data rom
+#define FS_START 0x1000
+#define FS_LEN 0x14000
+
+static uint8_t image[IMAGE_LEN];
+static uint8_t stream[SPARSE_MAX_LEN(IMAGE_LEN)];
+static uint32_t image_len;
+
+// an old rom in slot 1, to be erased under the skips
+static void setup(void) {
+	uint32_t roms[2] = {ROM0, ROM1};
+
+	sim_erase_all(0x100000);
+	sim_write_config(2, roms, 0);
+	sim_write_rom(ROM1, 0x18000, 3, 0x1000, 130);
+	sim_clear_stats();
+}
+
+// a rom padded with 0xff to the end of its last sector
+static void build_rom(void) {
+	uint32_t pos;
+
+	sim_erase_all(0x100000);
+	image_len = sim_write_rom(SCRATCH, 0x10000, 3, 0x800, 131);
+	memcpy(image, sim_flash + SCRATCH, image_len);
+	for (pos = image_len; pos % SECTOR_SIZE != 0; pos++) {
+		image[pos] = 0xff;
+	}
+	image_len = pos;
+}
+
+// a rom carrying a file system image (as spiffs is) in its irom, files
+// of a few pages through it, the rest erased
+static void build_data(void) {
+	uint32_t pos, len;
+
+	sim_erase_all(0x100000);
+	image_len = sim_write_rom(SCRATCH, 0x18000, 2, 0x800, 132);
+	memcpy(image, sim_flash + SCRATCH, image_len);
+	memset(image + FS_START, 0xff, FS_LEN);
+	sim_seed(133);
+	for (pos = FS_START; pos < FS_START + FS_LEN; pos += 0x100 * (1 + sim_rand() % 24)) {
+		for (len = 0x100 * (1 + sim_rand() % 4); len > 0 && pos < FS_START + FS_LEN; len--) {
+			image[pos++] = (uint8_t)sim_rand();
+		}
+	}
+}
+
+// write data to slot 1, as a sparse stream if sparse, in chunks of random
+// size up to max (at most 0x1000), true if the slot then holds the image
+static uint8_t write_slot(const uint8_t *data, uint32_t len, uint8_t sparse, uint32_t max) {
+	static uint32_t words[0x1000 / sizeof(uint32_t)];
+	ota_handle_t handle;
+	ota_sparse_t state;
+	uint32_t pos, chunk;
+
+	setup();
+	if (sparse) {
+		CHECK(rboot_ota_begin_sparse(&handle, &state, 1, image_len) == OTA_OK);
+	} else {
+		CHECK(rboot_ota_begin(&handle, 1, image_len) == OTA_OK);
+	}
+	for (pos = 0; pos < len; pos += chunk) {
+		chunk = 1 + sim_rand() % max;
+		if (chunk > len - pos) {
+			chunk = len - pos;
+		}
+		memcpy(words, data + pos, chunk);
+		CHECK(rboot_ota_write(&handle, (uint8_t*)words, chunk) == OTA_OK);
+	}
+	CHECK(rboot_ota_end(&handle) == OTA_OK);
+	CHECK(handle.metrics.bytes_skipped + handle.metrics.bytes_written >= image_len);
+	return (memcmp(sim_flash + ROM1, image, image_len) == 0);
+}
+
+// round trip through the encoder and the writer, for each chunking
+static void test_round_trip(void) {
+	static const uint32_t maxes[] = {1, 7, 300, 0x1000};
+	uint32_t loop, len, skipped;
+
+	for (loop = 0; loop < sizeof(maxes) / sizeof(maxes[0]); loop++) {
+		build_rom();
+		len = sparse_encode(image, image_len, 32, stream, &skipped);
+		CHECK(skipped > 0 && len < image_len);
+		sim_seed(loop);
+		CHECK(write_slot(stream, len, 1, maxes[loop]));
+
+		build_data();
+		len = sparse_encode(image, image_len, 32, stream, &skipped);
+		sim_seed(loop);
+		CHECK(write_slot(stream, len, 1, maxes[loop]));
+	}
+
+	// nothing to skip, the stream is one literal record
+	build_rom();
+	memset(image + OTA_HEADER_LEN, 0x55, image_len - OTA_HEADER_LEN);
+	CHECK(sparse_encode(image, image_len, 32, stream, &skipped) == image_len + 4 && skipped == 0);
+	// all erased but the header, and a run too short to skip
+	memset(image + OTA_HEADER_LEN, 0xff, image_len - OTA_HEADER_LEN);
+	image[0x20] = 0;
+	image[0x28] = 0;
+	len = sparse_encode(image, image_len, 32, stream, &skipped);
+	CHECK(skipped == image_len - 0x2c);
+	CHECK(len == 4 + 0x2c + 4);
+}
+
+// bytes sent and pages programmed for a padded rom and one carrying a
+// file system, plain and sparse, at a few minimum runs
+static void test_benchmark(void) {
+	static const uint32_t runs[] = {8, 32, 256};
+	const char *name;
+	uint32_t kind, loop, len, plain_programs, skipped;
+
+	for (kind = 0; kind < 2; kind++) {
+		if (kind == 0) {
+			build_rom();
+			name = "rom ";
+		} else {
+			build_data();
+			name = "fs  ";
+		}
+		CHECK(write_slot(image, image_len, 0, 0x1000));
+		plain_programs = sim.bytes_programmed / OTA_PAGE_SIZE;
+		printf("sparse: %s %6u bytes, plain        %6u bytes sent, %4u pages programmed\n",
+			name, image_len, image_len, plain_programs);
+		for (loop = 0; loop < sizeof(runs) / sizeof(runs[0]); loop++) {
+			len = sparse_encode(image, image_len, runs[loop], stream, &skipped);
+			CHECK(write_slot(stream, len, 1, 0x1000));
+			CHECK(len < image_len);
+			CHECK(sim.bytes_programmed / OTA_PAGE_SIZE < plain_programs);
+			printf("sparse: %s %6u bytes, min run %4u %6u bytes sent, %4u pages programmed\n",
+				name, image_len, runs[loop], len, sim.bytes_programmed / OTA_PAGE_SIZE);
+		}
+	}
+}
+
+int main(void) {
+	sim_init();
+	test_round_trip();
+	test_benchmark();
+	return sim_report("sparse");
+}
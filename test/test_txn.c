@@ -0,0 +1,155 @@
+//////////////////////////////////////////////////
+// rBoot host tests, config sector transactions and the journal.
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+// several config changes made in one transaction cost one write, an
+// aborted one costs nothing, and a commit cut short by a power cut at
+// any point leaves rBoot with either the old sector or the new one
+
+#include "../rboot.c"
+#include <string.h>
+#include <c_types.h>
+#include "rboot-api.h"
+#include "sim.h"
+
+#define ROM0 0x2000
+#define ROM1 0x82000
+// where the test keeps its app settings in the config sector, changed
+// in two places so a half written copy is neither old nor new
+#define SETTINGS 0x100
+#define SETTINGS_LEN 0xc00
+
+static void setup(void) {
+	uint32_t roms[2] = {ROM0, ROM1};
+	uint32_t loop;
+
+	sim_erase_all(0x100000);
+	sim_write_rom(ROM0, 0x4000, 2, 0x400, 60);
+	sim_write_rom(ROM1, 0x4000, 2, 0x400, 61);
+	sim_write_config(2, roms, 0);
+	for (loop = 0; loop < SETTINGS_LEN; loop++) {
+		sim_flash[BOOT_CONFIG_SECTOR * SECTOR_SIZE + SETTINGS + loop] = (uint8_t)loop;
+	}
+}
+
+// app settings change, as part of a transaction or on their own
+static void change_settings(rboot_config_txn *txn) {
+	txn->sector[SETTINGS] ^= 0x20;
+	txn->sector[SETTINGS + SETTINGS_LEN - 1] ^= 0x20;
+}
+
+// the update flow: boot the new rom, a new gpio rom and new settings
+static void flow_separate(void) {
+	rboot_config_txn txn;
+	rboot_config conf;
+
+	CHECK(rboot_set_current_rom(1));
+	conf = rboot_get_config();
+	conf.gpio_rom = 1;
+	CHECK(rboot_set_config(&conf));
+	CHECK(rboot_config_begin(&txn));
+	change_settings(&txn);
+	CHECK(rboot_config_commit(&txn));
+}
+
+static void flow_txn(void) {
+	rboot_config_txn txn;
+
+	CHECK(rboot_config_begin(&txn));
+	txn.config->current_rom = 1;
+	txn.config->gpio_rom = 1;
+	change_settings(&txn);
+	CHECK(rboot_config_commit(&txn));
+}
+
+// the sector is entirely the old one or the new one
+static uint8_t check_old_or_new(uint8_t *old, uint8_t *new) {
+	uint8_t *sector = sim_flash + BOOT_CONFIG_SECTOR * SECTOR_SIZE;
+	return memcmp(sector, old, SECTOR_SIZE) == 0 || memcmp(sector, new, SECTOR_SIZE) == 0;
+}
+
+static void test_cost(void) {
+	rboot_config_txn txn;
+	uint8_t separate[SECTOR_SIZE];
+	uint32_t start, us_separate, us_txn, erases_separate;
+
+	setup();
+	sim_clear_stats();
+	start = sim_time_us;
+	flow_separate();
+	us_separate = sim_time_us - start;
+	erases_separate = sim.erases;
+	memcpy(separate, sim_flash + BOOT_CONFIG_SECTOR * SECTOR_SIZE, SECTOR_SIZE);
+
+	setup();
+	sim_clear_stats();
+	start = sim_time_us;
+	flow_txn();
+	us_txn = sim_time_us - start;
+	CHECK(sim.erases < erases_separate);
+	CHECK(memcmp(separate, sim_flash + BOOT_CONFIG_SECTOR * SECTOR_SIZE, SECTOR_SIZE) == 0);
+	printf("txn: update flow %u erases %u us separately, %u erases %u us in one transaction\n",
+		erases_separate, us_separate, sim.erases, us_txn);
+
+	// abort, or commit with nothing changed, writes nothing
+	sim_clear_stats();
+	CHECK(rboot_config_begin(&txn));
+	txn.config->current_rom = 0;
+	rboot_config_abort(&txn);
+	CHECK(rboot_config_begin(&txn));
+	CHECK(rboot_config_commit(&txn));
+	CHECK(sim.erases == 0 && sim.programs == 0);
+	CHECK(rboot_get_current_rom() == 1);
+}
+
+// cut the power at each erase and program of the commit, then boot
+static void test_interrupted(void) {
+	uint8_t old[SECTOR_SIZE];
+	uint8_t new[SECTOR_SIZE];
+	uint32_t ops, cut;
+
+	setup();
+	memcpy(old, sim_flash + BOOT_CONFIG_SECTOR * SECTOR_SIZE, SECTOR_SIZE);
+	sim.ops = 0;
+	flow_txn();
+	ops = sim.ops;
+	memcpy(new, sim_flash + BOOT_CONFIG_SECTOR * SECTOR_SIZE, SECTOR_SIZE);
+
+	for (cut = 0; cut < ops; cut++) {
+		setup();
+		CHECK(SIM_CUT_AT(cut, flow_txn()));
+		find_image();
+		CHECK(check_old_or_new(old, new));
+		if (sim_failures) {
+			printf("  power cut at op %u of %u\n", cut, ops);
+			break;
+		}
+	}
+	printf("txn: old or new config after a power cut at each of %u ops\n", ops);
+}
+
+// the factory reset and OTA code write the sector through the journal too,
+// a copy left there by an interrupted write is finished at boot
+static void test_journal_finish(void) {
+	uint8_t new[SECTOR_SIZE];
+	uint32_t zero = 0;
+
+	setup();
+	flow_txn();
+	memcpy(new, sim_flash + BOOT_CONFIG_SECTOR * SECTOR_SIZE, SECTOR_SIZE);
+	setup();
+	memcpy(sim_flash + BOOT_CONFIG_JOURNAL_ADDR, new, SECTOR_SIZE);
+	memset(sim_flash + BOOT_CONFIG_SECTOR * SECTOR_SIZE, 0xff, SECTOR_SIZE / 2);
+	CHECK(find_image() == ROM1 + sizeof(rom_header_new) + 0x4000);
+	CHECK(memcmp(sim_flash + BOOT_CONFIG_SECTOR * SECTOR_SIZE, new, SECTOR_SIZE) == 0);
+	CHECK(memcmp(sim_flash + BOOT_CONFIG_JOURNAL_ADDR, &zero, sizeof(zero)) == 0);
+}
+
+int main(void) {
+	sim_init();
+	test_cost();
+	test_interrupted();
+	test_journal_finish();
+	return sim_report("txn");
+}
@@ -0,0 +1,277 @@
+//////////////////////////////////////////////////
+// rBoot host tests, OTA over a serial link.
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+// the host sender and the receiver talk over two ptys joined by a link
+// thread each way, which delivers the bytes at the baud rate and corrupts
+// them at the error rate, an update arrives intact however many bytes are
+// hit, packed or not, and with the window filled the link is kept busy
+// where stop and wait (a window of one) leaves it idle
+
+#define _GNU_SOURCE
+#define RBOOT_UART_SEND_NO_MAIN
+#include "../tools/rboot-uart-send.c"
+#include <pthread.h>
+#include <poll.h>
+#include "sim.h"
+
+#define ROM0 0x2000
+#define ROM1 0x82000
+#define SCRATCH 0x200000
+// the link and flash operations run ten times faster than they would
+#define REALTIME_DIV 10
+// bytes a link thread moves at a time, a short burst from a uart fifo
+#define LINK_CHUNK 32
+
+static uint8_t image[0x10000];
+static uint32_t image_len;
+
+// one direction of the link, from a pty master to the other
+typedef struct {
+	int from;
+	int to;
+	uint32_t baud;
+	uint32_t errors;         // bytes hit in every million
+	uint32_t seed;
+	uint32_t hit;            // bytes hit
+	pthread_t thread;
+} link_dir;
+
+static volatile int stop;
+static int rx_fd;
+static uart_ota_t rx;
+static ota_result_t rx_result;
+
+static uint64_t now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// each link thread's own random numbers, sim_rand isn't shared
+static uint32_t next_rand(link_dir *dir) {
+	dir->seed = dir->seed * 1103515245 + 12345;
+	return dir->seed >> 8;
+}
+
+// move bytes across, each taking ten bit times, flipping a bit in one
+// now and then
+static void *link_thread(void *arg) {
+	link_dir *dir = arg;
+	struct pollfd pfd;
+	uint8_t buf[LINK_CHUNK];
+	uint64_t free_at = now_us(), now;
+	ssize_t n, i;
+
+	pfd.fd = dir->from;
+	pfd.events = POLLIN;
+	while (!stop) {
+		// bytes already waiting go out straight after the last, so the
+		// time oversleeping is made up, otherwise the link was idle
+		if (poll(&pfd, 1, 0) <= 0) {
+			n = poll(&pfd, 1, 5);
+			now = now_us();
+			if (free_at < now) free_at = now;
+			if (n <= 0) {
+				continue;
+			}
+		}
+		n = read(dir->from, buf, sizeof(buf));
+		if (n <= 0) {
+			continue;
+		}
+		for (i = 0; i < n; i++) {
+			if (next_rand(dir) % 1000000 < dir->errors) {
+				buf[i] ^= 1 << (next_rand(dir) % 8);
+				dir->hit++;
+			}
+		}
+		free_at += (uint64_t)n * 10 * 1000000 / dir->baud / REALTIME_DIV;
+		while ((now = now_us()) < free_at) {
+			usleep(free_at - now);
+		}
+		write_all(dir->to, buf, n);
+	}
+	return NULL;
+}
+
+static void rx_send(const uint8_t *data, uint16_t len, void *arg) {
+	write_all(rx_fd, data, len);
+}
+
+// feed the receiver whatever arrives until told to stop, answering the
+// sender even after the update has ended in case the result is lost
+static void *rx_thread(void *arg) {
+	struct pollfd pfd;
+	uint8_t buf[LINK_CHUNK];
+	ssize_t n;
+
+	pfd.fd = rx_fd;
+	pfd.events = POLLIN;
+	while (!stop) {
+		if (poll(&pfd, 1, 5) > 0 && (n = read(rx_fd, buf, sizeof(buf))) > 0) {
+			rx_result = rboot_ota_uart_feed(&rx, buf, n);
+		}
+	}
+	return NULL;
+}
+
+// a pty, raw, returns the master and sets the slave
+static int open_pty(int *slave) {
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+
+	CHECK(master >= 0 && grantpt(master) == 0 && unlockpt(master) == 0);
+	*slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+	CHECK(*slave >= 0 && set_raw(*slave, 115200));
+	return master;
+}
+
+// a rom for slot 1 built at the scratch address, random or, for seed 0,
+// packing well
+static void build(uint32_t seed) {
+	uint32_t roms[2] = {ROM0, ROM1};
+
+	sim_erase_all(0x100000);
+	sim_write_config(2, roms, 0);
+	sim_write_rom(ROM0, 0x4000, 2, 0x400, 120);
+	image_len = sim_write_rom(SCRATCH, 0x4000, 3, 0x800, seed);
+	memcpy(image, sim_flash + SCRATCH, image_len);
+}
+
+// send the image at baud with errors bytes in a million hit each way,
+// true if it reached slot 1 intact, the time on the link in us
+static uint8_t transfer(uart_sender *tx, uint32_t baud, uint32_t errors, uint32_t *link_us) {
+	static uint8_t slots[UART_OTA_MAX_WINDOW * UART_OTA_FRAME_MAX] __attribute__((aligned(4)));
+	link_dir out, back;
+	pthread_t rx_pt;
+	ota_handle_t handle;
+	uint64_t begin;
+	int tx_slave, result;
+	uint8_t ok;
+
+	memset(&out, 0, sizeof(out));
+	memset(&back, 0, sizeof(back));
+	out.from = open_pty(&tx_slave);
+	out.to = open_pty(&rx_fd);
+	back.from = out.to;
+	back.to = out.from;
+	out.baud = back.baud = baud;
+	out.errors = back.errors = errors;
+	out.seed = baud + errors;
+	back.seed = out.seed * 3;
+
+	CHECK(rboot_ota_begin(&handle, 1, image_len) == OTA_OK);
+	CHECK(rboot_ota_uart_init(&rx, &handle, slots, tx->window, rx_send, NULL) == OTA_OK);
+	rx_result = OTA_PENDING;
+	stop = 0;
+	sim_realtime_div = REALTIME_DIV;
+	pthread_create(&out.thread, NULL, link_thread, &out);
+	pthread_create(&back.thread, NULL, link_thread, &back);
+	pthread_create(&rx_pt, NULL, rx_thread, NULL);
+
+	tx->fd = tx_slave;
+	tx->data = image;
+	tx->len = image_len;
+	begin = now_us();
+	result = uart_send(tx);
+	*link_us = (uint32_t)(now_us() - begin) * REALTIME_DIV;
+
+	stop = 1;
+	pthread_join(out.thread, NULL);
+	pthread_join(back.thread, NULL);
+	pthread_join(rx_pt, NULL);
+	sim_realtime_div = 0;
+	close(tx_slave);
+	close(rx_fd);
+	close(out.from);
+	close(out.to);
+	if (errors) {
+		CHECK(out.hit + back.hit > 0);
+	}
+	ok = (result == OTA_OK && rx_result == OTA_OK);
+	return (ok && memcmp(sim_flash + ROM1, image, image_len) == 0);
+}
+
+// window 8, packed and not, clean and with errors, and stop and wait
+static void test_transfer(void) {
+	static const uint32_t errors[] = {0, 200, 2000};
+	uart_sender tx;
+	uint32_t loop, link_us;
+	uint8_t packed;
+
+	for (packed = 0; packed < 2; packed++) {
+		for (loop = 0; loop < sizeof(errors) / sizeof(errors[0]); loop++) {
+			build(packed ? 0 : 121);
+			memset(&tx, 0, sizeof(tx));
+			tx.window = 8;
+			tx.packed = packed;
+			tx.timeout_ms = 50;
+			CHECK(transfer(&tx, 921600, errors[loop], &link_us));
+			if (errors[loop] == 0) {
+				// nothing resent, and packing only sends less
+				CHECK(tx.sent == tx.frames);
+				CHECK(packed ? tx.bytes_sent < image_len : tx.bytes_sent > image_len);
+			} else {
+				CHECK(tx.sent > tx.frames);
+			}
+		}
+	}
+
+	build(122);
+	memset(&tx, 0, sizeof(tx));
+	tx.window = 1;
+	tx.timeout_ms = 20;
+	CHECK(transfer(&tx, 921600, 2000, &link_us));
+}
+
+// link utilisation, update bytes over what the link could have carried
+// in the time, at a few baud and error rates, stop and wait against a
+// full window, and packed where the image packs, at the higher rates the
+// receiver erasing and programming as it goes is as slow as the link
+static void test_benchmark(void) {
+	static const uint32_t bauds[] = {115200, 460800, 921600};
+	static const uint32_t errors[] = {0, 100, 1000};
+	static const uint8_t windows[] = {1, 8};
+	uart_sender tx;
+	uint32_t b, e, w, link_us, percent, stop_wait = 0;
+
+	for (b = 0; b < sizeof(bauds) / sizeof(bauds[0]); b++) {
+		for (e = 0; e < sizeof(errors) / sizeof(errors[0]); e++) {
+			for (w = 0; w < sizeof(windows) / sizeof(windows[0]); w++) {
+				build(123);
+				memset(&tx, 0, sizeof(tx));
+				tx.window = windows[w];
+				tx.timeout_ms = 20;
+				CHECK(transfer(&tx, bauds[b], errors[e], &link_us));
+				percent = (uint32_t)((uint64_t)image_len * 10 * 1000000 * 100 / bauds[b] / link_us);
+				if (windows[w] == 1) {
+					stop_wait = percent;
+				} else if (errors[e] == 0) {
+					CHECK(percent > stop_wait);
+				}
+				printf("uart: %6u baud, %4u errors per million bytes, window %u, %3u%% utilisation, %4u of %u frames resent\n",
+					bauds[b], errors[e], windows[w], percent, tx.sent - tx.frames, tx.frames);
+			}
+		}
+	}
+
+	// an image that packs carries more than the link could unpacked
+	build(0);
+	memset(&tx, 0, sizeof(tx));
+	tx.window = 8;
+	tx.packed = 1;
+	tx.timeout_ms = 20;
+	CHECK(transfer(&tx, 115200, 0, &link_us));
+	percent = (uint32_t)((uint64_t)image_len * 10 * 1000000 * 100 / 115200 / link_us);
+	CHECK(percent > 100);
+	printf("uart: %6u baud, packed %u bytes to %u, %3u%% utilisation\n", 115200, image_len, tx.bytes_sent, percent);
+}
+
+int main(void) {
+	sim_init();
+	test_transfer();
+	test_benchmark();
+	return sim_report("uart");
+}
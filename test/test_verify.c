@@ -0,0 +1,150 @@
+//////////////////////////////////////////////////
+// rBoot host tests, deferred irom verification.
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+// rBoot only checks the ram sections of a rom whose irom checksum has been
+// recorded, so it starts the app sooner, and the app's background check of
+// the irom still catches corruption and rolls back to the previous rom
+
+#include "../rboot-ota.c"
+#include "sim.h"
+
+#define ROM0 0x2000
+#define ROM1 0x82000
+#define IROM_LEN 0x40000
+#define SCRATCH 0x200000
+
+extern uint32_t find_image(void);
+
+static uint32_t romlen;
+
+// rom 0 written by hand, rom 1 by OTA so its irom checksum is recorded
+static void setup(void) {
+	uint32_t roms[2] = {ROM0, ROM1};
+	ota_handle_t handle;
+	uint32_t pos;
+
+	sim_erase_all(0x100000);
+	sim_write_config(2, roms, 0);
+	sim_write_rom(ROM0, 0x4000, 2, 0x400, 50);
+	romlen = sim_write_rom(SCRATCH, IROM_LEN, 3, 0x800, 51);
+
+	CHECK(rboot_ota_begin(&handle, 1, romlen) == OTA_OK);
+	for (pos = 0; pos < romlen; pos += SECTOR_SIZE) {
+		CHECK(rboot_ota_write(&handle, sim_flash + SCRATCH + pos,
+			(romlen - pos < SECTOR_SIZE) ? romlen - pos : SECTOR_SIZE) == OTA_OK);
+	}
+	CHECK(rboot_ota_end(&handle) == OTA_OK);
+}
+
+// boot as far as picking the rom, with the simulated time it took
+static uint32_t boot(uint32_t *us) {
+	uint32_t start = sim_time_us;
+	uint32_t addr;
+
+	sim_clear_stats();
+	addr = find_image();
+	if (us) *us = sim_time_us - start;
+	return addr;
+}
+
+static ota_result_t check_irom(uint8_t rom, uint32_t *polls) {
+	ota_irom_verify_t verify;
+	ota_result_t result;
+
+	*polls = 0;
+	result = rboot_ota_irom_verify_begin(&verify, rom);
+	while (result == OTA_PENDING && *polls < 1000) {
+		result = rboot_ota_irom_verify_poll(&verify, 2000);
+		(*polls)++;
+	}
+	return result;
+}
+
+static void set_irom_valid(uint8_t valid) {
+	rboot_slot_meta *meta = (rboot_slot_meta*)(sim_flash + BOOT_CONFIG_SECTOR * SECTOR_SIZE + BOOT_SLOT_META_OFFSET);
+	meta->irom_valid = valid ? 0xffff : 0;
+}
+
+static void test_boot_time(void) {
+	uint32_t deferred, full, polls;
+
+	setup();
+	CHECK(boot(&deferred) == ROM1 + sizeof(rom_header_new) + IROM_LEN);
+
+	// as rBoot would without the recorded checksum
+	set_irom_valid(0);
+	CHECK(boot(&full) == ROM1 + sizeof(rom_header_new) + IROM_LEN);
+	CHECK(deferred < full);
+
+	// the app's check records it again, once
+	CHECK(check_irom(1, &polls) == OTA_OK);
+	CHECK(polls > 1);
+	sim_clear_stats();
+	CHECK(check_irom(1, &polls) == OTA_OK);
+	CHECK(sim.erases == 0);
+	CHECK(boot(0) == ROM1 + sizeof(rom_header_new) + IROM_LEN);
+
+	printf("verify: %u byte irom, time to app start %u us deferred, %u us checked at boot\n",
+		IROM_LEN, deferred, full);
+	printf("verify: app check took %u polls of 2000 us\n", polls);
+}
+
+static void test_corrupt(void) {
+	rboot_config romconf;
+	uint32_t polls;
+
+	// irom damage is only found by the app, which goes back to rom 0
+	setup();
+	sim_flash[ROM1 + sizeof(rom_header_new) + 0x1234] ^= 0x08;
+	CHECK(boot(0) == ROM1 + sizeof(rom_header_new) + IROM_LEN);
+	CHECK(check_irom(1, &polls) == OTA_ERR_VERIFY);
+	sim_read_config(&romconf);
+	CHECK(romconf.current_rom == 0);
+	CHECK(boot(0) == ROM0 + sizeof(rom_header_new) + 0x4000);
+	// and rBoot doesn't trust its irom again
+	CHECK(!(((rboot_slot_meta*)(sim_flash + BOOT_CONFIG_SECTOR * SECTOR_SIZE
+		+ BOOT_SLOT_META_OFFSET))->irom_valid & (1 << 1)));
+
+	// ram section damage is still found at boot
+	setup();
+	sim_flash[ROM1 + romlen - 0x100] ^= 0x08;
+	CHECK(boot(0) == ROM0 + sizeof(rom_header_new) + 0x4000);
+}
+
+static void test_record_errors(void) {
+	ota_irom_verify_t verify;
+	ota_handle_t other;
+	rboot_config romconf;
+
+	// no buffer free for the config sector, retried
+	setup();
+	sim_flash[ROM1 + sizeof(rom_header_new) + 0x1234] ^= 0x08;
+	CHECK(rboot_ota_begin(&other, 0, 0) == OTA_OK);
+	CHECK(rboot_ota_irom_verify_begin(&verify, 1) == OTA_PENDING);
+	CHECK(rboot_ota_irom_verify_poll(&verify, 0xffffffff) == OTA_PENDING);
+	CHECK(rboot_ota_irom_verify_poll(&verify, 0xffffffff) == OTA_PENDING);
+	rboot_ota_cancel(&other);
+	CHECK(rboot_ota_irom_verify_poll(&verify, 0xffffffff) == OTA_ERR_VERIFY);
+	sim_read_config(&romconf);
+	CHECK(romconf.current_rom == 0);
+
+	// a flash failure saving it is passed up, not retried for ever
+	setup();
+	sim_flash[ROM1 + sizeof(rom_header_new) + 0x1234] ^= 0x08;
+	CHECK(rboot_ota_irom_verify_begin(&verify, 1) == OTA_PENDING);
+	sim_write_protect = 1;
+	CHECK(rboot_ota_irom_verify_poll(&verify, 0xffffffff) == OTA_ERR_ERASE);
+	CHECK(rboot_ota_irom_verify_poll(&verify, 0xffffffff) == OTA_ERR_ERASE);
+	sim_write_protect = 0;
+	CHECK(!rboot_ota_is_in_progress());
+}
+
+int main(void) {
+	sim_init();
+	test_boot_time();
+	test_corrupt();
+	test_record_errors();
+	return sim_report("verify");
+}
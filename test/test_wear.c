@@ -0,0 +1,124 @@
+//////////////////////////////////////////////////
+// rBoot host tests, rom slot wear.
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+// ten years of weekly updates to a three slot layout, each sent to the
+// other of the first two slots (as a two slot updater does) or to the
+// slot rboot_ota_pick_slot picks, spreading the erases over all three,
+// and the slot wear counters match the erases the flash saw
+
+#include "../rboot-ota.c"
+#include "sim.h"
+
+#define ROM0 0x2000
+#define ROM1 0x56000
+#define ROM2 0xaa000
+#define SCRATCH 0x200000
+#define WEEKS (10 * 52)
+
+static const uint32_t roms[3] = {ROM0, ROM1, ROM2};
+
+static uint32_t slot_erases(uint8_t rom) {
+	rboot_slot_meta *meta = (rboot_slot_meta*)(sim_flash + BOOT_CONFIG_SECTOR * SECTOR_SIZE + BOOT_SLOT_META_OFFSET);
+	return (meta->magic == BOOT_SLOT_META_MAGIC) ? meta->wear[rom].erases : 0;
+}
+
+// erases the flash saw in a slot, and the most of any one sector
+static uint32_t flash_erases(uint8_t rom, uint32_t *peak) {
+	uint32_t sector, count = 0;
+
+	for (sector = roms[rom] / SECTOR_SIZE; sector < roms[rom] / SECTOR_SIZE + (ROM1 - ROM0) / SECTOR_SIZE; sector++) {
+		count += sim_erase_count[sector];
+		if (sim_erase_count[sector] > *peak) {
+			*peak = sim_erase_count[sector];
+		}
+	}
+	return count;
+}
+
+// a week's update, a new rom each time (its size varying a little)
+static void update(uint8_t target, uint32_t week) {
+	ota_handle_t handle;
+	uint32_t len;
+
+	len = sim_write_rom(SCRATCH, 0x20000 + (week % 4) * SECTOR_SIZE, 2, 0x800, week);
+	CHECK(rboot_ota_begin(&handle, target, len) == OTA_OK);
+	CHECK(rboot_ota_write(&handle, sim_flash + SCRATCH, len) == OTA_OK);
+	CHECK(rboot_ota_end(&handle) == OTA_OK);
+}
+
+// peak erases of any rom slot sector after WEEKS updates
+static uint32_t simulate(uint8_t pick) {
+	rboot_config config;
+	uint32_t week, peak = 0;
+	uint8_t target, rom;
+
+	sim_erase_all(0x100000);
+	sim_write_config(3, roms, 0);
+	sim_write_rom(ROM0, 0x20000, 2, 0x800, 1000);
+	for (week = 0; week < WEEKS && !sim_failures; week++) {
+		sim_read_config(&config);
+		if (pick) {
+			CHECK(rboot_ota_pick_slot(&target) == OTA_OK);
+		} else {
+			target = (config.current_rom == 0) ? 1 : 0;
+		}
+		CHECK(target != config.current_rom);
+		update(target, week);
+	}
+
+	// the counters are the erases, not the sectors written
+	for (rom = 0; rom < 3; rom++) {
+		CHECK(slot_erases(rom) == flash_erases(rom, &peak));
+	}
+	return peak;
+}
+
+// a bundle counts the sectors it erased too
+static void test_bundle(void) {
+	ota_bundle_toc_t toc;
+	ota_bundle_t bundle;
+	uint32_t len, i, peak = 0;
+
+	sim_erase_all(0x100000);
+	sim_write_config(3, roms, 0);
+	// an old rom covering some of the slot
+	sim_write_rom(ROM1, 0x8000, 1, 0x100, 1001);
+	len = sim_write_rom(SCRATCH, 0x20000, 2, 0x800, 1002);
+
+	memset(&toc, 0xff, sizeof(toc));
+	toc.magic = OTA_BUNDLE_MAGIC;
+	toc.count = 1;
+	toc.entries[0].type = OTA_BUNDLE_ROM;
+	toc.entries[0].id = 1;
+	toc.entries[0].length = len;
+	toc.entries[0].digest = DIGEST_INIT;
+	for (i = 0; i < len; i++) {
+		toc.entries[0].digest = (toc.entries[0].digest ^ sim_flash[SCRATCH + i]) * DIGEST_PRIME;
+	}
+	toc.digest = DIGEST_INIT;
+	for (i = 0; i < sizeof(ota_bundle_entry_t); i++) {
+		toc.digest = (toc.digest ^ ((uint8_t*)toc.entries)[i]) * DIGEST_PRIME;
+	}
+
+	CHECK(rboot_ota_bundle_begin(&bundle) == OTA_OK);
+	CHECK(rboot_ota_bundle_write(&bundle, (uint8_t*)&toc, BUNDLE_TOC_HEADER_SIZE + sizeof(ota_bundle_entry_t)) == OTA_OK);
+	CHECK(rboot_ota_bundle_write(&bundle, sim_flash + SCRATCH, len) == OTA_OK);
+	CHECK(rboot_ota_bundle_end(&bundle) == OTA_OK);
+	CHECK(slot_erases(1) == flash_erases(1, &peak));
+	CHECK(slot_erases(1) < (len + SECTOR_SIZE - 1) / SECTOR_SIZE);
+}
+
+int main(void) {
+	uint32_t toggle, pick;
+
+	sim_init();
+	toggle = simulate(0);
+	pick = simulate(1);
+	CHECK(pick < toggle);
+	printf("wear: %u weekly updates over 3 slots, peak erases of a rom sector %u toggling two slots, %u picking the least worn\n",
+		WEEKS, toggle, pick);
+	test_bundle();
+	return sim_report("wear");
+}
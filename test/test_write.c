@@ -0,0 +1,243 @@
+//////////////////////////////////////////////////
+// rBoot host tests, writing a rom from the app.
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+// a rom written to its slot has each header checked before anything after
+// it is erased or written, so a bad image header costs no erases and a bad
+// later header none past it, while good roms and plain data, in any size
+// of chunk and through the pipe, are written as before
+
+#include <string.h>
+#include <c_types.h>
+#include "rboot-private.h"
+#include "rboot-api.h"
+#include "sim.h"
+
+#define FLASH_SIZE 0x200000
+#define ROM0 0x2000
+#define ROM1 0x82000
+#define DATA 0xc0000
+#define IROM_LEN 0x8000
+#define SECT_LEN 0x800
+
+static uint8_t image[0x10000];
+static uint32_t image_len;
+
+// a new format (two link) image, or with irom_len 0 one with only ram
+// sections, built in the slot and kept to be written back
+static void build(uint32_t irom_len) {
+	uint32_t roms[2] = {ROM0, ROM1};
+
+	sim_erase_all(FLASH_SIZE);
+	image_len = sim_write_rom(ROM1, irom_len, 3, SECT_LEN, 90);
+	memcpy(image, sim_flash + ROM1, image_len);
+	sim_erase_all(FLASH_SIZE);
+	sim_write_config(2, roms, 0);
+	sim_clear_stats();
+}
+
+// write the image in chunks, false as soon as one is refused
+static bool write_image(rboot_write_status *status, uint32_t chunk) {
+	uint32_t pos, len;
+
+	for (pos = 0; pos < image_len; pos += len) {
+		len = (image_len - pos < chunk) ? image_len - pos : chunk;
+		if (!rboot_write_flash(status, image + pos, len)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static uint32_t erases_from(uint32_t addr) {
+	uint32_t sector, count = 0;
+
+	for (sector = addr / SECTOR_SIZE; sector < FLASH_SIZE / SECTOR_SIZE; sector++) {
+		count += sim_erase_count[sector];
+	}
+	return count;
+}
+
+// a header is refused before anything at all is erased or written
+static void check_refused(void) {
+	static const uint32_t chunks[] = {1, 7, 16, 0x1000};
+	rboot_write_status status;
+	uint32_t loop;
+
+	for (loop = 0; loop < sizeof(chunks) / sizeof(chunks[0]); loop++) {
+		sim_clear_stats();
+		status = rboot_write_init(ROM1);
+		CHECK(!write_image(&status, chunks[loop]));
+		CHECK(!rboot_write_flash(&status, image, 16));
+		CHECK(!rboot_write_end(&status));
+		CHECK(sim.erases == 0 && sim.programs == 0);
+	}
+}
+
+static void test_image_header(void) {
+	rom_header_new *header = (rom_header_new*)image;
+	section_header *section = (section_header*)(image + sizeof(rom_header));
+
+	build(IROM_LEN);
+	image[0] = 0x55;
+	check_refused();
+
+	build(IROM_LEN);
+	header->count = 0x05;
+	check_refused();
+
+	// entry point outside iram
+	build(IROM_LEN);
+	header->entry = 0x40200000;
+	check_refused();
+
+	// built for more flash than the device has
+	build(IROM_LEN);
+	header->flags2 = 0x40;
+	check_refused();
+
+	// irom that doesn't fit the slot, or leaves the rom header unaligned
+	build(IROM_LEN);
+	header->len = 0x80000;
+	check_refused();
+	build(IROM_LEN);
+	header->len = IROM_LEN + 2;
+	check_refused();
+
+	// a ram only image with a first section outside ram, or the irom of
+	// a single link image linked for another slot
+	build(0);
+	section->address = 0x60000000;
+	check_refused();
+	build(0);
+	section->address = RBOOT_FLASH_MAP_ADDR + ((ROM0 + 2 * sizeof(rom_header)) % 0x100000);
+	check_refused();
+	build(0);
+	image[1] = 0;
+	check_refused();
+}
+
+// a header after the irom is only seen once the irom is written, nothing
+// from its sector on is erased and nothing from it on is written
+static void test_later_header(void) {
+	rboot_write_status status;
+	section_header *section;
+	uint32_t offset;
+
+	offset = sizeof(rom_header_new) + IROM_LEN + sizeof(rom_header) + sizeof(section_header) + SECT_LEN;
+	build(IROM_LEN);
+	section = (section_header*)(image + offset);
+	section->length = 0x10000;
+	status = rboot_write_init(ROM1);
+	CHECK(!write_image(&status, 1000));
+	CHECK(!rboot_write_end(&status));
+	CHECK(erases_from(((ROM1 + offset) | (SECTOR_SIZE - 1)) + 1) == 0);
+	CHECK(sim_flash[ROM1 + offset] == 0xff);
+	CHECK(memcmp(sim_flash + ROM1, image, offset) == 0);
+
+	build(IROM_LEN);
+	image[sizeof(rom_header_new) + IROM_LEN] = 0x55;
+	status = rboot_write_init(ROM1);
+	CHECK(!write_image(&status, 1000));
+	CHECK(sim_flash[ROM1 + sizeof(rom_header_new) + IROM_LEN] == 0xff);
+
+	// nor is an image that stops short
+	build(IROM_LEN);
+	status = rboot_write_init(ROM1);
+	image_len = offset;
+	CHECK(write_image(&status, 1000));
+	CHECK(!rboot_write_end(&status));
+}
+
+static void test_good(void) {
+	static const uint32_t chunks[] = {1, 3, 7, 1000, 0x1000};
+	rboot_write_status status;
+	section_header *section;
+	uint32_t loop;
+	uint8_t irom;
+
+	for (irom = 0; irom < 3; irom++) {
+		for (loop = 0; loop < sizeof(chunks) / sizeof(chunks[0]); loop++) {
+			build(irom == 1 ? IROM_LEN : 0);
+			if (irom == 2) {
+				// single link, its irom where it is mapped for this slot
+				section = (section_header*)(image + sizeof(rom_header));
+				section->address = RBOOT_FLASH_MAP_ADDR + ((ROM1 + 2 * sizeof(rom_header)) % 0x100000);
+			}
+			status = rboot_write_init(ROM1);
+			CHECK(write_image(&status, chunks[loop]));
+			CHECK(rboot_write_end(&status));
+			CHECK(memcmp(sim_flash + ROM1, image, image_len) == 0);
+			CHECK(sim.erases == (image_len + SECTOR_SIZE - 1) / SECTOR_SIZE);
+		}
+	}
+
+	// built for all of the device's flash, beyond the 8Mbit rboot maps
+	// without big flash, on 16Mbit and 32Mbit devices
+	for (loop = 0x30; loop <= 0x40; loop += 0x10) {
+		build(IROM_LEN);
+		sim_flash[3] = loop;
+		((rom_header_new*)image)->flags2 = loop;
+		status = rboot_write_init(ROM1);
+		CHECK(write_image(&status, 1000));
+		CHECK(rboot_write_end(&status));
+		CHECK(memcmp(sim_flash + ROM1, image, image_len) == 0);
+	}
+
+	// anything else is written as it is
+	build(IROM_LEN);
+	memset(image, 0x55, 64);
+	status = rboot_write_init(DATA);
+	CHECK(write_image(&status, 7));
+	CHECK(rboot_write_end(&status));
+	CHECK(memcmp(sim_flash + DATA, image, image_len) == 0);
+}
+
+// the pipe only erases ahead up to the next header still to be checked
+static void test_pipe(void) {
+	static uint32_t slots[4 * 0x400 / sizeof(uint32_t)];
+	rboot_write_status status;
+	rboot_pipe pipe;
+	uint32_t pos, len;
+	uint16_t space;
+	uint8_t *slot;
+
+	build(IROM_LEN);
+	status = rboot_write_init(ROM1);
+	CHECK(rboot_pipe_init(&pipe, &status, (uint8_t*)slots, 0x400, 4, ROM1 + 0x80000));
+	CHECK(rboot_pipe_write(&pipe, &status));
+	CHECK(sim.erases == 0);
+	for (pos = 0; pos < image_len && !sim_failures; pos += len) {
+		slot = rboot_pipe_reserve(&pipe, &space);
+		CHECK(slot != NULL);
+		len = (image_len - pos < space) ? image_len - pos : space;
+		memcpy(slot, image + pos, len);
+		rboot_pipe_commit(&pipe, len);
+		CHECK(rboot_pipe_write(&pipe, &status));
+		CHECK(rboot_pipe_write(&pipe, &status));
+	}
+	CHECK(rboot_write_end(&status));
+	CHECK(memcmp(sim_flash + ROM1, image, image_len) == 0);
+
+	// a bad image header, erase ahead doesn't start
+	build(IROM_LEN);
+	image[0] = 0x55;
+	status = rboot_write_init(ROM1);
+	CHECK(rboot_pipe_init(&pipe, &status, (uint8_t*)slots, 0x400, 4, ROM1 + 0x80000));
+	slot = rboot_pipe_reserve(&pipe, &space);
+	memcpy(slot, image, space);
+	rboot_pipe_commit(&pipe, space);
+	CHECK(!rboot_pipe_write(&pipe, &status));
+	CHECK(!rboot_pipe_write(&pipe, &status));
+	CHECK(sim.erases == 0 && sim.programs == 0);
+}
+
+int main(void) {
+	sim_init();
+	test_image_header();
+	test_later_header();
+	test_good();
+	test_pipe();
+	return sim_report("write");
+}
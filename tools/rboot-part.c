@@ -0,0 +1,235 @@
+//////////////////////////////////////////////////
+// rBoot partition table generator, builds the table
+// for the config sector from a layout description.
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+// usage: rboot-part <layout> <image>
+//
+// Each line of the layout is a partition, "name type offset size [flags]",
+// the type one of sdkconfig, data, assets or log or a number, offset and
+// size in bytes or with a k or m suffix, and # starts a comment. The table
+// is sorted and indexed as rboot_set_part_table does, and refused for the
+// same reasons. The image is a config sector holding only the table, to
+// write at 0x1000 on a new device, rBoot writes its default config around
+// the table at first boot. BOOT_PLAN_ENABLED and MAX_ROMS move the table,
+// the tool must be built with those rBoot was ("make tools" from the top
+// level passes the rBoot options on).
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef BOOT_PARTITIONS
+#define BOOT_PARTITIONS
+#endif
+#include "rboot.h"
+
+static const struct {
+	const char *name;
+	uint8_t type;
+} part_types[] = {
+	{"sdkconfig", PART_TYPE_SDKCONFIG},
+	{"data", PART_TYPE_DATA},
+	{"assets", PART_TYPE_ASSETS},
+	{"log", PART_TYPE_LOG},
+};
+
+// a number, with a k or m suffix for KB or MB, true if it was one
+static int parse_number(const char *str, uint32_t *val) {
+	char *end;
+
+	*val = strtoul(str, &end, 0);
+	if (end == str) {
+		return 0;
+	}
+	if (*end == 'k' || *end == 'K') {
+		*val *= 0x400;
+		end++;
+	} else if (*end == 'm' || *end == 'M') {
+		*val *= 0x100000;
+		end++;
+	}
+	return (*end == 0);
+}
+
+// a line of the layout, 1 for a partition, 0 for a blank or comment line
+// and -1 if it can't be read
+static int part_parse(char *line, rboot_partition *part) {
+	char *field[5], *token;
+	uint32_t val;
+	int count = 0;
+	unsigned loop;
+
+	token = strchr(line, '#');
+	if (token) {
+		*token = 0;
+	}
+	for (token = strtok(line, " \t\r\n"); token; token = strtok(NULL, " \t\r\n")) {
+		if (count == 5) {
+			return -1;
+		}
+		field[count++] = token;
+	}
+	if (count == 0) {
+		return 0;
+	}
+	if (count < 4 || strlen(field[0]) > BOOT_PART_NAME_LEN) {
+		return -1;
+	}
+
+	memset(part, 0, sizeof(rboot_partition));
+	memcpy(part->name, field[0], strlen(field[0]));
+	for (loop = 0; loop < sizeof(part_types) / sizeof(part_types[0]); loop++) {
+		if (strcmp(field[1], part_types[loop].name) == 0) {
+			break;
+		}
+	}
+	if (loop < sizeof(part_types) / sizeof(part_types[0])) {
+		part->type = part_types[loop].type;
+	} else if (parse_number(field[1], &val) && val > 0 && val <= 0xff) {
+		part->type = val;
+	} else {
+		return -1;
+	}
+	if (!parse_number(field[2], &part->offset) || !parse_number(field[3], &part->size)) {
+		return -1;
+	}
+	if (count == 5) {
+		if (!parse_number(field[4], &val) || val > 0xff) {
+			return -1;
+		}
+		part->flags = val;
+	}
+	return 1;
+}
+
+static int by_name(const void *a, const void *b) {
+	return strncmp(((const rboot_partition*)a)->name, ((const rboot_partition*)b)->name, BOOT_PART_NAME_LEN);
+}
+
+// by type, then by name as the table is, as rboot_set_part_table's
+// insertion sort leaves them
+static const rboot_partition *sort_parts;
+static int by_type(const void *a, const void *b) {
+	uint8_t ia = *(const uint8_t*)a;
+	uint8_t ib = *(const uint8_t*)b;
+
+	if (sort_parts[ia].type != sort_parts[ib].type) {
+		return sort_parts[ia].type - sort_parts[ib].type;
+	}
+	return ia - ib;
+}
+
+// sort, index and check the count partitions in table, ready to store,
+// returns NULL or why the table can't be used
+static const char *part_build(rboot_part_table *table) {
+	const rboot_partition *a, *b;
+	uint8_t *byte;
+	uint8_t loop, index;
+
+	if (table->count > BOOT_PART_MAX) {
+		return "too many partitions";
+	}
+	qsort(table->parts, table->count, sizeof(rboot_partition), by_name);
+	for (loop = 0; loop < BOOT_PART_MAX; loop++) {
+		table->by_type[loop] = (loop < table->count) ? loop : 0xff;
+	}
+	sort_parts = table->parts;
+	qsort(table->by_type, table->count, 1, by_type);
+
+	for (loop = 0; loop < table->count; loop++) {
+		a = &table->parts[loop];
+		if (loop > 0 && strncmp(table->parts[loop - 1].name, a->name, BOOT_PART_NAME_LEN) == 0) {
+			return "name used twice";
+		}
+		if ((a->offset % SECTOR_SIZE) != 0 || a->size == 0 || (a->size % SECTOR_SIZE) != 0) {
+			return "not whole sectors";
+		}
+		if (a->offset < (BOOT_CONFIG_SECTOR + 1) * SECTOR_SIZE) {
+			return "over rBoot or its config";
+		}
+		if ((a->offset / 0x100000) != ((a->offset + a->size - 1) / 0x100000)) {
+			return "crosses a 1MB boundary";
+		}
+		for (index = loop + 1; index < table->count; index++) {
+			b = &table->parts[index];
+			if (a->offset < b->offset + b->size && b->offset < a->offset + a->size) {
+				return "overlaps another";
+			}
+		}
+	}
+
+	table->magic = BOOT_PART_MAGIC;
+	table->chksum = CHKSUM_INIT;
+	for (byte = (uint8_t*)table->parts; byte < (uint8_t*)(table + 1); byte++) {
+		table->chksum ^= *byte;
+	}
+	return NULL;
+}
+
+// a config sector holding only the table
+static void part_sector(const rboot_part_table *table, uint8_t *sector) {
+	memset(sector, 0xff, SECTOR_SIZE);
+	memcpy(sector + BOOT_PART_TABLE_OFFSET, table, sizeof(rboot_part_table));
+}
+
+#ifndef RBOOT_PART_NO_MAIN
+int main(int argc, char **argv) {
+	static rboot_part_table table;
+	static uint8_t sector[SECTOR_SIZE];
+	rboot_partition part;
+	const char *error;
+	char line[256];
+	FILE *file;
+	int number = 0, result;
+	uint8_t loop;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s <layout> <image>\n", argv[0]);
+		return 2;
+	}
+
+	file = fopen(argv[1], "r");
+	if (!file) {
+		fprintf(stderr, "can't read %s\n", argv[1]);
+		return 2;
+	}
+	memset(&table, 0, sizeof(table));
+	while (fgets(line, sizeof(line), file)) {
+		number++;
+		result = part_parse(line, &part);
+		if (result < 0) {
+			fprintf(stderr, "%s:%d: expected name type offset size [flags]\n", argv[1], number);
+			return 1;
+		}
+		if (result > 0) {
+			if (table.count == BOOT_PART_MAX) {
+				fprintf(stderr, "%s:%d: more than %d partitions\n", argv[1], number, BOOT_PART_MAX);
+				return 1;
+			}
+			table.parts[table.count++] = part;
+		}
+	}
+	fclose(file);
+
+	error = part_build(&table);
+	if (error) {
+		fprintf(stderr, "%s: partition table refused, %s\n", argv[1], error);
+		return 1;
+	}
+	part_sector(&table, sector);
+
+	file = fopen(argv[2], "wb");
+	if (!file || fwrite(sector, 1, SECTOR_SIZE, file) != SECTOR_SIZE || fclose(file) != 0) {
+		fprintf(stderr, "can't write %s\n", argv[2]);
+		return 2;
+	}
+	for (loop = 0; loop < table.count; loop++) {
+		printf("%-8.8s type %02x flags %02x %06x-%06x\n", table.parts[loop].name, table.parts[loop].type,
+			table.parts[loop].flags, table.parts[loop].offset, table.parts[loop].offset + table.parts[loop].size);
+	}
+	printf("table at %x\n", BOOT_CONFIG_SECTOR * SECTOR_SIZE + (uint32_t)BOOT_PART_TABLE_OFFSET);
+	return 0;
+}
+#endif
@@ -0,0 +1,129 @@
+//////////////////////////////////////////////////
+// rBoot sparse stream encoder, turns a rom or data
+// partition image in to a stream for rboot_ota_begin_sparse.
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+// usage: rboot-sparse [-m min_run] <image> <stream>
+//
+// Word aligned runs of at least min_run (default 32) 0xff bytes become
+// skip records, everything else literal records. The first OTA_HEADER_LEN
+// bytes are always literal, as the OTA writer checks a rom header before
+// it will skip anything.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "rboot-ota.h"
+
+// shortest run worth a skip, a skip and the literal record after it cost
+// 8 bytes, so the stream is never more than 4 bytes longer than the image
+#define SPARSE_MIN_RUN 8
+
+// largest stream for an image of len bytes
+#define SPARSE_MAX_LEN(len) ((len) + 4)
+
+static int erased_word(const uint8_t *in) {
+	return (in[0] & in[1] & in[2] & in[3]) == 0xff;
+}
+
+static uint8_t *put_record(uint8_t *out, uint32_t record) {
+	out[0] = record & 0xff;
+	out[1] = (record >> 8) & 0xff;
+	out[2] = (record >> 16) & 0xff;
+	out[3] = record >> 24;
+	return out + 4;
+}
+
+// a literal record of the image from start to end, if there is any
+static uint8_t *put_literal(uint8_t *out, const uint8_t *in, uint32_t start, uint32_t end) {
+	if (end > start) {
+		out = put_record(out, end - start);
+		memcpy(out, in + start, end - start);
+		out += end - start;
+	}
+	return out;
+}
+
+// encode len bytes of image in to out (SPARSE_MAX_LEN(len) bytes), runs of
+// min_run or more erased bytes skipped, returns the stream length and the
+// bytes skipped in skipped, if it isn't NULL
+static uint32_t sparse_encode(const uint8_t *in, uint32_t len, uint32_t min_run, uint8_t *out, uint32_t *skipped) {
+	uint8_t *start = out;
+	uint32_t pos = OTA_HEADER_LEN, lit = 0, run;
+
+	if (min_run < SPARSE_MIN_RUN) {
+		min_run = SPARSE_MIN_RUN;
+	}
+	if (skipped) {
+		*skipped = 0;
+	}
+
+	// whole erased words from each word boundary
+	while (pos + 4 <= len) {
+		for (run = 0; pos + run + 4 <= len && erased_word(in + pos + run); run += 4);
+		if (run >= min_run) {
+			out = put_literal(out, in, lit, pos);
+			out = put_record(out, OTA_SPARSE_SKIP | run);
+			if (skipped) {
+				*skipped += run;
+			}
+			pos += run;
+			lit = pos;
+		} else {
+			pos += run + 4;
+		}
+	}
+	out = put_literal(out, in, lit, len);
+
+	return out - start;
+}
+
+#ifndef RBOOT_SPARSE_NO_MAIN
+int main(int argc, char **argv) {
+	uint32_t min_run = 32, skipped, out_len;
+	uint8_t *in, *out;
+	FILE *file;
+	long len;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:")) != -1) {
+		switch (opt) {
+		case 'm': min_run = strtoul(optarg, NULL, 0); break;
+		default: optind = argc; break;
+		}
+	}
+	if (argc - optind != 2) {
+		fprintf(stderr, "usage: %s [-m min_run] <image> <stream>\n", argv[0]);
+		return 2;
+	}
+
+	file = fopen(argv[optind], "rb");
+	if (!file || fseek(file, 0, SEEK_END) != 0 || (len = ftell(file)) <= 0) {
+		fprintf(stderr, "can't read %s\n", argv[optind]);
+		return 2;
+	}
+	in = malloc(len);
+	out = malloc(SPARSE_MAX_LEN(len));
+	rewind(file);
+	if (!in || !out || fread(in, 1, len, file) != (size_t)len) {
+		fprintf(stderr, "can't read %s\n", argv[optind]);
+		return 2;
+	}
+	fclose(file);
+
+	out_len = sparse_encode(in, len, min_run, out, &skipped);
+
+	file = fopen(argv[optind + 1], "wb");
+	if (!file || fwrite(out, 1, out_len, file) != out_len || fclose(file) != 0) {
+		fprintf(stderr, "can't write %s\n", argv[optind + 1]);
+		return 2;
+	}
+	printf("%lu byte image, %u byte stream, %u bytes skipped\n", len, out_len, skipped);
+	free(in);
+	free(out);
+	return 0;
+}
+#endif
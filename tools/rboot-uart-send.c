@@ -0,0 +1,392 @@
+//////////////////////////////////////////////////
+// rBoot serial OTA sender, sends an update to the
+// receiver in rboot-ota-uart.c over a serial port.
+// See license.txt for license terms.
+//////////////////////////////////////////////////
+
+// usage: rboot-uart-send [-b baud] [-w window] [-t timeout_ms] [-p] <port> <file>
+//
+// The window must be the one the receiver was given. With -p each frame
+// that packs smaller is sent packed. The exit status is 0 once the
+// receiver reports the update written and ended.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include "rboot-ota-uart.h"
+
+// frame header (sync, type, seq, length) and crc
+#define FRAME_HEADER 5
+#define FRAME_CRC 2
+
+// timeouts in a row, with nothing heard, before giving up
+#define MAX_TIMEOUTS 20
+
+// one update being sent
+typedef struct {
+	int fd;                  // serial port
+	const uint8_t *data;     // update to send
+	uint32_t len;            // length of the update
+	uint8_t window;          // frames outstanding, as given to the receiver
+	uint8_t packed;          // send frames that pack smaller packed
+	uint32_t timeout_ms;     // resend the oldest frame after hearing nothing for this long
+	// results
+	uint32_t frames;         // DATA frames and END
+	uint32_t sent;           // frames sent, with resends
+	uint32_t bytes_sent;     // bytes sent, with resends
+	uint32_t timeouts;       // times nothing was heard
+	// reply being parsed
+	uint8_t reply[FRAME_HEADER + 4 + FRAME_CRC];
+	uint8_t reply_len;
+} uart_sender;
+
+// CRC-16/CCITT as the receiver uses
+static uint16_t crc16(uint16_t crc, const uint8_t *data, uint32_t len) {
+	uint8_t i;
+
+	while (len--) {
+		crc ^= (uint16_t)*data++ << 8;
+		for (i = 0; i < 8; i++) {
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+static uint32_t now_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// pack a frame in the format the receiver unpacks (that of the rboot_install
+// blocks), greedy longest match, returns the packed length, or len if
+// packing doesn't make it smaller
+static uint32_t pack_frame(const uint8_t *in, uint32_t len, uint8_t *out) {
+	uint32_t pos = 0, outpos = 0, lit = 0;
+	uint32_t best, bestoff, off, n;
+
+	while (pos < len) {
+		best = 0;
+		bestoff = 0;
+		for (off = 1; off <= pos; off++) {
+			for (n = 0; n < 130 && pos + n < len && in[pos + n] == in[pos + n - off]; n++);
+			if (n > best) {
+				best = n;
+				bestoff = off;
+			}
+		}
+		if (best >= 3) {
+			if (lit) {
+				out[outpos - lit - 1] = lit - 1;
+				lit = 0;
+			}
+			out[outpos++] = 0x80 | (best - 3);
+			out[outpos++] = bestoff & 0xff;
+			out[outpos++] = bestoff >> 8;
+			pos += best;
+		} else {
+			if (lit == 0) outpos++;
+			out[outpos++] = in[pos++];
+			if (++lit == 128) {
+				out[outpos - lit - 1] = lit - 1;
+				lit = 0;
+			}
+		}
+		if (outpos >= len) {
+			return len;
+		}
+	}
+	if (lit) {
+		out[outpos - lit - 1] = lit - 1;
+	}
+	return outpos;
+}
+
+static int write_all(int fd, const uint8_t *data, uint32_t len) {
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, data, len);
+		if (n <= 0) {
+			return 0;
+		}
+		data += n;
+		len -= n;
+	}
+	return 1;
+}
+
+// send frame index, the END frame after the last DATA frame
+static int send_frame(uart_sender *tx, uint32_t index) {
+	uint8_t frame[FRAME_HEADER + UART_OTA_FRAME_MAX + FRAME_CRC];
+	uint32_t pos = index * UART_OTA_FRAME_MAX;
+	uint32_t len = 0, packed;
+	uint16_t crc;
+
+	frame[1] = UART_OTA_END;
+	if (index < tx->frames - 1) {
+		len = (tx->len - pos < UART_OTA_FRAME_MAX) ? tx->len - pos : UART_OTA_FRAME_MAX;
+		packed = tx->packed ? pack_frame(tx->data + pos, len, frame + FRAME_HEADER) : len;
+		if (packed < len) {
+			frame[1] = UART_OTA_PACKED;
+			len = packed;
+		} else {
+			frame[1] = UART_OTA_DATA;
+			memcpy(frame + FRAME_HEADER, tx->data + pos, len);
+		}
+	}
+	frame[0] = UART_OTA_SYNC;
+	frame[2] = (uint8_t)index;
+	frame[3] = len & 0xff;
+	frame[4] = len >> 8;
+	crc = crc16(0xffff, frame + 1, FRAME_HEADER - 1 + len);
+	frame[FRAME_HEADER + len] = crc & 0xff;
+	frame[FRAME_HEADER + len + 1] = crc >> 8;
+
+	tx->sent++;
+	tx->bytes_sent += FRAME_HEADER + len + FRAME_CRC;
+	return write_all(tx->fd, frame, FRAME_HEADER + len + FRAME_CRC);
+}
+
+// wait up to the timeout for an ACK or RESULT, returns 1 with the reply
+// in tx->reply, 0 on timeout, -1 if the port fails
+static int read_reply(uart_sender *tx) {
+	struct pollfd pfd;
+	uint32_t start = now_ms(), elapsed, need;
+	uint16_t crc;
+	ssize_t n;
+
+	for (;;) {
+		// drop bytes up to a sync
+		while (tx->reply_len > 0 && tx->reply[0] != UART_OTA_SYNC) {
+			memmove(tx->reply, tx->reply + 1, --tx->reply_len);
+		}
+		if (tx->reply_len >= FRAME_HEADER) {
+			need = FRAME_HEADER + tx->reply[3] + FRAME_CRC;
+			if (tx->reply[4] != 0 || need > sizeof(tx->reply)
+				|| (tx->reply[1] != UART_OTA_ACK && tx->reply[1] != UART_OTA_RESULT)) {
+				// not a reply, look for the next sync
+				memmove(tx->reply, tx->reply + 1, --tx->reply_len);
+				continue;
+			}
+			if (tx->reply_len >= need) {
+				crc = crc16(0xffff, tx->reply + 1, need - FRAME_CRC - 1);
+				if (tx->reply[need - 2] == (crc & 0xff) && tx->reply[need - 1] == (crc >> 8)) {
+					return 1;
+				}
+				memmove(tx->reply, tx->reply + 1, --tx->reply_len);
+				continue;
+			}
+		}
+
+		elapsed = now_ms() - start;
+		if (elapsed >= tx->timeout_ms) {
+			return 0;
+		}
+		pfd.fd = tx->fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, tx->timeout_ms - elapsed) < 0) {
+			return -1;
+		}
+		if (pfd.revents & POLLIN) {
+			n = read(tx->fd, tx->reply + tx->reply_len, sizeof(tx->reply) - tx->reply_len);
+			if (n <= 0) {
+				return -1;
+			}
+			tx->reply_len += n;
+		}
+	}
+}
+
+// drop the reply just handled
+static void reply_done(uart_sender *tx) {
+	uint32_t len = FRAME_HEADER + tx->reply[3] + FRAME_CRC;
+
+	tx->reply_len -= len;
+	memmove(tx->reply, tx->reply + len, tx->reply_len);
+}
+
+// send the update, returns the ota_result_t the receiver reports, or -1 if
+// the port fails or nothing is heard for MAX_TIMEOUTS timeouts in a row
+static int uart_send(uart_sender *tx) {
+	uint32_t *order;         // when each frame was last sent, 0 if not yet
+	uint8_t *held;           // frames the receiver has
+	uint32_t base = 0;       // first frame the receiver still needs
+	uint32_t next = 0;       // next frame to send for the first time
+	uint32_t count = 0;      // frames sent so far, for order
+	uint32_t heard = 0;      // latest order of a frame the receiver has
+	uint32_t need, i, n, bitmap, timeouts = 0;
+	int result = -1, reply;
+
+	tx->frames = (tx->len + UART_OTA_FRAME_MAX - 1) / UART_OTA_FRAME_MAX + 1;
+	tx->sent = 0;
+	tx->bytes_sent = 0;
+	tx->timeouts = 0;
+	tx->reply_len = 0;
+	if (tx->window == 0 || tx->window > UART_OTA_MAX_WINDOW) {
+		return -1;
+	}
+	order = calloc(tx->frames, sizeof(uint32_t));
+	held = calloc(tx->frames, 1);
+	if (!order || !held) {
+		goto out;
+	}
+
+	for (;;) {
+		// resend the frames the receiver got one sent after, as the link
+		// keeps frames in order they were lost, then fill the window
+		for (i = base; i < next; i++) {
+			if (!held[i] && order[i] < heard) {
+				order[i] = ++count;
+				if (!send_frame(tx, i)) goto out;
+			}
+		}
+		while (next < tx->frames && next < base + tx->window) {
+			order[next] = ++count;
+			if (!send_frame(tx, next++)) goto out;
+		}
+
+		reply = read_reply(tx);
+		if (reply < 0) {
+			goto out;
+		}
+		if (reply == 0) {
+			// the frames or their replies were lost, resend the oldest
+			tx->timeouts++;
+			if (++timeouts == MAX_TIMEOUTS) {
+				goto out;
+			}
+			for (i = base; i < next && held[i]; i++);
+			if (i < next) {
+				order[i] = ++count;
+				if (!send_frame(tx, i)) goto out;
+			}
+			continue;
+		}
+		timeouts = 0;
+
+		if (tx->reply[1] == UART_OTA_RESULT) {
+			result = tx->reply[FRAME_HEADER];
+			goto out;
+		}
+
+		// the receiver has everything before need and the frames after it
+		// in the bitmap
+		need = base + (uint8_t)(tx->reply[2] - (uint8_t)base);
+		bitmap = tx->reply[5] | (tx->reply[6] << 8) | (tx->reply[7] << 16) | ((uint32_t)tx->reply[8] << 24);
+		reply_done(tx);
+		if (need > next) {
+			continue;
+		}
+		for (; base < need; base++) {
+			held[base] = 1;
+			if (order[base] > heard) heard = order[base];
+		}
+		for (n = 1; n < tx->window && base + n < next; n++) {
+			if (bitmap & ((uint32_t)1 << n)) {
+				held[base + n] = 1;
+				if (order[base + n] > heard) heard = order[base + n];
+			}
+		}
+	}
+
+out:
+	free(order);
+	free(held);
+	return result;
+}
+
+// raw 8N1 at baud, false if the port can't be set up
+static int set_raw(int fd, uint32_t baud) {
+	static const struct {
+		uint32_t baud;
+		speed_t speed;
+	} speeds[] = {
+		{9600, B9600}, {19200, B19200}, {38400, B38400}, {57600, B57600},
+		{115200, B115200}, {230400, B230400}, {460800, B460800}, {921600, B921600},
+	};
+	struct termios tio;
+	uint32_t i;
+
+	if (tcgetattr(fd, &tio) != 0) {
+		return 0;
+	}
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	for (i = 0; i < sizeof(speeds) / sizeof(speeds[0]) && speeds[i].baud != baud; i++);
+	if (i == sizeof(speeds) / sizeof(speeds[0])) {
+		return 0;
+	}
+	cfsetispeed(&tio, speeds[i].speed);
+	cfsetospeed(&tio, speeds[i].speed);
+	return (tcsetattr(fd, TCSANOW, &tio) == 0);
+}
+
+#ifndef RBOOT_UART_SEND_NO_MAIN
+int main(int argc, char **argv) {
+	uart_sender tx;
+	uint32_t baud = 115200;
+	uint8_t *data;
+	FILE *file;
+	long len;
+	int opt, result;
+
+	memset(&tx, 0, sizeof(tx));
+	tx.window = 8;
+	tx.timeout_ms = 500;
+	while ((opt = getopt(argc, argv, "b:w:t:p")) != -1) {
+		switch (opt) {
+		case 'b': baud = strtoul(optarg, NULL, 0); break;
+		case 'w': tx.window = strtoul(optarg, NULL, 0); break;
+		case 't': tx.timeout_ms = strtoul(optarg, NULL, 0); break;
+		case 'p': tx.packed = 1; break;
+		default: optind = argc; break;
+		}
+	}
+	if (argc - optind != 2) {
+		fprintf(stderr, "usage: %s [-b baud] [-w window] [-t timeout_ms] [-p] <port> <file>\n", argv[0]);
+		return 2;
+	}
+
+	file = fopen(argv[optind + 1], "rb");
+	if (!file || fseek(file, 0, SEEK_END) != 0 || (len = ftell(file)) <= 0) {
+		fprintf(stderr, "can't read %s\n", argv[optind + 1]);
+		return 2;
+	}
+	data = malloc(len);
+	rewind(file);
+	if (!data || fread(data, 1, len, file) != (size_t)len) {
+		fprintf(stderr, "can't read %s\n", argv[optind + 1]);
+		return 2;
+	}
+	fclose(file);
+
+	tx.fd = open(argv[optind], O_RDWR | O_NOCTTY);
+	if (tx.fd < 0 || !set_raw(tx.fd, baud)) {
+		fprintf(stderr, "can't open %s at %u baud\n", argv[optind], baud);
+		return 2;
+	}
+	tx.data = data;
+	tx.len = len;
+
+	result = uart_send(&tx);
+	printf("%u bytes in %u frames, %u sent (%u bytes) with %u timeouts, ",
+		tx.len, tx.frames, tx.sent, tx.bytes_sent, tx.timeouts);
+	if (result < 0) {
+		printf("no result from the receiver\n");
+	} else {
+		printf("result %d\n", result);
+	}
+	close(tx.fd);
+	free(data);
+	return (result == OTA_OK) ? 0 : 1;
+}
+#endif